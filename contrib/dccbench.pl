@@ -0,0 +1,243 @@
+#!/usr/bin/perl
+# Perl script to measure how fast dircproxy relays a DCC SEND, and how
+# much CPU it uses doing it.  Everything runs over the loopback: a fake
+# IRC server, a fake sender offering the file and a client receiving it
+# through the proxy.  The result is given in MB/s and CPU seconds per GB
+# of data relayed.
+#
+# The CPU time is read from /proc, so this only works on Linux.
+#
+# Usage: dccbench.pl [-s SIZE] [-r RUNS] /path/to/dircproxy
+#
+#   -s SIZE   bytes to send each run (default 100000000)
+#   -r RUNS   how many sends to do (default 3)
+#
+
+use strict;
+use IO::Socket::INET;
+use IO::Select;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep);
+use Getopt::Std;
+
+my %opts;
+getopts('s:r:', \%opts) && @ARGV == 1
+	or die "Usage: $0 [-s SIZE] [-r RUNS] /path/to/dircproxy\n";
+
+my $dircproxy = $ARGV[0];
+my $size = $opts{'s'} || 100000000;
+my $runs = $opts{'r'} || 3;
+my $password = 'bench';
+my $ticks = POSIX::sysconf(&POSIX::_SC_CLK_TCK);
+
+my @children;
+my $tmpdir = "/tmp/dccbench-$$";
+
+END {
+	kill 'TERM', @children if @children;
+	waitpid($_, 0) foreach @children;
+	system('rm', '-rf', $tmpdir) if $tmpdir && -d $tmpdir;
+}
+
+
+#------------------------------------------------------------------------------#
+
+# Open a listening socket on a free loopback port
+sub listener {
+	return IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => 0,
+				     Listen => 5, ReuseAddr => 1)
+	    or die "Couldn't listen: $!\n";
+}
+
+# Run a function in a child process, remembering it so we can kill it
+sub spawn {
+	my ($func) = @_;
+	my $pid = fork;
+
+	die "Couldn't fork: $!\n" unless defined $pid;
+	if (!$pid) {
+		$func->();
+		POSIX::_exit(0);
+	}
+
+	push @children, $pid;
+	return $pid;
+}
+
+# CPU time used by a process so far, in seconds
+sub cputime {
+	my ($pid) = @_;
+
+	open(STAT, "/proc/$pid/stat") or die "Couldn't read /proc/$pid/stat\n";
+	my $stat = <STAT>;
+	close(STAT);
+
+	$stat =~ s/^.*\) //;
+	my @f = split(/ /, $stat);
+	return ($f[11] + $f[12]) / $ticks;
+}
+
+# Fake IRC server, offers a file from the sender whenever asked to "go"
+sub ircd {
+	my ($listen, $sendport) = @_;
+	my $sock = $listen->accept;
+	my $nick = 'bench';
+
+	while (my $line = <$sock>) {
+		$line =~ s/\r?\n$//;
+		$line =~ s/^:\S+ //;
+		my ($cmd, @params) = split(/ /, $line);
+
+		if ($cmd eq 'NICK') {
+			$nick = $params[0];
+			$nick =~ s/^://;
+		} elsif ($cmd eq 'USER') {
+			print $sock ":srv 001 $nick :Welcome\r\n";
+			print $sock ":srv 002 $nick :Your host is srv\r\n";
+			print $sock ":srv 003 $nick :Created today\r\n";
+			print $sock ":srv 004 $nick srv bench i o\r\n";
+			print $sock ":srv 376 $nick :End of MOTD\r\n";
+		} elsif ($cmd eq 'PING') {
+			print $sock ":srv PONG srv $params[0]\r\n";
+		} elsif (($cmd eq 'PRIVMSG') && ($params[1] eq ':go')) {
+			print $sock ":sender!s\@localhost PRIVMSG $nick :\001DCC SEND "
+			    . "bench.bin 2130706433 $sendport $size\001\r\n";
+		}
+		$sock->flush;
+	}
+}
+
+# Fake DCC sender, sends the file and reads acks until they say we're done
+sub sender {
+	my ($listen) = @_;
+	my $block = pack('C*', map { $_ % 256 } 0..65535);
+
+	while (my $sock = $listen->accept) {
+		my $sel = IO::Select->new($sock);
+		my ($sent, $acked, $acks) = (0, 0, '');
+
+		$sock->blocking(0);
+		while ($acked < $size) {
+			my ($r, $w) = IO::Select->select($sel,
+							 ($sent < $size ? $sel : undef),
+							 undef, 30);
+			last unless $r || $w;
+
+			if ($w && @$w) {
+				my $len = $size - $sent;
+				$len = length($block) if $len > length($block);
+				my $wr = syswrite($sock, $block, $len);
+				$sent += $wr if $wr;
+			}
+			if ($r && @$r) {
+				my $buf;
+				last unless sysread($sock, $buf, 65536);
+				$acks .= $buf;
+				while (length($acks) >= 4) {
+					$acked = unpack('N', substr($acks, 0, 4, ''));
+				}
+			}
+		}
+		close($sock);
+	}
+}
+
+# Read lines from the proxy until one matches, returns the match
+sub expect {
+	my ($sock, $pattern) = @_;
+
+	while (my $line = <$sock>) {
+		return $line if $line =~ $pattern;
+	}
+	die "Lost the connection to dircproxy\n";
+}
+
+# Receive one file through the proxy, returns the seconds it took and the
+# CPU seconds dircproxy used
+sub receive {
+	my ($client, $dpid) = @_;
+
+	print $client "PRIVMSG sender :go\r\n";
+	my $offer = expect($client, qr/DCC SEND \S+ \d+ \d+ \d+/);
+	my ($ip, $port) = ($offer =~ /DCC SEND \S+ (\d+) (\d+)/);
+	$ip = join('.', unpack('C4', pack('N', $ip)));
+
+	my $cpu = cputime($dpid);
+	my $start = time;
+	my $sock = IO::Socket::INET->new(PeerAddr => $ip, PeerPort => $port)
+	    or die "Couldn't connect to the DCC offer: $!\n";
+
+	my ($got, $buf) = (0);
+	while ($got < $size) {
+		my $rd = sysread($sock, $buf, 262144);
+		die "DCC SEND ended after $got bytes\n" unless $rd;
+		$got += $rd;
+		syswrite($sock, pack('N', $got & 0xffffffff));
+	}
+	my $secs = time - $start;
+	close($sock);
+
+	return ($secs, cputime($dpid) - $cpu);
+}
+
+
+#------------------------------------------------------------------------------#
+
+$SIG{'PIPE'} = 'IGNORE';
+$SIG{'INT'} = $SIG{'TERM'} = sub { exit 1 };
+mkdir($tmpdir, 0700) or die "Couldn't create $tmpdir: $!\n";
+
+my $irc = listener();
+my $send = listener();
+my $proxy = listener();
+my ($ircport, $sendport, $proxyport) =
+    ($irc->sockport, $send->sockport, $proxy->sockport);
+close($proxy);
+
+spawn(sub { ircd($irc, $sendport) });
+spawn(sub { sender($send) });
+close($irc);
+close($send);
+
+open(CONF, ">$tmpdir/dircproxyrc") or die "Couldn't write config: $!\n";
+print CONF "listen_port $proxyport\n";
+print CONF "connection {\n";
+print CONF "  password \"" . crypt($password, 'db') . "\"\n";
+print CONF "  server \"127.0.0.1:$ircport\"\n";
+print CONF "}\n";
+close(CONF);
+chmod(0600, "$tmpdir/dircproxyrc");
+
+# Debug builds stay in the foreground already, and -D backgrounds them
+my @args = ('-f', "$tmpdir/dircproxyrc");
+unshift(@args, '-D') if `$dircproxy --help 2>&1` =~ /--no-daemon/;
+
+my $dpid = spawn(sub {
+	open(STDOUT, '>/dev/null');
+	exec($dircproxy, @args);
+	warn "Couldn't run $dircproxy: $!\n";
+	POSIX::_exit(1);
+});
+
+my $client;
+for (1..50) {
+	last if $client = IO::Socket::INET->new(PeerAddr => '127.0.0.1',
+						PeerPort => $proxyport);
+	sleep(0.1);
+}
+die "Couldn't connect to dircproxy\n" unless $client;
+$client->autoflush(1);
+
+print $client "PASS $password\r\nNICK bench\r\nUSER bench 0 * :bench\r\n";
+expect($client, qr/ 001 /);
+
+printf("%d bytes per run\n\n", $size);
+printf("%-6s %10s %10s %10s\n", 'run', 'MB/s', 'CPU s', 'CPU s/GB');
+for my $run (1..$runs) {
+	my ($secs, $cpu) = receive($client, $dpid);
+
+	printf("%-6d %10.1f %10.2f %10.2f\n", $run, $size / $secs / 1e6,
+	       $cpu, $cpu / ($size / 1e9));
+}
+
+close($client);
@@ -0,0 +1,137 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ *
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ *
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ *
+ *
+ * fmtbench.c
+ *  - time x_sprintf() and x_bprintf() on the format strings dircproxy uses
+ *    most, against snprintf() into a buffer on the stack
+ * --
+ * Build dircproxy first, then run "make fmtbench" in this directory.
+ *
+ * This file is distributed according to the GNU General Public
+ * License.  For full details, read the top of 'main.c' or the
+ * file called COPYING that was distributed with this code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <dircproxy.h>
+#include "sprintf.h"
+
+/* How many calls make up a run, and how many runs we take the best of */
+#define BENCH_CALLS 200000
+#define BENCH_RUNS 5
+
+/* Which way of formatting is being timed */
+#define BENCH_SPRINTF 0
+#define BENCH_BPRINTF 1
+#define BENCH_SNPRINTF 2
+
+/* Format the strings dircproxy spends most of its time on */
+static void _bench_format(int how, struct strbuf *sb, int n,
+                          const char *line) {
+  char buff[8192];
+
+  switch (n) {
+#define FMT(...) \
+    if (how == BENCH_SPRINTF) { \
+      free(x_sprintf(__VA_ARGS__)); \
+    } else if (how == BENCH_BPRINTF) { \
+      sb->len = 0; \
+      x_bprintf(sb, __VA_ARGS__); \
+    } else { \
+      snprintf(buff, sizeof(buff), __VA_ARGS__); \
+    } \
+    break
+
+    case 0:
+      FMT(":%s NOTICE %s :%s", "dircproxy", "tester",
+          "You are not authorised to do that");
+    case 1:
+      FMT("%s!%s@%s", "somenick", "~user", "host.example.com");
+    case 2:
+      FMT("[%02d:%02d] %s", 12, 34, "<bob> hello there everyone");
+    case 3:
+      FMT("%s %s\r\n", "PRIVMSG #channel",
+          ":a normal length message of chat text");
+    case 4:
+      FMT(":%s PRIVMSG %s :\001DCC SEND %s %lu %d %lu\001", "dircproxy",
+          "tester", "file.bin", 2130706433UL, 18000, 5000000UL);
+    case 5:
+      FMT("%d %ld %lu %x", -12345, 1234567890L, 4000000000UL, 0xbeef);
+    case 6:
+      FMT(":%s PRIVMSG %s :%s", "nick!u@h", "#chan", line);
+#undef FMT
+  }
+}
+
+/* Best time of a few runs, in nanoseconds per call */
+static double _bench_time(int how, struct strbuf *sb, int n,
+                          const char *line, int calls) {
+  double best;
+  int run, i;
+
+  best = 0;
+  for (run = 0; run < BENCH_RUNS; run++) {
+    struct timeval start, end;
+    double t;
+
+    gettimeofday(&start, 0);
+    for (i = 0; i < calls; i++)
+      _bench_format(how, sb, n, line);
+    gettimeofday(&end, 0);
+
+    t = ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec))
+        * 1e3 / calls;
+    if (!run || (t < best))
+      best = t;
+  }
+
+  return best;
+}
+
+int main(void) {
+  static const char *names[] = { "notice", "prefix", "log stamp",
+                                 "server line", "dcc offer", "numbers",
+                                 "4KB line" };
+  struct strbuf sb;
+  char line[4097];
+  int n;
+
+  memset(line, 'x', sizeof(line) - 1);
+  line[sizeof(line) - 1] = 0;
+  memset(&sb, 0, sizeof(struct strbuf));
+
+#ifdef HAVE_VASPRINTF
+  printf("x_sprintf() uses vasprintf(), x_bprintf() its own formatting\n");
+#else /* HAVE_VASPRINTF */
+  printf("x_sprintf() and x_bprintf() both use their own formatting\n");
+#endif /* HAVE_VASPRINTF */
+  printf("nanoseconds per call, best of %d runs\n\n", BENCH_RUNS);
+  printf("%-14s %11s %11s %11s\n", "", "x_sprintf", "x_bprintf", "snprintf");
+
+  for (n = 0; n < (int)(sizeof(names) / sizeof(names[0])); n++) {
+    /* The long line takes much longer, so it gets fewer calls */
+    int calls = (n == 6 ? BENCH_CALLS / 10 : BENCH_CALLS);
+
+    printf("%-14s %11.0f %11.0f %11.0f\n", names[n],
+           _bench_time(BENCH_SPRINTF, &sb, n, line, calls),
+           _bench_time(BENCH_BPRINTF, &sb, n, line, calls),
+           _bench_time(BENCH_SNPRINTF, &sb, n, line, calls));
+  }
+
+  free(sb.str);
+#ifdef DEBUG_MEMORY
+  mem_report("termination");
+#endif /* DEBUG_MEMORY */
+
+  return 0;
+}
@@ -0,0 +1,87 @@
+#!/usr/bin/perl
+# Perl script to convert one of dircproxy's internal log files into the
+# older text format, one line per event:
+#
+#   <time> <event> <destination> <source> <text>
+#
+# This is the same information given to log programs such as log.pl, so
+# it can be used to feed them an existing log.  The internal log files
+# live in a temporary directory (usually /tmp/dircproxy-user-pid-n) while
+# dircproxy is running.
+#
+# Usage: logexport.pl LOGFILE [LOGFILE...]
+#
+
+use strict;
+
+# Event names, in the order of their codes
+my @events = ('message', 'notice', 'action', 'ctcp', 'join', 'part', 'kick',
+	      'quit', 'nick', 'mode', 'topic', 'client', 'server', 'error');
+
+
+#------------------------------------------------------------------------------#
+
+# Read a number stored 7 bits at a time, least significant first
+sub varint {
+	my ($fh) = @_;
+	my ($val, $shift, $c) = (0, 0);
+
+	while (read($fh, $c, 1)) {
+		$c = ord($c);
+		$val |= ($c & 0x7f) << $shift;
+		return $val unless $c & 0x80;
+		$shift += 7;
+	}
+
+	die "Unexpected end of file\n";
+}
+
+# Read a string of the given length
+sub string {
+	my ($fh, $len) = @_;
+	my $str = '';
+
+	read($fh, $str, $len) == $len || die "Unexpected end of file\n"
+		if $len;
+	return $str;
+}
+
+
+#------------------------------------------------------------------------------#
+
+die "Usage: $0 LOGFILE [LOGFILE...]\n" unless @ARGV;
+
+foreach my $file (@ARGV) {
+	my (%strings, $magic, $code, $when);
+
+	open(LOG, "<", $file) || die "Can't open $file: $!\n";
+	binmode(LOG);
+
+	read(LOG, $magic, 8);
+	die "$file is not a dircproxy log file\n" unless $magic eq "DIRCLOG1";
+
+	$when = 0;
+	while (read(LOG, $code, 1)) {
+		$code = ord($code);
+
+		# String definition: id, length, bytes
+		if ($code == 0xff) {
+			my $id = varint(\*LOG);
+			$strings{$id} = string(\*LOG, varint(\*LOG));
+			next;
+		}
+
+		# Event: time difference, destination, source, length, text
+		my $delta = varint(\*LOG);
+		$when += ($delta & 1) ? -($delta >> 1) : ($delta >> 1);
+
+		my $dest = $strings{varint(\*LOG)};
+		my $from = $strings{varint(\*LOG)};
+		my $text = string(\*LOG, varint(\*LOG));
+
+		printf("%lu %s %s %s %s\n", $when, $events[$code] || '', $dest,
+		       $from, $text);
+	}
+
+	close(LOG);
+}
@@ -0,0 +1,263 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ * 
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ * 
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ * 
+ * 
+ * arena.c
+ *  - bump allocator for memory that only lives while a message is handled
+ *  - strdup() and sprintf() into it
+ *
+ * Handling one line from a server or client makes dozens of small strings
+ * that are all finished with by the time the next line is read.  Rather
+ * than malloc() and free() each of them, they're carved off the end of a
+ * block that's kept from one message to the next.  Take an arena_mark()
+ * before, and arena_release() it afterwards to throw them all away at once.
+ * --
+ * @(#) $Id$
+ *
+ * This file is distributed according to the GNU General Public
+ * License.  For full details, read the top of 'main.c' or the
+ * file called COPYING that was distributed with this code.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <dircproxy.h>
+#include "sprintf.h"
+#include "arena.h"
+
+/* Size of the blocks the arena is made of, anything bigger than this gets
+   a block of its own that's freed as soon as it's released */
+#define ARENA_BLOCK_SIZE 8192
+
+/* Everything is handed out on this boundary so it can hold pointers */
+#define ARENA_ALIGN 8
+
+/* Formatting is done straight into the current block if it has at least
+   this much room, otherwise it moves on to the next one first */
+#define ARENA_FORMAT_ROOM 1024
+
+/* A block of memory things are carved from */
+struct arenablock {
+  size_t size, used;
+
+  struct arenablock *next;
+};
+
+/* Where a block's memory begins */
+#define ARENA_DATA(B) ((char *)(B) + sizeof(struct arenablock))
+
+/* forward declarations */
+static struct arenablock *_arena_room(size_t);
+static void *_arena_take(struct arenablock *, size_t);
+static void *_arena_big(size_t);
+
+/* The blocks, the one being carved from, and the oversized ones (newest
+   first) */
+static struct arenablock *arena_blocks = 0;
+static struct arenablock *arena_current = 0;
+static struct arenablock *arena_bigblocks = 0;
+
+/* How much is in use, and the counters */
+static unsigned long arena_inuse = 0;
+static struct arenastats arena_counts;
+
+/* Find a block with room for size more bytes and make it the current one.
+   Blocks after the current one are always empty, so we can just move on to
+   them; a new one is only malloc()d when we run out. */
+static struct arenablock *_arena_room(size_t size) {
+  struct arenablock *b, *last;
+
+  last = b = arena_current;
+  if (!b && (b = arena_blocks))
+    b->used = 0;
+
+  while (b && (b->used + size > b->size)) {
+    last = b;
+    b = b->next;
+    if (b)
+      b->used = 0;
+  }
+
+  if (!b) {
+    b = (struct arenablock *)malloc(sizeof(struct arenablock)
+                                    + ARENA_BLOCK_SIZE);
+    if (!b)
+      return 0;
+    b->size = ARENA_BLOCK_SIZE;
+    b->used = 0;
+    b->next = 0;
+
+    if (last) {
+      last->next = b;
+    } else {
+      arena_blocks = b;
+    }
+
+    arena_counts.blocks++;
+    arena_counts.held += ARENA_BLOCK_SIZE;
+    arena_counts.grown++;
+  }
+
+  arena_current = b;
+  return b;
+}
+
+/* Carve size bytes off the end of a block that has room for them */
+static void *_arena_take(struct arenablock *b, size_t size) {
+  void *ptr;
+
+  size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+  ptr = ARENA_DATA(b) + b->used;
+  b->used += size;
+
+  arena_counts.allocs++;
+  arena_counts.bytes += size;
+  arena_inuse += size;
+  if (arena_inuse > arena_counts.peak)
+    arena_counts.peak = arena_inuse;
+
+  return ptr;
+}
+
+/* Something too big for a block gets one of its own, so the room left in
+   the current block isn't wasted */
+static void *_arena_big(size_t size) {
+  struct arenablock *b;
+
+  b = (struct arenablock *)malloc(sizeof(struct arenablock) + size);
+  if (!b)
+    return 0;
+  b->size = size;
+  b->used = 0;
+  b->next = arena_bigblocks;
+  arena_bigblocks = b;
+  arena_counts.grown++;
+
+  return _arena_take(b, size);
+}
+
+/* Allocate memory from the arena, it goes away at the next arena_release()
+   of a mark taken before it */
+void *arena_alloc(size_t size) {
+  struct arenablock *b;
+
+  size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+  if (size > ARENA_BLOCK_SIZE)
+    return _arena_big(size);
+
+  b = _arena_room(size);
+  if (!b)
+    return 0;
+
+  return _arena_take(b, size);
+}
+
+/* strdup() into the arena */
+char *arena_strdup(const char *str) {
+  return arena_strndup(str, strlen(str));
+}
+
+/* Copy len characters of a string into the arena and terminate it */
+char *arena_strndup(const char *str, size_t len) {
+  char *ret;
+
+  ret = (char *)arena_alloc(len + 1);
+  if (ret) {
+    memcpy(ret, str, len);
+    ret[len] = 0;
+  }
+
+  return ret;
+}
+
+/* sprintf() into the arena */
+char *arena_sprintf(const char *format, ...) {
+  va_list ap;
+  char *ret;
+
+  va_start(ap, format);
+  ret = arena_vsprintf(format, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+/* Format straight onto the end of the current block, only going through
+   the heap if it turns out to be too long for the room there */
+char *arena_vsprintf(const char *format, va_list ap) {
+  struct arenablock *b;
+  StrBuf sb;
+  char *ret;
+
+  b = _arena_room(ARENA_FORMAT_ROOM);
+  if (!b)
+    return 0;
+
+  sb.str = ARENA_DATA(b) + b->used;
+  sb.len = 0;
+  sb.size = b->size - b->used;
+  if (x_vbprintf_fixed(&sb, format, ap) == -1)
+    return 0;
+
+  if (sb.str == ARENA_DATA(b) + b->used)
+    return (char *)_arena_take(b, sb.len + 1);
+
+  arena_counts.spilt++;
+  ret = arena_strndup(sb.str, sb.len);
+  free(sb.str);
+  return ret;
+}
+
+/* Remember how much of the arena is in use */
+void arena_mark(struct arenamark *m) {
+  m->block = arena_current;
+  m->used = (arena_current ? arena_current->used : 0);
+  m->big = arena_bigblocks;
+  m->inuse = arena_inuse;
+}
+
+/* Throw away everything allocated since the mark was taken */
+void arena_release(const struct arenamark *m) {
+  while (arena_bigblocks != m->big) {
+    struct arenablock *b;
+
+    b = arena_bigblocks;
+    arena_bigblocks = b->next;
+    free(b);
+  }
+
+  arena_current = m->block;
+  if (arena_current)
+    arena_current->used = m->used;
+  arena_inuse = m->inuse;
+}
+
+/* Get the arena's counters */
+void arena_stats(struct arenastats *s) {
+  memcpy(s, &arena_counts, sizeof(struct arenastats));
+}
+
+/* Free all the blocks */
+void arena_flush(void) {
+  struct arenamark empty;
+
+  memset(&empty, 0, sizeof(struct arenamark));
+  arena_release(&empty);
+
+  while (arena_blocks) {
+    struct arenablock *b;
+
+    b = arena_blocks;
+    arena_blocks = b->next;
+    free(b);
+  }
+
+  arena_counts.blocks = arena_counts.held = 0;
+}
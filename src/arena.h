@@ -0,0 +1,54 @@
+/* dircproxy
+ * Copyright (C) 2000-2003 Scott James Remnant <scott at netsplit dot com>
+ * 
+ * Copyright (C) 2004-2008 Francois Harvey <contact at francoisharvey dot ca>
+ * 
+ * Copyright (C) 2008-2009 Noel Shrum <noel dot w8tvi at gmail dot com>
+ *                         Francois Harvey <contact at francoisharvey dot ca>
+ * 
+ * 
+ * arena.h
+ * --
+ * @(#) $Id$
+ *
+ * This file is distributed according to the GNU General Public
+ * License.  For full details, read the top of 'main.c' or the
+ * file called COPYING that was distributed with this code.
+ */
+
+#ifndef __DIRCPROXY_ARENA_H
+#define __DIRCPROXY_ARENA_H
+
+/* required includes */
+#include <stddef.h>
+#include <stdarg.h>
+
+/* a point in the arena to go back to, everything allocated after it is
+   thrown away by arena_release() */
+struct arenamark {
+  struct arenablock *block, *big;
+  size_t used;
+  unsigned long inuse;
+};
+
+/* counters to see how the arena is doing */
+struct arenastats {
+  unsigned long allocs, bytes;     /* Allocations handed out, and size */
+  unsigned long peak;              /* Most bytes in use at once */
+  unsigned long blocks, held;      /* Blocks kept for reuse, and size */
+  unsigned long grown;             /* Times a block had to be malloc()d */
+  unsigned long spilt;             /* Strings formatted on the heap first */
+};
+
+/* functions */
+extern void *arena_alloc(size_t);
+extern char *arena_strdup(const char *);
+extern char *arena_strndup(const char *, size_t);
+extern char *arena_sprintf(const char *, ...);
+extern char *arena_vsprintf(const char *, va_list);
+extern void arena_mark(struct arenamark *);
+extern void arena_release(const struct arenamark *);
+extern void arena_stats(struct arenastats *);
+extern void arena_flush(void);
+
+#endif /* __DIRCPROXY_ARENA_H */
@@ -64,13 +64,20 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   globals->client_timeout = DEFAULT_CLIENT_TIMEOUT;
   globals->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
   globals->dns_timeout = DEFAULT_DNS_TIMEOUT;
+  globals->connect_rate = DEFAULT_CONNECT_RATE;
+  globals->connect_jitter = DEFAULT_CONNECT_JITTER;
+  globals->connect_per_server = DEFAULT_CONNECT_PER_SERVER;
+  globals->dcc_proxy_totalrate = DEFAULT_DCC_PROXY_TOTALRATE;
 
   /* Initialise using defaults */
   def->server_port = x_strdup(DEFAULT_SERVER_PORT ? DEFAULT_SERVER_PORT : "0");
   def->server_retry = DEFAULT_SERVER_RETRY;
   def->server_maxattempts = DEFAULT_SERVER_MAXATTEMPTS;
   def->server_maxinitattempts = DEFAULT_SERVER_MAXINITATTEMPTS;
+  def->server_race = DEFAULT_SERVER_RACE;
+  def->server_race_delay = DEFAULT_SERVER_RACE_DELAY;
   def->server_keepalive = DEFAULT_SERVER_KEEPALIVE;
+  def->server_timeout = DEFAULT_SERVER_TIMEOUT;
   def->server_pingtimeout = DEFAULT_SERVER_PINGTIMEOUT;
   if (DEFAULT_SERVER_THROTTLE_BYTES || DEFAULT_SERVER_THROTTLE_PERIOD) {
     def->server_throttle = (long *)malloc(sizeof(long) * 2);
@@ -84,6 +91,7 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   def->idle_maxtime = DEFAULT_IDLE_MAXTIME;
   def->disconnect_existing = DEFAULT_DISCONNECT_EXISTING;
   def->disconnect_on_detach = DEFAULT_DISCONNECT_ON_DETACH;
+  def->multiple_clients = DEFAULT_MULTIPLE_CLIENTS;
   def->initial_modes = (DEFAULT_INITIAL_MODES
                         ? x_strdup(DEFAULT_INITIAL_MODES) : 0);
   def->drop_modes = (DEFAULT_DROP_MODES ? x_strdup(DEFAULT_DROP_MODES) : 0);
@@ -107,6 +115,9 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   def->log_timestamp = DEFAULT_LOG_TIMESTAMP;
   def->log_relativetime = DEFAULT_LOG_RELATIVETIME;
   def->log_timeoffset = DEFAULT_LOG_TIMEOFFSET;
+  def->log_recall_since_detach = DEFAULT_LOG_RECALL_SINCE_DETACH;
+  def->log_search = DEFAULT_LOG_SEARCH;
+  def->log_recall_queue = DEFAULT_LOG_RECALL_QUEUE;
   def->log_events = DEFAULT_LOG_EVENTS;
   def->log_dir = (DEFAULT_LOG_DIR ? x_strdup(DEFAULT_LOG_DIR) : 0);
   def->log_program = (DEFAULT_LOG_PROGRAM ? x_strdup(DEFAULT_LOG_PROGRAM) : 0);
@@ -128,7 +139,11 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
   def->dcc_proxy_ports_sz = 0;
   def->dcc_proxy_timeout = DEFAULT_DCC_PROXY_TIMEOUT;
   def->dcc_proxy_sendreject = DEFAULT_DCC_PROXY_SENDREJECT;
+  def->dcc_proxy_maxrate = DEFAULT_DCC_PROXY_MAXRATE;
+  def->dcc_proxy_classrate = DEFAULT_DCC_PROXY_CLASSRATE;
+  def->dcc_proxy_weight = DEFAULT_DCC_PROXY_WEIGHT;
   def->dcc_send_fast = DEFAULT_DCC_SEND_FAST;
+  def->dcc_send_window = DEFAULT_DCC_SEND_WINDOW;
   def->dcc_capture_directory = (DEFAULT_DCC_CAPTURE_DIRECTORY
                                 ? x_strdup(DEFAULT_DCC_CAPTURE_DIRECTORY) : 0);
   def->dcc_capture_always = DEFAULT_DCC_CAPTURE_ALWAYS;
@@ -267,6 +282,23 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* dns_timeout 60 */
         _cfg_read_numeric(&buf, &globals->dns_timeout);
 
+      } else if (!class && !strcasecmp(key, "connect_rate")) {
+        /* connect_rate 5 */
+        _cfg_read_numeric(&buf, &globals->connect_rate);
+
+      } else if (!class && !strcasecmp(key, "connect_jitter")) {
+        /* connect_jitter 5 */
+        _cfg_read_numeric(&buf, &globals->connect_jitter);
+
+      } else if (!class && !strcasecmp(key, "connect_per_server")) {
+        /* connect_per_server 8 */
+        _cfg_read_numeric(&buf, &globals->connect_per_server);
+
+      } else if (!class && !strcasecmp(key, "dcc_proxy_totalrate")) {
+        /* dcc_proxy_totalrate 0
+           dcc_proxy_totalrate 512 */
+        _cfg_read_numeric(&buf, &globals->dcc_proxy_totalrate);
+
       } else if (!strcasecmp(key, "server_port")) {
         /* server_port 6667
            server_port "irc"    # From /etc/services */
@@ -290,10 +322,22 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
         /* server_maxinitattempts 5 */
         _cfg_read_numeric(&buf, &(class ? class : def)->server_maxinitattempts);
 
+      } else if (!strcasecmp(key, "server_race")) {
+        /* server_race 2 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->server_race);
+
+      } else if (!strcasecmp(key, "server_race_delay")) {
+        /* server_race_delay 1 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->server_race_delay);
+
       } else if (!strcasecmp(key, "server_keepalive")) {
         /* server_keepalive yes
            server_keepalive no */
         _cfg_read_bool(&buf, &(class ? class : def)->server_keepalive);
+
+      } else if (!strcasecmp(key, "server_timeout")) {
+        /* server_timeout 60 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->server_timeout);
         
       } else if (!strcasecmp(key, "server_pingtimeout")) {
         /* server_pingtimeout 600 */
@@ -338,6 +382,11 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
            disconnect_existing_user no */
         _cfg_read_bool(&buf, &(class ? class : def)->disconnect_existing);
 
+      } else if (!strcasecmp(key, "multiple_clients")) {
+        /* multiple_clients yes
+           multiple_clients no */
+        _cfg_read_bool(&buf, &(class ? class : def)->multiple_clients);
+
       } else if (!strcasecmp(key, "disconnect_on_detach")) {
         /* disconnect_on_detach yes
            disconnect_on_detach no */
@@ -557,6 +606,20 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
            log_relativetime no */
         _cfg_read_bool(&buf, &(class ? class : def)->log_relativetime);
 
+      } else if (!strcasecmp(key, "log_recall_since_detach")) {
+        /* log_recall_since_detach yes
+           log_recall_since_detach no */
+        _cfg_read_bool(&buf, &(class ? class : def)->log_recall_since_detach);
+
+      } else if (!strcasecmp(key, "log_search")) {
+        /* log_search yes
+           log_search no */
+        _cfg_read_bool(&buf, &(class ? class : def)->log_search);
+
+      } else if (!strcasecmp(key, "log_recall_queue")) {
+        /* log_recall_queue 16384 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->log_recall_queue);
+
       } else if (!strcasecmp(key, "log_timeoffset")) {
         /* log_timeoffset 0
            log_timeoffset -60
@@ -850,11 +913,29 @@ int cfg_read(const char *filename, char **listen_port, char **pid_file,
            dcc_proxy_sendreject no  */
         _cfg_read_bool(&buf, &(class ? class : def)->dcc_proxy_sendreject);
 
+      } else if (!strcasecmp(key, "dcc_proxy_maxrate")) {
+        /* dcc_proxy_maxrate 0
+           dcc_proxy_maxrate 64 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->dcc_proxy_maxrate);
+
+      } else if (!strcasecmp(key, "dcc_proxy_classrate")) {
+        /* dcc_proxy_classrate 0
+           dcc_proxy_classrate 128 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->dcc_proxy_classrate);
+
+      } else if (!strcasecmp(key, "dcc_proxy_weight")) {
+        /* dcc_proxy_weight 1 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->dcc_proxy_weight);
+
       } else if (!strcasecmp(key, "dcc_send_fast")) {
         /* dcc_send_fast yes
            dcc_send_fast no  */
         _cfg_read_bool(&buf, &(class ? class : def)->dcc_send_fast);
 
+      } else if (!strcasecmp(key, "dcc_send_window")) {
+        /* dcc_send_window 16 */
+        _cfg_read_numeric(&buf, &(class ? class : def)->dcc_send_window);
+
       } else if (!strcasecmp(key, "dcc_capture_directory")) {
         /* dcc_capture_directory none
            dcc_capture_directory ""    # same as none
@@ -38,6 +38,9 @@
 /* forward declarations */
 static void _dccchat_data(struct dccproxy *, int);
 static void _dccchat_error(struct dccproxy *, int, int);
+#ifdef DEBUG
+static void _dccchat_tap(const char *, const char *, int);
+#endif /* DEBUG */
 
 /* Called when we've connected to the sender */
 void dccchat_connected(struct dccproxy *p, int sock) {
@@ -100,17 +103,23 @@ void dccchat_accepted(struct dccproxy *p) {
 
 /* Called when we get data over a DCC link */
 static void _dccchat_data(struct dccproxy *p, int sock) {
-  char *str, *dir;
+#ifdef DEBUG
+  char *dir;
+#endif /* DEBUG */
   int to;
  
   if (sock == p->sender_sock) {
+#ifdef DEBUG
     dir = "}}";
+#endif /* DEBUG */
     to = p->sendee_sock;
 
     if (p->sendee_status != DCC_SENDEE_ACTIVE)
       return;
   } else if (sock == p->sendee_sock) {
+#ifdef DEBUG
     dir = "{{";
+#endif /* DEBUG */
     to = p->sender_sock;
 
     if (p->sender_status != DCC_SENDER_ACTIVE)
@@ -122,13 +131,29 @@ static void _dccchat_data(struct dccproxy *p, int sock) {
     return;
   }
 
-  str = 0;
-  while (net_gets(sock, &str, "\n") > 0) {
-    debug("%s '%s'", dir, str);
-    net_send(to, "%s\n", str);
-    free(str);
+  /* Pass whole lines straight across, they don't need looking at */
+#ifdef DEBUG
+  net_relay(sock, to, (void (*)(void *, const char *, int))_dccchat_tap,
+            (void *)dir);
+#else /* DEBUG */
+  net_relay(sock, to, 0, 0);
+#endif /* DEBUG */
+}
+
+#ifdef DEBUG
+/* Show the lines being relayed */
+static void _dccchat_tap(const char *dir, const char *data, int len) {
+  const char *nl;
+
+  while (len > 0) {
+    nl = memchr(data, '\n', len);
+    debug("%s '%.*s'", dir, (int)(nl - data), data);
+
+    len -= nl - data + 1;
+    data = nl + 1;
   }
 }
+#endif /* DEBUG */
 
 /* Called on DCC disconnection or error */
 static void _dccchat_error(struct dccproxy *p, int sock, int bad) {
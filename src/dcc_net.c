@@ -20,8 +20,13 @@
  * file called COPYING that was distributed with this code.
  */
 
+/* fallocate() is a GNU extension */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -46,6 +51,11 @@ static int _dccnet_listen(struct dccproxy *, int *, size_t, int *);
 static int _dccnet_connect(struct dccproxy *, struct in_addr, int,
                            int *, size_t, int *);
 static int _dccnet_bind(int sock, int *, size_t, int *);
+static int _dccnet_bindport(int, int);
+static int _dccnet_nextport(int *, size_t, int);
+static void _dccnet_release(int);
+static int _dccnet_busy(struct dccproxy *);
+static uint32_t _dccnet_done(struct dccproxy *);
 static void _dccnet_timedout(struct dccproxy *, void *);
 static void _dccnet_accept(struct dccproxy *, int);
 static void _dccnet_free(struct dccproxy *);
@@ -53,10 +63,21 @@ static void _dccnet_free(struct dccproxy *);
 /* list of currently proxied connections */
 static struct dccproxy *proxies = 0;
 
+/* Ports from the dcc_proxy_ports ranges that our proxies have taken, one
+   bit each, and the last one handed out so the next starts after it */
+static unsigned char ports_used[65536 / 8];
+static int ports_last = 0;
+
+/* handy macros for the bitmap */
+#define PORT_USED(_P) (ports_used[(_P) / 8] & (1 << ((_P) % 8)))
+#define PORT_TAKE(_P) (ports_used[(_P) / 8] |= (1 << ((_P) % 8)))
+#define PORT_FREE(_P) (ports_used[(_P) / 8] &= ~(1 << ((_P) % 8)))
+
 /* Create a new DCC connection */
-int dccnet_new(int type, long timeout, int *range, size_t range_sz,
+int dccnet_new(int type, long timeout, long window, long maxrate,
+               long ownerrate, long weight, int *range, size_t range_sz,
                int *lport, struct in_addr addr, int port,
-               const char *filename, long maxsize,
+               const char *filename, long maxsize, uint32_t size,
                int (*n_f)(void *, const char *, const char *),
                void *n_p, const char *n_msg, uint32_t resume_from) {
   struct dccproxy *p;
@@ -64,11 +85,30 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
   p = (struct dccproxy *)malloc(sizeof(struct dccproxy));
   memset(p, 0, sizeof(struct dccproxy));
   p->type = type;
+  p->start = time(0);
+  p->size = size;
+  p->window = (window > 1 ? window : 1) * DCC_BLOCK_SIZE;
+  p->maxrate = maxrate;
+  p->ownerrate = ownerrate;
+  p->weight = (weight > 1 ? weight : 1);
+  /* Nothing until its first share if it's limited at all */
+  p->allowance = ((maxrate || ownerrate || g.dcc_proxy_totalrate) ? 0 : -1);
   p->bytes_rcvd = resume_from;
+  p->cap_fd = -1;
+  p->file_fd = -1;
   /* If we're capturing, we do not need to listen for the client connecting
      because its not going to! */
   if (p->type & DCC_SEND_CAPTURE) {
-    /* Unlink first for security */
+    p->bytes_max = maxsize * 1024;
+
+    /* Don't bother if they've told us it's too big */
+    if (p->bytes_max && (size > resume_from)
+        && (size - resume_from >= p->bytes_max)) {
+      debug("Capture of %lu bytes would be too big", (unsigned long)size);
+      free(p);
+      return -1;
+    }
+
      if (!resume_from){
 	/* Unlink first for security */
 	if (unlink(filename) && (errno != ENOENT)) {
@@ -78,25 +118,70 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
 	}
      }
 
-    /* Open for writing */
-    p->cap_file = fopen(filename, "a");
-    if (!p->cap_file) {
-      syscall_fail("fopen", filename, 0);
+    /* Open for writing at the end.  Not in append mode, splice() won't
+       write to a file that is. */
+    p->cap_fd = open(filename, O_WRONLY | O_CREAT, 0666);
+    if ((p->cap_fd == -1) || (lseek(p->cap_fd, 0, SEEK_END) == -1)) {
+      syscall_fail("open", filename, 0);
+      if (p->cap_fd != -1)
+        close(p->cap_fd);
       free(p);
       return -1;
     }
-
     p->cap_filename = x_strdup(filename);
-    p->bytes_max = maxsize * 1024;
+
+#ifdef HAVE_FALLOCATE
+    /* Reserve the space for the rest of the file now, so it's laid out in
+       one piece and we find out straight away if it won't fit */
+    if ((size > resume_from)
+        && fallocate(p->cap_fd, FALLOC_FL_KEEP_SIZE, resume_from,
+                     size - resume_from)
+        && (errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+      syscall_fail("fallocate", filename, 0);
+      if (!resume_from)
+        unlink(filename);
+      close(p->cap_fd);
+      free(p->cap_filename);
+      free(p);
+      return -1;
+    }
+#endif /* HAVE_FALLOCATE */
 
     /* Connect to the sender */
     if (_dccnet_connect(p, addr, port, range, range_sz, lport)) {
-      fclose(p->cap_file);
+      close(p->cap_fd);
       free(p->cap_filename);
       free(p);
       return -1;
     }
 
+  } else if (p->type & DCC_SEND_FILE) {
+    struct stat statinfo;
+
+    /* We're the sender, so there's nobody to connect to.  Only the first
+       size bytes are offered, the file may still be being captured. */
+    p->file_fd = open(filename, O_RDONLY);
+    if ((p->file_fd == -1) || fstat(p->file_fd, &statinfo)) {
+      syscall_fail("open", filename, 0);
+      if (p->file_fd != -1)
+        close(p->file_fd);
+      free(p);
+      return -1;
+    } else if (!S_ISREG(statinfo.st_mode) || (statinfo.st_size < size)) {
+      debug("%s isn't a file we can send", filename);
+      close(p->file_fd);
+      free(p);
+      return -1;
+    }
+    p->file_size = size;
+    p->bytes_sent = p->bytes_ackd = resume_from;
+
+    if (_dccnet_listen(p, range, range_sz, lport)) {
+      close(p->file_fd);
+      free(p);
+      return -1;
+    }
+
   } else {
     /* Do the connect first, because then that'll hopefully get a port,
        which the listen socket can also use later anyway */
@@ -108,6 +193,7 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
     /* Now listen, if this fails a bind() then thats fatal */
     if (_dccnet_listen(p, range, range_sz, lport)) {
       net_close(&(p->sender_sock));
+      _dccnet_release(p->sender_port);
       free(p);
       return -1;
     }
@@ -118,6 +204,9 @@ int dccnet_new(int type, long timeout, int *range, size_t range_sz,
   if (n_msg)
     p->notify_msg = x_strdup(n_msg);
 
+  p->moved = p->sampled = p->start;
+  p->sample_bytes = _dccnet_done(p);
+
   p->next = proxies;
   proxies = p;
 
@@ -135,14 +224,22 @@ static int _dccnet_listen(struct dccproxy *p, int *range, size_t range_sz,
   if (p->sendee_sock == -1)
     return -1;
 
-  if (_dccnet_bind(p->sendee_sock, range, range_sz, &theport)) {
+  /* Listen on the port we're connecting to the sender from if we can, so
+     we only use the one */
+  if (p->sender_port && !_dccnet_bindport(p->sendee_sock, p->sender_port)) {
+    theport = p->sender_port;
+  } else if (_dccnet_bind(p->sendee_sock, range, range_sz, &theport)) {
     net_close(&(p->sendee_sock));
     return -1;
+  } else if (range) {
+    p->sendee_port = theport;
   }
 
   if (listen(p->sendee_sock, SOMAXCONN)) {
     syscall_fail("listen", 0, 0);
     net_close(&(p->sendee_sock));
+    _dccnet_release(p->sendee_port);
+    p->sendee_port = 0;
     return -1;
   }
 
@@ -176,6 +273,8 @@ static int _dccnet_connect(struct dccproxy *p, struct in_addr addr, int port,
     debug("Connecting to DCC Sender from random port");
   } else {
     debug("Connecting to DCC Sender from port %d", theport);
+    if (range)
+      p->sender_port = theport;
     if (bindport)
       *bindport = theport;
   }
@@ -184,6 +283,8 @@ static int _dccnet_connect(struct dccproxy *p, struct in_addr addr, int port,
               sizeof(struct sockaddr_in)) && (errno != EINPROGRESS)) {
     syscall_fail("connect", inet_ntoa(p->sender_addr.sin_addr), 0);
     net_close(&(p->sender_sock));
+    _dccnet_release(p->sender_port);
+    p->sender_port = 0;
     return -1;
   }
 
@@ -207,37 +308,41 @@ static int _dccnet_bind(int sock, int *range, size_t range_sz, int *port) {
   struct sockaddr_in local_addr;
   int len;
 
-  local_addr.sin_family = AF_INET;
-  local_addr.sin_addr.s_addr = INADDR_ANY;
-
   if (range) {
-    int bound = 0;
-    size_t i;
-    int j;
-
-    for (i = 0; i < range_sz; i += 2) {
-      for (j = range[i]; j <= range[i + 1]; j++) {
-        debug("Trying to bind DCC to port %d", j);
-        local_addr.sin_port = htons(j);
-
-        if (!bind(sock, (struct sockaddr *)&local_addr,
-                  sizeof(struct sockaddr_in))) {
-          bound = 1;
-          break;
-        }
-      }
-
-      if (bound)
+    long total, i;
+    size_t r;
+    int try;
+
+    /* Start after the last port we handed out, and skip the ones our
+       other proxies have; only other processes can make bind() fail */
+    total = 0;
+    for (r = 0; r < range_sz; r += 2)
+      if (range[r + 1] >= range[r])
+        total += range[r + 1] - range[r] + 1;
+
+    try = ports_last;
+    for (i = 0; i < total; i++) {
+      try = _dccnet_nextport(range, range_sz, try);
+      if ((try < 1) || (try > 65535) || PORT_USED(try))
+        continue;
+
+      debug("Trying to bind DCC to port %d", try);
+      if (!_dccnet_bindport(sock, try))
         break;
     }
 
-    if (!bound) {
+    if (i == total) {
       debug("No free ports to bind DCC to");
       return -1;
     }
+
+    PORT_TAKE(try);
+    ports_last = try;
  
   } else {
     debug("Binding DCC to random port");
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = INADDR_ANY;
     local_addr.sin_port = 0;
 
     if (bind(sock, (struct sockaddr *)&local_addr,
@@ -250,6 +355,8 @@ static int _dccnet_bind(int sock, int *range, size_t range_sz, int *port) {
   len = sizeof(struct sockaddr_in);
   if (getsockname(sock, (struct sockaddr *)&local_addr, &len)) {
     syscall_fail("getsockname", 0, 0);
+    if (range)
+      _dccnet_release(ports_last);
     return -1;
   }
                   
@@ -259,6 +366,40 @@ static int _dccnet_bind(int sock, int *range, size_t range_sz, int *port) {
   return 0;
 }
 
+/* Bind a dcc socket to a particular port */
+static int _dccnet_bindport(int sock, int port) {
+  struct sockaddr_in local_addr;
+
+  local_addr.sin_family = AF_INET;
+  local_addr.sin_addr.s_addr = INADDR_ANY;
+  local_addr.sin_port = htons(port);
+
+  return (bind(sock, (struct sockaddr *)&local_addr,
+               sizeof(struct sockaddr_in)) ? -1 : 0);
+}
+
+/* The port after the one given in the allowed range, going round to the
+   start again after the last */
+static int _dccnet_nextport(int *range, size_t range_sz, int port) {
+  size_t i;
+
+  for (i = 0; i < range_sz; i += 2) {
+    if ((port >= range[i]) && (port < range[i + 1])) {
+      return port + 1;
+    } else if (port == range[i + 1]) {
+      return (i + 2 < range_sz ? range[i + 2] : range[0]);
+    }
+  }
+
+  return range[0];
+}
+
+/* Give back a port taken from the allowed range */
+static void _dccnet_release(int port) {
+  if ((port > 0) && (port < 65536))
+    PORT_FREE(port);
+}
+
 /* Timer hook to check if we've timed out */
 static void _dccnet_timedout(struct dccproxy *p, void *data) {
   if ((p->sender_status == DCC_SENDER_ACTIVE) && (p->type & DCC_SEND_CAPTURE)) {
@@ -276,7 +417,8 @@ static void _dccnet_timedout(struct dccproxy *p, void *data) {
                        "Timed out awaiting connection from peer");
     }
 
-  } else if (p->sender_status != DCC_SENDER_ACTIVE) {
+  } else if ((p->sender_status != DCC_SENDER_ACTIVE)
+             && !(p->type & DCC_SEND_FILE)) {
     if (p->type & DCC_CHAT) {
       net_send(p->sendee_sock, "--(%s)-- Connection to remote peer timed out\n",
                PACKAGE);
@@ -343,13 +485,21 @@ static void _dccnet_free(struct dccproxy *p) {
     net_close(&(p->sender_sock));
   if (p->sendee_status & DCC_SENDEE_CREATED)
     net_close(&(p->sendee_sock));
+  _dccnet_release(p->sender_port);
+  _dccnet_release(p->sendee_port);
 
   if (p->cap_filename) {
     unlink(p->cap_filename);
     free(p->cap_filename);
   }
-  if (p->cap_file)
-    fclose(p->cap_file);
+  if (p->cap_fd != -1)
+    close(p->cap_fd);
+  if (p->file_fd != -1)
+    close(p->file_fd);
+  if (p->relaying > 0) {
+    close(p->relay[0]);
+    close(p->relay[1]);
+  }
   free(p->notify_msg);
   free(p->buf);
 
@@ -359,6 +509,231 @@ static void _dccnet_free(struct dccproxy *p) {
   free(p);
 }
 
+/* Move a DCC send from a file we've offered, but which hasn't been
+   accepted yet, to a different position in the file for DCC RESUME */
+int dccnet_resume(int port, uint32_t position) {
+  struct dccproxy *p;
+
+  for (p = proxies; p; p = p->next) {
+    struct sockaddr_in local_addr;
+    int len;
+
+    if (p->dead || !(p->type & DCC_SEND_FILE)
+        || (p->sendee_status != DCC_SENDEE_LISTENING))
+      continue;
+
+    /* Find it by the port it's listening on */
+    len = sizeof(struct sockaddr_in);
+    if (getsockname(p->sendee_sock, (struct sockaddr *)&local_addr, &len)
+        || (ntohs(local_addr.sin_port) != port))
+      continue;
+
+    if (position > p->file_size)
+      return -1;
+
+    debug("Resuming DCC send from a file at %lu", (unsigned long)position);
+    p->bytes_sent = p->bytes_ackd = position;
+    return 0;
+  }
+
+  return -1;
+}
+
+/* Whether a DCC proxy is moving data, and so wants a share of bandwidth */
+static int _dccnet_busy(struct dccproxy *p) {
+  if (p->dead || !(p->type & DCC_SEND))
+    return 0;
+
+  if (p->type & DCC_SEND_CAPTURE)
+    return (p->sender_status == DCC_SENDER_ACTIVE);
+
+  return (p->sendee_status == DCC_SENDEE_ACTIVE);
+}
+
+/* How far through a DCC send we've got */
+static uint32_t _dccnet_done(struct dccproxy *p) {
+  if (p->type & DCC_SEND_CAPTURE) {
+    return p->bytes_rcvd;
+  } else if (p->type & DCC_SEND) {
+    return p->bytes_sent;
+  } else {
+    return 0;
+  }
+}
+
+/* Share out the bandwidth DCC sends are allowed between them.  Called
+   each time round the main loop, it hands out a new allowance every
+   DCC_RATE_SLICE milliseconds.  Each send gets a share of
+   dcc_proxy_totalrate by its weight, and no more than its own limit or
+   its part of its owner's limit, with what it can't use going to the
+   others. */
+void dccnet_schedule(void) {
+  static struct timeval last = { 0, 0 };
+  static int limited = 0;
+  struct dccproxy *p, *q;
+  struct timeval now;
+  long elapsed, budget, wsum;
+  int settled;
+
+  gettimeofday(&now, 0);
+  elapsed = ((now.tv_sec - last.tv_sec) * 1000
+             + (now.tv_usec - last.tv_usec) / 1000);
+  if ((elapsed >= 0) && (elapsed < DCC_RATE_SLICE)) {
+    if (limited)
+      net_pollwait(DCC_RATE_SLICE - elapsed);
+    return;
+  } else if ((elapsed < 0) || (elapsed > 1000)) {
+    /* Clock went backwards, or we've been idle; don't hand out a burst */
+    elapsed = DCC_RATE_SLICE;
+  }
+  last = now;
+
+  /* Once a second note how fast each has been going, and whether it's
+     moved at all; the counters are all the data path keeps */
+  for (p = proxies; p; p = p->next) {
+    uint32_t done;
+
+    if (now.tv_sec <= p->sampled)
+      continue;
+
+    done = _dccnet_done(p);
+    if (done != p->sample_bytes)
+      p->moved = now.tv_sec;
+    p->rate = (done - p->sample_bytes) / (now.tv_sec - p->sampled);
+    p->sample_bytes = done;
+    p->sampled = now.tv_sec;
+  }
+
+  /* Each send's own limit, and its part of its owner's */
+  wsum = 0;
+  for (p = proxies; p; p = p->next) {
+    if (!_dccnet_busy(p))
+      continue;
+
+    p->share = (p->maxrate ? p->maxrate * 1024 / 1000 * elapsed : -1);
+    if (p->ownerrate) {
+      long owsum, part;
+
+      owsum = 0;
+      for (q = proxies; q; q = q->next)
+        if (_dccnet_busy(q) && (q->notify_data == p->notify_data))
+          owsum += q->weight;
+
+      part = p->ownerrate * 1024 / 1000 * elapsed / owsum * p->weight;
+      if ((p->share == -1) || (part < p->share))
+        p->share = part;
+    }
+
+    wsum += p->weight;
+  }
+
+  /* Fill up from the total, those whose own limit is less than their
+     share of what's left get just that, and so on until nobody's left
+     over; everyone else splits the rest */
+  if (g.dcc_proxy_totalrate) {
+    budget = g.dcc_proxy_totalrate * 1024 / 1000 * elapsed;
+
+    for (p = proxies; p; p = p->next)
+      if (_dccnet_busy(p))
+        p->allowance = -2;
+
+    do {
+      settled = 0;
+      for (p = proxies; p && wsum; p = p->next) {
+        if (!_dccnet_busy(p) || (p->allowance != -2) || (p->share == -1)
+            || (p->share > budget / wsum * p->weight))
+          continue;
+
+        p->allowance = p->share;
+        budget -= p->share;
+        wsum -= p->weight;
+        settled = 1;
+      }
+    } while (settled);
+
+    for (p = proxies; p; p = p->next)
+      if (_dccnet_busy(p) && (p->allowance == -2))
+        p->share = budget / wsum * p->weight;
+  }
+
+  /* Hand it out, and let them know; those still waiting for the other
+     side to connect keep what they have */
+  limited = 0;
+  for (p = proxies; p; p = p->next) {
+    if (_dccnet_busy(p)) {
+      p->allowance = p->share;
+      dccsend_scheduled(p);
+    }
+
+    if (!p->dead && (p->allowance != -1))
+      limited = 1;
+  }
+
+  if (limited)
+    net_pollwait(DCC_RATE_SLICE);
+}
+
+/* Fill in how the nth DCC proxy belonging to owner (or anyone, if not
+   given) is getting on, returns -1 if there isn't one */
+int dccnet_stats(void *owner, int n, struct dccstats *s) {
+  struct dccproxy *p;
+  time_t now;
+
+  for (p = proxies; p; p = p->next)
+    if (!p->dead && (!owner || (p->notify_data == owner)) && !n--)
+      break;
+  if (!p)
+    return -1;
+
+  now = time(0);
+  memset(s, 0, sizeof(struct dccstats));
+  s->type = p->type;
+  s->sender_addr = p->sender_addr;
+  s->sendee_addr = p->sendee_addr;
+  s->age = now - p->start;
+  s->size = p->size;
+  s->done = _dccnet_done(p);
+  s->rate = p->rate;
+
+  if (p->type & DCC_SEND) {
+    s->connected = _dccnet_busy(p);
+    if (!(p->type & DCC_SEND_CAPTURE) && (p->bytes_ackd < p->bytes_sent))
+      s->unackd = p->bytes_sent - p->bytes_ackd;
+    s->buffered = p->relay_len;
+    s->buffer_size = p->relay_size;
+  } else {
+    s->connected = ((p->sender_status == DCC_SENDER_ACTIVE)
+                    && (p->sendee_status == DCC_SENDEE_ACTIVE));
+    s->buffered = net_queued(p->sender_sock) + net_queued(p->sendee_sock);
+  }
+
+  /* Whoever it is that's holding things up just now */
+  if (!s->connected) {
+    s->waiting = "connection";
+    return 0;
+  }
+
+  s->stalled = now - p->moved;
+  if (!(p->type & DCC_SEND)) {
+    s->waiting = 0;
+  } else if (!p->allowance) {
+    s->waiting = "limit";
+  } else if (p->type & DCC_SEND_CAPTURE) {
+    s->waiting = "sender";
+  } else if (!(p->type & DCC_SEND_FAST) && (s->unackd >= p->window)) {
+    s->waiting = "acks";
+  } else if ((p->type & DCC_SEND_FILE) || p->relay_full
+             || (p->relay_size && (p->relay_len >= p->relay_size))) {
+    s->waiting = "receiver";
+  } else if (!p->relay_len) {
+    s->waiting = "sender";
+  } else {
+    s->waiting = 0;
+  }
+
+  return 0;
+}
+
 /* Get rid of any dead proxies */
 int dccnet_expunge_proxies(void) {
   struct dccproxy *p, *l;
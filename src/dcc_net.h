@@ -45,23 +45,61 @@ struct dccproxy {
   int sendee_status;
   struct sockaddr_in sendee_addr;
 
+  /* ports from dcc_proxy_ports we've taken, 0 if none */
+  int sender_port, sendee_port;
+
   int (*notify_func)(void *, const char *, const char *);
   void *notify_data;
   char *notify_msg;
 
   /* DCC SEND only */
+  uint32_t size;
   uint32_t bytes_sent, bytes_ackd, bytes_rcvd;
+  unsigned long window;
   char *buf;
-  unsigned long bufsz;
+
+  /* DCC SEND bandwidth, see dccnet_schedule() */
+  long maxrate, ownerrate, weight;
+  long allowance, share;
+
+  /* DCC SEND relayed through a pipe, or through buf as a ring */
+  int relaying, relay_full;
+  int relay[2];
+  unsigned long relay_len, relay_size, relay_start;
+  uint32_t ack;
+  int ack_len;
 
   /* DCC SEND (Capture) only */
   char *cap_filename;
-  FILE *cap_file;
+  int cap_fd;
   uint32_t bytes_max;
 
+  /* DCC SEND (from a file) only */
+  int file_fd;
+  uint32_t file_size;
+
+  /* progress, sampled by dccnet_schedule() */
+  time_t moved, sampled;
+  uint32_t sample_bytes;
+  unsigned long rate;
+
   struct dccproxy *next;
 };
 
+/* how a dcc proxy is getting on, see dccnet_stats() */
+typedef struct dccstats {
+  int type;
+  int connected;
+  struct sockaddr_in sender_addr, sendee_addr;
+
+  time_t age, stalled;
+  uint32_t size, done, unackd;
+  unsigned long buffered, buffer_size;
+  unsigned long rate, avgrate;
+
+  const char *waiting;
+} DCCStats;
+
 /* handy defines */
 #define DCCN_FUNCTION(_FUNC) ((int (*)(void *, const char *, const char *)) \
                               _FUNC)
@@ -71,7 +109,8 @@ struct dccproxy {
 #define DCC_SEND_SIMPLE      0x10
 #define DCC_SEND_FAST        0x20
 #define DCC_SEND_CAPTURE     0x40
-#define DCC_SEND             0x70
+#define DCC_SEND_FILE        0x80
+#define DCC_SEND             0xf0
 
 /* states a sender can be in */
 #define DCC_SENDER_NONE      0x00
@@ -88,11 +127,14 @@ struct dccproxy {
 #define DCC_SENDEE_CREATED   0x03
 
 /* functions */
-extern int dccnet_new(int, long, int *, size_t, int *,
-                      struct in_addr, int, const char *, long,
+extern int dccnet_new(int, long, long, long, long, long, int *, size_t, int *,
+                      struct in_addr, int, const char *, long, uint32_t,
                       int (*)(void *, const char *, const char *),
                       void *, const char *, uint32_t);
+extern int dccnet_resume(int, uint32_t);
 extern int dccnet_expunge_proxies(void);
+extern void dccnet_schedule(void);
+extern int dccnet_stats(void *, int, struct dccstats *);
 extern void dccnet_flush(void);
 
 #endif /* __DIRCPROXY_IRC_DCC_H */
@@ -11,17 +11,28 @@
  * file called COPYING that was distributed with this code.
  */
 
+/* splice() is a GNU extension */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <dircproxy.h>
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define DCC_SENDFILE
+#endif /* HAVE_SENDFILE && HAVE_SYS_SENDFILE_H */
+
 #include "sprintf.h"
 #include "net.h"
 #include "dns.h"
@@ -30,9 +41,21 @@
 #include "dcc_send.h"
 
 /* forward declarations */
-static void _dccsend_data(struct dccproxy *, int);
 static void _dccsend_error(struct dccproxy *, int, int);
-static int _dccsend_sendpacket(struct dccproxy *);
+static void _dccsend_capture(struct dccproxy *, int);
+static int _dccsend_capwrite(struct dccproxy *, size_t);
+static int _dccsend_readacks(struct dccproxy *, int);
+static unsigned long _dccsend_window(struct dccproxy *);
+static void _dccsend_filedata(struct dccproxy *, int);
+static void _dccsend_filewrite(struct dccproxy *, int);
+static void _dccsend_filewant(struct dccproxy *);
+static void _dccsend_relay(struct dccproxy *);
+static void _dccsend_relaydata(struct dccproxy *, int);
+static void _dccsend_relaywrite(struct dccproxy *, int);
+static void _dccsend_relaywant(struct dccproxy *);
+
+/* The usual size of a pipe, if we can't ask for a bigger one */
+#define DCC_RELAY_PIPE 65536
 
 /* Called when we've connected to the sender */
 void dccsend_connected(struct dccproxy *p, int sock) {
@@ -45,9 +68,22 @@ void dccsend_connected(struct dccproxy *p, int sock) {
 
   debug("DCC Connection succeeded");
   p->sender_status |= DCC_SENDER_CONNECTED;
-  net_hook(p->sender_sock, SOCK_NORMAL, (void *)p,
-           ACTIVITY_FUNCTION(_dccsend_data),
+
+  /* Captures are read straight into the file */
+  if (p->type & DCC_SEND_CAPTURE) {
+    net_hook(p->sender_sock, SOCK_DIRECT, (void *)p,
+             ACTIVITY_FUNCTION(_dccsend_capture),
+             ERROR_FUNCTION(_dccsend_error));
+    net_direct(p->sender_sock, (p->allowance != 0), 0);
+    return;
+  }
+
+  /* Data for a client is relayed from one socket to the other */
+  _dccsend_relay(p);
+  net_hook(p->sender_sock, SOCK_DIRECT, (void *)p,
+           ACTIVITY_FUNCTION(_dccsend_relaydata),
            ERROR_FUNCTION(_dccsend_error));
+  _dccsend_relaywant(p);
 }
 
 /* Called when a connection fails */
@@ -71,87 +107,32 @@ void dccsend_connectfailed(struct dccproxy *p, int sock, int bad) {
 
 /* Called when the sendee has been accepted */
 void dccsend_accepted(struct dccproxy *p) {
-  net_hook(p->sendee_sock, SOCK_NORMAL, (void *)p,
-           ACTIVITY_FUNCTION(_dccsend_data),
-           ERROR_FUNCTION(_dccsend_error));
-
-  /* If we've already got data, we better some */
-  if (p->bufsz)
-    _dccsend_sendpacket(p);
-}
-
-/* Called when we get data over a DCC link */
-static void _dccsend_data(struct dccproxy *p, int sock) {
-  if (sock == p->sender_sock) {
-    int buflen, nr;
-
-    /* Read the data into the buffer */
-    buflen = net_read(p->sender_sock, 0, 0);
-    p->buf = (char *)realloc(p->buf, p->bufsz + buflen);
-    nr = net_read(p->sender_sock, (void *)(p->buf + p->bufsz), buflen);
-
-    /* Check we read some */
-    if (nr > 0) {
-      uint32_t na;
-      int ret;
-
-      p->bufsz += nr;
-      p->bytes_rcvd += nr;
-
-      /* Acknowledge them */
-      na = htonl(p->bytes_rcvd);
-      ret = net_queue(p->sender_sock, (void *)&na, sizeof(uint32_t));
-      if (ret) {
-        error("Couldn't queue data in dccsend_data");
-        net_close(&sock);
-        return;
-      }
-    } else {
-      p->buf = (char *)realloc(p->buf, p->bufsz);
-    }
-
-  } else if (sock == p->sendee_sock) {
-    uint32_t ack;
-    int len;
-
-    /* We should only ever get ack's back */
-    len = net_read(p->sendee_sock, (void *)&ack, sizeof(uint32_t));
-    if (len == sizeof(uint32_t))
-      p->bytes_ackd = ntohl(ack);
-
-  } else {
-    error("Unexpected socket %d in dccsend_data, expected %d or %d", sock,
-          p->sender_sock, p->sendee_sock);
-    net_close(&sock);
+  /* We're sending them a file ourselves */
+  if (p->type & DCC_SEND_FILE) {
+    net_hook(p->sendee_sock, SOCK_DIRECT, (void *)p,
+             ACTIVITY_FUNCTION(_dccsend_filedata),
+             ERROR_FUNCTION(_dccsend_error));
+    net_drain(p->sendee_sock, ACTIVITY_FUNCTION(_dccsend_filewrite));
+    _dccsend_filewant(p);
     return;
   }
 
-  /* Receiving data is as good as trigger as any to check whether we can send
-     more. */
-  if (p->bufsz && ((p->type & DCC_SEND_FAST) || (p->type & DCC_SEND_CAPTURE) || 
-                   (p->bytes_ackd >= p->bytes_sent))) {
-    /* Capturing?  Just eat the buffer right here, right now */
-    if (p->type & DCC_SEND_CAPTURE) {
-      /* Write it to the file */
-      fwrite((void *)p->buf, 1, p->bufsz, p->cap_file);
-
-      /* Sent the whole thing */
-      p->bytes_sent += p->bufsz;
-      p->bufsz = 0;
-      free(p->buf);
-      p->buf = 0;
-
-      /* Check we haven't exceeded the maximum size */
-      if (p->bytes_max && (p->bytes_sent >= p->bytes_max)) {
-        /* We have, kill it.  It'll automatically get unlinked */
-        debug("Too big for my boots!");
-        p->dead = 1;
-      }
+  _dccsend_relay(p);
+  net_hook(p->sendee_sock, SOCK_DIRECT, (void *)p,
+           ACTIVITY_FUNCTION(_dccsend_relaydata),
+           ERROR_FUNCTION(_dccsend_error));
+  net_drain(p->sendee_sock, ACTIVITY_FUNCTION(_dccsend_relaywrite));
+  _dccsend_relaywant(p);
+}
 
-    } else if (p->sendee_status == DCC_SENDEE_ACTIVE) {
-      /* Send packet to the client */
-      _dccsend_sendpacket(p);
-    }
+/* Called when the bandwidth DCC sends may use has been shared out again */
+void dccsend_scheduled(struct dccproxy *p) {
+  if (p->type & DCC_SEND_CAPTURE) {
+    net_direct(p->sender_sock, (p->allowance != 0), 0);
+  } else if (p->type & DCC_SEND_FILE) {
+    _dccsend_filewant(p);
+  } else {
+    _dccsend_relaywant(p);
   }
 }
 
@@ -165,7 +146,8 @@ static void _dccsend_error(struct dccproxy *p, int sock, int bad) {
     net_close(&(p->sender_sock));
 
     /* Not necessarily bad, just means the client has gone */
-    if (p->bufsz && !(p->type & DCC_SEND_CAPTURE)) {
+    if ((p->relay_len || (p->bytes_ackd != p->bytes_sent))
+        && !(p->type & DCC_SEND_CAPTURE)) {
       p->sender_status = DCC_SENDER_GONE;
     } else {
       p->dead = 1;
@@ -191,51 +173,428 @@ static void _dccsend_error(struct dccproxy *p, int sock, int bad) {
     if (p->type & DCC_SEND_CAPTURE) {
       debug("%s closed", p->cap_filename);
       free(p->cap_filename);
-      fclose(p->cap_file);
+      close(p->cap_fd);
       p->cap_filename = 0;
-      p->cap_file = 0;
+      p->cap_fd = -1;
     }
   }
 }
 
-/* Send a packet of buffered data to the client */
-static int _dccsend_sendpacket(struct dccproxy *p) {
-  unsigned long nr;
+/* Called when the sender of a captured DCC send has something for us, it
+   goes into the file without passing through the socket buffers */
+static void _dccsend_capture(struct dccproxy *p, int sock) {
+  unsigned long room;
+  uint32_t na;
+  ssize_t nr;
+
+  if (sock != p->sender_sock) {
+    error("Unexpected socket %d in dccsend_capture, expected %d", sock,
+          p->sender_sock);
+    net_close(&sock);
+    return;
+  }
+
+  /* Never take more than we're allowed to keep, or faster than we're
+     allowed to take it */
+  room = DCC_CAPTURE_SIZE;
+  if (p->bytes_max && (p->bytes_max - p->bytes_sent < room))
+    room = p->bytes_max - p->bytes_sent;
+  if ((p->allowance != -1) && ((unsigned long)p->allowance < room))
+    room = p->allowance;
+  if (!room) {
+    net_direct(p->sender_sock, 0, 0);
+    return;
+  }
+
+  _dccsend_relay(p);
+#ifdef HAVE_SPLICE
+  if (p->relaying > 0) {
+    nr = splice(p->sender_sock, NULL, p->relay[1], NULL, room,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } else
+#endif /* HAVE_SPLICE */
+  {
+    /* Goes straight out again, so it's always at the start */
+    nr = read(p->sender_sock, p->buf, room);
+  }
+
+  if (!nr) {
+    /* Sender has finished */
+    _dccsend_error(p, sock, 0);
+    return;
+
+  } else if (nr == -1) {
+    if ((errno != EAGAIN) && (errno != EINTR)) {
+      if (errno != ECONNRESET)
+        syscall_fail("read", "sender", 0);
+      _dccsend_error(p, sock, (errno != ECONNRESET));
+    }
+    return;
+  }
+
+  /* Write it to the file */
+  if (_dccsend_capwrite(p, nr)) {
+    syscall_fail("write", p->cap_filename, 0);
+    p->dead = 1;
+    return;
+  }
+  p->bytes_rcvd += nr;
+  p->bytes_sent += nr;
+  if (p->allowance != -1)
+    p->allowance -= nr;
+
+  /* Acknowledge them */
+  na = htonl(p->bytes_rcvd);
+  if (net_queue(p->sender_sock, (void *)&na, sizeof(uint32_t))) {
+    error("Couldn't queue data in dccsend_capture");
+    p->dead = 1;
+    return;
+  }
+
+  /* Check we haven't reached the maximum size */
+  if (p->bytes_max && (p->bytes_sent >= p->bytes_max)) {
+    /* We have, kill it.  It'll automatically get unlinked */
+    debug("Too big for my boots!");
+    p->dead = 1;
+  }
+}
+
+/* Read acknowledgements from a direct sendee, which may arrive in pieces.
+   Returns -1 if the sendee has gone. */
+static int _dccsend_readacks(struct dccproxy *p, int sock) {
+  unsigned char buf[64];
+  ssize_t nr, i;
+
+  nr = read(sock, buf, sizeof(buf));
+  if (nr > 0) {
+    for (i = 0; i < nr; i++) {
+      p->ack = (p->ack << 8) | buf[i];
+      if (++p->ack_len == sizeof(uint32_t)) {
+        p->bytes_ackd = p->ack;
+        p->ack = 0;
+        p->ack_len = 0;
+      }
+    }
+
+  } else if (!nr) {
+    _dccsend_error(p, sock, 0);
+    return -1;
+
+  } else if ((errno != EAGAIN) && (errno != EINTR)) {
+    if (errno != ECONNRESET)
+      syscall_fail("read", "sendee", 0);
+    _dccsend_error(p, sock, (errno != ECONNRESET));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* How much more can go to the sendee just now, before it has to
+   acknowledge some of what it has already or we're allowed more
+   bandwidth */
+static unsigned long _dccsend_window(struct dccproxy *p) {
+  unsigned long window;
+  uint32_t unackd;
 
-  /* If we're doing simple sends, we limit the amount we send, if doing fast
-     just shove the whole lot to them */
   if (p->type & DCC_SEND_FAST) {
-    nr = p->bufsz;
+    window = ULONG_MAX;
   } else {
-    nr = (p->bufsz > DCC_BLOCK_SIZE ? DCC_BLOCK_SIZE : p->bufsz);
+    unackd = (p->bytes_ackd < p->bytes_sent
+              ? p->bytes_sent - p->bytes_ackd : 0);
+    window = (unackd < p->window ? p->window - unackd : 0);
+  }
+
+  if ((p->allowance != -1) && ((unsigned long)p->allowance < window))
+    window = p->allowance;
+
+  return window;
+}
+
+/* Called when the sendee of a DCC send from a file acknowledges some */
+static void _dccsend_filedata(struct dccproxy *p, int sock) {
+  if (sock != p->sendee_sock) {
+    error("Unexpected socket %d in dccsend_filedata, expected %d", sock,
+          p->sendee_sock);
+    net_close(&sock);
+    return;
   }
 
-  /* Send it to the sendee */
-  if (nr) {
-    int ret;
+  if (!_dccsend_readacks(p, sock))
+    _dccsend_filewant(p);
+}
+
+/* Called when the sendee has room for more of a DCC send from a file, it
+   goes from the file to the socket without passing through our buffers
+   if the system lets it */
+static void _dccsend_filewrite(struct dccproxy *p, int sock) {
+  unsigned long nr, window;
+  ssize_t nw;
+
+  /* If we're doing simple sends, we limit the amount we send */
+  nr = p->file_size - p->bytes_sent;
+  window = _dccsend_window(p);
+  if (nr > window)
+    nr = window;
+
+#ifdef DCC_SENDFILE
+  {
+    off_t offset;
+
+    if (nr > DCC_RELAY_SIZE)
+      nr = DCC_RELAY_SIZE;
+    offset = p->bytes_sent;
+    nw = sendfile(p->sendee_sock, p->file_fd, &offset, nr);
+  }
+#else /* DCC_SENDFILE */
+  /* One buffer for the whole send, anything that doesn't fit in the
+     socket is just read again next time */
+  if (!p->buf)
+    p->buf = (char *)malloc(DCC_CAPTURE_SIZE);
+  if (nr > DCC_CAPTURE_SIZE)
+    nr = DCC_CAPTURE_SIZE;
+  nw = pread(p->file_fd, p->buf, nr, p->bytes_sent);
+  if (nw > 0)
+    nw = write(p->sendee_sock, p->buf, nw);
+#endif /* DCC_SENDFILE */
+
+  if (nw > 0) {
+    p->bytes_sent += nw;
+    if (p->allowance != -1)
+      p->allowance -= nw;
+
+  } else if (!nw) {
+    /* Someone's cut the file short */
+    debug("File ended early at %lu", (unsigned long)p->bytes_sent);
+    p->dead = 1;
+    return;
 
-    ret = net_queue(p->sendee_sock, (void *)p->buf, nr);
-    if (ret) {
-      error("Couldn't queue data in dccsend_data");
-      net_close(&(p->sendee_sock));
+  } else if ((errno != EAGAIN) && (errno != EINTR)) {
+    if ((errno != EPIPE) && (errno != ECONNRESET))
+      syscall_fail("sendfile", "sendee", 0);
+    _dccsend_error(p, sock, ((errno != EPIPE) && (errno != ECONNRESET)));
+    return;
+  }
+
+  _dccsend_filewant(p);
+}
+
+/* Tell the network code whether we're waiting for room to send more of a
+   file to the sendee */
+static void _dccsend_filewant(struct dccproxy *p) {
+  /* They've got all of it */
+  if (p->bytes_ackd == p->file_size) {
+    debug("DCC send from a file complete");
+    p->dead = 1;
+    return;
+  }
+
+  net_direct(p->sendee_sock, 1,
+             ((p->bytes_sent < p->file_size) && _dccsend_window(p)));
+}
+
+/* Write len bytes just captured, from the pipe or our buffer, to the
+   capture file */
+static int _dccsend_capwrite(struct dccproxy *p, size_t len) {
+  ssize_t nw;
+  size_t off;
+
+  off = 0;
+  while (off < len) {
+#ifdef HAVE_SPLICE
+    if (p->relaying > 0) {
+      nw = splice(p->relay[0], NULL, p->cap_fd, NULL, len - off,
+                  SPLICE_F_MOVE);
+    } else
+#endif /* HAVE_SPLICE */
+    {
+      nw = write(p->cap_fd, p->buf + off, len - off);
+    }
+
+    if (nw > 0) {
+      off += nw;
+    } else if (!nw || (errno != EINTR)) {
       return -1;
     }
+  }
+
+  return 0;
+}
 
-    /* Adjust or free the buffer */
-    p->bytes_sent += nr;
-    p->bufsz -= nr;
-    if (p->bufsz) {
-      memmove(p->buf, p->buf + nr, p->bufsz);
-      p->buf = (char *)realloc(p->buf, p->bufsz);
+/* Set up what we relay the send through, if we haven't already.  That's
+   a pipe if we can, so it goes from one socket to the other without us
+   copying it, or otherwise a ring buffer of our own. */
+static void _dccsend_relay(struct dccproxy *p) {
+#ifdef HAVE_SPLICE
+  long size;
+
+  if (!p->relaying) {
+    if (pipe(p->relay)) {
+      syscall_fail("pipe", 0, 0);
+      p->relaying = -1;
     } else {
-      free(p->buf);
-      p->buf = 0;
+      fcntl(p->relay[0], F_SETFL, O_NONBLOCK);
+      fcntl(p->relay[1], F_SETFL, O_NONBLOCK);
+
+      size = -1;
+#ifdef F_SETPIPE_SZ
+      size = fcntl(p->relay[1], F_SETPIPE_SZ, DCC_RELAY_SIZE);
+#endif /* F_SETPIPE_SZ */
+      p->relay_size = (size > 0 ? size : DCC_RELAY_PIPE);
+      p->relaying = 1;
+
+      debug("Relaying DCC send through a %lu byte pipe", p->relay_size);
+    }
+  }
+
+  if (p->relaying > 0)
+    return;
+#endif /* HAVE_SPLICE */
+
+  if (!p->buf) {
+    p->buf = (char *)malloc(DCC_RELAY_SIZE);
+    p->relay_size = DCC_RELAY_SIZE;
+    p->relay_start = 0;
+
+    debug("Relaying DCC send through a %lu byte buffer", p->relay_size);
+  }
+}
+
+/* Called when either side of a relayed DCC send has something for us */
+static void _dccsend_relaydata(struct dccproxy *p, int sock) {
+  if (sock == p->sender_sock) {
+    uint32_t na;
+    ssize_t nr;
+
+    /* Move what's arrived into the pipe or ring, if there's room */
+    if (p->relay_full || (p->relay_len >= p->relay_size))
+      return;
+
+#ifdef HAVE_SPLICE
+    if (p->relaying > 0) {
+      nr = splice(p->sender_sock, NULL, p->relay[1], NULL,
+                  p->relay_size - p->relay_len,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } else
+#endif /* HAVE_SPLICE */
+    {
+      unsigned long end;
+
+      /* Only as far as the end of the ring, the rest next time */
+      end = (p->relay_start + p->relay_len) % p->relay_size;
+      nr = read(p->sender_sock, p->buf + end,
+                (end >= p->relay_start ? p->relay_size : p->relay_start)
+                - end);
+    }
+
+    if (nr > 0) {
+      p->relay_len += nr;
+      p->bytes_rcvd += nr;
+
+      /* Acknowledge them */
+      na = htonl(p->bytes_rcvd);
+      if (net_queue(p->sender_sock, (void *)&na, sizeof(uint32_t))) {
+        error("Couldn't queue data in dccsend_relaydata");
+        _dccsend_error(p, sock, 1);
+        return;
+      }
+
+    } else if (!nr) {
+      /* Sender has finished */
+      _dccsend_error(p, sock, 0);
+      return;
+
+    } else if (errno == EAGAIN) {
+      /* Pipe has no more room even though it's not full of bytes, so wait
+         until some has gone to the sendee */
+      if ((p->relaying > 0) && p->relay_len)
+        p->relay_full = 1;
+
+    } else if (errno != EINTR) {
+      if (errno != ECONNRESET)
+        syscall_fail((p->relaying > 0 ? "splice" : "read"), "sender", 0);
+      _dccsend_error(p, sock, (errno != ECONNRESET));
+      return;
     }
+
+  } else if (sock == p->sendee_sock) {
+    if (_dccsend_readacks(p, sock))
+      return;
+
+  } else {
+    error("Unexpected socket %d in dccsend_relaydata, expected %d or %d",
+          sock, p->sender_sock, p->sendee_sock);
+    net_close(&sock);
+    return;
+  }
+
+  _dccsend_relaywant(p);
+}
+
+/* Called when the sendee has room for more of a relayed DCC send */
+static void _dccsend_relaywrite(struct dccproxy *p, int sock) {
+  unsigned long nr, window;
+  ssize_t nw;
+
+  /* If we're doing simple sends, we limit the amount they have that they
+     haven't acknowledged, if doing fast just shove the whole lot to them */
+  nr = p->relay_len;
+  window = _dccsend_window(p);
+  if (nr > window)
+    nr = window;
+
+#ifdef HAVE_SPLICE
+  if (p->relaying > 0) {
+    nw = splice(p->relay[0], NULL, p->sendee_sock, NULL, nr,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } else
+#endif /* HAVE_SPLICE */
+  {
+    /* Only as far as the end of the ring, the rest next time */
+    if (nr > p->relay_size - p->relay_start)
+      nr = p->relay_size - p->relay_start;
+    nw = write(p->sendee_sock, p->buf + p->relay_start, nr);
+    if (nw > 0)
+      p->relay_start = (p->relay_start + nw) % p->relay_size;
   }
 
-  /* Out of buffer and the sender has gone */
-  if (!p->bufsz && (p->sender_status == DCC_SENDER_GONE))
+  if (nw > 0) {
+    p->relay_len -= nw;
+    p->bytes_sent += nw;
+    p->relay_full = 0;
+    if (p->allowance != -1)
+      p->allowance -= nw;
+
+    /* Keep an empty ring in one piece */
+    if (!p->relay_len)
+      p->relay_start = 0;
+
+  } else if ((nw == -1) && (errno != EAGAIN) && (errno != EINTR)) {
+    if ((errno != EPIPE) && (errno != ECONNRESET))
+      syscall_fail((p->relaying > 0 ? "splice" : "write"), "sendee", 0);
+    _dccsend_error(p, sock, ((errno != EPIPE) && (errno != ECONNRESET)));
+    return;
+  }
+
+  _dccsend_relaywant(p);
+}
+
+/* Tell the network code which sides of a relayed DCC send we're waiting
+   to hear from */
+static void _dccsend_relaywant(struct dccproxy *p) {
+  /* Out of data, the sender has gone and the sendee has all of it.  We
+     wait for the last ack because closing with acks unread would reset
+     the connection and could lose the end of the file. */
+  if (!p->relay_len && (p->sender_status == DCC_SENDER_GONE)
+      && (p->bytes_ackd == p->bytes_sent)) {
     p->dead = 1;
+    return;
+  }
+
+  if (p->sender_status == DCC_SENDER_ACTIVE)
+    net_direct(p->sender_sock,
+               (!p->relay_full && (p->relay_len < p->relay_size)), 0);
 
-  return nr;
+  if (p->sendee_status & DCC_SENDEE_CONNECTED)
+    net_direct(p->sendee_sock, 1, (p->relay_len && _dccsend_window(p)));
 }
@@ -20,5 +20,6 @@
 extern void dccsend_connected(struct dccproxy *, int);
 extern void dccsend_connectfailed(struct dccproxy *, int, int);
 extern void dccsend_accepted(struct dccproxy *);
+extern void dccsend_scheduled(struct dccproxy *);
 
 #endif /* __DIRCPROXY_DCC_SEND_H */
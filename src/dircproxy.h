@@ -66,6 +66,24 @@
  */
 #define DCC_BLOCK_SIZE 2048
 
+/* DCC_RELAY_SIZE
+ * Size of the pipe we ask for when relaying a DCC send with splice(), or
+ * of the ring buffer we use otherwise.  The most we hold for the sendee
+ * before we stop reading from the sender.
+ */
+#define DCC_RELAY_SIZE 262144
+
+/* DCC_RATE_SLICE
+ * Milliseconds between each sharing out of bandwidth to DCC sends, when
+ * there's a limit on it.
+ */
+#define DCC_RATE_SLICE 100
+
+/* DCC_CAPTURE_SIZE
+ * Most we take from a DCC sender at once when capturing a send to disk.
+ */
+#define DCC_CAPTURE_SIZE 65536
+
 /* NICK_GUARD_TIME
  * Number of seconds after being told the set nickname was rejected to wait
  * until we attempt to get it back again.
@@ -143,6 +161,31 @@
  */
 #define DEFAULT_DNS_TIMEOUT 20
 
+/* DEFAULT_CONNECT_RATE
+ * How many new server connections (across all proxies) can be started each
+ * second.  Any more wait their turn.  0 means no limit.
+ */
+#define DEFAULT_CONNECT_RATE 5
+
+/* DEFAULT_CONNECT_JITTER
+ * Up to how many seconds at random to add to server_retry, so that proxies
+ * which lost their server together don't all come back at once.
+ */
+#define DEFAULT_CONNECT_JITTER 5
+
+/* DEFAULT_CONNECT_PER_SERVER
+ * How many proxies can be connecting to the same server at once, counted
+ * until the server welcomes them.  0 means no limit.
+ */
+#define DEFAULT_CONNECT_PER_SERVER 8
+
+/* DEFAULT_DCC_PROXY_TOTALRATE
+ * Most bandwidth (in kilobytes per second) all DCC sends together may use,
+ * shared between them by the weight of their connection class.
+ * 0 = No limit
+ */
+#define DEFAULT_DCC_PROXY_TOTALRATE 0
+
 /* DEFAULT_SERVER_PORT
  * What port do we connect to IRC servers on if the server string doesn't
  * explicitly set one
@@ -170,6 +213,18 @@
  */
 #define DEFAULT_SERVER_MAXINITATTEMPTS 5
 
+/* DEFAULT_SERVER_RACE
+ * How many servers from the list do we look up and try to connect to at
+ * once, using whichever answers first?
+ */
+#define DEFAULT_SERVER_RACE 2
+
+/* DEFAULT_SERVER_RACE_DELAY
+ * How many seconds do we give one connection attempt before starting the
+ * next one alongside it?
+ */
+#define DEFAULT_SERVER_RACE_DELAY 1
+
 /* DEFAULT_SERVER_KEEPALIVE
  * Set the SO_KEEPALIVE socket option?
  *  1 = Yes
@@ -177,6 +232,13 @@
  */
 #define DEFAULT_SERVER_KEEPALIVE 0
 
+/* DEFAULT_SERVER_TIMEOUT
+ * How many seconds can go by without the server acknowledging what we've
+ * sent it, or answering keepalive probes, before the connection is dropped?
+ * 0 = leave it up to the operating system
+ */
+#define DEFAULT_SERVER_TIMEOUT 60
+
 /* DEFAULT_SERVER_PINGTIMEOUT
  * How many seconds after receiving a PING do we wait until we assume the
  * server is stoned?  Receipt of another ping resets this timer.
@@ -238,6 +300,15 @@
  */
 #define DEFAULT_DISCONNECT_EXISTING 0
 
+/* DEFAULT_MULTIPLE_CLIENTS
+ * If a connecting user tries to use a proxy that is already in use, do we
+ * let them both use it at once?  If so, disconnect_existing_user doesn't
+ * come into it.
+ *  1 = Yes
+ *  0 = No, do what disconnect_existing_user says
+ */
+#define DEFAULT_MULTIPLE_CLIENTS 0
+
 /* DEFAULT_DISCONNECT_ON_DETACH
  * When the user detaches from the proxy, do we disconnect them from the
  * server?
@@ -341,6 +412,29 @@
  */
 #define DEFAULT_LOG_TIMEOFFSET 0
 
+/* DEFAULT_LOG_RECALL_SINCE_DETACH
+ * Whether automatic recall should only send lines logged since the client
+ * last detached, rather than repeating ones it has already seen.
+ * 1 = Yes
+ * 0 = No
+ */
+#define DEFAULT_LOG_RECALL_SINCE_DETACH 0
+
+/* DEFAULT_LOG_SEARCH
+ * Whether to keep an index of the words in each internal log file so
+ * /DIRCPROXY SEARCH can find lines without reading the whole file.  It
+ * costs memory for every line indexed, so it's something to ask for.
+ * 1 = Yes
+ * 0 = No
+ */
+#define DEFAULT_LOG_SEARCH 0
+
+/* DEFAULT_LOG_RECALL_QUEUE
+ * Most bytes of recalled log text to have waiting for the client at once,
+ * more is sent as it reads what's there.  0 = No limit
+ */
+#define DEFAULT_LOG_RECALL_QUEUE 16384
+
 /* DEFAULT_LOG_EVENTS
  * Bitmask of events that we can log.  All is 0xffff, best to keep it at
  * that.  Otherwise check irc_net.h for the possible list.
@@ -481,6 +575,25 @@
  */
 #define DEFAULT_DCC_PROXY_SENDREJECT 1
 
+/* DEFAULT_DCC_PROXY_MAXRATE
+ * Most bandwidth (in kilobytes per second) one DCC send may use.
+ * 0 = No limit
+ */
+#define DEFAULT_DCC_PROXY_MAXRATE 0
+
+/* DEFAULT_DCC_PROXY_CLASSRATE
+ * Most bandwidth (in kilobytes per second) all of a connection class's DCC
+ * sends together may use.
+ * 0 = No limit
+ */
+#define DEFAULT_DCC_PROXY_CLASSRATE 0
+
+/* DEFAULT_DCC_PROXY_WEIGHT
+ * A connection class's DCC sends' share of dcc_proxy_totalrate, against
+ * the weights of the others.
+ */
+#define DEFAULT_DCC_PROXY_WEIGHT 1
+
 /* DEFAULT_DCC_SEND_FAST
  * Whether to wait for acknowledgement of data from the client before sending
  * any more (during a DCC Send).
@@ -489,6 +602,13 @@
  */
 #define DEFAULT_DCC_SEND_FAST 0
 
+/* DEFAULT_DCC_SEND_WINDOW
+ * When waiting for acknowledgement, how many blocks of data the client
+ * may have unacknowledged before we stop sending it more.
+ * 1 = Wait for each block to be acknowledged
+ */
+#define DEFAULT_DCC_SEND_WINDOW 16
+
 /* DEFAULT_DCC_CAPTURE_DIRECTORY
  * Directory to capture DCC sends in.
  * 0 = Do not capture
@@ -626,6 +746,10 @@ struct globalvars {
   long client_timeout;
   long connect_timeout;
   long dns_timeout;
+  long connect_rate;
+  long connect_jitter;
+  long connect_per_server;
+  long dcc_proxy_totalrate;
 };
 
 /* global variables */
@@ -46,6 +46,7 @@ struct dnschild {
   int pipe;
 
   const char *ip;
+  int all;
 
   dns_fun_t function;
   void *boundto;
@@ -54,22 +55,26 @@ struct dnschild {
   struct dnschild *next;
 };
 
-/* Reply generated by a child */
+/* Reply generated by a child, ip is a list separated by spaces if all the
+   addresses were asked for */
 struct dnsresult {
   int success;
-  char ip[40];
+  char ip[DNS_MAX_ADDRS * 41];
   char name[DNS_MAX_HOSTLEN];
 };
 
 /* forward declarations */
-static struct dnsresult _dns_lookup(const char *, const char *);
-static int _dns_startrequest(void *, dns_fun_t, void *, const char *, const char *);
+static struct dnsresult _dns_lookup(const char *, const char *, int);
+static int _dns_startrequest(void *, dns_fun_t, void *, const char *,
+                             const char *, int);
+static int _dns_splitaddr(const char *, const char *, char *);
 
 /* Children */
 static struct dnschild *dnschildren = 0;
 
 /* Function that looks up DNS request */
-static struct dnsresult _dns_lookup(const char *name, const char *ip) {
+static struct dnsresult _dns_lookup(const char *name, const char *ip,
+                                    int all) {
   struct dnsresult res;
   pid_t pid;
 
@@ -79,7 +84,8 @@ static struct dnsresult _dns_lookup(const char *name, const char *ip) {
   if (name) {
     debug("%d: Looking up IP for '%s'", pid, name);
 
-    if (dns_getip(name, res.ip)) {
+    if (all ? dns_getips(name, res.ip, sizeof(res.ip))
+            : dns_getip(name, res.ip)) {
       strncpy(res.name, name, sizeof(res.name));
       res.name[sizeof(res.name) - 1] = '\0';
       res.success = 1;
@@ -104,7 +110,7 @@ static struct dnsresult _dns_lookup(const char *name, const char *ip) {
 
 /* Function that starts a non-blocking DNS request. */
 static int _dns_startrequest(void *boundto, dns_fun_t function, void *data,
-                             const char *ip, const char *name)
+                             const char *ip, const char *name, int all)
 {
   struct dnschild *child;
   int p[2], wp[2];
@@ -131,6 +137,7 @@ static int _dns_startrequest(void *boundto, dns_fun_t function, void *data,
   child->function = function;
   child->boundto = boundto;
   child->ip = ip;
+  child->all = all;
   child->data = data;
   child->next = dnschildren;
   dnschildren = child;
@@ -176,7 +183,7 @@ static int _dns_startrequest(void *boundto, dns_fun_t function, void *data,
     close(wp[0]);
     
     /* Do the lookup */
-    result = _dns_lookup(name, ip);
+    result = _dns_lookup(name, ip, all);
     if (result.success) {
       /* Succeeded, write to our parent and die */
       write(p[1], (void *)&result, sizeof(struct dnsresult));
@@ -324,40 +331,54 @@ void dns_flush(void) {
 
 /* Returns the IP address of a hostname */
 int dns_addrfromhost(void *boundto, void *data, const char *name, dns_fun_t function) {
-  return _dns_startrequest(boundto, function, data, 0, name);
+  return _dns_startrequest(boundto, function, data, 0, name, 0);
 }
 
 /* Returns the hostname of an IP address */
 int dns_hostfromaddr(void *boundto, void *data, const char *ip, dns_fun_t function) {
-  return _dns_startrequest(boundto, function, data, ip, 0);
+  return _dns_startrequest(boundto, function, data, ip, 0, 0);
 }
 
-/* Fill a sockaddr_in from a hostname or hostname:port combo thing */
-int dns_filladdr(void *boundto, const char *name, const char *defaultport,
-                 SOCKADDR *result, dns_fun_t function) {
-  int ret = 0;
-  
-  char host[DNS_MAX_HOSTLEN];
+/* Split a hostname or hostname:port combo thing, returns the port */
+static int _dns_splitaddr(const char *name, const char *defaultport,
+                          char *host) {
   char portbuf[32];
-  int port;
 
-  memset(result, 0, sizeof(SOCKADDR));
   host[0] = '\0';
   /* 1. IPv6 [addr]:port */
   if ((sscanf(name, "[%39[^]]]:%31s", host, portbuf) == 2) ||
       /* 2. host/ipv4:port */
       (sscanf(name, "%255[^:]:%31s", host, portbuf) == 2))
-    port = dns_portfromserv(portbuf);
-  else {
-    /* 3. just host name */
-    port = dns_portfromserv(defaultport);
-    strncpy(host, name, sizeof(host));
-    host[sizeof(host) - 1] = '\0';
-  }
+    return dns_portfromserv(portbuf);
 
-  ret = _dns_startrequest(boundto, function, (void*)port, 0, host);
+  /* 3. just host name */
+  strncpy(host, name, DNS_MAX_HOSTLEN);
+  host[DNS_MAX_HOSTLEN - 1] = '\0';
+  return dns_portfromserv(defaultport);
+}
 
-  return ret;
+/* Fill a sockaddr_in from a hostname or hostname:port combo thing */
+int dns_filladdr(void *boundto, const char *name, const char *defaultport,
+                 SOCKADDR *result, dns_fun_t function) {
+  char host[DNS_MAX_HOSTLEN];
+  int port;
+
+  memset(result, 0, sizeof(SOCKADDR));
+  port = _dns_splitaddr(name, defaultport, host);
+
+  return _dns_startrequest(boundto, function, (void*)port, 0, host, 0);
+}
+
+/* Like dns_filladdr but give the function every address the hostname has,
+   separated by spaces, instead of just the first.  The port is placed in
+   port and data is passed through untouched */
+int dns_filladdrs(void *boundto, void *data, const char *name,
+                  const char *defaultport, int *port, dns_fun_t function) {
+  char host[DNS_MAX_HOSTLEN];
+
+  *port = _dns_splitaddr(name, defaultport, host);
+
+  return _dns_startrequest(boundto, function, data, 0, host, 1);
 }
 
 /* Returns a network port number for a port as a string */
@@ -445,6 +466,103 @@ int dns_getip(const char *name, char *ip) {
 #endif
 }
 
+/* look up hostname, place every address it has into ips separated by
+ * spaces, alternating between IPv6 and IPv4 so a connection can race them.
+ * Returns 1 on success */
+int dns_getips(const char *name, char *ips, int len) {
+#ifdef HAVE_IPV6
+  struct addrinfo *head, *ai, hints;
+  char found[DNS_MAX_ADDRS][40];
+  int family[DNS_MAX_ADDRS];
+  int nfound, i, pass, last;
+
+  if (dns_getip(name, found[0]) && !strcmp(found[0], name)) {
+    /* Already an IP address */
+    strncpy(ips, name, len);
+    ips[len - 1] = '\0';
+    return 1;
+  }
+
+  head = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  getaddrinfo(name, NULL, &hints, &head);
+
+  nfound = 0;
+  for (ai = head; ai && (nfound < DNS_MAX_ADDRS); ai = ai->ai_next) {
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, found[nfound], 40, NULL,
+                    0, NI_NUMERICHOST))
+      continue;
+
+    for (i = 0; i < nfound; i++) {
+      if (!strcmp(found[i], found[nfound]))
+        break;
+    }
+    if (i == nfound)
+      family[nfound++] = ai->ai_family;
+  }
+  if (head)
+    freeaddrinfo(head);
+
+  /* Take the first of each family in turn, starting with the family the
+     resolver preferred */
+  ips[0] = '\0';
+  last = -1;
+  for (pass = 0; pass < nfound; pass++) {
+    int first = -1;
+
+    for (i = 0; i < nfound; i++) {
+      if (family[i] == -1)
+        continue;
+      if (first == -1)
+        first = i;
+      if (family[i] != last)
+        break;
+    }
+    if (i == nfound)
+      i = first;
+    last = family[i];
+
+    if (strlen(ips) + strlen(found[i]) + 2 <= (size_t)len) {
+      if (ips[0])
+        strcat(ips, " ");
+      strcat(ips, found[i]);
+    }
+    family[i] = -1;
+  }
+
+  return (ips[0] ? 1 : 0);
+#else
+  struct in_addr inp;
+  struct hostent *host;
+  int i;
+
+  if (inet_aton(name, &inp)) {
+    strncpy(ips, name, len);
+    ips[len - 1] = '\0';
+    return 1;
+  }
+
+  host = gethostbyname(name);
+  if (!host)
+    return 0;
+
+  ips[0] = '\0';
+  for (i = 0; host->h_addr_list[i] && (i < DNS_MAX_ADDRS); i++) {
+    char *temp = inet_ntoa(*(struct in_addr *)host->h_addr_list[i]);
+
+    if (strlen(ips) + strlen(temp) + 2 <= (size_t)len) {
+      if (ips[0])
+        strcat(ips, " ");
+      strcat(ips, temp);
+    }
+  }
+
+  return (ips[0] ? 1 : 0);
+#endif
+}
+
 /* look up ip, place up to len bytes of name into name.
 * Returns 1 on success */
 int dns_getname(const char *ip, char *name, int len) {
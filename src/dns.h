@@ -28,6 +28,7 @@
 
 /* handy defines */
 #define DNS_MAX_HOSTLEN 256
+#define DNS_MAX_ADDRS   8
 
 typedef void (*dns_fun_t)(void *, void *, const char *, const char *);
 
@@ -39,9 +40,12 @@ extern int dns_addrfromhost(void *, void *, const char *, dns_fun_t);
 extern int dns_hostfromaddr(void *, void *, const char *, dns_fun_t);
 extern int dns_filladdr(void *, const char *, const char *,
                         SOCKADDR *, dns_fun_t);
+extern int dns_filladdrs(void *, void *, const char *, const char *, int *,
+                         dns_fun_t);
 extern int dns_portfromserv(const char *);
 extern char *dns_servfromport(int);
 
 extern int dns_getip(const char *, char *);
+extern int dns_getips(const char *, char *, int);
 extern int dns_getname(const char *, char *, int);
 #endif /* __DIRCPROXY_DNS_H */
@@ -97,6 +97,63 @@ static char *help_recall[] = {
   "can specify the number of lines to recall and an optional",
   "starting point in the file, or you can specify ALL to",
   "recall all log messages",
+  "",
+  "/DIRCPROXY RECALL [<nickname>|SERVER|<channel>] SINCE <time>",
+  "recalls log messages logged at or after the time given",
+  "instead of a number of lines.  The time can be HH:MM, an",
+  "amount of time ago such as 30m, 2h or 1d, or DETACH for",
+  "the time you last detached from dircproxy",
+  0
+};
+
+/* help search */
+static char *help_search[] = {
+  "/DIRCPROXY SEARCH [SERVER|<channel>] <words>",
+  "searches the private message log file, or the server or",
+  "channel log file given, for the lines containing all of",
+  "the words and shows the most recent of them.  Only the",
+  "last 20000 lines of each log are searched.  You can",
+  "narrow it down further with any of:",
+  "",
+  "  FROM:<nickname>  only lines from that nickname",
+  "  EVENT:<event>    only that type of event, as named in",
+  "                   the log_events configuration option",
+  "  SINCE:<time>     only lines logged at or after the time,",
+  "                   given as for /DIRCPROXY RECALL SINCE",
+  "  LIMIT:<lines>    show this many matches (default 20, at most 500)",
+  0
+};
+
+/* help files */
+static char *help_files[] = {
+  "/DIRCPROXY FILES",
+  "lists the files in the dcc capture directory, with their",
+  "sizes, that you can fetch with /DIRCPROXY GETFILE.",
+  0
+};
+
+/* help getfile */
+static char *help_getfile[] = {
+  "/DIRCPROXY GETFILE <file>",
+  "offers you a file from the dcc capture directory as a",
+  "DCC SEND from dircproxy, so you can fetch files that were",
+  "captured while you were detached.  Your client can resume",
+  "a partly fetched file as usual.",
+  0
+};
+
+/* help dcc */
+static char *help_dcc[] = {
+  "/DIRCPROXY DCC",
+  "shows the DCC chats and sends being proxied for you, with",
+  "how far each send has got, how fast it's going, what's",
+  "buffered in dircproxy and not yet acknowledged by the",
+  "receiver, and who it's waiting on just now: the sender,",
+  "the receiver, acknowledgements or a bandwidth limit.",
+  "",
+  "/DIRCPROXY DCC RAW",
+  "shows the same with one line of name=value pairs for each",
+  "DCC, for scripts.",
   0
 };
 
@@ -20,10 +20,14 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
 #include <time.h>
 
 #include <dircproxy.h>
@@ -35,6 +39,7 @@
 #endif /* HAVE_CRYPT_H */
 
 #include "sprintf.h"
+#include "arena.h"
 #include "net.h"
 #include "dns.h"
 #include "timers.h"
@@ -53,17 +58,37 @@ static void _ircclient_connected2(struct ircproxy *, void *, const char *,
 static void _ircclient_data(struct ircproxy *, int);
 static void _ircclient_error(struct ircproxy *, int, int);
 static int _ircclient_detach(struct ircproxy *, const char *);
+static struct ircattach *_ircclient_attached(struct ircproxy *, int);
+static void _ircclient_swap(struct ircproxy *, struct ircattach *);
+static void _ircclient_drop(struct ircproxy *, struct ircattach *);
+static void _ircclient_promote(struct ircproxy *);
+static void _ircclient_another(struct ircproxy *, struct ircproxy *);
+static void _ircclient_echo(struct ircproxy *, const char *, const char *,
+                           const char *);
+static int _ircclient_sendbuf(struct ircproxy *, struct netbuf *);
 static int _ircclient_gotmsg(struct ircproxy *, const char *);
 static int _ircclient_authenticate(struct ircproxy *, const char *);
 static void _ircclient_resetnick(struct ircproxy *, void *);
 static int _ircclient_got_details(struct ircproxy *, const char *,
                                   const char *, const char *, const char *);
 static int _ircclient_motd(struct ircproxy *);
+static const char *_ircclient_motdtext(struct ircconnclass *);
+static void _ircclient_burst(struct ircproxy *);
+static void _ircclient_burst_add(struct ircproxy *, char **, int *, short,
+                                 const char *, ...);
 static void _ircclient_timedout(struct ircproxy *, void *);
 static int _ircclient_send_dccreject(struct ircproxy *, const char *,
                                      const char *);
+static int _ircclient_parsetime(struct ircproxy *, const char *, time_t *);
 int  _ircclient_handle_privmsg(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_recall(struct ircproxy *, struct ircmessage);
+void _ircclient_handle_search(struct ircproxy *, struct ircmessage);
+void _ircclient_handle_files(struct ircproxy *, struct ircmessage);
+void _ircclient_handle_getfile(struct ircproxy *, struct ircmessage);
+void _ircclient_handle_dcc(struct ircproxy *, struct ircmessage);
+static int _ircclient_handle_chanquery(struct ircproxy *, struct ircmessage);
+static void _ircclient_send_topic(struct ircproxy *, struct ircchannel *, int);
+static void _ircclient_send_names(struct ircproxy *, struct ircchannel *);
 void _ircclient_handle_users(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_kill(struct ircproxy *, struct ircmessage);
 void _ircclient_handle_notify(struct ircproxy *, struct ircmessage);
@@ -116,30 +141,55 @@ static void _ircclient_connected2(struct ircproxy *p, void *data,
 
 /* Called when a client sends us stuff. */
 static void _ircclient_data(struct ircproxy *p, int sock) {
+  struct arenamark mark;
   char *str;
 
   if (sock != p->client_sock) {
-    error("Unexpected socket %d in _ircclient_data, expected %d", sock,
-          p->client_sock);
-    net_close(&sock);
-    return;
+    struct ircattach *a;
+
+    a = _ircclient_attached(p, sock);
+    if (!a) {
+      error("Unexpected socket %d in _ircclient_data, expected %d", sock,
+            p->client_sock);
+      net_close(&sock);
+      return;
+    }
+
+    /* Another client is talking, so it's the one we answer now */
+    _ircclient_swap(p, a);
   }
 
+  /* Replies to what they send only go back to them.  Each line is read into
+     the arena, and everything made while handling it is thrown away before
+     the next. */
   str = 0;
+  p->client_only = 1;
+  arena_mark(&mark);
   while (!p->dead && (p->client_status & IRC_CLIENT_CONNECTED)
          && net_gets(p->client_sock, &str, "\r\n") > 0) {
     debug(">> '%s'", str);
     _ircclient_gotmsg(p, str);
-    free(str);
+    arena_release(&mark);
   }
+  arena_release(&mark);
+  p->client_only = 0;
 }
 
 /* Called on client disconnection or error */
 static void _ircclient_error(struct ircproxy *p, int sock, int bad) {
   if (sock != p->client_sock) {
-    error("Unexpected socket %d in _ircclient_error, expected %d", sock,
-          p->client_sock);
-    net_close(&sock);
+    struct ircattach *a;
+
+    a = _ircclient_attached(p, sock);
+    if (!a) {
+      error("Unexpected socket %d in _ircclient_error, expected %d", sock,
+            p->client_sock);
+      net_close(&sock);
+      return;
+    }
+
+    debug("Attached client %s", (bad ? "socket error" : "disconnect"));
+    _ircclient_drop(p, a);
     return;
   }
 
@@ -154,7 +204,12 @@ static void _ircclient_error(struct ircproxy *p, int sock, int bad) {
 
 /* Called to detach an irc client */
 static int _ircclient_detach(struct ircproxy *p, const char *message) {
-  if (p->die_on_close) {
+  if (p->attached) {
+    /* Others are still using the proxy, so it stays attached */
+    debug("Client left, others still attached");
+    _ircclient_promote(p);
+
+  } else if (p->die_on_close) {
     debug("Killing proxy");
 
     if (message) {
@@ -172,9 +227,11 @@ static int _ircclient_detach(struct ircproxy *p, const char *message) {
 
   } else {
     debug("Detaching proxy");
-    if (p->client_status == IRC_CLIENT_ACTIVE)
+    if (p->client_status == IRC_CLIENT_ACTIVE) {
+      time(&(p->detach_time));
       irclog_log(p, IRC_LOG_CLIENT, IRC_LOGFILE_ALL, PACKAGE,
                  "You disconnected");
+    }
 
     /* Drop modes */
     if ((p->client_status == IRC_CLIENT_ACTIVE)
@@ -326,6 +383,126 @@ static int _ircclient_detach(struct ircproxy *p, const char *message) {
   return 0;
 }
 
+/* Find another client attached to a proxy by its socket */
+static struct ircattach *_ircclient_attached(struct ircproxy *p, int sock) {
+  struct ircattach *a;
+
+  a = p->attached;
+  while (a && (a->sock != sock))
+    a = a->next;
+
+  return a;
+}
+
+/* Make an attached client the one we talk to, and the one we were talking
+   to just another attached client */
+static void _ircclient_swap(struct ircproxy *p, struct ircattach *a) {
+  SOCKADDR addr;
+  char *host;
+  int sock;
+
+  sock = p->client_sock;
+  p->client_sock = a->sock;
+  a->sock = sock;
+
+  addr = p->client_addr;
+  p->client_addr = a->addr;
+  a->addr = addr;
+
+  host = p->client_host;
+  p->client_host = a->host;
+  a->host = host;
+}
+
+/* Close an attached client that isn't the one we're talking to */
+static void _ircclient_drop(struct ircproxy *p, struct ircattach *a) {
+  struct ircattach *l;
+
+  if (p->attached == a) {
+    p->attached = a->next;
+  } else {
+    l = p->attached;
+    while (l->next != a)
+      l = l->next;
+    l->next = a->next;
+  }
+
+  irclog_endrecall(p, a->sock);
+  net_close(&(a->sock));
+  free(a->host);
+  free(a);
+}
+
+/* The client we're talking to has gone, so talk to one of the others
+   instead */
+static void _ircclient_promote(struct ircproxy *p) {
+  struct ircattach *a;
+
+  irclog_endrecall(p, p->client_sock);
+  net_close(&(p->client_sock));
+  free(p->client_host);
+
+  a = p->attached;
+  p->attached = a->next;
+  p->client_sock = a->sock;
+  p->client_addr = a->addr;
+  p->client_host = a->host;
+  free(a);
+}
+
+/* Attach a newly authenticated client alongside those already using a
+   proxy, and welcome just them */
+static void _ircclient_another(struct ircproxy *p, struct ircproxy *newp) {
+  struct ircattach *a;
+
+  a = (struct ircattach *)malloc(sizeof(struct ircattach));
+  a->sock = p->client_sock;
+  a->addr = p->client_addr;
+  a->host = p->client_host;
+  a->next = p->attached;
+  p->attached = a;
+
+  p->client_sock = newp->client_sock;
+  p->client_addr = newp->client_addr;
+  p->client_host = newp->client_host;
+  newp->client_host = 0;
+  net_hook(p->client_sock, SOCK_NORMAL, (void *)p,
+           ACTIVITY_FUNCTION(_ircclient_data),
+           ERROR_FUNCTION(_ircclient_error));
+
+  /* If the connecting client doesn't agree with the proxy about its
+     nickname, then correct it. */
+  if (strcmp(newp->nickname, p->nickname))
+    ircclient_send_selfcmd(newp, "NICK", ":%s", p->nickname);
+
+  p->client_only = 1;
+  ircclient_welcome(p);
+  p->client_only = 0;
+
+  /* Kill off the temporary proxy, the socket is ours now */
+  newp->client_sock = -1;
+  newp->client_status = IRC_CLIENT_NONE;
+  newp->dead = 1;
+}
+
+/* Show the other attached clients what one of them said, as though it
+   came from the server */
+static void _ircclient_echo(struct ircproxy *p, const char *cmd,
+                            const char *to, const char *text) {
+  struct ircattach *a;
+  struct netbuf *b;
+
+  if (!p->attached)
+    return;
+
+  b = net_newbuf();
+  net_bufprintf(b, ":%s!%s@%s %s %s :%s\r\n", p->nickname, p->username,
+                p->hostname, cmd, to, text);
+  for (a = p->attached; a; a = a->next)
+    net_queuebuf(a->sock, b);
+  net_freebuf(b);
+}
+
 /* Called when we get an irc protocol data from a client */
 static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
   struct ircmessage msg;
@@ -406,7 +583,6 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
         ircnet_announce_status(p);
         ircclient_send_error(p, "Detached from %s %s", PACKAGE, VERSION);
         _ircclient_detach(p, 0);
-        ircprot_freemsg(&msg);
         return 0;
 
       } else if (!irc_strcasecmp(msg.cmd, "PONG")) {
@@ -447,6 +623,12 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
         /* All PRIVMSGs go to the server unless we fiddle */
         squelch = _ircclient_handle_privmsg(p, msg);
 
+      } else if (!irc_strcasecmp(msg.cmd, "TOPIC")
+                 || !irc_strcasecmp(msg.cmd, "NAMES")
+                 || !irc_strcasecmp(msg.cmd, "MODE")) {
+        /* Questions about a channel we might already know the answer to */
+        squelch = _ircclient_handle_chanquery(p, msg);
+
       } else if (!irc_strcasecmp(msg.cmd, "NOTICE")) {
         /* Notices from us get logged */
         if (msg.numparams >= 2) {
@@ -457,16 +639,16 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
           if (str && strlen(str)) {
             char *tmp;
 
-            tmp = x_sprintf("%s!%s@%s", p->nickname, p->username,
-                            p->hostname);
+            tmp = arena_sprintf("%s!%s@%s", p->nickname, p->username,
+                                p->hostname);
             irclog_log(p, IRC_LOG_NOTICE, msg.params[0], tmp, "%s", str);
-            free(tmp);
           }
-          free(str);
         }
 
         if (p->conn_class->idle_maxtime)
           ircserver_resetidle(p);
+        if (msg.numparams >= 2)
+          _ircclient_echo(p, "NOTICE", msg.params[0], msg.params[1]);
         squelch = 0;
 
       } else {
@@ -475,7 +657,7 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
 
       /* Send command up to server? (We know there is one at this point) */
       if (!squelch)
-        net_send(p->server_sock, "%s\r\n", msg.orig);
+        ircserver_send_raw(p, "%s", msg.orig);
 
     } else if (irc_strcasecmp(msg.cmd, "DIRCPROXY")) {
       /* Command didn't (and won't be) handled.  We better stick to the
@@ -492,6 +674,18 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
         if (!irc_strcasecmp(msg.params[0], "RECALL")) {
           _ircclient_handle_recall(p, msg);
 
+        } else if (!irc_strcasecmp(msg.params[0], "SEARCH")) {
+          _ircclient_handle_search(p, msg);
+
+        } else if (!irc_strcasecmp(msg.params[0], "FILES")) {
+          _ircclient_handle_files(p, msg);
+
+        } else if (!irc_strcasecmp(msg.params[0], "GETFILE")) {
+          _ircclient_handle_getfile(p, msg);
+
+        } else if (!irc_strcasecmp(msg.params[0], "DCC")) {
+          _ircclient_handle_dcc(p, msg);
+
         } else if (p->conn_class->allow_persist
                    && !irc_strcasecmp(msg.params[0], "PERSIST")) {
           /* User wants a die_on_close proxy to persist */
@@ -539,7 +733,6 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
           } else {
             _ircclient_detach(p, 0);
           }
-          ircprot_freemsg(&msg);
           return 0;
 
         } else if (!irc_strcasecmp(msg.params[0], "QUIT")) {
@@ -561,7 +754,6 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
           ircserver_close_sock(p);
           p->conn_class = 0;
           ircclient_close(p);
-          ircprot_freemsg(&msg);
           return 0;
 
         } else if (!irc_strcasecmp(msg.params[0], "MOTD")) {
@@ -631,7 +823,6 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
           ircserver_connectagain(p);
 
           /* We have no server now, so need to get out of here */
-          ircprot_freemsg(&msg);
           return 0;
 
         } else if (!irc_strcasecmp(msg.params[0], "STATUS")) {
@@ -688,7 +879,6 @@ static int _ircclient_gotmsg(struct ircproxy *p, const char *str) {
     }
   }
 
-  ircprot_freemsg(&msg);
   return 0;
 }
 
@@ -738,7 +928,13 @@ static int _ircclient_authenticate(struct ircproxy *p, const char *password) {
 
     tmp_p = ircnet_fetchclass(cc);
     if (tmp_p && (tmp_p->client_status & IRC_CLIENT_CONNECTED)) {
-      if (tmp_p->conn_class->disconnect_existing) {
+      if (tmp_p->conn_class->multiple_clients
+          && (tmp_p->client_status == IRC_CLIENT_ACTIVE)) {
+        debug("Already connected, attaching alongside existing");
+        _ircclient_another(tmp_p, p);
+        return 0;
+
+      } else if (tmp_p->conn_class->disconnect_existing) {
         debug("Already connected, disconnecting existing");
 
         ircclient_send_error(tmp_p, "Collided with new user");
@@ -795,16 +991,12 @@ static int _ircclient_authenticate(struct ircproxy *p, const char *password) {
 
         c = tmp_p->channels;
         while (c) {
-          if (c->unjoined) {
-            if (c->key) {
-              ircserver_send_command(tmp_p, "JOIN", "%s :%s", c->name, c->key);
-            } else {
-              ircserver_send_command(tmp_p, "JOIN", ":%s", c->name);
-            }
-          }
+          if (c->unjoined)
+            c->joining = 1;
 
           c = c->next;
         }
+        ircnet_sendjoins(tmp_p);
       }
 
       /* Send attach message to all channels we're on */
@@ -1167,6 +1359,9 @@ int ircclient_change_mode(struct ircproxy *p, const char *change) {
 int ircclient_close(struct ircproxy *p) {
   timer_del((void *)p, "client_auth");
   timer_del((void *)p, "client_connect");
+  while (p->attached)
+    _ircclient_drop(p, p->attached);
+  irclog_endrecall(p, -1);
 
   net_close(&(p->client_sock));
   p->client_sock = -1;
@@ -1187,62 +1382,194 @@ int ircclient_close(struct ircproxy *p) {
   return p->dead;
 }
 
-/* send message of the day to the user */
-static int _ircclient_motd(struct ircproxy *p) {
+/* Get the text of a class's MOTD file, one line after another each ending
+   in a newline.  The file is only read again when it changes. */
+static const char *_ircclient_motdtext(struct ircconnclass *cc) {
+  struct stat statinfo;
   FILE *motd_file;
-
-  if (p->conn_class->motd_file) {
-    motd_file = fopen(p->conn_class->motd_file, "r");
-    if (!motd_file)
-      syscall_fail("fopen", p->conn_class->motd_file, 0);
-  } else {
-    motd_file = (FILE *)0;
+  char buff[512];
+  size_t len;
+
+  if (stat(cc->motd_file, &statinfo)) {
+    if (cc->motd_mtime || !cc->motd_text)
+      syscall_fail("stat", cc->motd_file, 0);
+    free(cc->motd_text);
+    cc->motd_text = 0;
+    cc->motd_mtime = 0;
+    return 0;
+  } else if (cc->motd_text && (cc->motd_mtime == statinfo.st_mtime)) {
+    return cc->motd_text;
   }
 
-  /* Check whether to do anything, and send appropriate numerics */
-  if (!p->conn_class->motd_logo && !p->conn_class->motd_stats && !motd_file) {
-    if (p->conn_class->motd_file) {
-      ircclient_send_numeric(p, 422, ":MOTD File is missing");
-    } else {
-      ircclient_send_numeric(p, 422, ":No MOTD");
-    }
+  motd_file = fopen(cc->motd_file, "r");
+  if (!motd_file) {
+    syscall_fail("fopen", cc->motd_file, 0);
     return 0;
-  } else {
-    ircclient_send_numeric(p, 375, ":- %s Message of the Day -", PACKAGE);
   }
 
-  /* Send the pretty dircproxy logo */
+  debug("Reading MOTD file '%s'", cc->motd_file);
+  free(cc->motd_text);
+  cc->motd_text = x_strdup("");
+  cc->motd_mtime = statinfo.st_mtime;
+  len = 0;
+
+  while (fgets(buff, 512, motd_file)) {
+    char *ptr;
+
+    ptr = buff + strlen(buff);
+    while ((ptr >= buff) && (!ptr || strchr(" \t\r\n", *ptr))) *(ptr--) = 0;
+
+    cc->motd_text = (char *)realloc(cc->motd_text, len + strlen(buff) + 2);
+    strcpy(cc->motd_text + len, buff);
+    len += strlen(buff);
+    cc->motd_text[len++] = '\n';
+    cc->motd_text[len] = 0;
+  }
+
+  fclose(motd_file);
+  return cc->motd_text;
+}
+
+/* Add a numeric to a burst being rendered */
+static void _ircclient_burst_add(struct ircproxy *p, char **buf, int *len,
+                                 short numeric, const char *format, ...) {
+  va_list ap;
+  char *msg, *line;
+
+  va_start(ap, format);
+  msg = x_vsprintf(format, ap);
+  va_end(ap);
+
+  line = x_sprintf(":%s %03d %s %s\r\n",
+                   (p->servername ? p->servername : PACKAGE), numeric,
+                   (p->nickname ? p->nickname : "*"), msg);
+
+  *buf = (char *)realloc(*buf, *len + strlen(line) + 1);
+  strcpy(*buf + *len, line);
+  *len += strlen(line);
+
+  free(line);
+  free(msg);
+}
+
+/* Render the welcome numerics and the unchanging start of the MOTD, unless
+   what we rendered last time is still good */
+static void _ircclient_burst(struct ircproxy *p) {
+  const char *servername, *nickname, *motd;
+  struct strlist *s;
+  char tbuf[40];
+
+  servername = (p->servername ? p->servername : PACKAGE);
+  nickname = (p->nickname ? p->nickname : "*");
+  motd = (p->conn_class->motd_file
+          ? _ircclient_motdtext(p->conn_class) : 0);
+
+  if (p->burst.welcome && !strcmp(p->burst.nickname, nickname)
+      && !strcmp(p->burst.servername, servername)
+      && (p->burst.motd_mtime == (motd ? p->conn_class->motd_mtime : 0)))
+    return;
+
+  debug("Rendering welcome for '%s' from '%s'", nickname, servername);
+  ircclient_freeburst(p);
+  p->burst.nickname = x_strdup(nickname);
+  p->burst.servername = x_strdup(servername);
+  p->burst.motd_mtime = (motd ? p->conn_class->motd_mtime : 0);
+
+  /* Welcome numerics */
+  strftime(tbuf, sizeof(tbuf), START_TIMEDATE_FORMAT, localtime(&(p->start)));
+
+  _ircclient_burst_add(p, &p->burst.welcome, &p->burst.welcomelen, 1,
+                       ":Welcome to the Internet Relay Network %s",
+                       p->nickname);
+  _ircclient_burst_add(p, &p->burst.welcome, &p->burst.welcomelen, 2,
+                       ":Your host is %s running %s via %s %s",
+                       p->servername,
+                       (p->serverver ? p->serverver : "(unknown)"),
+                       PACKAGE, VERSION);
+  _ircclient_burst_add(p, &p->burst.welcome, &p->burst.welcomelen, 3,
+                       ":This proxy has been running since %s", tbuf);
+  if (p->serverver)
+    _ircclient_burst_add(p, &p->burst.welcome, &p->burst.welcomelen, 4,
+                         "%s %s %s %s",
+                         p->servername, p->serverver,
+                         p->serverumodes, p->servercmodes);
+  for (s = p->serversupported; s; s = s->next)
+    _ircclient_burst_add(p, &p->burst.welcome, &p->burst.welcomelen, 5,
+                         "%s", s->str);
+
+  /* Start of the MOTD */
+  _ircclient_burst_add(p, &p->burst.motd, &p->burst.motdlen, 375,
+                       ":- %s Message of the Day -", PACKAGE);
+
+  /* The pretty dircproxy logo */
   if (p->conn_class->motd_logo) {
     char *ver;
     int line;
 
     line = 0;
     while (logo[line]) {
-      ircclient_send_numeric(p, 372, ":- %s", logo[line]);
+      _ircclient_burst_add(p, &p->burst.motd, &p->burst.motdlen, 372,
+                           ":- %s", logo[line]);
       line++;
     }
 
     ver = x_sprintf(verstr, VERSION);
-    ircclient_send_numeric(p, 372, ":- %s", ver);
-    ircclient_send_numeric(p, 372, ":-");
+    _ircclient_burst_add(p, &p->burst.motd, &p->burst.motdlen, 372,
+                         ":- %s", ver);
+    _ircclient_burst_add(p, &p->burst.motd, &p->burst.motdlen, 372, ":-");
     free(ver);
   }
 
-  /* Send from file */
-  if (motd_file) {
-    char buff[512];
+  /* From the file */
+  if (motd) {
+    const char *end;
+
+    while ((end = strchr(motd, '\n'))) {
+      char *line;
 
-    while (fgets(buff, 512, motd_file)) {
-      char *ptr;
+      line = x_strdup(motd);
+      line[end - motd] = 0;
+      _ircclient_burst_add(p, &p->burst.motd, &p->burst.motdlen, 372,
+                           ":- %s", line);
+      free(line);
 
-      ptr = buff + strlen(buff);
-      while ((ptr >= buff) && (!ptr || strchr(" \t\r\n", *ptr))) *(ptr--) = 0;
-      ircclient_send_numeric(p, 372, ":- %s", buff);
+      motd = end + 1;
     }
 
-    ircclient_send_numeric(p, 372, ":-");
+    _ircclient_burst_add(p, &p->burst.motd, &p->burst.motdlen, 372, ":-");
+  }
+}
+
+/* Throw away the rendered welcome, something it contains has changed */
+void ircclient_freeburst(struct ircproxy *p) {
+  free(p->burst.nickname);
+  free(p->burst.servername);
+  free(p->burst.welcome);
+  free(p->burst.motd);
+  memset(&(p->burst), 0, sizeof(struct ircburst));
+}
+
+/* send message of the day to the user */
+static int _ircclient_motd(struct ircproxy *p) {
+  const char *motd;
+
+  _ircclient_burst(p);
+  motd = (p->conn_class->motd_file ? p->conn_class->motd_text : 0);
+
+  /* Check whether to do anything, and send appropriate numerics */
+  if (!p->conn_class->motd_logo && !p->conn_class->motd_stats && !motd) {
+    if (p->conn_class->motd_file) {
+      ircclient_send_numeric(p, 422, ":MOTD File is missing");
+    } else {
+      ircclient_send_numeric(p, 422, ":No MOTD");
+    }
+    return 0;
   }
 
+  /* The start, logo and file, rendered already */
+  net_queue(p->client_sock, p->burst.motd, p->burst.motdlen);
+  debug("<- (%d bytes of MOTD)", p->burst.motdlen);
+
   /* Send some stats */
   if (p->conn_class->motd_stats) {
     /* Private messages */
@@ -1336,34 +1663,15 @@ static int _ircclient_motd(struct ircproxy *p) {
 
   /* Done */
   ircclient_send_numeric(p, 376, ":End of /MOTD command");
-  if (motd_file)
-    fclose(motd_file);
 
   return 1;
 }
 
 /* send welcome headers to the user */
 int ircclient_welcome(struct ircproxy *p) {
-  char tbuf[40];
-
-  strftime(tbuf, sizeof(tbuf), START_TIMEDATE_FORMAT, localtime(&(p->start)));
-
-  ircclient_send_numeric(p, 1, ":Welcome to the Internet Relay Network %s",
-                         p->nickname);
-  ircclient_send_numeric(p, 2, ":Your host is %s running %s via %s %s",
-                         p->servername,
-                         (p->serverver ? p->serverver : "(unknown)"),
-                         PACKAGE, VERSION);
-  ircclient_send_numeric(p, 3, ":This proxy has been running since %s", tbuf);
-  if (p->serverver)
-    ircclient_send_numeric(p, 4, "%s %s %s %s",
-                           p->servername, p->serverver,
-                           p->serverumodes, p->servercmodes);
-  struct strlist *s = p->serversupported;
-  while (s) {
-    ircclient_send_numeric(p, 5, "%s", s->str);
-    s = s->next;
-  }
+  _ircclient_burst(p);
+  net_queue(p->client_sock, p->burst.welcome, p->burst.welcomelen);
+  debug("<- (%d bytes of welcome)", p->burst.welcomelen);
 
   _ircclient_motd(p);
 
@@ -1395,8 +1703,18 @@ int ircclient_welcome(struct ircproxy *p) {
     while (c) {
       if (!c->inactive && !c->unjoined) {
         ircclient_send_selfcmd(p, "JOIN", ":%s", c->name);
-        ircserver_send_command(p, "TOPIC", ":%s", c->name);
-        ircserver_send_command(p, "NAMES", ":%s", c->name);
+        if (c->names_known) {
+          /* We've kept track, so there's no need to wait for the server */
+          _ircclient_send_topic(p, c, 0);
+          _ircclient_send_names(p, c);
+        } else if (!p->attached) {
+          ircserver_send_bulk(p, "TOPIC", ":%s", c->name);
+          ircserver_send_bulk(p, "NAMES", ":%s", c->name);
+        }
+        /* Otherwise another client is attached, and the server is already
+           answering a JOIN for the channel.  That answer goes to every
+           client, this one included, and asking again would send the
+           others a second copy. */
 
         if (p->conn_class->chan_log_enabled) {
           irclog_autorecall(p, c->name);
@@ -1446,136 +1764,155 @@ static void _ircclient_timedout(struct ircproxy *p, void *data) {
   ircclient_close(p);
 }
 
+/* Send a line to the client, or to every attached client unless we're
+   answering one of them.  The same buffer is queued on each of their
+   sockets, and the caller's reference to it is given up. */
+static int _ircclient_sendbuf(struct ircproxy *p, struct netbuf *b) {
+  struct ircattach *a;
+  int ret;
+
+  ret = net_queuebuf(p->client_sock, b);
+  if (!p->client_only)
+    for (a = p->attached; a; a = a->next)
+      net_queuebuf(a->sock, b);
+  net_freebuf(b);
+
+  return ret;
+}
+
+/* send a line from the server to the user unchanged */
+int ircclient_send_raw(struct ircproxy *p, const char *format, ...) {
+  struct netbuf *b;
+  va_list ap;
+
+  b = net_newbuf();
+  va_start(ap, format);
+  net_vbufprintf(b, format, ap);
+  va_end(ap);
+
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
+
+  return _ircclient_sendbuf(p, b);
+}
+
 /* send a numeric to the user */
 int ircclient_send_numeric(struct ircproxy *p, short numeric,
                            const char *format, ...) {
+  struct netbuf *b;
   va_list ap;
-  char *msg;
-  int ret;
 
+  b = net_newbuf();
+  net_bufprintf(b, ":%s %03d %s ", (p->servername ? p->servername : PACKAGE),
+                numeric, (p->nickname ? p->nickname : "*"));
   va_start(ap, format);
-  msg = x_vsprintf(format, ap);
+  net_vbufprintf(b, format, ap);
   va_end(ap);
 
-  ret = net_send(p->client_sock, ":%s %03d %s %s\r\n",
-                 (p->servername ? p->servername : PACKAGE), numeric,
-                 (p->nickname ? p->nickname : "*"), msg);
-  debug("<- ':%s %03d %s %s'", (p->servername ? p->servername : PACKAGE),
-        numeric, (p->nickname ? p->nickname : "*"), msg);
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(msg);
-  return ret;
+  return _ircclient_sendbuf(p, b);
 }
 
 /* send a notice to the user */
 int ircclient_send_notice(struct ircproxy *p, const char *format, ...) {
+  struct netbuf *b;
   va_list ap;
-  char *msg;
-  int ret;
 
+  b = net_newbuf();
+  net_bufprintf(b, ":%s %s %s :", PACKAGE, "NOTICE",
+                (p->nickname ? p->nickname : "AUTH"));
   va_start(ap, format);
-  msg = x_vsprintf(format, ap);
+  net_vbufprintf(b, format, ap);
   va_end(ap);
 
-  ret = net_send(p->client_sock, ":%s %s %s :%s\r\n", PACKAGE, "NOTICE",
-                 (p->nickname ? p->nickname : "AUTH"), msg);
-  debug("<- ':%s %s %s :%s'", PACKAGE, "NOTICE",
-        (p->nickname ? p->nickname : "AUTH"), msg);
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(msg);
-  return ret;
+  return _ircclient_sendbuf(p, b);
 }
 
 /* send a notice to a channel */
 int ircclient_send_channotice(struct ircproxy *p, const char *channel,
                               const char *format, ...) {
+  struct netbuf *b;
   va_list ap;
-  char *msg;
-  int ret;
 
+  b = net_newbuf();
+  net_bufprintf(b, ":%s %s %s :", (p->servername ? p->servername : PACKAGE),
+                "NOTICE", channel);
   va_start(ap, format);
-  msg = x_vsprintf(format, ap);
+  net_vbufprintf(b, format, ap);
   va_end(ap);
 
-  ret = net_send(p->client_sock, ":%s %s %s :%s\r\n",
-                 (p->servername ? p->servername : PACKAGE), "NOTICE",
-                 channel, msg);
-  debug("<- ':%s %s %s :%s'", (p->servername ? p->servername : PACKAGE),
-        "NOTICE", channel, msg);
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(msg);
-  return ret;
+  return _ircclient_sendbuf(p, b);
 }
 
 /* send a command to the user from the server */
 int ircclient_send_command(struct ircproxy *p, const char *command,
                            const char *format, ...) {
+  struct netbuf *b;
   va_list ap;
-  char *msg;
-  int ret;
 
+  b = net_newbuf();
+  net_bufprintf(b, ":%s %s ", (p->servername ? p->servername : PACKAGE),
+                command);
   va_start(ap, format);
-  msg = x_vsprintf(format, ap);
+  net_vbufprintf(b, format, ap);
   va_end(ap);
 
-  ret = net_send(p->client_sock, ":%s %s %s\r\n",
-                 (p->servername ? p->servername : PACKAGE), command, msg);
-  debug("<- ':%s %s %s'", (p->servername ? p->servername : PACKAGE),
-        command, msg);
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(msg);
-  return ret;
+  return _ircclient_sendbuf(p, b);
 }
 
 /* send a command to the user making it look like its from them */
 int ircclient_send_selfcmd(struct ircproxy *p, const char *command,
                            const char *format, ...) {
-  char *msg, *prefix;
+  struct netbuf *b;
   va_list ap;
-  int ret;
-
-  va_start(ap, format);
-  msg = x_vsprintf(format, ap);
-  va_end(ap);
 
+  b = net_newbuf();
   if (p->nickname && p->username && p->hostname) {
-    prefix = x_sprintf(":%s!%s@%s ", p->nickname, p->username, p->hostname);
+    net_bufprintf(b, ":%s!%s@%s ", p->nickname, p->username, p->hostname);
   } else if (p->nickname) {
-    prefix = x_sprintf(":%s ", p->nickname);
-  } else {
-    prefix = (char *)malloc(1);
-    prefix[0] = 0;
+    net_bufprintf(b, ":%s ", p->nickname);
   }
+  net_bufprintf(b, "%s ", command);
+  va_start(ap, format);
+  net_vbufprintf(b, format, ap);
+  va_end(ap);
 
-  ret = net_send(p->client_sock, "%s%s %s\r\n", prefix, command, msg);
-  debug("<- '%s%s %s'", prefix, command, msg);
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(prefix);
-  free(msg);
-  return ret;
+  return _ircclient_sendbuf(p, b);
 }
 
 /* send an error to the user */
 int ircclient_send_error(struct ircproxy *p, const char *format, ...) {
-  char *msg, *nick, *user, *host;
+  struct netbuf *b;
   va_list ap;
-  int ret;
 
+  b = net_newbuf();
+  net_bufprintf(b, "%s :%s: %s[%s@%s] (", "ERROR", "Closing Link",
+                (p->nickname ? p->nickname : ""),
+                (p->username ? p->username : "user"),
+                (p->hostname ? p->hostname : "host"));
   va_start(ap, format);
-  msg = x_vsprintf(format, ap);
+  net_vbufprintf(b, format, ap);
   va_end(ap);
+  net_bufprintf(b, ")");
 
-  nick = p->nickname ? p->nickname : "";
-  user = p->username ? p->username : "user";
-  host = p->hostname ? p->hostname : "host";
-
-  ret = net_send(p->client_sock, "%s :%s: %s[%s@%s] (%s)\r\n",
-                 "ERROR", "Closing Link", nick, user, host, msg);
-  debug("<- '%s :%s: %s[%s@%s] (%s)'", "ERROR", "Closing Link",
-        nick, user, host, msg);
+  debug("<- '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(msg);
-  return ret;
+  return _ircclient_sendbuf(p, b);
 }
 
 /* Send a DCC reject message */
@@ -1602,6 +1939,14 @@ static int _ircclient_send_dccreject(struct ircproxy *p, const char *msg,
 void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
   struct ircchannel *c;
   struct strlist *s;
+  struct connstats stats;
+  struct arenastats astats;
+#ifdef DEBUG_MEMORY
+  unsigned long allocs, frees;
+#endif /* DEBUG_MEMORY */
+  static const char *sendq_names[SENDQ_CLASSES] = { "Control", "Interactive",
+                                                    "Bulk" };
+  int i;
 
   ircclient_send_notice(p, "%s %s status:", PACKAGE, VERSION);
   ircclient_send_notice(p, "- Nickname on server: %s", p->nickname);
@@ -1627,6 +1972,13 @@ void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
     if (p->client_status & IRC_CLIENT_SENTWELCOME)
       ircclient_send_notice(p, "-   Welcomed");
   }
+  if (p->attached) {
+    struct ircattach *a;
+
+    ircclient_send_notice(p, "-   You: %s", p->client_host);
+    for (a = p->attached; a; a = a->next)
+      ircclient_send_notice(p, "-   Also attached: %s", a->host);
+  }
   ircclient_send_notice(p, "-");
 
   ircclient_send_notice(p, "- Server status: %s",
@@ -1643,6 +1995,48 @@ void _ircclient_handle_status(struct ircproxy *p, struct ircmessage msg) {
     if (p->server_status & IRC_SERVER_GOTWELCOME)
       ircclient_send_notice(p, "-   Have been welcomed");
   }
+  if (p->rtt_samples)
+    ircclient_send_notice(p, "-   Lag: %ldms (deviation %ldms, %lu PINGs)",
+                          p->server_rtt, p->server_rttvar, p->rtt_samples);
+  ircclient_send_notice(p, "-");
+
+  ircserver_connectstats(&stats);
+  ircclient_send_notice(p, "- Connection scheduler:");
+  ircclient_send_notice(p, "-   %lu waiting (longest %lds), %lu connecting",
+                        stats.waiting, stats.waiting_longest,
+                        stats.connecting);
+  ircclient_send_notice(p, "-   %lu started, %lu had to wait (longest %lds)",
+                        stats.admitted, stats.delayed, stats.longest);
+  ircclient_send_notice(p, "-");
+
+  arena_stats(&astats);
+  ircclient_send_notice(p, "- Message arena:");
+  ircclient_send_notice(p, "-   %lu allocations (%lu bytes), at most %lu bytes "
+                        "in use at once", astats.allocs, astats.bytes,
+                        astats.peak);
+  ircclient_send_notice(p, "-   %lu blocks held (%lu bytes), grown %lu times, "
+                        "%lu strings spilt to the heap", astats.blocks,
+                        astats.held, astats.grown, astats.spilt);
+  ircclient_send_notice(p, "-");
+
+#ifdef DEBUG_MEMORY
+  mem_counts(&allocs, &frees);
+  ircclient_send_notice(p, "- Heap:");
+  ircclient_send_notice(p, "-   %lu malloc()s, %lu free()s", allocs, frees);
+  ircclient_send_notice(p, "-");
+#endif /* DEBUG_MEMORY */
+
+  ircclient_send_notice(p, "- Send queue:");
+  for (i = 0; i < SENDQ_CLASSES; i++) {
+    struct sendqclass *q;
+
+    q = &(p->sendq_stats[i]);
+    ircclient_send_notice(p, "-   %s: %lu queued (%lu bytes), %lu sent, "
+                          "wait %ldms average, %ldms longest",
+                          sendq_names[i], q->queued, q->queued_bytes, q->sent,
+                          (long)(q->sent ? q->wait_total / q->sent : 0),
+                          q->wait_longest);
+  }
   ircclient_send_notice(p, "-");
 
   ircclient_send_notice(p,  "- Servers.  Current marked by '->'");
@@ -1750,7 +2144,6 @@ int _ircclient_handle_jump(struct ircproxy *p, struct ircmessage msg) {
     ircserver_connectagain(p);
 
     /* We have no server now, so need to get out of here */
-    ircprot_freemsg(&msg);
     return 1;
   } else {
     return 0;
@@ -1852,7 +2245,7 @@ void _ircclient_handle_notify(struct ircproxy *p, struct ircmessage msg)
       }
       
       if (proxy) {
-         net_send(proxy->client_sock, ":dircproxy!dircproxy@localhost NOTICE %s :%s\r\n",cp->nickname, msg.paramstarts[2]);
+         ircclient_send_raw(proxy, ":dircproxy!dircproxy@localhost NOTICE %s :%s",cp->nickname, msg.paramstarts[2]);
       } else {
          ircclient_send_numeric(p, 401, "No such user, use /DIRCPROXY USERS to see them");
       }
@@ -1892,13 +2285,35 @@ void _ircclient_handle_users(struct ircproxy *p, struct ircmessage msg) {
 void _ircclient_handle_recall(struct ircproxy *p, struct ircmessage msg) {
   char *src, *filter;
   long start, lines;
+  time_t since;
+  int bytime;
 
   /* User wants to recall stuff from log files */
   src = filter = 0;
   start = -1;
   lines = 0;
+  since = 0;
+  bytime = 0;
+
+  if (((msg.numparams == 3) || (msg.numparams == 4))
+      && !irc_strcasecmp(msg.params[msg.numparams - 2], "SINCE")) {
+    /* Recall by time rather than by line */
+    switch (_ircclient_parsetime(p, msg.params[msg.numparams - 1], &since)) {
+      case -1:
+        ircclient_send_notice(p, "Unknown time '%s', use HH:MM, a number "
+                              "of s/m/h/d ago or DETACH",
+                              msg.params[msg.numparams - 1]);
+        return;
+      case 1:
+        ircclient_send_notice(p, "Nothing to recall, you haven't "
+                              "detached yet");
+        return;
+    }
 
-  if (msg.numparams >= 4) {
+    if (msg.numparams == 4)
+      src = msg.params[1];
+    bytime = 1;
+  } else if (msg.numparams >= 4) {
     src = msg.params[1];
     start = atol(msg.params[2]);
     lines = atol(msg.params[3]);
@@ -1938,7 +2353,454 @@ void _ircclient_handle_recall(struct ircproxy *p, struct ircmessage msg) {
     src = p->nickname;
   }
 
-  irclog_recall(p, src, start, lines, filter);
+  if (bytime) {
+    irclog_recallsince(p, src, since, filter);
+  } else {
+    irclog_recall(p, src, start, lines, filter);
+  }
+}
+
+  /* /DIRCPROXY SEARCH handler */
+void _ircclient_handle_search(struct ircproxy *p, struct ircmessage msg) {
+  char *src, *word;
+  StrBuf query, text;
+  LogQuery q;
+  int i, ret;
+
+  if (msg.numparams < 2) {
+    ircclient_send_numeric(p, 461, ":Not enough parameters");
+    return;
+  } else if (!p->conn_class->log_search) {
+    ircclient_send_notice(p, "Log files aren't indexed for searching");
+    return;
+  }
+
+  /* The first parameter is the log, unless it's a word to search for */
+  i = 1;
+  src = p->nickname;
+  if (!irc_strcasecmp(msg.params[1], "SERVER")) {
+    src = 0;
+    i++;
+  } else if (ircnet_fetchchannel(p, msg.params[1])) {
+    src = msg.params[1];
+    i++;
+  }
+
+  /* Clients may send the query as any number of parameters, with spaces in
+     some of them, so put it back together and split it up again */
+  memset(&query, 0, sizeof(StrBuf));
+  x_bprintf(&query, "");
+  for (; i < msg.numparams; i++)
+    x_bprintf(&query, " %s", msg.params[i]);
+
+  memset(&q, 0, sizeof(LogQuery));
+  memset(&text, 0, sizeof(StrBuf));
+  x_bprintf(&text, "");
+  word = strtok(query.str, " ");
+  while (word) {
+    if (!strncasecmp(word, "FROM:", 5)) {
+      q.from = word + 5;
+    } else if (!strncasecmp(word, "EVENT:", 6)) {
+      q.event = irclog_strtoflag(word + 6);
+      if (q.event == IRC_LOG_NONE) {
+        ircclient_send_notice(p, "Unknown event '%s'", word + 6);
+        break;
+      }
+    } else if (!strncasecmp(word, "SINCE:", 6)) {
+      ret = _ircclient_parsetime(p, word + 6, &q.since);
+      if (ret == -1) {
+        ircclient_send_notice(p, "Unknown time '%s', use HH:MM, a number "
+                              "of s/m/h/d ago or DETACH", word + 6);
+        break;
+      } else if (ret) {
+        ircclient_send_notice(p, "Nothing to search, you haven't "
+                              "detached yet");
+        break;
+      }
+    } else if (!strncasecmp(word, "LIMIT:", 6)) {
+      q.limit = strtoul(word + 6, 0, 10);
+    } else {
+      x_bprintf(&text, " %s", word);
+    }
+
+    word = strtok(0, " ");
+  }
+
+  /* Only search if the whole query made sense */
+  if (!word) {
+    q.text = text.str;
+    irclog_search(p, src, &q);
+  }
+
+  free(text.str);
+  free(query.str);
+}
+
+/* /DIRCPROXY FILES handler */
+void _ircclient_handle_files(struct ircproxy *p, struct ircmessage msg) {
+  struct dirent *entry;
+  DIR *dir;
+  int numfiles;
+
+  if (!p->conn_class->dcc_capture_directory) {
+    ircclient_send_notice(p, "DCC sends aren't being captured");
+    return;
+  }
+
+  dir = opendir(p->conn_class->dcc_capture_directory);
+  if (!dir) {
+    ircclient_send_notice(p, "Couldn't read %s: %s",
+                          p->conn_class->dcc_capture_directory,
+                          strerror(errno));
+    return;
+  }
+
+  numfiles = 0;
+  while ((entry = readdir(dir))) {
+    struct stat statinfo;
+    char *file;
+
+    file = x_sprintf("%s/%s", p->conn_class->dcc_capture_directory,
+                     entry->d_name);
+    if (!stat(file, &statinfo) && S_ISREG(statinfo.st_mode)) {
+      if (!numfiles++)
+        ircclient_send_notice(p, "Captured files:");
+      ircclient_send_notice(p, "-   %s (%lu bytes)", entry->d_name,
+                            (unsigned long)statinfo.st_size);
+    }
+    free(file);
+  }
+  closedir(dir);
+
+  if (numfiles) {
+    ircclient_send_notice(p, "Use /DIRCPROXY GETFILE <file> to fetch one");
+  } else {
+    ircclient_send_notice(p, "No captured files");
+  }
+}
+
+/* /DIRCPROXY GETFILE handler */
+void _ircclient_handle_getfile(struct ircproxy *p, struct ircmessage msg) {
+  struct sockaddr_in vis_addr;
+  struct stat statinfo;
+  char *name, *file, *rejmsg;
+  int len, type, l_port;
+  struct in_addr l_addr;
+
+  if (msg.numparams < 2) {
+    ircclient_send_numeric(p, 461, ":Not enough parameters");
+    return;
+  } else if (!p->conn_class->dcc_capture_directory) {
+    ircclient_send_notice(p, "DCC sends aren't being captured");
+    return;
+  }
+
+  /* Only files in the capture directory itself */
+  name = msg.paramstarts[1];
+  if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+    ircclient_send_notice(p, "No captured file called %s", name);
+    return;
+  }
+
+  /* The client has to be able to reach us where it reached us before */
+  len = sizeof(struct sockaddr_in);
+  if (getsockname(p->client_sock, (struct sockaddr *)&vis_addr, &len)) {
+    syscall_fail("getsockname", "", 0);
+    return;
+  }
+  l_addr.s_addr = ntohl(vis_addr.sin_addr.s_addr);
+
+  file = x_sprintf("%s/%s", p->conn_class->dcc_capture_directory, name);
+  if (stat(file, &statinfo) || !S_ISREG(statinfo.st_mode)) {
+    ircclient_send_notice(p, "No captured file called %s", name);
+    free(file);
+    return;
+  } else if ((uint32_t)statinfo.st_size != statinfo.st_size) {
+    ircclient_send_notice(p, "%s is too big to send by DCC", name);
+    free(file);
+    return;
+  }
+
+  type = DCC_SEND_FILE | (p->conn_class->dcc_send_fast ? DCC_SEND_FAST : 0);
+  rejmsg = x_sprintf(":%s NOTICE %s :\001DCC REJECT SEND %s", PACKAGE,
+                     p->nickname, name);
+
+  if (!dccnet_new(type, p->conn_class->dcc_proxy_timeout,
+                  p->conn_class->dcc_send_window,
+                  p->conn_class->dcc_proxy_maxrate,
+                  p->conn_class->dcc_proxy_classrate,
+                  p->conn_class->dcc_proxy_weight,
+                  p->conn_class->dcc_proxy_ports,
+                  p->conn_class->dcc_proxy_ports_sz,
+                  &l_port, l_addr, 0, file, 0, statinfo.st_size,
+                  DCCN_FUNCTION(_ircclient_send_dccreject),
+                  p, rejmsg, 0)) {
+    /* Filenames with spaces have to be quoted */
+    ircclient_send_raw(p, ":%s PRIVMSG %s :\001DCC SEND %s%s%s %lu %d %lu\001",
+                       PACKAGE, p->nickname,
+                       (strchr(name, ' ') ? "\"" : ""), name,
+                       (strchr(name, ' ') ? "\"" : ""),
+                       (unsigned long)l_addr.s_addr, l_port,
+                       (unsigned long)statinfo.st_size);
+  } else {
+    ircclient_send_notice(p, "Couldn't offer %s", name);
+  }
+
+  free(rejmsg);
+  free(file);
+}
+
+/* /DIRCPROXY DCC handler */
+void _ircclient_handle_dcc(struct ircproxy *p, struct ircmessage msg) {
+  struct dccstats stats;
+  int i, raw;
+
+  raw = ((msg.numparams >= 2) && !irc_strcasecmp(msg.params[1], "RAW"));
+
+  for (i = 0; !dccnet_stats(p, i, &stats); i++) {
+    char *type, *from, *to;
+
+    if (stats.type & DCC_SEND_CAPTURE) {
+      type = "CAPTURE";
+    } else if (stats.type & DCC_SEND_FILE) {
+      type = "GETFILE";
+    } else if (stats.type & DCC_SEND) {
+      type = "SEND";
+    } else {
+      type = "CHAT";
+    }
+
+    from = x_sprintf("%s:%d", inet_ntoa(stats.sender_addr.sin_addr),
+                     ntohs(stats.sender_addr.sin_port));
+    to = x_sprintf("%s:%d", inet_ntoa(stats.sendee_addr.sin_addr),
+                   ntohs(stats.sendee_addr.sin_port));
+    if (stats.type & DCC_SEND_FILE)
+      strcpy(from, "-");
+    if ((stats.type & DCC_SEND_CAPTURE) || !stats.sendee_addr.sin_port)
+      strcpy(to, "-");
+
+    /* One line of name=value pairs each, for scripts to pick apart */
+    if (raw) {
+      ircclient_send_notice(p, "dcc=%d type=%s from=%s to=%s connected=%d "
+                            "age=%ld size=%lu done=%lu rate=%lu unackd=%lu "
+                            "buffered=%lu bufsize=%lu stalled=%ld "
+                            "waiting=%s", i, type, from, to, stats.connected,
+                            (long)stats.age, (unsigned long)stats.size,
+                            (unsigned long)stats.done, stats.rate,
+                            (unsigned long)stats.unackd, stats.buffered,
+                            stats.buffer_size, (long)stats.stalled,
+                            (stats.waiting ? stats.waiting : "-"));
+      free(from);
+      free(to);
+      continue;
+    }
+
+    if (!i)
+      ircclient_send_notice(p, "DCC transfers:");
+    ircclient_send_notice(p, "-   %s from %s to %s, started %lds ago", type,
+                          from, to, (long)stats.age);
+    if (stats.type & DCC_SEND)
+      ircclient_send_notice(p, "-     %lu of %lu bytes, %lu KB/s, "
+                            "%lu unacknowledged", (unsigned long)stats.done,
+                            (unsigned long)stats.size, stats.rate / 1024,
+                            (unsigned long)stats.unackd);
+    if (stats.buffer_size) {
+      ircclient_send_notice(p, "-     %lu of %lu bytes buffered",
+                            stats.buffered, stats.buffer_size);
+    } else if (stats.buffered) {
+      ircclient_send_notice(p, "-     %lu bytes buffered", stats.buffered);
+    }
+    if (stats.waiting && stats.stalled) {
+      ircclient_send_notice(p, "-     Waiting on %s, nothing moved for %lds",
+                            stats.waiting, (long)stats.stalled);
+    } else if (stats.waiting) {
+      ircclient_send_notice(p, "-     Waiting on %s", stats.waiting);
+    }
+
+    free(from);
+    free(to);
+  }
+
+  if (!i && !raw)
+    ircclient_send_notice(p, "No DCC transfers");
+}
+
+/* Answer TOPIC, NAMES or MODE for a single channel from what we know about
+   it, returns 0 if the server has to answer instead */
+static int _ircclient_handle_chanquery(struct ircproxy *p,
+                                       struct ircmessage msg) {
+  struct ircchannel *c;
+
+  if ((msg.numparams != 1) || !(c = ircnet_fetchchannel(p, msg.params[0])))
+    return 0;
+
+  if (!irc_strcasecmp(msg.cmd, "TOPIC") && c->names_known) {
+    _ircclient_send_topic(p, c, 1);
+
+  } else if (!irc_strcasecmp(msg.cmd, "NAMES") && c->names_known) {
+    _ircclient_send_names(p, c);
+
+  } else if (!irc_strcasecmp(msg.cmd, "MODE") && c->modes_known) {
+    StrBuf params;
+    char *ptr;
+
+    memset(&params, 0, sizeof(StrBuf));
+    x_bprintf(&params, "");
+    for (ptr = (c->modes ? c->modes : ""); *ptr; ptr++) {
+      if ((*ptr == 'k') && c->key) {
+        x_bprintf(&params, " %s", c->key);
+      } else if ((*ptr == 'l') && c->limit) {
+        x_bprintf(&params, " %ld", c->limit);
+      }
+    }
+
+    ircclient_send_numeric(p, 324, "%s +%s%s", c->name,
+                           (c->modes ? c->modes : ""), params.str);
+    free(params.str);
+
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Send a channel's topic to the client.  When joining, nothing is sent if
+   there isn't one; when asked, we say so. */
+static void _ircclient_send_topic(struct ircproxy *p, struct ircchannel *c,
+                                  int asked) {
+  if (c->topic) {
+    ircclient_send_numeric(p, 332, "%s :%s", c->name, c->topic);
+    if (c->topic_setter)
+      ircclient_send_numeric(p, 333, "%s %s %lu", c->name, c->topic_setter,
+                             (unsigned long)c->topic_time);
+  } else if (asked) {
+    ircclient_send_numeric(p, 331, "%s :No topic is set", c->name);
+  }
+}
+
+/* Send the members of a channel to the client, as many to a line as will
+   fit, each with the highest of their prefixes */
+static void _ircclient_send_names(struct ircproxy *p, struct ircchannel *c) {
+  struct ircmember *m;
+  unsigned long i;
+  size_t max, len;
+  char *names, type[2];
+
+  type[0] = (c->names_type ? c->names_type : '=');
+  type[1] = 0;
+
+  /* Leave room for ":server 353 nick = #channel :" and the \r\n */
+  max = 510 - strlen(p->servername ? p->servername : PACKAGE)
+        - strlen(p->nickname ? p->nickname : "*") - strlen(c->name) - 12;
+  names = (char *)malloc(max + 1);
+  len = 0;
+
+  for (i = 0; i < c->membersize; i++) {
+    for (m = c->members[i]; m; m = m->next) {
+      size_t nlen;
+
+      nlen = strlen(m->nick) + (m->prefixes[0] ? 1 : 0);
+      if (len && (len + 1 + nlen > max)) {
+        names[len] = 0;
+        ircclient_send_numeric(p, 353, "%s %s :%s", type, c->name, names);
+        len = 0;
+      }
+
+      if (len)
+        names[len++] = ' ';
+      if (m->prefixes[0])
+        names[len++] = m->prefixes[0];
+      strncpy(names + len, m->nick, max - len);
+      len = MIN(len + strlen(m->nick), max);
+    }
+  }
+
+  if (len) {
+    names[len] = 0;
+    ircclient_send_numeric(p, 353, "%s %s :%s", type, c->name, names);
+  }
+  ircclient_send_numeric(p, 366, "%s :End of /NAMES list.", c->name);
+  free(names);
+}
+
+/* Parse the time given to RECALL SINCE.  This can be HH:MM for the last
+   time it was that time of day, a number followed by s, m, h or d for that
+   long ago, or DETACH for when the client last went away.  Returns -1 if
+   it didn't make sense, or 1 if it was DETACH and the client never has. */
+static int _ircclient_parsetime(struct ircproxy *p, const char *str,
+                                time_t *when) {
+  unsigned long num, mult;
+  time_t now;
+  char *ptr;
+
+  time(&now);
+
+  if (!irc_strcasecmp(str, "DETACH")) {
+    if (!p->detach_time)
+      return 1;
+
+    *when = p->detach_time;
+    return 0;
+  }
+
+  if (!isdigit((unsigned char)*str))
+    return -1;
+  num = strtoul(str, &ptr, 10);
+
+  if (*ptr == ':') {
+    unsigned long min;
+    struct tm *tm;
+    char *end;
+
+    min = strtoul(ptr + 1, &end, 10);
+    if ((end == ptr + 1) || *end || (num > 23) || (min > 59))
+      return -1;
+
+    tm = localtime(&now);
+    tm->tm_hour = num;
+    tm->tm_min = min;
+    tm->tm_sec = 0;
+    *when = mktime(tm);
+
+    /* It hasn't been that time yet today, so they mean yesterday */
+    if (*when > now)
+      *when -= 86400;
+
+    return 0;
+  }
+
+  mult = 1;
+  switch (*ptr) {
+    case 'd':
+    case 'D':
+      mult *= 24;
+      /* fall through */
+    case 'h':
+    case 'H':
+      mult *= 60;
+      /* fall through */
+    case 'm':
+    case 'M':
+    case 0:
+      mult *= 60;
+      /* fall through */
+    case 's':
+    case 'S':
+      break;
+    default:
+      return -1;
+  }
+  if (*ptr && *(ptr + 1))
+    return -1;
+
+  /* Anything from before the epoch just means everything */
+  if (num > (unsigned long)now / mult) {
+    *when = 0;
+  } else {
+    *when = now - (time_t)(num * mult);
+  }
+  return 0;
 }
 
   /* PRIVMSG handler */
@@ -1955,15 +2817,13 @@ int _ircclient_handle_privmsg(struct ircproxy *p, struct ircmessage msg) {
     if (str && strlen(str)) {
       char *tmp;
 
-      tmp = x_sprintf("%s!%s@%s", p->nickname, p->username,
-                      p->hostname);
+      tmp = arena_sprintf("%s!%s@%s", p->nickname, p->username,
+                          p->hostname);
       irclog_log(p, IRC_LOG_MSG, msg.params[0], tmp, "%s", str);
-      free(tmp);
     }
-    free(str);
 
     /* Handle CTCP */
-    str = x_strdup(msg.params[1]);
+    str = arena_strdup(msg.params[1]);
     s = list;
     while (s) {
       struct ctcpmessage cmsg;
@@ -1974,22 +2834,50 @@ int _ircclient_handle_privmsg(struct ircproxy *p, struct ircmessage msg) {
       n = s->next;
       r = ircprot_parsectcp(s->str, &cmsg);
       unquoted = s->str;
-      free(s);
       s = n;
-      if (r == -1) {
-        free(unquoted);
+      if (r == -1)
         continue;
-      }
 
       if (!strcmp(cmsg.cmd, "ACTION")) {
         char *tmp;
 
-        tmp = x_sprintf("%s!%s@%s", p->nickname, p->username,
-                        p->hostname);
+        tmp = arena_sprintf("%s!%s@%s", p->nickname, p->username,
+                            p->hostname);
 	if (cmsg.paramstarts)	   
 	   irclog_log(p, IRC_LOG_ACTION, msg.params[0], tmp, "%s", cmsg.paramstarts[0]);
 	else 
 	   irclog_log(p, IRC_LOG_ACTION, msg.params[0], tmp, NULL);	 
+
+      } else if (!strcmp(cmsg.cmd, "DCC") && (cmsg.numparams >= 4)
+                 && !irc_strcasecmp(cmsg.params[0], "RESUME")
+                 && !irc_strcasecmp(msg.params[0], PACKAGE)) {
+        char *tmp, *ptr, *file;
+        int port;
+        uint32_t position;
+
+        /* Resuming a file offered by /DIRCPROXY GETFILE, the filename may
+           have spaces in so the port and position are the last two */
+        port = atoi(cmsg.params[cmsg.numparams - 2]);
+        position = strtoul(cmsg.params[cmsg.numparams - 1], (char **)NULL, 10);
+        file = x_strdup(cmsg.paramstarts[1]);
+        file[cmsg.paramstarts[cmsg.numparams - 2]
+             - cmsg.paramstarts[1] - 1] = 0;
+
+        if (!dccnet_resume(port, position)) {
+          ircclient_send_raw(p, ":%s PRIVMSG %s :\001DCC ACCEPT %s %d %lu\001",
+                             PACKAGE, p->nickname, file, port,
+                             (unsigned long)position);
+        } else {
+          ircclient_send_notice(p, "Can't resume %s from %lu", file,
+                                (unsigned long)position);
+        }
+        free(file);
+
+        /* It's for us, don't send it on */
+        tmp = x_sprintf("\001%s\001", unquoted);
+        ptr = strstr(str, tmp);
+        if (ptr)
+          memmove(ptr, ptr + strlen(tmp), strlen(ptr + strlen(tmp)) + 1);
         free(tmp);
 
       } else if (!strcmp(cmsg.cmd, "DCC")
@@ -2054,9 +2942,13 @@ int _ircclient_handle_privmsg(struct ircproxy *p, struct ircmessage msg) {
 
           /* Set up a dcc proxy */
           if (ptr && !dccnet_new(type, p->conn_class->dcc_proxy_timeout,
+                                 p->conn_class->dcc_send_window,
+                                 p->conn_class->dcc_proxy_maxrate,
+                                 p->conn_class->dcc_proxy_classrate,
+                                 p->conn_class->dcc_proxy_weight,
                                  p->conn_class->dcc_proxy_ports,
                                  p->conn_class->dcc_proxy_ports_sz,
-                                 &l_port, r_addr, r_port, 0, 0,
+                                 &l_port, r_addr, r_port, 0, 0, 0,
                                  DCCN_FUNCTION(_ircclient_send_dccreject),
                                  p, rejmsg, 0)) {
             char *me_tmp;
@@ -2089,9 +2981,8 @@ int _ircclient_handle_privmsg(struct ircproxy *p, struct ircmessage msg) {
             ptr += strlen(tmp);
 
             oldstr = str;
-            str = x_sprintf("%s%s%s", oldstr, dccmsg, ptr);
+            str = arena_sprintf("%s%s%s", oldstr, dccmsg, ptr);
 
-            free(oldstr);
             free(dccmsg);
           }
 
@@ -2106,24 +2997,21 @@ int _ircclient_handle_privmsg(struct ircproxy *p, struct ircmessage msg) {
       } else {
         char *tmp;
 
-        tmp = x_sprintf("%s!%s@%s", p->nickname, p->username,
-                        p->hostname);
+        tmp = arena_sprintf("%s!%s@%s", p->nickname, p->username,
+                            p->hostname);
 	if (cmsg.numparams > 0)
 	   irclog_log(p, IRC_LOG_CTCP, msg.params[0], tmp, "Sent CTCP %s", cmsg.params[0]);
-        free(tmp);
       }
-
-      ircprot_freectcp(&cmsg);
-      free(unquoted);
     }
 
     /* Send str */
-    if (strlen(str))
-      net_send(p->server_sock, ":%s PRIVMSG %s :%s\r\n",
-               (msg.src.orig ? msg.src.orig : p->nickname),
-               msg.params[0], str);
+    if (strlen(str)) {
+      ircserver_send_raw(p, ":%s PRIVMSG %s :%s",
+                         (msg.src.orig ? msg.src.orig : p->nickname),
+                         msg.params[0], str);
+      _ircclient_echo(p, "PRIVMSG", msg.params[0], str);
+    }
     squelch = 1;
-    free(str);
   }
 
   if (p->conn_class->idle_maxtime)
@@ -2172,6 +3060,14 @@ void _ircclient_handle_help(struct ircproxy *p, struct ircmessage msg) {
       help_page = command_help[I_HELP_KILL];
     } else if (!irc_strcasecmp(msg.params[1], "NOTIFY")) {
       help_page = command_help[I_HELP_NOTIFY]; 
+    } else if (!irc_strcasecmp(msg.params[1], "SEARCH")) {
+      help_page = command_help[I_HELP_SEARCH];
+    } else if (!irc_strcasecmp(msg.params[1], "FILES")) {
+      help_page = command_help[I_HELP_FILES];
+    } else if (!irc_strcasecmp(msg.params[1], "GETFILE")) {
+      help_page = command_help[I_HELP_GETFILE];
+    } else if (!irc_strcasecmp(msg.params[1], "DCC")) {
+      help_page = command_help[I_HELP_DCC];
     } else if (!irc_strcasecmp(msg.params[1], "HELP")) {
       help_page = command_help[I_HELP_HELP];
     } else {
@@ -2201,6 +3097,17 @@ void _ircclient_handle_help(struct ircproxy *p, struct ircmessage msg) {
                             "(show dircproxy status information)");
       ircclient_send_notice(p, "-     RECALL    "
                             "(recall text from log files)");
+      if (p->conn_class->log_search)
+        ircclient_send_notice(p, "-     SEARCH    "
+                              "(search the log files)");
+      if (p->conn_class->dcc_capture_directory) {
+        ircclient_send_notice(p, "-     FILES     "
+                              "(list captured DCC files)");
+        ircclient_send_notice(p, "-     GETFILE   "
+                              "(fetch a captured DCC file)");
+      }
+      ircclient_send_notice(p, "-     DCC       "
+                            "(show DCC transfers in progress)");
       ircclient_send_notice(p, "-     GET    "
 			    "(Get the value of a configuration item)");
       ircclient_send_notice(p, "-     SET    "
@@ -40,7 +40,11 @@ static char * client_commands[] = {
   "STATUS",
   "NOTIFY",
   "GET",
-  "SET"
+  "SET",
+  "SEARCH",
+  "FILES",
+  "GETFILE",
+  "DCC"
 };
 
 #define I_HELP_INDEX     0
@@ -63,6 +67,10 @@ static char * client_commands[] = {
 #define I_HELP_NOTIFY    17
 #define I_HELP_GET       18
 #define I_HELP_SET       19
+#define I_HELP_SEARCH    20
+#define I_HELP_FILES     21
+#define I_HELP_GETFILE   22
+#define I_HELP_DCC       23
 
 static char ** command_help[] = {
   help_index,
@@ -84,7 +92,11 @@ static char ** command_help[] = {
   help_status,
   help_notify,
   help_get,
-  help_set
+  help_set,
+  help_search,
+  help_files,
+  help_getfile,
+  help_dcc
 };
 
 /* functions */
@@ -98,6 +110,8 @@ extern int ircclient_generate_nick(struct ircproxy *, const char *);
 extern int ircclient_change_mode(struct ircproxy *, const char *);
 extern int ircclient_close(struct ircproxy *);
 extern int ircclient_welcome(struct ircproxy *);
+extern void ircclient_freeburst(struct ircproxy *);
+extern int ircclient_send_raw(struct ircproxy *, const char *, ...);
 extern int ircclient_send_numeric(struct ircproxy *, short, const char *, ...);
 extern int ircclient_send_notice(struct ircproxy *, const char *, ...);
 extern int ircclient_send_channotice(struct ircproxy *, const char *,
@@ -44,9 +44,11 @@
 #include <errno.h>
 
 #include "sprintf.h"
+#include "arena.h"
 #include "irc_net.h"
 
 #include <fcntl.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
@@ -68,11 +70,57 @@
 /* Log time/date format for strftime(3) */
 #define LOG_TIMEDATE_FORMAT "%a, %d %b %Y %H:%M:%S %z"
 
+/* Start of the minute a time falls in.  Time zones are whole minutes away
+ * from UTC, so this is the same minute in local time too. */
+#define LOG_MINUTE(_t) ((_t) - (((_t) % 60 + 60) % 60))
+
+/* Magic string at the start of every internal log file */
+#define LOG_MAGIC "DIRCLOG1"
+#define LOG_MAGIC_LEN 8
+
+/* Record type that introduces a string, rather than a logged event */
+#define LOG_REC_STRING 0xff
+
+/* Longest varint we ever write, 7 bits per byte */
+#define LOG_VARINT_MAX ((sizeof(unsigned long) * 8 + 6) / 7)
+
+/* Number of records between each entry in a log file's index */
+#define LOG_INDEX_STEP 32
+
+/* Words shorter than this aren't worth indexing, and ones longer than this
+ * probably aren't words */
+#define LOG_WORD_MIN 2
+#define LOG_WORD_MAX 32
+
+/* Records sent from one recall before it's the next one's turn */
+#define LOG_RECALL_BATCH 16
+
+/* Kinds of log a recall can be from */
+#define LOG_RECALL_SERVER  0
+#define LOG_RECALL_PRIVATE 1
+#define LOG_RECALL_CHANNEL 2
+
+/* Most search results shown when the user doesn't say, and when they do */
+#define LOG_SEARCH_LIMIT 20
+#define LOG_SEARCH_MAX   500
+
+/* Only this many of the most recent records in each log are indexed, so
+ * the index stays bounded however large the log is allowed to grow */
+#define LOG_SEARCH_LINES 20000
+
+/* Convert a real time into the adjusted time stored in the log files */
+#define LOG_TIME(_p, _t) ((_t) - ((_p)->conn_class->log_timeoffset * 60))
+
 /* Define MIN() */
 #ifndef MIN
 # define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif /* !MIN */
 
+/* Define MAX() */
+#ifndef MAX
+# define MAX(x, y) ((x) > (y) ? (x) : (y))
+#endif /* !MAX */
+
 /* Convenient code defines */
 #define IS_SERVER_LOG(_p, _log)  ((_log) == &((_p)->server_log))
 #define IS_PRIVATE_LOG(_p, _log) ((_log) == &((_p)->private_log))
@@ -89,25 +137,136 @@ typedef struct _flag_info {
 	int   value;
 } FlagInfo;
 
+/* A log message encoded once, ready to be appended to any number of log
+ * files.  Only the destination differs between the copies.
+ */
+typedef struct _log_record {
+	time_t		when;
+	int		event;
+	int		code;	/* Index into flag_table */
+	const char     *from;
+	const char     *text;
+	size_t		textlen;
+	char	       *userline; /* Human-readable copy for log_dir, or NULL */
+} LogRecord;
+
+/* A record as read back from an internal log file.  The text buffer is
+ * reused from one record to the next.
+ */
+typedef struct _log_entry {
+	time_t		when;
+	int		code;
+	unsigned long	dest, from;
+	char	       *text;
+	size_t		textlen, textsz;
+} LogEntry;
+/* A recall in progress.  Records are numbered as for the search index so
+ * a log file being rolled underneath doesn't lose our place.
+ */
+struct logrecall {
+	int		  sock;	/* The client that asked for it */
+	int		  type;
+	char		 *to;	/* Name of the log, or NULL for the server */
+	char		 *from;	/* Only lines from this nickname, or NULL */
+	unsigned long	  seq, end, lines;
+	time_t		  now;	/* When the recall started */
+	FILE		 *file;	/* Our own copy, if the log isn't open */
+	LogEntry	  e;
+
+	struct logrecall *next;
+};
+
+/* A timestamp already formatted for one minute.  Lines are logged and
+ * recalled in bursts, so usually the last one is wanted again and
+ * formatting it is just a copy.
+ */
+typedef struct _log_stamp {
+	const char *format;
+	int	    valid;
+	time_t	    minute;
+	char	    buf[40];
+} LogStamp;
+
+/* A term in a log file's search index and the sequence numbers of the
+ * records it appears in, oldest first.  Words are stored lowercased,
+ * nicknames prefixed with '<' and event names with '='.
+ */
+typedef struct _log_term {
+	char	     *term;
+	unsigned int *post;
+	unsigned long npost, postsz;
+} LogTerm;
+
+/* Inverted index of a log file.  Records are numbered from when the file
+ * was first opened, so rolling it only moves log->first rather than
+ * renumbering.
+ */
+struct logsearch {
+	LogTerm	     *terms;	/* Open addressed, NULL term is empty */
+	unsigned long nterms, size;
+	unsigned long compacted; /* Oldest record indexed when stale
+				    postings last went */
+};
+
 
 /* Forward prototypes for internal functions */
 static char *	_safe_name(char *);
 static LogFile *_logfile_get(IRCProxy *, const char *);
 static void	_logfile_close(LogFile *);
-static FILE *	_open_user_log(IRCProxy *, const char *);
-static char *	_log_read(FILE *);
-static void	_log_printf(FILE *, const char *, ...);
-static int	_logfile_write(LogFile *, const char *, ...);
+static int	_open_user_log(IRCProxy *, const char *);
+static unsigned long _logstr_intern(LogStrings *, const char *);
+static const char *_logstr_get(LogStrings *, unsigned long);
+static void	_logstr_free(LogStrings *);
+static void	_logstr_compact(LogFile *, LogStrings *);
+static size_t	_varint_put(unsigned char *, unsigned long);
+static int	_varint_get(FILE *, unsigned long *);
+static int	_log_eventcode(int);
+static int	_log_readentry(FILE *, LogEntry *, int);
+static void	_logindex_add(LogFile *, unsigned long, long, time_t, time_t);
+static void	_logindex_seek(LogFile *, FILE *, unsigned long, LogEntry *);
+static unsigned long _logindex_find(LogFile *, FILE *, time_t);
+static const char *_log_nextword(const char *, char *);
+static LogTerm *_logsearch_term(struct logsearch *, const char *, int);
+static void	_logsearch_post(struct logsearch *, const char *,
+				unsigned long);
+static void	_logsearch_add(LogFile *, unsigned long, const LogRecord *);
+static unsigned long _logsearch_oldest(LogFile *);
+static void	_logsearch_compact(LogFile *);
+static void	_logsearch_free(LogFile *);
+static const char *_log_stamp(LogStamp *, time_t);
+static void	_irclog_send(IRCProxy *, LogFile *, int, const LogEntry *,
+			     const char *, time_t);
+static FILE *	_logfile_reader(IRCProxy *, LogFile *, int *);
+static void	_logfile_endread(FILE *, int);
+static int	_log_append(LogFile *, FILE *, time_t, int,
+			    unsigned long, unsigned long, const char *,
+			    size_t);
+static void	_log_puts(int, const char *);
+static void	_logrecord_make(IRCProxy *, LogRecord *, int, const char *,
+				const char *);
+static int	_logfile_write(IRCProxy *, LogFile *, const char *,
+			       const LogRecord *);
 static int	_log_pipe(IRCProxy *, int, const char *, const char *,
 			  const char *);
-static int	_logfile_writetext(IRCProxy *, LogFile *, int, const char *,
-				   const char *, const char *);
-
-static int _irclog_recall(struct ircproxy *, struct logfile *, unsigned long,
-                          unsigned long, const char *, const char *);
-
-
-/* The translation table between our #defines and string event types */
+static int	_logfile_writerecord(IRCProxy *, LogFile *, const char *,
+				     const LogRecord *);
+
+static int	_irclog_recall(IRCProxy *, LogFile *, unsigned long,
+			       unsigned long, const char *, const char *);
+static LogFile *_irclog_recallfrom(IRCProxy *, struct logrecall *);
+static int	_irclog_recallsome(IRCProxy *, struct logrecall *);
+static void	_irclog_recallfree(struct logrecall *);
+static void	_irclog_recallend(IRCProxy *, struct logrecall *);
+static void	_irclog_pump(IRCProxy *);
+static void	_irclog_drain(IRCProxy *, int);
+static unsigned long _irclog_since(struct ircproxy *, struct logfile *,
+                                   time_t);
+
+
+/* The translation table between our #defines and string event types.  This
+ * is in bit order, so the index of each entry is also the event code stored
+ * in the internal log files.
+ */
 static FlagInfo flag_table[] = {
 	{ "message",	IRC_LOG_MSG },
 	{ "notice",	IRC_LOG_NOTICE },
@@ -126,6 +285,24 @@ static FlagInfo flag_table[] = {
 	{ NULL,		IRC_LOG_NONE }
 };
 
+/* Timestamps for the user's copy of the logs, and for recalled lines when
+ * they're not relative */
+static LogStamp user_stamp = { LOG_USER_TIME_FORMAT, 0, 0, "" };
+static LogStamp recall_stamp = { LOG_TIME_FORMAT, 0, 0, "" };
+
+/* Timestamps for recalled lines with log_relativetime, by how long ago
+ * they were logged.  The last entry is used for anything older.
+ */
+static struct {
+	long	 age;
+	LogStamp stamp;
+} relative_stamps[] = {
+	{ 82800L,	{ "[%H:%M] ", 0, 0, "" } },	/* Within 23 hours */
+	{ 518400L,	{ "[%a %H:%M] ", 0, 0, "" } },	/* Within 6 days */
+	{ 25920000L,	{ "[%d %b] ", 0, 0, "" } },	/* Within 300 days */
+	{ 0,		{ "[%d %b %Y] ", 0, 0, "" } }	/* Otherwise */
+};
+
 
 /* irclog_maketempdir
  * Create the temporary directory in which we place internal log files.
@@ -247,6 +424,187 @@ _logfile_get(IRCProxy *p, const char *to)
 	}
 }
 
+/* _logstr_hash
+ * Hash a string for the interned string table (FNV-1a)
+ */
+static unsigned long
+_logstr_hash(const char *str)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*str) {
+		hash ^= (unsigned char)*(str++);
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/* _logstr_intern
+ * Return the id of a string in a log file's string table, adding it if it
+ * isn't there already.  Ids are handed out in order from zero and only
+ * change when the table is compacted, which rewrites the file anyway.
+ */
+static unsigned long
+_logstr_intern(LogStrings *ls, const char *str)
+{
+	unsigned long h, id;
+
+	if (!str)
+		str = "";
+
+	/* Grow the hash when it gets half full, rehashing what we have */
+	if ((ls->nstr + 1) * 2 > ls->hashsz) {
+		unsigned long newsz, i;
+
+		newsz = (ls->hashsz ? ls->hashsz * 2 : 64);
+		free(ls->hash);
+		ls->hash = (unsigned long *)malloc(sizeof(unsigned long)
+						   * newsz);
+		memset(ls->hash, 0, sizeof(unsigned long) * newsz);
+		ls->hashsz = newsz;
+
+		for (i = 0; i < ls->nstr; i++) {
+			h = _logstr_hash(ls->str[i]) & (newsz - 1);
+			while (ls->hash[h])
+				h = (h + 1) & (newsz - 1);
+			ls->hash[h] = i + 1;
+		}
+	}
+
+	/* Slots hold id + 1, so zero means empty */
+	h = _logstr_hash(str) & (ls->hashsz - 1);
+	while (ls->hash[h]) {
+		id = ls->hash[h] - 1;
+		if (!strcmp(ls->str[id], str))
+			return id;
+		h = (h + 1) & (ls->hashsz - 1);
+	}
+
+	if (ls->nstr >= ls->strsz) {
+		ls->strsz = (ls->strsz ? ls->strsz * 2 : 32);
+		ls->str = (char **)realloc(ls->str, sizeof(char *)
+					   * ls->strsz);
+	}
+
+	id = ls->nstr++;
+	ls->str[id] = x_strdup(str);
+	ls->hash[h] = id + 1;
+
+	return id;
+}
+
+/* _logstr_get
+ * Look up an interned string by id.  Returns the empty string for ids we
+ * don't know, which only happens if the log file is corrupt.
+ */
+static const char *
+_logstr_get(LogStrings *ls, unsigned long id)
+{
+	return (id < ls->nstr ? ls->str[id] : "");
+}
+
+/* _logstr_free
+ * Free a string table, once nothing in the log file refers to it any more
+ */
+static void
+_logstr_free(LogStrings *ls)
+{
+	unsigned long i;
+
+	for (i = 0; i < ls->nstr; i++)
+		free(ls->str[i]);
+	free(ls->str);
+	free(ls->hash);
+	memset(ls, 0, sizeof(LogStrings));
+}
+
+/* _logstr_compact
+ * Start a log file's string table again while the file is being rewritten,
+ * so strings only used by records that have been rolled off go.  The old
+ * table is left in old, for looking up the ids of the records being copied.
+ * Like the search index, this is only worth doing once a whole log's worth
+ * has gone.
+ */
+static void
+_logstr_compact(LogFile *log, LogStrings *old)
+{
+	memset(old, 0, sizeof(LogStrings));
+	if (log->first - log->strings.compacted < MAX(log->nlines, 1024UL))
+		return;
+
+	debug("Compacting string table of '%s'", log->filename);
+	*old = log->strings;
+	memset(&(log->strings), 0, sizeof(LogStrings));
+	log->strings.compacted = log->first;
+
+	/* The ids are all new, so the bitmap only needs to be as big as the
+	 * table is now */
+	free(log->strdef);
+	log->strdef = 0;
+	log->strdefsz = 0;
+}
+
+/* _varint_put
+ * Encode a number 7 bits at a time, least significant first, with the top
+ * bit set on every byte except the last.  Returns the number of bytes used,
+ * at most LOG_VARINT_MAX.
+ */
+static size_t
+_varint_put(unsigned char *buf, unsigned long val)
+{
+	size_t len = 0;
+
+	while (val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[len++] = val;
+
+	return len;
+}
+
+/* _varint_get
+ * Read a number written by _varint_put.  Returns -1 at end of file or if
+ * the number is too long to be one of ours.
+ */
+static int
+_varint_get(FILE *file, unsigned long *val)
+{
+	unsigned int shift = 0;
+	int	     c;
+
+	*val = 0;
+	while ((c = getc(file)) != EOF) {
+		if (shift >= sizeof(unsigned long) * 8)
+			return -1;
+
+		*val |= (unsigned long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/* _log_eventcode
+ * Convert an event flag into the code stored in the log file, which is the
+ * number of the bit that is set.
+ */
+static int
+_log_eventcode(int event)
+{
+	int code;
+
+	for (code = 0; flag_table[code].name != NULL; code++) {
+		if (flag_table[code].value & event)
+			return code;
+	}
+
+	return 0;
+}
+
 /* irclog_init
  * Initialise a log file, this decides on, and allocates, a filename and is
  * usually called when creating the proxy/channel this log file is a member
@@ -332,9 +690,22 @@ irclog_open(IRCProxy *p, const char *to)
 	/* Try to remove world and group read/write */
 	if (fchmod(fileno(log->file), 0600))
 		syscall_fail("fchmod", log->filename, 0);
+
+	/* New file, so none of the old records or their strings are in it */
+	fputs(LOG_MAGIC, log->file);
+	fflush(log->file);
+	free(log->strdef);
+	log->strdef = 0;
+	log->strdefsz = 0;
+	log->last = 0;
+	log->nindex = 0;
+	_logsearch_free(log);
   
 	log->open = log->made = 1;
+	log->first += log->nlines;
 	log->nlines = 0;
+	_logstr_free(&(log->strings));
+	log->strings.compacted = log->first;
 	return 0;
 }
 
@@ -387,13 +758,23 @@ irclog_free(LogFile *log)
 	debug("Freeing up log file '%s'", log->filename);
 	unlink(log->filename);
 	free(log->filename);
-	log->nlines = 0;
+	free(log->strdef);
+	free(log->index);
+	_logsearch_free(log);
+	_logstr_free(&(log->strings));
+	log->filename = 0;
+	log->strdef = 0;
+	log->strdefsz = 0;
+	log->index = 0;
+	log->nindex = log->indexsz = 0;
+	log->nlines = log->first = 0;
 	log->made = 0;
 }
 
 /* irclog_closetempdir
  * Remove the temporary directory and free up the space in the IRCProxy
- * structure.  This should only be called once all log files have been closed.
+ * structure.  This should only be called once all log files have been
+ * closed.
  */
 void
 irclog_closetempdir(IRCProxy *p)
@@ -412,131 +793,519 @@ irclog_closetempdir(IRCProxy *p)
  * This file should be closed once you've finished with it, it'll be opened
  * again next time (to allow the user to wipe it while we're running).
  */
-static FILE *
+static int
 _open_user_log(IRCProxy *p, const char *to)
 {
 	struct stat  statinfo;
 	char	    *filename, *userfile;
-	FILE	    *log;
+	int	     log;
 
 	if (!p->conn_class->log_dir)
-		return NULL;
+		return -1;
 
 	/* Work out the filename, because we don't have a LogFile structure
 	 * we simply accept whatever we're given.
 	 */
 	if (to == IRC_LOGFILE_SERVER) {
-		filename = x_strdup("Server");
+		filename = "Server";
 	
 	} else {
-		filename = x_strdup(to);
-		irc_strlwr(_safe_name((char*)to));
+		filename = irc_strlwr(_safe_name(arena_strdup(to)));
 	}
 
 	/* The filename is under the user's log_dir */
-	userfile = x_sprintf("%s/%s.log", p->conn_class->log_dir, filename);
+	userfile = arena_sprintf("%s/%s.log", p->conn_class->log_dir,
+				 filename);
 	debug("User log file = '%s'", userfile);
-	free(filename);
 
 	/* Make sure it's safe to use */
 	if (lstat(userfile, &statinfo)) {
 		if (errno != ENOENT) {
 			syscall_fail("lstat", userfile, 0);
-			free(userfile);
-			return NULL;
+			return -1;
 		}
 	} else if (!S_ISREG(statinfo.st_mode)) {
 		debug("File existed, but wasn't a file");
-		free(userfile);
-		return NULL;
+		return -1;
 	}
 
-	/* Open the file for appending */
-	if (!(log = fopen(userfile, "a")))
-		syscall_fail("fopen", userfile, 0);
-	free(userfile);
+	/* Open the file for appending, without stdio as it's only open for
+	 * the one line
+	 */
+	log = open(userfile, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (log == -1)
+		syscall_fail("open", userfile, 0);
 
 	return log;
 }
 
-/* Read a line from the log FIXME */
-static char *_log_read(FILE *file) {
-  char buff[512], *line;
-
-  line = 0;
-  while (1) {
-    if (!fgets(buff, 512, file)) {
-      free(line);
-      return 0;
-    } else if (!strlen(buff)) {
-      free(line);
-      return 0;
-    } else {
-      char *ptr;
+/* _log_readentry
+ * Read the next event from an internal log file, skipping over any string
+ * definitions on the way.  entry->when must hold the time of the previous
+ * record (zero at the start of the file) as each record only stores the
+ * difference.  If wanttext is zero the text is skipped rather than read.
+ * Returns 0 on success, -1 at the end of the file or if it is corrupt.
+ */
+static int
+_log_readentry(FILE *file, LogEntry *entry, int wanttext)
+{
+	unsigned long delta, len;
+	int	      c;
 
-      if (line) {
-        char *new;
+	while ((c = getc(file)) == LOG_REC_STRING) {
+		unsigned long id;
 
-        new = x_sprintf("%s%s", line, buff);
-        free(line);
-        line = new;
-      } else {
-        line = x_strdup(buff);
-      }
+		/* Strings are already in the log file's table, skip them */
+		if (_varint_get(file, &id) || _varint_get(file, &len))
+			return -1;
+		if (fseek(file, len, SEEK_CUR))
+			return -1;
+	}
+	if ((c == EOF) || (c >= (int)(sizeof(flag_table) / sizeof(FlagInfo)) - 1))
+		return -1;
 
-      ptr = line + strlen(line) - 1;
-      if (*ptr == '\n') {
-        while ((ptr >= line) && (!ptr || strchr(" \t\r\n", *ptr))) *(ptr--) = 0;
-        break;
-      }
-    }
-  }
+	entry->code = c;
+	if (_varint_get(file, &delta) || _varint_get(file, &(entry->dest))
+	    || _varint_get(file, &(entry->from)) || _varint_get(file, &len))
+		return -1;
 
-  return line;
+	/* The time difference is zig-zag encoded so it can go backwards */
+	entry->when += (delta & 1 ? -(long)(delta >> 1) : (long)(delta >> 1));
+
+	if (!wanttext)
+		return (fseek(file, len, SEEK_CUR) ? -1 : 0);
+
+	if (len + 1 > entry->textsz) {
+		entry->textsz = len + 1;
+		entry->text = (char *)realloc(entry->text, entry->textsz);
+	}
+	if (fread(entry->text, 1, len, file) != len)
+		return -1;
+	entry->text[len] = 0;
+	entry->textlen = len;
+
+	return 0;
 }
 
-/* _log_printf
- * Seek to the end of the file, write a line then flush the file so it
- * appears immediately.
+/* _logindex_add
+ * Note where a record starts if it's one that belongs in the index.  base
+ * is the time of the record before it, which is needed to decode it.
  */
 static void
-_log_printf(FILE *fd, const char *format, ...)
+_logindex_add(LogFile *log, unsigned long line, long offset, time_t base,
+	      time_t when)
 {
-	va_list  ap;
-	char	*msg;
+	struct logindex *idx;
 
-	/* Slurp the arguments in like printf */
-	va_start(ap, format);
-	msg = x_vsprintf(format, ap);
-	va_end(ap);
+	if ((line % LOG_INDEX_STEP) || (line / LOG_INDEX_STEP != log->nindex))
+		return;
 
-	/* Write the line at the end of the file, then flush */
-	fseek(fd, 0, SEEK_END);
-	fputs(msg, fd);
-	fflush(fd);
+	if (log->nindex >= log->indexsz) {
+		log->indexsz = (log->indexsz ? log->indexsz * 2 : 16);
+		log->index = (struct logindex *)realloc(log->index,
+							sizeof(struct logindex)
+							* log->indexsz);
+	}
 
-	free(msg);
+	idx = &(log->index[log->nindex++]);
+	idx->offset = offset;
+	idx->base = base;
+	idx->when = when;
 }
 
-/* Write a line to the log FIXME don't just roll by line counts now? */
-static int _logfile_write(struct logfile *log, const char *format, ...) {
-  va_list ap;
-  char *msg;
+/* _logindex_seek
+ * Position a file at the start of a given record, using the index to get
+ * close and then reading the few records in between.  On return entry->when
+ * is ready for the next _log_readentry().
+ */
+static void
+_logindex_seek(LogFile *log, FILE *file, unsigned long line, LogEntry *entry)
+{
+	unsigned long k;
 
-  va_start(ap, format);
-  msg = x_vsprintf(format, ap);
-  va_end(ap);
+	k = line / LOG_INDEX_STEP;
+	if (k >= log->nindex) {
+		k = (log->nindex ? log->nindex - 1 : 0);
+	}
+
+	if (log->nindex) {
+		fseek(file, log->index[k].offset, SEEK_SET);
+		entry->when = log->index[k].base;
+		line -= k * LOG_INDEX_STEP;
+	} else {
+		fseek(file, LOG_MAGIC_LEN, SEEK_SET);
+		entry->when = 0;
+	}
+
+	while (line && !_log_readentry(file, entry, 0))
+		line--;
+}
+
+/* _logindex_find
+ * Find the first record logged at or after a time, returning its line
+ * number (or the number of lines if there isn't one).  A binary search of
+ * the index finds the right block, then we only need to read within it.
+ */
+static unsigned long
+_logindex_find(LogFile *log, FILE *file, time_t since)
+{
+	unsigned long lo, hi, line;
+	LogEntry      e;
+
+	/* Find the last block that starts before the time */
+	lo = 0;
+	hi = log->nindex;
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (log->index[mid].when < since) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (!lo)
+		return 0;
+
+	/* Then read along it until we reach the time */
+	memset(&e, 0, sizeof(LogEntry));
+	line = (lo - 1) * LOG_INDEX_STEP;
+	_logindex_seek(log, file, line, &e);
+	while ((line < log->nlines) && !_log_readentry(file, &e, 0)
+	       && (e.when < since))
+		line++;
+
+	return line;
+}
+
+/* _log_nextword
+ * Find the next word worth indexing in a string, copying it lowercased into
+ * buf, which must hold LOG_WORD_MAX + 1 bytes.  Bytes with the high bit set
+ * count as letters so UTF-8 words stay whole.  Returns a pointer to just
+ * after the word, or NULL if there are no more.
+ */
+static const char *
+_log_nextword(const char *str, char *buf)
+{
+	for (;;) {
+		size_t len;
+
+		while (*str && !isalnum((unsigned char)*str)
+		       && !(*str & 0x80))
+			str++;
+		if (!*str)
+			return NULL;
+
+		for (len = 0; isalnum((unsigned char)str[len])
+			     || (str[len] & 0x80); len++) {
+			if (len < LOG_WORD_MAX)
+				buf[len] = tolower((unsigned char)str[len]);
+		}
+		str += len;
+
+		if ((len >= LOG_WORD_MIN) && (len <= LOG_WORD_MAX)) {
+			buf[len] = 0;
+			return str;
+		}
+	}
+}
+
+/* _logsearch_term
+ * Find a term in a search index, adding it if create is set.  Returns NULL
+ * if it isn't there and wasn't created.
+ */
+static LogTerm *
+_logsearch_term(struct logsearch *ls, const char *term, int create)
+{
+	unsigned long i;
+
+	if (create && ((ls->nterms + 1) * 2 > ls->size)) {
+		LogTerm	     *old;
+		unsigned long oldsz, j;
+
+		old = ls->terms;
+		oldsz = ls->size;
+		ls->size = (oldsz ? oldsz * 2 : 256);
+		ls->terms = (LogTerm *)malloc(sizeof(LogTerm) * ls->size);
+		memset(ls->terms, 0, sizeof(LogTerm) * ls->size);
+
+		for (j = 0; j < oldsz; j++) {
+			if (!old[j].term)
+				continue;
+
+			i = _logstr_hash(old[j].term) & (ls->size - 1);
+			while (ls->terms[i].term)
+				i = (i + 1) & (ls->size - 1);
+			ls->terms[i] = old[j];
+		}
+		free(old);
+	}
+	if (!ls->size)
+		return NULL;
+
+	i = _logstr_hash(term) & (ls->size - 1);
+	while (ls->terms[i].term) {
+		if (!strcmp(ls->terms[i].term, term))
+			return &(ls->terms[i]);
+		i = (i + 1) & (ls->size - 1);
+	}
+	if (!create)
+		return NULL;
+
+	ls->terms[i].term = x_strdup(term);
+	ls->nterms++;
+	return &(ls->terms[i]);
+}
+
+/* _logsearch_post
+ * Note that a record contains a term.  Records are always added in order,
+ * so a term that appears twice in one record is spotted at the end.
+ */
+static void
+_logsearch_post(struct logsearch *ls, const char *term, unsigned long seq)
+{
+	LogTerm *t;
+
+	t = _logsearch_term(ls, term, 1);
+	if (t->npost && (t->post[t->npost - 1] == seq))
+		return;
+
+	if (t->npost >= t->postsz) {
+		t->postsz = (t->postsz ? t->postsz * 2 : 4);
+		t->post = (unsigned int *)realloc(t->post, sizeof(unsigned int)
+						  * t->postsz);
+	}
+	t->post[t->npost++] = seq;
+}
+
+/* _logsearch_add
+ * Add a record to a log file's search index under its event, the nickname
+ * it came from and each of the words in it.
+ */
+static void
+_logsearch_add(LogFile *log, unsigned long seq, const LogRecord *rec)
+{
+	char	    term[LOG_WORD_MAX + 2];
+	const char *str;
+	size_t	    len;
+
+	if (!log->search) {
+		log->search = (struct logsearch *)malloc(sizeof(struct logsearch));
+		memset(log->search, 0, sizeof(struct logsearch));
+		log->search->compacted = _logsearch_oldest(log);
+	}
+
+	term[0] = '=';
+	strncpy(term + 1, flag_table[rec->code].name, LOG_WORD_MAX);
+	term[LOG_WORD_MAX + 1] = 0;
+	irc_strlwr(term);
+	_logsearch_post(log->search, term, seq);
+
+	len = strcspn(rec->from, "!");
+	if (len && (len <= LOG_WORD_MAX)) {
+		term[0] = '<';
+		memcpy(term + 1, rec->from, len);
+		term[len + 1] = 0;
+		irc_strlwr(term);
+		_logsearch_post(log->search, term, seq);
+	}
+
+	str = rec->text;
+	while ((str = _log_nextword(str, term)))
+		_logsearch_post(log->search, term, seq);
+}
+
+/* _logsearch_oldest
+ * Sequence number of the oldest record the search index covers, either the
+ * start of the log file or LOG_SEARCH_LINES back from its end.
+ */
+static unsigned long
+_logsearch_oldest(LogFile *log)
+{
+	if (log->nlines > LOG_SEARCH_LINES)
+		return log->first + log->nlines - LOG_SEARCH_LINES;
+
+	return log->first;
+}
+
+/* _logsearch_compact
+ * Throw away the postings for records that have been rolled off the start
+ * of the log file or fallen out of the indexed window, and any terms left
+ * with none.  This is only worth doing once a whole window's worth has
+ * gone, so the cost is spread over the writes.
+ */
+static void
+_logsearch_compact(LogFile *log)
+{
+	struct logsearch *ls;
+	LogTerm		 *old;
+	unsigned long	  oldest, oldsz, i;
+
+	ls = log->search;
+	oldest = _logsearch_oldest(log);
+	if (!ls || (oldest - ls->compacted
+		    < MAX(MIN(log->nlines, LOG_SEARCH_LINES), 1024UL)))
+		return;
+
+	debug("Compacting search index of '%s'", log->filename);
+	old = ls->terms;
+	oldsz = ls->size;
+	ls->terms = NULL;
+	ls->nterms = ls->size = 0;
+	ls->compacted = oldest;
+
+	for (i = 0; i < oldsz; i++) {
+		LogTerm	     *t;
+		unsigned long lo, hi;
+
+		if (!old[i].term)
+			continue;
+
+		/* Postings are sorted, find the first one we keep */
+		lo = 0;
+		hi = old[i].npost;
+		while (lo < hi) {
+			unsigned long mid = lo + (hi - lo) / 2;
+
+			if (old[i].post[mid] < oldest) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		if (lo == old[i].npost) {
+			free(old[i].term);
+			free(old[i].post);
+			continue;
+		}
+
+		memmove(old[i].post, old[i].post + lo,
+			sizeof(unsigned int) * (old[i].npost - lo));
+		old[i].npost -= lo;
+
+		t = _logsearch_term(ls, old[i].term, 1);
+		free(t->term);
+		*t = old[i];
+	}
+	free(old);
+}
+
+/* _logsearch_free
+ * Free a log file's search index
+ */
+static void
+_logsearch_free(LogFile *log)
+{
+	unsigned long i;
+
+	if (!log->search)
+		return;
+
+	for (i = 0; i < log->search->size; i++) {
+		free(log->search->terms[i].term);
+		free(log->search->terms[i].post);
+	}
+	free(log->search->terms);
+	free(log->search);
+	log->search = NULL;
+}
+
+/* _log_append
+ * Write a single event to an internal log file, preceded by the definitions
+ * of any strings it refers to that the file hasn't seen yet.  The file
+ * position must already be at the end.
+ */
+static int
+_log_append(LogFile *log, FILE *file, time_t when, int code,
+	    unsigned long dest, unsigned long from, const char *text,
+	    size_t textlen)
+{
+	unsigned char  buf[1 + LOG_VARINT_MAX * 4];
+	unsigned long  ids[2], delta;
+	long	       diff;
+	size_t	       len;
+	int	       i;
+
+	ids[0] = dest;
+	ids[1] = from;
+	for (i = 0; i < 2; i++) {
+		unsigned long byte = ids[i] / 8;
+		const char   *str;
+
+		if (byte >= log->strdefsz) {
+			unsigned long newsz;
+
+			newsz = (byte + 1 > log->strdefsz * 2
+				 ? byte + 1 : log->strdefsz * 2);
+			log->strdef = (unsigned char *)realloc(log->strdef,
+							       newsz);
+			memset(log->strdef + log->strdefsz, 0,
+			       newsz - log->strdefsz);
+			log->strdefsz = newsz;
+		}
+		if (log->strdef[byte] & (1 << (ids[i] % 8)))
+			continue;
+
+		str = _logstr_get(&(log->strings), ids[i]);
+		buf[0] = LOG_REC_STRING;
+		len = 1;
+		len += _varint_put(buf + len, ids[i]);
+		len += _varint_put(buf + len, strlen(str));
+		fwrite(buf, 1, len, file);
+		fputs(str, file);
+		log->strdef[byte] |= 1 << (ids[i] % 8);
+	}
+
+	diff = when - log->last;
+	delta = (diff < 0 ? ((unsigned long)-diff << 1) | 1
+		 : (unsigned long)diff << 1);
+	log->last = when;
+
+	buf[0] = code;
+	len = 1;
+	len += _varint_put(buf + len, delta);
+	len += _varint_put(buf + len, dest);
+	len += _varint_put(buf + len, from);
+	len += _varint_put(buf + len, textlen);
+	fwrite(buf, 1, len, file);
+	fwrite(text, 1, textlen, file);
+
+	return (ferror(file) ? -1 : 0);
+}
+
+/* _log_puts
+ * Write an already formatted string to the end of a file opened for
+ * appending.
+ */
+static void
+_log_puts(int fd, const char *str)
+{
+	if (write(fd, str, strlen(str)) == -1)
+		syscall_fail("write", 0, 0);
+}
+
+/* Write a record to the log FIXME don't just roll by line counts now? */
+static int _logfile_write(struct ircproxy *p, struct logfile *log,
+                          const char *dest, const LogRecord *rec) {
+  unsigned long line;
+  time_t base;
+  long offset;
+
+  if (!log->open)
+    return 0;
 
-  if (log->open && log->maxlines && (log->nlines >= log->maxlines)) {
+  if (log->maxlines && (log->nlines >= log->maxlines)) {
+    LogStrings old;
+    LogEntry e;
     FILE *fout;
-    char *l;
 
     /* We can't simply add .tmp or something on the end, because there is
        always a possibility that might be a channel name.  Besides using
        temporary files always looks icky to me.  This "Sick Puppy" way of
        reading from an unlinked file sits with me much better (says a lot
        about me, that) */
-    fseek(log->file, 0, SEEK_SET);
+    fseek(log->file, LOG_MAGIC_LEN, SEEK_SET);
     unlink(log->filename);
 
     /* This *really* shouldn't happen */
@@ -551,29 +1320,56 @@ static int _logfile_write(struct logfile *log, const char *format, ...) {
       syscall_fail("fchmod", log->filename, 0);
 
     /* Eat from the start */
-    while ((log->nlines >= log->maxlines) && (l = _log_read(log->file))) {
-      free(l);
+    memset(&e, 0, sizeof(LogEntry));
+    while ((log->nlines >= log->maxlines) && !_log_readentry(log->file, &e, 0)) {
       log->nlines--;
+      log->first++;
     }
+    _logsearch_compact(log);
+
+    /* Write the rest, it's a new file so the strings need defining again
+       and the first time is relative to zero */
+    fputs(LOG_MAGIC, fout);
+    if (log->strdef)
+      memset(log->strdef, 0, log->strdefsz);
+    _logstr_compact(log, &old);
+    log->last = 0;
+    log->nindex = 0;
+    line = 0;
+    while (!_log_readentry(log->file, &e, 1)) {
+      if (old.nstr) {
+        e.dest = _logstr_intern(&(log->strings), _logstr_get(&old, e.dest));
+        e.from = _logstr_intern(&(log->strings), _logstr_get(&old, e.from));
+      }
 
-    /* Write the rest */
-    while ((l = _log_read(log->file))) {
-      fprintf(fout, "%s\n", l);
-      free(l);
+      base = log->last;
+      offset = ftell(fout);
+      _log_append(log, fout, e.when, e.code, e.dest, e.from, e.text,
+                  e.textlen);
+      _logindex_add(log, line++, offset, base, e.when);
     }
+    free(e.text);
+    _logstr_free(&old);
 
     /* Close the input file, thereby *whoosh*ing it */
     fclose(log->file);
     log->file = fout;
   }
 
-  /* Write to the log file */
-  if (log->open) {
-    _log_printf(log->file, "%s\n", msg);
-    log->nlines++;
-  }
+  /* Append the record, no reformatting necessary */
+  fseek(log->file, 0, SEEK_END);
+  base = log->last;
+  offset = ftell(log->file);
+  _log_append(log, log->file, rec->when, rec->code,
+              _logstr_intern(&(log->strings), dest),
+              _logstr_intern(&(log->strings), rec->from),
+              rec->text, rec->textlen);
+  fflush(log->file);
+  if (p->conn_class->log_search)
+    _logsearch_add(log, log->first + log->nlines, rec);
+  _logindex_add(log, log->nlines++, offset, base, rec->when);
+  _logsearch_compact(log);
 
-  free(msg);
   return 0;
 }
 
@@ -648,124 +1444,138 @@ _log_pipe(IRCProxy *p, int event, const char *to, const char *from,
 	return 0;
 }
 
-/* Write some text to a log file */
-static int _logfile_writetext(struct ircproxy *p, struct logfile *log, int event, const char *to, const char *from, const char *text) {
-  const char *dest;
-  FILE *user_log;
-  time_t now;
+/* _logrecord_make
+ * Encode a log message once: take the time, convert the event to its name
+ * and build both the internal and human-readable forms of the line.  The
+ * result can then be written to as many log files as necessary, and is in
+ * the arena.
+ */
+static void
+_logrecord_make(IRCProxy *p, LogRecord *rec, int event, const char *from,
+		const char *text)
+{
+	const char *tstamp;
+	time_t	    now;
+
+	time(&now);
+	if (p->conn_class->log_timeoffset)
+		now -= (p->conn_class->log_timeoffset * 60);
+
+	rec->when = now;
+	rec->event = event;
+	rec->code = _log_eventcode(event);
+	rec->from = from;
+	rec->text = text;
+	rec->textlen = strlen(text);
+	rec->userline = NULL;
+
+	/* Only bother with the pretty version if someone will read it */
+	if (!p->conn_class->log_dir)
+		return;
 
-  if (to == IRC_LOGFILE_ALL) {
-    return -1;
-  } else if (to == IRC_LOGFILE_SERVER) {
-    dest = "SERVER";
-  } else {
-    dest = to;
-  }
- 
-  time(&now);
-  if (p->conn_class->log_timeoffset)
-    now -= (p->conn_class->log_timeoffset * 60);
-  
-  _logfile_write(log, "%lu %s %s %s %s",
-                now, irclog_flagtostr(event), dest, from, text);
+	tstamp = (p->conn_class->log_timestamp ? _log_stamp(&user_stamp, now)
+		  : "");
+
+	if (event & IRC_LOG_MSG) {
+		rec->userline = arena_sprintf("%s<%s> %s\n", tstamp, from, text);
+	} else if (event & IRC_LOG_NOTICE) {
+		rec->userline = arena_sprintf("%s-%s- %s\n", tstamp, from, text);
+	} else if (event & IRC_LOG_ACTION) {
+		size_t nicklen;
+
+		nicklen = strcspn(from, "!");
+		rec->userline = arena_sprintf("%s* %.*s %s\n", tstamp,
+					      (int)nicklen, from, text);
+	} else if (event & IRC_LOG_CTCP) {
+		rec->userline = arena_sprintf("%s[%s] %s\n", tstamp, from, text);
+	} else if (event & IRC_LOG_JOIN) {
+		rec->userline = arena_sprintf("%s--> %s\n", tstamp, text);
+	} else if (event & (IRC_LOG_PART | IRC_LOG_KICK | IRC_LOG_QUIT)) {
+		rec->userline = arena_sprintf("%s<-- %s\n", tstamp, text);
+	} else if (event & (IRC_LOG_NICK | IRC_LOG_MODE | IRC_LOG_TOPIC)) {
+		rec->userline = arena_sprintf("%s--- %s\n", tstamp, text);
+	} else if (event & (IRC_LOG_CLIENT | IRC_LOG_SERVER | IRC_LOG_ERROR)) {
+		rec->userline = arena_sprintf("%s*** %s\n", tstamp, text);
+	}
+}
 
-  /* Write to the user's copy */
-  user_log = _open_user_log(p, to);
-  if (user_log) {
-    char tbuf[40];
-    
-    if (p->conn_class->log_timestamp) {
-      strftime(tbuf, sizeof(tbuf), LOG_USER_TIME_FORMAT, localtime(&now));
-    } else {
-      tbuf[0] = '0';
-    }
+/* _logfile_writerecord
+ * Append an encoded record to a log file, the user's copy of it and the
+ * log program.
+ */
+static int
+_logfile_writerecord(IRCProxy *p, LogFile *log, const char *to,
+		     const LogRecord *rec)
+{
+	const char *dest;
+	int	    user_log;
 
-    /* Print a nicely formatted entry to the log file */
-    if (event & IRC_LOG_MSG) {
-      _log_printf(user_log, "%s<%s> %s\n", tbuf, from, text);
-    } else if (event & IRC_LOG_NOTICE) {
-      _log_printf(user_log, "%s-%s- %s\n", tbuf, from, text);
-    } else if (event & IRC_LOG_ACTION) {
-      char *nick, *ptr;
-
-      nick = x_strdup(from);
-      ptr = strchr(nick, '!');
-      if (ptr)
-        *ptr = 0;
-
-      _log_printf(user_log, "%s* %s %s\n", tbuf, nick, text);
-      free(nick);
-    } else if (event & IRC_LOG_CTCP) {
-      _log_printf(user_log, "%s[%s] %s\n", tbuf, from, text);
-    } else if (event & IRC_LOG_JOIN) {
-      _log_printf(user_log, "%s--> %s\n", tbuf, text);
-    } else if (event & IRC_LOG_PART) {
-      _log_printf(user_log, "%s<-- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_KICK) {
-      _log_printf(user_log, "%s<-- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_QUIT) {
-      _log_printf(user_log, "%s<-- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_NICK) {
-      _log_printf(user_log, "%s--- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_MODE) {
-      _log_printf(user_log, "%s--- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_TOPIC) {
-      _log_printf(user_log, "%s--- %s\n", tbuf, text);
-    } else if (event & IRC_LOG_CLIENT) {
-      _log_printf(user_log, "%s*** %s\n", tbuf, text);
-    } else if (event & IRC_LOG_SERVER) {
-      _log_printf(user_log, "%s*** %s\n", tbuf, text);
-    } else if (event & IRC_LOG_ERROR) {
-      _log_printf(user_log, "%s*** %s\n", tbuf, text);
-    }
-      
-    fclose(user_log);
-  }
+	if (to == IRC_LOGFILE_ALL) {
+		return -1;
+	} else if (to == IRC_LOGFILE_SERVER) {
+		dest = "SERVER";
+	} else {
+		dest = to;
+	}
 
-  /* Write to the pipe */
-  _log_pipe(p, event, dest, from, text); 
+	_logfile_write(p, log, dest, rec);
 
-  return 0;
+	/* Write to the user's copy */
+	if (rec->userline && ((user_log = _open_user_log(p, to)) != -1)) {
+		_log_puts(user_log, rec->userline);
+		close(user_log);
+	}
+
+	/* Write to the pipe */
+	_log_pipe(p, rec->event, dest, rec->from, rec->text);
+
+	return 0;
 }
 
 /* Write a message to log file(s) */
 int irclog_log(struct ircproxy *p, int event, const char *to, const char *from,
                const char *format, ...) {
+  struct arenamark mark;
+  LogRecord rec;
   char *text;
   va_list ap;
+  int ret = 0;
 
   if (!(p->conn_class->log_events & event))
     return 0;
 
+  arena_mark(&mark);
   va_start(ap, format);
-  text = x_vsprintf(format, ap);
+  text = arena_vsprintf(format, ap);
+  va_end(ap);
+
+  /* Encode it once, no matter how many files it ends up in */
+  _logrecord_make(p, &rec, event, from, text);
 
   if (to != IRC_LOGFILE_ALL) {
     struct logfile *log;
     
     /* Write to one file */
     log = _logfile_get(p, to);
-    if (!log)
-      return -1;
-
-    _logfile_writetext(p, log, event, to, from, text);
+    if (log) {
+      _logfile_writerecord(p, log, to, &rec);
+    } else {
+      ret = -1;
+    }
   } else {
     struct ircchannel *c;
 
     /* Write to all files except the private one */
-    _logfile_writetext(p, &(p->server_log), event, IRC_LOGFILE_SERVER,
-                      from, text);
+    _logfile_writerecord(p, &(p->server_log), IRC_LOGFILE_SERVER, &rec);
     c = p->channels;
     while (c) {
-	    _logfile_writetext(p, &(c->log), event, c->name, from, text);
+      _logfile_writerecord(p, &(c->log), c->name, &rec);
       c = c->next;
     }
   }
 
-  free(text);
-  va_end(ap);
-
-  return 0;
+  arena_release(&mark);
+  return ret;
 }
 
 
@@ -797,6 +1607,15 @@ int irclog_autorecall(struct ircproxy *p, const char *to) {
   } else {
     start = (recall > log->nlines ? 0 : log->nlines - recall);
   }
+
+  /* Don't repeat what they saw before they went away */
+  if (p->conn_class->log_recall_since_detach && p->detach_time) {
+    unsigned long since;
+
+    since = _irclog_since(p, log, p->detach_time);
+    if (since > start)
+      start = since;
+  }
   lines = log->nlines - start;
 
   return _irclog_recall(p, log, start, lines, to, 0);
@@ -824,198 +1643,572 @@ int irclog_recall(struct ircproxy *p, const char *to,
   return _irclog_recall(p, log, start, lines, to, from);
 }
 
-/* Called to do the recall from a log file FIXME */
-static int _irclog_recall(struct ircproxy *p, struct logfile *log,
-                          unsigned long start, unsigned long lines,
-                          const char *to, const char *from) {
-  FILE *file;
-  int close;
-
-  /* If the file isn't open, we have to open it and remember to close it
-     later */
-  if (log->open) {
-    file = log->file;
-    close = 0;
-  } else if (log->filename && log->made) {
-    file = fopen(log->filename, "r");
-    if (!file) {
-      ircclient_send_notice(p, "Couldn't open log file %s", log->filename);
-      syscall_fail("fopen", log->filename, 0);
-      return -1;
-    }
-    close = 1;
-  } else {
-    return -1;
-  }
+/* irclog_recallsince
+ * Recall everything logged at or after the given time
+ */
+int
+irclog_recallsince(IRCProxy *p, const char *to, time_t since,
+		   const char *from)
+{
+	unsigned long start;
+	LogFile	     *log;
 
-  debug("recalling log [%s]\r\n", log->filename);
+	if (!(log = _logfile_get(p, to)))
+		return -1;
 
-  /* If to is 0, then we're recalling from the server_log, and need to send
-   * it to the nickname */
-  if (!to)
-    to = p->nickname ? p->nickname : "";
+	start = _irclog_since(p, log, since);
+	return _irclog_recall(p, log, start, log->nlines - start, to, from);
+}
 
-  /* Jump to the beginning */
-  fseek(file, 0, SEEK_SET);
+/* _logfile_reader
+ * Get a FILE * to read an internal log file from.  If the file isn't open,
+ * we have to open it and remember to close it later.
+ */
+static FILE *
+_logfile_reader(IRCProxy *p, LogFile *log, int *close)
+{
+	FILE *file;
 
-  if (start < log->nlines) {
-    char *msg;
+	if (log->open) {
+		*close = 0;
+		return log->file;
 
-    /* Skip start lines */
-    while (start && (msg = _log_read(file))) {
-      free(msg);
-      start--;
-    }
+	} else if (log->filename && log->made) {
+		if (!(file = fopen(log->filename, "r"))) {
+			ircclient_send_notice(p, "Couldn't open log file %s",
+					      log->filename);
+			syscall_fail("fopen", log->filename, 0);
+			return NULL;
+		}
 
-    /* Make lines sensible */
-    lines = MIN(lines, log->nlines - start);
-
-    /* Recall lines */
-    while (lines && (msg = _log_read(file))) {
-      time_t when = 0;
-      char *ll;
-      int event;
-      char *src, *frm, *eventtext;
-      char *work, *rest;
-      time_t now, diff;
-      char tbuf[40];
-
-      tbuf[0] = 0;
-     
-      debug("log: [%s]\r\n", msg);
-
-       /*
-	* 1079304950 client #dircproxy dircproxy You connected
-	* 1079304951 join #dircproxy niven.freenode.net You joined the channel
-	* 1079305132 client #dircproxy dircproxy You disconnected
-	* 1079305143 message #dircproxy bear!~bear@pa.comcast.net lah
-	* 1079305150 action #dircproxy bear!~bear@pa.comcast.net moons the channel
-	*/
-
-      ll   = msg;
-      work = msg;
-      if (!*work) {                             /* Timestamp is first value now */
-        free(ll);
-        continue;
-      }
-  
-      rest = strchr(msg, ' ');                  /* parse to the space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
+		*close = 1;
+		return file;
 
-      *(rest++) = 0;                            /* delete the space */
-      msg = rest;
-  
-      when = strtoul(work, (char **)NULL, 10);  /* Obtain the timestamp */
+	} else {
+		return NULL;
+	}
+}
 
-      eventtext = msg;                          /* store the event text */
-      if (!*eventtext) {
-        free(ll);
-        continue;
-      }
-      
-      rest = strchr(msg, ' ');                  /* Message continues after a space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-      
-      *(rest++) = 0;                            /* Delete the space */
-      msg = rest;
-
-      event = irclog_strtoflag(eventtext);      /* determine the event code */
-      src   = msg;                              /* log source */
-      
-      rest = strchr(msg, ' ');                  /* Message continues after a space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-  
-      *(rest++) = 0;                            /* Delete the space */
-      msg = rest;
-  
-      frm = msg;                                /* where the entry is from */
-      
-      rest = strchr(msg, ' ');                  /* Message continues after a space */
-      if (!rest) {
-        free(ll);
-        continue;
-      }
-      
-      *(rest++) = 0;                             /* Delete the space */
-      msg = rest;
-  
-      debug("timestamp: %d event: %d src: [%s] frm: [%s] log: [%s]\r\n", when, event, src, frm, msg);
-
-      /* If the log_timestamp option is on, format the timestamp */
-      if (when && p->conn_class->log_timestamp) {
-        if (p->conn_class->log_relativetime) {
-          time(&now);
-          diff = now - when;
-
-          if (diff < 82800L) {                /* Within 23 hours [hh:mm] */
-            strftime(tbuf, sizeof(tbuf), "[%H:%M] ", localtime(&when));
-          } else if (diff < 518400L) {        /* Within 6 days [day hh:mm] */
-            strftime(tbuf, sizeof(tbuf), "[%a %H:%M] ", localtime(&when));
-          } else if (diff < 25920000L) {      /* Within 300 days [d mon] */
-            strftime(tbuf, sizeof(tbuf), "[%d %b] ", localtime(&when));
-          } else {                            /* Otherwise [d mon yyyy] */
-            strftime(tbuf, sizeof(tbuf), "[%d %b %Y] ", localtime(&when));
-          }
-        } else {
-          strftime(tbuf, sizeof(tbuf), LOG_TIME_FORMAT, localtime(&when));
-        }
-      }
+/* _logfile_endread
+ * Finish with a FILE * from _logfile_reader, either closing it or leaving
+ * it at the end ready for writing.
+ */
+static void
+_logfile_endread(FILE *file, int close)
+{
+	if (close) {
+		fclose(file);
+	} else {
+		fseek(file, 0, SEEK_END);
+	}
+}
 
-      /* Message or Notice lines, these require a bit of parsing */
-      if ((event == IRC_LOG_NOTICE) || (event == IRC_LOG_MSG) || (event == IRC_LOG_ACTION)) {
-        /* Do filtering */
-        if (from) {
-          char *comp, *ptr;
-
-          /* We just check the nickname, so strip off anything after the ! */
-          comp = x_strdup(src);
-          if ((ptr = strchr(comp, '!')))
-            *ptr = 0;
-
-            /* Check the nicknames are the same */
-          if (irc_strcasecmp(comp, from)) {
-            free(comp);
-            free(ll);
-            continue;
-          }
-          free(comp);
-        }
-      }
-      
-        /* Send the line */
-      if (event == IRC_LOG_MSG) {
-        net_send(p->client_sock, ":%s PRIVMSG %s :%s%s\r\n", frm, to, tbuf, msg);
-      } else if (event == IRC_LOG_ACTION) {
-        net_send(p->client_sock, ":%s PRIVMSG %s :\001ACTION %s%s\001\r\n", frm, to, tbuf, msg);
-      } else if (event == IRC_LOG_CTCP) {
-        net_send(p->client_sock, ":%s PRIVMSG %s :\001%s %s%s%s\001\r\n", src, to, eventtext, tbuf, (strlen(msg) ? " " : ""), msg);
-      } else if (event == IRC_LOG_NOTICE) {
-        ircclient_send_notice(p, "%s", msg);
-      } else {
-        net_send(p->client_sock, ":%s PRIVMSG %s :%s%s\r\n", src, to, tbuf, msg);
-      }
+/* _irclog_since
+ * Work out the line number of the first record logged at or after a time
+ */
+static unsigned long
+_irclog_since(IRCProxy *p, LogFile *log, time_t since)
+{
+	unsigned long line;
+	FILE	     *file;
+	int	      close;
 
-      free(ll);
-      lines--;
-    }
-  }
+	if (!(file = _logfile_reader(p, log, &close)))
+		return log->nlines;
 
-    /* Either close, or skip back to the end */
-  if (close) {
-    fclose(file);
-  } else {
-    fseek(file, 0, SEEK_END);
-  }
-  return 0;
+	line = _logindex_find(log, file, LOG_TIME(p, since));
+	_logfile_endread(file, close);
+
+	return line;
+}
+
+/* _irclog_recall
+ * Start recalling lines from a log file.  Rather than queueing them all at
+ * once they're sent as the client makes room, taking turns with any other
+ * recalls in progress.
+ */
+static int
+_irclog_recall(IRCProxy *p, LogFile *log, unsigned long start,
+	       unsigned long lines, const char *to, const char *from)
+{
+	struct logrecall *r;
+
+	if ((p->client_sock == -1)
+	    || (!log->open && !(log->filename && log->made)))
+		return -1;
+	if ((start >= log->nlines) || !lines)
+		return 0;
+
+	debug("recalling log [%s]", log->filename);
+
+	r = (struct logrecall *)malloc(sizeof(struct logrecall));
+	memset(r, 0, sizeof(struct logrecall));
+	r->sock = p->client_sock;
+	if (IS_SERVER_LOG(p, log)) {
+		r->type = LOG_RECALL_SERVER;
+	} else if (IS_PRIVATE_LOG(p, log)) {
+		r->type = LOG_RECALL_PRIVATE;
+		r->to = x_strdup(to);
+	} else {
+		r->type = LOG_RECALL_CHANNEL;
+		r->to = x_strdup(to);
+	}
+	r->from = (from ? x_strdup(from) : NULL);
+	r->seq = log->first + start;
+	r->end = log->first + log->nlines;
+	r->lines = lines;
+	time(&(r->now));
+
+	if (p->recalls_last) {
+		p->recalls_last->next = r;
+	} else {
+		p->recalls = r;
+	}
+	p->recalls_last = r;
+	net_drain(r->sock, ACTIVITY_FUNCTION(_irclog_drain));
+
+	_irclog_pump(p);
+	return 0;
+}
+
+/* _irclog_recallfrom
+ * Get the log file a recall is from, or NULL if it's gone away
+ */
+static LogFile *
+_irclog_recallfrom(IRCProxy *p, struct logrecall *r)
+{
+	IRCChannel *c;
+
+	switch (r->type) {
+	case LOG_RECALL_SERVER:
+		return &(p->server_log);
+	case LOG_RECALL_PRIVATE:
+		return &(p->private_log);
+	default:
+		c = ircnet_fetchchannel(p, r->to);
+		return (c ? &(c->log) : NULL);
+	}
+}
+
+/* _irclog_recallsome
+ * Send the next few lines of a recall to the client.  Returns 0 if there
+ * are more to come, or -1 once it's finished.
+ */
+static int
+_irclog_recallsome(IRCProxy *p, struct logrecall *r)
+{
+	const char *to;
+	LogFile	   *log;
+	FILE	   *file;
+	int	    close, n;
+
+	if (!(log = _irclog_recallfrom(p, r)))
+		return -1;
+
+	/* A log file that isn't being written to can be kept open and read
+	 * straight through, otherwise find our place again each time */
+	if (r->file) {
+		/* Once the log's been opened again, what we were reading isn't
+		 * in it any more, and nor are the strings it refers to */
+		if (r->seq < log->first)
+			return -1;
+		file = r->file;
+	} else if (!(file = _logfile_reader(p, log, &close))) {
+		return -1;
+	} else if (close) {
+		r->file = file;
+		if (r->seq < log->first)
+			r->seq = log->first;
+		_logindex_seek(log, file, r->seq - log->first, &(r->e));
+	} else {
+		if (r->seq < log->first)
+			r->seq = log->first;
+		if (r->seq >= log->first + log->nlines)
+			return -1;
+		_logindex_seek(log, file, r->seq - log->first, &(r->e));
+	}
+
+	/* If to is 0, then we're recalling from the server_log, and need to send
+	 * it to the nickname */
+	to = (r->to ? r->to : (p->nickname ? p->nickname : ""));
+
+	for (n = 0; (n < LOG_RECALL_BATCH) && r->lines && (r->seq < r->end);
+	     n++) {
+		if (_log_readentry(file, &(r->e), 1)) {
+			r->lines = 0;
+			break;
+		}
+		r->seq++;
+
+		/* Message or Notice lines are filtered by the nickname they
+		 * are from, which is everything before the ! */
+		if (r->from && ((flag_table[r->e.code].value == IRC_LOG_NOTICE)
+				|| (flag_table[r->e.code].value == IRC_LOG_MSG)
+				|| (flag_table[r->e.code].value
+				    == IRC_LOG_ACTION))) {
+			const char *frm;
+			size_t	    nicklen;
+
+			frm = _logstr_get(&(log->strings), r->e.from);
+			nicklen = strcspn(frm, "!");
+			if ((strlen(r->from) != nicklen)
+			    || irc_strncasecmp(frm, r->from, nicklen))
+				continue;
+		}
+
+		_irclog_send(p, log, r->sock, &(r->e), to, r->now);
+		r->lines--;
+	}
+
+	/* Skip back to the end of a file that's being written to */
+	if (file != r->file)
+		_logfile_endread(file, 0);
+
+	return ((r->lines && (r->seq < r->end)) ? 0 : -1);
+}
+
+/* _irclog_recallfree
+ * Free a recall once it's finished or been abandoned
+ */
+static void
+_irclog_recallfree(struct logrecall *r)
+{
+	if (r->file)
+		fclose(r->file);
+	free(r->e.text);
+	free(r->to);
+	free(r->from);
+	free(r);
+}
+
+/* _irclog_pump
+ * Send lines from the recalls in progress until each client has as much
+ * waiting as it's allowed, a batch from each recall in turn.  New messages
+ * are queued as they arrive, so they only wait behind that much history.
+ * When several clients are attached, one that's slow to read only holds up
+ * its own recalls.
+ */
+static void
+_irclog_pump(IRCProxy *p)
+{
+	struct logrecall *r, **rr;
+	int		  sent;
+
+	do {
+		sent = 0;
+		rr = &(p->recalls);
+		while ((r = *rr)) {
+			if (p->conn_class->log_recall_queue
+			    && (net_queued(r->sock)
+				>= p->conn_class->log_recall_queue)) {
+				rr = &(r->next);
+				continue;
+			}
+
+			sent = 1;
+			if (_irclog_recallsome(p, r)) {
+				*rr = r->next;
+				_irclog_recallend(p, r);
+			} else {
+				rr = &(r->next);
+			}
+		}
+	} while (sent);
+
+	/* Find the back again, things may have come off it */
+	p->recalls_last = NULL;
+	for (r = p->recalls; r; r = r->next)
+		p->recalls_last = r;
+}
+
+/* _irclog_recallend
+ * Free a recall that's been taken off the list, and stop waiting for its
+ * client to drain if it was the last one for them
+ */
+static void
+_irclog_recallend(IRCProxy *p, struct logrecall *r)
+{
+	struct logrecall *o;
+
+	for (o = p->recalls; o && (o->sock != r->sock); o = o->next)
+		;
+	if (!o && (r->sock != -1))
+		net_drain(r->sock, NULL);
+
+	_irclog_recallfree(r);
+}
+
+/* _irclog_drain
+ * Called when some of what's waiting for the client has been sent
+ */
+static void
+_irclog_drain(IRCProxy *p, int sock)
+{
+	_irclog_pump(p);
+}
+
+/* irclog_endrecall
+ * Abandon any recalls in progress for a client, because it has gone.  A
+ * socket of -1 abandons them all.
+ */
+void
+irclog_endrecall(IRCProxy *p, int sock)
+{
+	struct logrecall *r, **rr;
+
+	rr = &(p->recalls);
+	while ((r = *rr)) {
+		if ((sock == -1) || (r->sock == sock)) {
+			*rr = r->next;
+			_irclog_recallfree(r);
+		} else {
+			rr = &(r->next);
+		}
+	}
+
+	p->recalls_last = NULL;
+	for (r = p->recalls; r; r = r->next)
+		p->recalls_last = r;
+}
+
+/* _log_stamp
+ * Format a time with a cached timestamp's format, reusing the last one if
+ * it was for the same minute.
+ */
+static const char *
+_log_stamp(LogStamp *stamp, time_t when)
+{
+	time_t minute;
+
+	minute = LOG_MINUTE(when);
+	if (!stamp->valid || (stamp->minute != minute)) {
+		strftime(stamp->buf, sizeof(stamp->buf), stamp->format,
+			 localtime(&when));
+		stamp->minute = minute;
+		stamp->valid = 1;
+	}
+
+	return stamp->buf;
+}
+
+/* _irclog_send
+ * Send a record read from a log file to the client on sock, formatted as
+ * the event it was with a timestamp if the user wants one.  now is when the
+ * recall started, relative timestamps are worked out from that.
+ */
+static void
+_irclog_send(IRCProxy *p, LogFile *log, int sock, const LogEntry *e,
+	     const char *to, time_t now)
+{
+	const char *src, *frm, *tbuf;
+	int	    event;
+
+	/* No parsing needed, the event and strings come straight from the
+	 * record */
+	event = flag_table[e->code].value;
+	src = _logstr_get(&(log->strings), e->dest);
+	frm = _logstr_get(&(log->strings), e->from);
+	tbuf = "";
+
+	/* If the log_timestamp option is on, format the timestamp */
+	if (e->when && p->conn_class->log_timestamp) {
+		if (p->conn_class->log_relativetime) {
+			int i;
+
+			for (i = 0; relative_stamps[i].age
+				     && (now - e->when
+					 >= relative_stamps[i].age); i++)
+				;
+			tbuf = _log_stamp(&(relative_stamps[i].stamp), e->when);
+		} else {
+			tbuf = _log_stamp(&recall_stamp, e->when);
+		}
+	}
+
+	/* Send the line */
+	if (event == IRC_LOG_MSG) {
+		net_send(sock, ":%s PRIVMSG %s :%s%s\r\n", frm, to,
+			 tbuf, e->text);
+	} else if (event == IRC_LOG_ACTION) {
+		net_send(sock,
+			 ":%s PRIVMSG %s :\001ACTION %s%s\001\r\n", frm, to,
+			 tbuf, e->text);
+	} else if (event == IRC_LOG_CTCP) {
+		net_send(sock, ":%s PRIVMSG %s :\001%s %s%s%s\001\r\n",
+			 src, to, flag_table[e->code].name, tbuf,
+			 (e->textlen ? " " : ""), e->text);
+	} else if (event == IRC_LOG_NOTICE) {
+		net_send(sock, ":%s NOTICE %s :%s\r\n", PACKAGE,
+			 (p->nickname ? p->nickname : "AUTH"), e->text);
+	} else {
+		net_send(sock, ":%s PRIVMSG %s :%s%s\r\n", src, to,
+			 tbuf, e->text);
+	}
+}
+
+/* irclog_search
+ * Search a log file's index for the records matching a query, and send the
+ * most recent of them to the client.  Only the matching records are read
+ * from the file.
+ */
+int
+irclog_search(IRCProxy *p, const char *to, const LogQuery *q)
+{
+	LogTerm	     **lists, *t;
+	unsigned int  *found;
+	unsigned long  minseq, limit, nfound, foundsz, total, k;
+	char	       term[LOG_WORD_MAX + 2];
+	const char    *str;
+	LogFile	      *log;
+	FILE	      *file;
+	time_t	       now;
+	int	       nlists, listsz, close, i;
+
+	if (!(log = _logfile_get(p, to)))
+		return -1;
+	if (!log->search) {
+		ircclient_send_notice(p, "No matches");
+		return 0;
+	}
+
+	/* Find the posting list of every term; if one of them isn't there,
+	 * there's nothing to show */
+	lists = NULL;
+	nlists = listsz = 0;
+	str = q->text;
+	for (i = 0; ; i++) {
+		if (i == 0) {
+			if (!q->from)
+				continue;
+			term[0] = '<';
+			strncpy(term + 1, q->from, LOG_WORD_MAX);
+			term[LOG_WORD_MAX + 1] = 0;
+			irc_strlwr(term);
+		} else if (i == 1) {
+			if (q->event == IRC_LOG_NONE)
+				continue;
+			term[0] = '=';
+			strncpy(term + 1, irclog_flagtostr(q->event),
+				LOG_WORD_MAX);
+			term[LOG_WORD_MAX + 1] = 0;
+			irc_strlwr(term);
+		} else if (!str || !(str = _log_nextword(str, term))) {
+			break;
+		}
+
+		t = _logsearch_term(log->search, term, 0);
+		if (!t || !t->npost) {
+			free(lists);
+			ircclient_send_notice(p, "No matches");
+			return 0;
+		}
+
+		if (nlists >= listsz) {
+			listsz = (listsz ? listsz * 2 : 8);
+			lists = (LogTerm **)realloc(lists,
+						    sizeof(LogTerm *) * listsz);
+		}
+		lists[nlists++] = t;
+	}
+	if (!nlists) {
+		ircclient_send_notice(p, "Nothing to search for");
+		return -1;
+	}
+
+	/* Walk the shortest list, it bounds the number of matches */
+	for (i = 1; i < nlists; i++) {
+		if (lists[i]->npost < lists[0]->npost) {
+			t = lists[0];
+			lists[0] = lists[i];
+			lists[i] = t;
+		}
+	}
+
+	/* Postings older than the index covers may not have gone yet */
+	minseq = log->first;
+	if (q->since)
+		minseq += _irclog_since(p, log, q->since);
+	minseq = MAX(minseq, _logsearch_oldest(log));
+	limit = (q->limit ? MIN(q->limit, LOG_SEARCH_MAX) : LOG_SEARCH_LIMIT);
+
+	/* Newest first, keeping as many as we're going to show */
+	found = NULL;
+	nfound = foundsz = total = 0;
+	for (k = lists[0]->npost; k--; ) {
+		unsigned int seq;
+
+		seq = lists[0]->post[k];
+		if (seq < minseq)
+			break;
+
+		for (i = 1; i < nlists; i++) {
+			unsigned long lo, hi;
+
+			lo = 0;
+			hi = lists[i]->npost;
+			while (lo < hi) {
+				unsigned long mid = lo + (hi - lo) / 2;
+
+				if (lists[i]->post[mid] < seq) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			if ((lo == lists[i]->npost) || (lists[i]->post[lo] != seq))
+				break;
+		}
+		if (i < nlists)
+			continue;
+
+		if (nfound < limit) {
+			if (nfound >= foundsz) {
+				unsigned int *newfound;
+
+				foundsz = (foundsz ? foundsz * 2 : 16);
+				newfound = (unsigned int *)realloc(found,
+					sizeof(unsigned int) * foundsz);
+				if (!newfound)
+					break;
+				found = newfound;
+			}
+			found[nfound++] = seq;
+		}
+		total++;
+	}
+	free(lists);
+
+	if (!nfound) {
+		free(found);
+		ircclient_send_notice(p, "No matches");
+		return 0;
+	}
+	if (!(file = _logfile_reader(p, log, &close))) {
+		free(found);
+		return -1;
+	}
+
+	/* If to is 0, then we're searching the server_log, and need to send
+	 * it to the nickname */
+	if (!to)
+		to = (p->nickname ? p->nickname : "");
+
+	ircclient_send_notice(p, "%lu match%s, showing the most recent %lu",
+			      total, (total == 1 ? "" : "es"), nfound);
+	time(&now);
+	while (nfound--) {
+		LogEntry e;
+
+		memset(&e, 0, sizeof(LogEntry));
+		_logindex_seek(log, file, found[nfound] - log->first, &e);
+		if (!_log_readentry(file, &e, 1))
+			_irclog_send(p, log, p->client_sock, &e, to, now);
+		free(e.text);
+	}
+
+	_logfile_endread(file, close);
+	free(found);
+	return 0;
 }
 
 /* irclog_strtoflag
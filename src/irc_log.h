@@ -31,6 +31,7 @@
 
 /* Required includes */
 #include <stdio.h>
+#include <time.h>
 
 #include "irc_net.h"
 
@@ -56,6 +57,15 @@
 #define IRC_LOG_ERROR  0x2000
 #define IRC_LOG_ALL    0x3fff
 
+/* A search of an internal log file, records must match all of it */
+typedef struct logquery {
+	const char     *text;	/* Words that must appear, or NULL */
+	const char     *from;	/* Nickname it must be from, or NULL */
+	int		event;	/* Event it must be, or IRC_LOG_NONE */
+	time_t		since;	/* Logged at or after this, or 0 */
+	unsigned long	limit;	/* Most recent matches to show, or 0 */
+} LogQuery;
+
 /* Functions to initialise internal logging */
 int irclog_maketempdir(IRCProxy *);
 int irclog_init(IRCProxy *, const char *);
@@ -73,6 +83,11 @@ int irclog_log(IRCProxy *, int, const char *, const char *, const char *, ...);
 extern int irclog_autorecall(struct ircproxy *, const char *);
 extern int irclog_recall(struct ircproxy *, const char *, long, long,
                          const char *);
+int irclog_recallsince(IRCProxy *, const char *, time_t, const char *);
+void irclog_endrecall(IRCProxy *, int);
+
+/* Search the internal log */
+int irclog_search(IRCProxy *, const char *, const LogQuery *);
 
 /* Convert numeric flags to string names and back again */
 int	    irclog_strtoflag(const char *);
@@ -51,6 +51,26 @@ static int _ircnet_client_connected(struct ircproxy *);
 static void _ircnet_acceptclient(void *, int);
 static void _ircnet_freeproxy(struct ircproxy *);
 static void _ircnet_rejoin(struct ircproxy *, void *);
+static void _ircnet_rejointimer(struct ircproxy *);
+static void _ircnet_sendjoin(struct ircproxy *, const char *, const char *);
+static void _ircnet_chanhash_rebuild(struct ircproxy *, unsigned long);
+static void _ircnet_memberhash_rebuild(struct ircproxy *, struct ircchannel *,
+                                       unsigned long);
+static struct ircmember **_ircnet_findmember(struct ircproxy *,
+                                             struct ircchannel *,
+                                             const char *);
+
+/* smallest size of a proxy's channel hash table */
+#define CHANHASH_MIN 16
+
+/* smallest size of a channel's member hash table */
+#define MEMBERHASH_MIN 16
+
+/* longest we'll back off between attempts to rejoin a channel (seconds) */
+#define REJOIN_BACKOFF_MAX 600
+
+/* longest JOIN line we'll send, not counting the \r\n */
+#define JOIN_LINE_MAX 510
 
 /* list of connection classes */
 struct ircconnclass *connclasses = 0;
@@ -217,16 +237,60 @@ struct ircproxy *ircnet_fetchclass(struct ircconnclass *class) {
   return 0;
 }
 
+/* Put every channel of a proxy into a hash table of the given size, keyed
+   on the name under the server's case mapping */
+static void _ircnet_chanhash_rebuild(struct ircproxy *p, unsigned long size) {
+  struct ircchannel *c;
+
+  free(p->chanhash);
+  p->chanhash = (struct ircchannel **)malloc(sizeof(struct ircchannel *)
+                                             * size);
+  memset(p->chanhash, 0, sizeof(struct ircchannel *) * size);
+  p->chanhashsize = size;
+
+  for (c = p->channels; c; c = c->next) {
+    unsigned long h;
+
+    h = irc_strhash(c->name, p->casemapping) % p->chanhashsize;
+    c->hash_next = p->chanhash[h];
+    p->chanhash[h] = c;
+  }
+}
+
+/* The server told us how it compares names, rehash the channels and their
+   members to match */
+void ircnet_casemapping(struct ircproxy *p, const char *name) {
+  struct ircchannel *c;
+  int casemap;
+
+  casemap = irc_casemapping(name);
+  if (casemap == p->casemapping)
+    return;
+
+  debug("Case mapping now '%s'", name);
+  p->casemapping = casemap;
+  if (p->chanhash)
+    _ircnet_chanhash_rebuild(p, p->chanhashsize);
+
+  for (c = p->channels; c; c = c->next) {
+    if (c->members)
+      _ircnet_memberhash_rebuild(p, c, c->membersize);
+  }
+}
+
 /* Fetch a channel from a proxy */
 struct ircchannel *ircnet_fetchchannel(struct ircproxy *p, const char *name) {
   struct ircchannel *c;
 
-  c = p->channels;
+  if (!p->chanhash)
+    return 0;
+
+  c = p->chanhash[irc_strhash(name, p->casemapping) % p->chanhashsize];
   while (c) {
-    if (!irc_strcasecmp(c->name, name))
+    if (!irc_strcasecmp_map(c->name, name, p->casemapping))
       return c;
 
-    c = c->next;
+    c = c->hash_next;
   }
 
   return 0;
@@ -256,6 +320,19 @@ int ircnet_addchannel(struct ircproxy *p, const char *name) {
     p->channels = c;
   }
 
+  /* Grow the table to keep about one channel in each bucket */
+  p->nchannels++;
+  if (!p->chanhash || (p->nchannels > p->chanhashsize)) {
+    _ircnet_chanhash_rebuild(p, (p->chanhash ? p->chanhashsize * 2
+                                             : CHANHASH_MIN));
+  } else {
+    unsigned long h;
+
+    h = irc_strhash(c->name, p->casemapping) % p->chanhashsize;
+    c->hash_next = p->chanhash[h];
+    p->chanhash[h] = c;
+  }
+
   /* Intialise the channel log */
   irclog_init(p, c->name);
 
@@ -271,36 +348,111 @@ int ircnet_addchannel(struct ircproxy *p, const char *name) {
 
 /* Remove a channel from a proxy */
 int ircnet_delchannel(struct ircproxy *p, const char *name) {
-  struct ircchannel *c, *l;
-
-  l = 0;
-  c = p->channels;
+  struct ircchannel *c, **l;
 
   debug("Parted channel '%s'", name);
 
-  while (c) {
-    if (!irc_strcasecmp(c->name, name)) {
-      if (l) {
-        l->next = c->next;
-      } else {
-        p->channels = c->next;
-      }
+  c = ircnet_fetchchannel(p, name);
+  if (!c) {
+    debug("    (which didn't exist)");
+    return -1;
+  }
 
-      ircnet_freechannel(c);
-      return 0;
-    } else {
-      l = c;
-      c = c->next;
+  l = &(p->chanhash[irc_strhash(c->name, p->casemapping) % p->chanhashsize]);
+  while (*l != c)
+    l = &((*l)->hash_next);
+  *l = c->hash_next;
+
+  l = &(p->channels);
+  while (*l != c)
+    l = &((*l)->next);
+  *l = c->next;
+
+  p->nchannels--;
+  ircnet_freechannel(c);
+  return 0;
+}
+
+/* What to assume about channel modes if the server doesn't tell us */
+#define DEFAULT_PREFIX_MODES "ov"
+#define DEFAULT_PREFIX_CHARS "@+"
+#define DEFAULT_CHANMODES "beIO,k,l,aimnpqrst"
+
+/* Find which kind of channel mode a mode character is, as given in the
+   CHANMODES=A,B,C,D parameter of 005.  A modes are lists and always have a
+   parameter, B modes always have one, C modes only have one when being set
+   and D modes never have one. */
+static char _ircnet_modetype(struct ircproxy *p, char mode) {
+  const char *ptr;
+  char type;
+
+  type = 'A';
+  for (ptr = (p->chanmodes ? p->chanmodes : DEFAULT_CHANMODES); *ptr; ptr++) {
+    if (*ptr == ',') {
+      type++;
+    } else if (*ptr == mode) {
+      return type;
     }
   }
 
-  debug("    (which didn't exist)");
-  return -1;
+  return 'D';
+}
+
+/* Add or remove a mode letter from a channel's list of them */
+static void _ircnet_setmode(struct ircchannel *c, char mode, int add) {
+  char *ptr;
+
+  ptr = (c->modes ? strchr(c->modes, mode) : 0);
+  if (add && !ptr) {
+    size_t len;
+
+    len = (c->modes ? strlen(c->modes) : 0);
+    c->modes = (char *)realloc(c->modes, len + 2);
+    c->modes[len] = mode;
+    c->modes[len + 1] = 0;
+  } else if (!add && ptr) {
+    memmove(ptr, ptr + 1, strlen(ptr));
+  }
+}
+
+/* Give or take away a member's status prefix, keeping them in order */
+static void _ircnet_setprefix(struct ircproxy *p, struct ircchannel *c,
+                              const char *nick, char prefix, int add) {
+  struct ircmember **l, *m;
+  const char *chars, *cp;
+  char *tmp, *ptr;
+
+  if (!(l = _ircnet_findmember(p, c, nick)))
+    return;
+  m = *l;
+
+  ptr = strchr(m->prefixes, prefix);
+  if (!add) {
+    if (ptr)
+      memmove(ptr, ptr + 1, strlen(ptr));
+    return;
+  } else if (ptr) {
+    return;
+  }
+
+  /* Rebuild the prefixes in the order the server ranks them */
+  chars = (p->prefix_chars ? p->prefix_chars : DEFAULT_PREFIX_CHARS);
+  tmp = (char *)malloc(strlen(m->prefixes) + 2);
+  ptr = tmp;
+  for (cp = chars; *cp; cp++) {
+    if ((*cp == prefix) || strchr(m->prefixes, *cp))
+      *(ptr++) = *cp;
+  }
+  *ptr = 0;
+
+  free(m->prefixes);
+  m->prefixes = tmp;
 }
 
 /* Got a channel mode change */
 int ircnet_channel_mode(struct ircproxy *p, struct ircchannel *c,
                         struct ircmessage *msg, int modes) {
+  const char *pmodes, *pchars;
   int add = 1;
   int param;
   char *ptr;
@@ -312,41 +464,63 @@ int ircnet_channel_mode(struct ircproxy *p, struct ircchannel *c,
   ptr = msg->params[modes];
   param = modes + 1;
 
+  pmodes = (p->prefix_modes ? p->prefix_modes : DEFAULT_PREFIX_MODES);
+  pchars = (p->prefix_chars ? p->prefix_chars : DEFAULT_PREFIX_CHARS);
+
   while (*ptr) {
-    switch (*ptr) {
-      case '+':
-        add = 1;
-        break;
-      case '-':
-        add = 0;
-        break;
-      /* RFC2812 modes that have a parameter */
-      case 'O':
-      case 'o':
-      case 'v':
-      case 'b':
-      case 'e':
-      case 'I':
-      case 'l':
-        param++;
-        break;
-      /* Channel key */  
-      case 'k':
-        if (add) {
-          if (msg->numparams >= (param + 1)) {
-            debug("Set channel '%s' key '%s'", c->name, msg->params[param]);
-            free(c->key);
-            c->key = x_strdup(msg->params[param]);
-          } else {
-            debug("Bad mode from server, said +k without a key");
-          }
-        } else if (c->key) {
-          debug("Remove channel '%s' key");
+    const char *pm;
+
+    if (*ptr == '+') {
+      add = 1;
+
+    } else if (*ptr == '-') {
+      add = 0;
+
+    } else if ((pm = strchr(pmodes, *ptr))) {
+      /* Someone's status on the channel */
+      if ((param < msg->numparams) && ((size_t)(pm - pmodes) < strlen(pchars)))
+        _ircnet_setprefix(p, c, msg->params[param], pchars[pm - pmodes], add);
+      param++;
+
+    } else if (*ptr == 'k') {
+      /* Channel key */
+      if (add) {
+        if (msg->numparams >= (param + 1)) {
+          debug("Set channel '%s' key '%s'", c->name, msg->params[param]);
           free(c->key);
-          c->key = 0;
+          c->key = x_strdup(msg->params[param]);
+        } else {
+          debug("Bad mode from server, said +k without a key");
         }
-        param++;
-        break;
+      } else if (c->key) {
+        debug("Remove channel '%s' key");
+        free(c->key);
+        c->key = 0;
+      }
+      _ircnet_setmode(c, *ptr, add);
+      param++;
+
+    } else {
+      switch (_ircnet_modetype(p, *ptr)) {
+        case 'A':
+          /* Lists, we don't keep those */
+          param++;
+          break;
+        case 'B':
+          _ircnet_setmode(c, *ptr, add);
+          param++;
+          break;
+        case 'C':
+          if (add && (*ptr == 'l') && (param < msg->numparams))
+            c->limit = atol(msg->params[param]);
+          _ircnet_setmode(c, *ptr, add);
+          if (add)
+            param++;
+          break;
+        default:
+          _ircnet_setmode(c, *ptr, add);
+          break;
+      }
     }
 
     ptr++;
@@ -355,6 +529,207 @@ int ircnet_channel_mode(struct ircproxy *p, struct ircchannel *c,
   return 0;
 }
 
+/* Got a channel topic, setter is who set it and when.  The topic can be
+   the one already stored, to only change who set it. */
+void ircnet_channel_topic(struct ircchannel *c, const char *topic,
+                          const char *setter, time_t when) {
+  if (topic != c->topic) {
+    free(c->topic);
+    c->topic = (topic && strlen(topic) ? x_strdup(topic) : 0);
+  }
+
+  if (setter) {
+    free(c->topic_setter);
+    c->topic_setter = x_strdup(setter);
+    c->topic_time = when;
+  }
+}
+
+/* Got a line of channel members, a list of nicknames each preceded by the
+   prefixes for their status.  The first line since the end of the last list
+   starts a new one. */
+void ircnet_channel_names(struct ircproxy *p, struct ircchannel *c, char type,
+                          const char *names) {
+  const char *chars;
+
+  if (!c->names_pending) {
+    ircnet_channel_resetnames(c);
+    c->names_pending = 1;
+  }
+  c->names_type = type;
+
+  chars = (p->prefix_chars ? p->prefix_chars : DEFAULT_PREFIX_CHARS);
+  while (*names) {
+    size_t plen, nlen;
+    char *prefixes, *nick;
+
+    names += strspn(names, " ");
+    plen = strspn(names, chars);
+    nlen = strcspn(names + plen, " ");
+    if (!nlen) {
+      names += plen;
+      continue;
+    }
+
+    prefixes = x_strdup(names);
+    prefixes[plen] = 0;
+    nick = x_strdup(names + plen);
+    nick[strcspn(nick, " !")] = 0;
+
+    ircnet_channel_addmember(p, c, nick, prefixes);
+    free(prefixes);
+    free(nick);
+
+    names += plen + nlen;
+  }
+}
+
+/* Forget the members of a channel, the hash table is kept for the next
+   list */
+void ircnet_channel_resetnames(struct ircchannel *c) {
+  unsigned long i;
+
+  for (i = 0; i < c->membersize; i++) {
+    while (c->members[i]) {
+      struct ircmember *m;
+
+      m = c->members[i];
+      c->members[i] = m->next;
+      free(m->nick);
+      free(m->prefixes);
+      free(m);
+    }
+  }
+
+  c->nmembers = 0;
+  c->names_pending = c->names_known = 0;
+}
+
+/* Put every member of a channel into a hash table of the given size, keyed
+   on the nickname under the server's case mapping */
+static void _ircnet_memberhash_rebuild(struct ircproxy *p, struct ircchannel *c,
+                                       unsigned long size) {
+  struct ircmember **old;
+  unsigned long oldsize, i;
+
+  old = c->members;
+  oldsize = c->membersize;
+  c->members = (struct ircmember **)malloc(sizeof(struct ircmember *) * size);
+  memset(c->members, 0, sizeof(struct ircmember *) * size);
+  c->membersize = size;
+
+  for (i = 0; i < oldsize; i++) {
+    while (old[i]) {
+      struct ircmember *m;
+      unsigned long h;
+
+      m = old[i];
+      old[i] = m->next;
+
+      h = irc_strhash(m->nick, p->casemapping) % c->membersize;
+      m->next = c->members[h];
+      c->members[h] = m;
+    }
+  }
+  free(old);
+}
+
+/* Find where a member of a channel is in its hash table, so they can be
+   taken out of it.  Returns 0 if they aren't on the channel. */
+static struct ircmember **_ircnet_findmember(struct ircproxy *p,
+                                             struct ircchannel *c,
+                                             const char *nick) {
+  struct ircmember **l;
+
+  if (!c->members)
+    return 0;
+
+  l = &(c->members[irc_strhash(nick, p->casemapping) % c->membersize]);
+  while (*l) {
+    if (!irc_strcasecmp_map((*l)->nick, nick, p->casemapping))
+      return l;
+
+    l = &((*l)->next);
+  }
+
+  return 0;
+}
+
+/* Someone joined a channel */
+int ircnet_channel_addmember(struct ircproxy *p, struct ircchannel *c,
+                             const char *nick, const char *prefixes) {
+  struct ircmember *m;
+  unsigned long h;
+
+  if (_ircnet_findmember(p, c, nick))
+    return 0;
+
+  m = (struct ircmember *)malloc(sizeof(struct ircmember));
+  m->nick = x_strdup(nick);
+  m->prefixes = x_strdup(prefixes);
+
+  /* Grow the table to keep about one member in each bucket */
+  c->nmembers++;
+  if (!c->members || (c->nmembers > c->membersize))
+    _ircnet_memberhash_rebuild(p, c, (c->members ? c->membersize * 2
+                                                 : MEMBERHASH_MIN));
+
+  h = irc_strhash(m->nick, p->casemapping) % c->membersize;
+  m->next = c->members[h];
+  c->members[h] = m;
+
+  return 0;
+}
+
+/* Someone left a channel */
+int ircnet_channel_delmember(struct ircproxy *p, struct ircchannel *c,
+                             const char *nick) {
+  struct ircmember **l, *m;
+
+  if (!(l = _ircnet_findmember(p, c, nick)))
+    return -1;
+
+  m = *l;
+  *l = m->next;
+  c->nmembers--;
+
+  free(m->nick);
+  free(m->prefixes);
+  free(m);
+  return 0;
+}
+
+/* Someone left IRC, so they've left every channel */
+void ircnet_delmember(struct ircproxy *p, const char *nick) {
+  struct ircchannel *c;
+
+  for (c = p->channels; c; c = c->next)
+    ircnet_channel_delmember(p, c, nick);
+}
+
+/* Someone changed their nickname, which moves them in the hash table */
+void ircnet_renamemember(struct ircproxy *p, const char *oldnick,
+                         const char *newnick) {
+  struct ircchannel *c;
+
+  for (c = p->channels; c; c = c->next) {
+    struct ircmember **l, *m;
+    unsigned long h;
+
+    if (!(l = _ircnet_findmember(p, c, oldnick)))
+      continue;
+
+    m = *l;
+    *l = m->next;
+    free(m->nick);
+    m->nick = x_strdup(newnick);
+
+    h = irc_strhash(m->nick, p->casemapping) % c->membersize;
+    m->next = c->members[h];
+    c->members[h] = m;
+  }
+}
+
 /* Free an ircchannel structure, returns the next */
 struct ircchannel *ircnet_freechannel(struct ircchannel *chan) {
   struct ircchannel *ret;
@@ -362,8 +737,13 @@ struct ircchannel *ircnet_freechannel(struct ircchannel *chan) {
   ret = chan->next;
 
   irclog_free(&(chan->log));
+  ircnet_channel_resetnames(chan);
+  free(chan->members);
   free(chan->name);
   free(chan->key);
+  free(chan->topic);
+  free(chan->topic_setter);
+  free(chan->modes);
   free(chan);
 
   return ret;
@@ -401,6 +781,9 @@ static void _ircnet_freeproxy(struct ircproxy *p) {
   free(p->serverumodes);
   free(p->servercmodes);
   free(p->serverpassword);
+  free(p->prefix_modes);
+  free(p->prefix_chars);
+  free(p->chanmodes);
 
   free(p->password);
 
@@ -414,6 +797,7 @@ static void _ircnet_freeproxy(struct ircproxy *p) {
     while (c)
       c = ircnet_freechannel(c);
   }
+  free(p->chanhash);
 
   if (p->squelch_modes) {
     struct strlist *s;
@@ -429,6 +813,11 @@ static void _ircnet_freeproxy(struct ircproxy *p) {
     }
   }
 
+  irclog_endrecall(p, -1);
+  ircclient_freeburst(p);
+  ircserver_freerace(p);
+  ircserver_freesendq(p);
+  ircserver_unqueue(p);
   irclog_free(&(p->private_log));
   irclog_free(&(p->server_log));
   irclog_closetempdir(p);
@@ -516,6 +905,7 @@ void ircnet_freeconnclass(struct ircconnclass *class) {
   free(class->dcc_tunnel_outgoing);
   free(class->switch_user);
   free(class->motd_file);
+  free(class->motd_text);
 
   free(class->orig_local_address);
   free(class->nickserv_password);
@@ -556,37 +946,148 @@ void ircnet_freeconnclass(struct ircconnclass *class) {
   free(class);
 }
 
-/* hook to rejoin a channel after a kick */
+/* Send a JOIN for a list of channels and their keys */
+static void _ircnet_sendjoin(struct ircproxy *p, const char *chans,
+                             const char *keys) {
+  if (keys[0]) {
+    ircserver_send_bulk(p, "JOIN", "%s :%s", chans, keys);
+  } else {
+    ircserver_send_bulk(p, "JOIN", ":%s", chans);
+  }
+}
+
+/* Send JOINs for every channel marked as joining, with as many channels on
+   each line as will fit and the server allows.  Channels with keys go first
+   so the keys line up. */
+int ircnet_sendjoins(struct ircproxy *p) {
+  char chans[JOIN_LINE_MAX + 1], keys[JOIN_LINE_MAX + 1];
+  struct ircchannel *c;
+  long ntargets, joined;
+  int pass;
+
+  /* Count what we're on already so we don't go over the server's limit */
+  joined = 0;
+  for (c = p->channels; c; c = c->next) {
+    if (!c->joining && !c->inactive && !c->unjoined)
+      joined++;
+  }
+
+  chans[0] = keys[0] = 0;
+  ntargets = 0;
+  for (pass = 0; pass < 2; pass++) {
+    for (c = p->channels; c; c = c->next) {
+      size_t len;
+
+      if (!c->joining || (pass ? (c->key != 0) : (c->key == 0)))
+        continue;
+      c->joining = 0;
+      c->rejoin_time = 0;
+
+      if (p->maxchannels && (joined >= p->maxchannels)) {
+        debug("Not joining '%s', already on %ld channels", c->name, joined);
+        c->unjoined = 1;
+        continue;
+      }
+      joined++;
+
+      /* Too long to ever fit on a line */
+      if (7 + strlen(c->name) + (c->key ? strlen(c->key) + 1 : 0)
+          > JOIN_LINE_MAX)
+        continue;
+
+      /* No room on this line, send it and start another */
+      len = 5 + strlen(chans) + 1 + strlen(c->name);
+      if (keys[0] || c->key)
+        len += 1 + strlen(keys) + 1 + (c->key ? strlen(c->key) : 0);
+      if (ntargets && ((len > JOIN_LINE_MAX)
+                       || (p->join_targmax
+                           && (ntargets >= p->join_targmax)))) {
+        _ircnet_sendjoin(p, chans, keys);
+        chans[0] = keys[0] = 0;
+        ntargets = 0;
+      }
+
+      if (chans[0])
+        strcat(chans, ",");
+      strcat(chans, c->name);
+      if (c->key) {
+        if (keys[0])
+          strcat(keys, ",");
+        strcat(keys, c->key);
+      }
+      ntargets++;
+    }
+  }
+
+  if (ntargets)
+    _ircnet_sendjoin(p, chans, keys);
+
+  return 0;
+}
+
+/* Set the timer for the next channel due to be rejoined, if any */
+static void _ircnet_rejointimer(struct ircproxy *p) {
+  struct ircchannel *c;
+  time_t next;
+
+  next = 0;
+  for (c = p->channels; c; c = c->next) {
+    if (c->rejoin_time && (!next || (c->rejoin_time < next)))
+      next = c->rejoin_time;
+  }
+
+  if (timer_exists((void *)p, "channel_rejoin"))
+    timer_del((void *)p, "channel_rejoin");
+  if (next)
+    timer_new((void *)p, "channel_rejoin",
+              (next > time(0) ? next - time(0) : 0),
+              TIMER_FUNCTION(_ircnet_rejoin), 0);
+}
+
+/* hook to rejoin channels after a kick, all those that are due are joined
+   together */
 static void _ircnet_rejoin(struct ircproxy *p, void *data) {
   struct ircchannel *c;
+  time_t now;
 
-  debug("Rejoining '%s'", (char *)data);
-  c = ircnet_fetchchannel(p, (char *)data);
-  if (c) {
-    if (c->key) {
-      ircserver_send_command(p, "JOIN", "%s :%s", c->name, c->key);
-    } else {
-      ircserver_send_command(p, "JOIN", ":%s", c->name);
+  now = time(0);
+  for (c = p->channels; c; c = c->next) {
+    if (c->rejoin_time && (c->rejoin_time <= now)) {
+      debug("Rejoining '%s'", c->name);
+      c->joining = 1;
     }
-  } else {
-    ircserver_send_command(p, "JOIN", ":%s", (char *)data);
   }
 
-  free(data);
+  if (p->server_status == IRC_SERVER_ACTIVE)
+    ircnet_sendjoins(p);
+  _ircnet_rejointimer(p);
 }
 
-/* Set a timer to rejoin a channel */
+/* Schedule a channel to be rejoined, waiting twice as long each time it
+   fails until we get back in */
 int ircnet_rejoin(struct ircproxy *p, const char *name) {
-  char *str;
-
-  str = x_strdup(name);
-  if (p->conn_class->channel_rejoin == 0) {
-    _ircnet_rejoin(p, (void *)str);
-  } else if (p->conn_class->channel_rejoin > 0) {
-    debug("Will rejoin '%s' in %d seconds", str, p->conn_class->channel_rejoin);
-    timer_new((void *)p, 0, p->conn_class->channel_rejoin,
-              TIMER_FUNCTION(_ircnet_rejoin), (void *)str);
-  } 
+  struct ircchannel *c;
+  long delay;
+  int i;
+
+  if (p->conn_class->channel_rejoin < 0)
+    return 0;
+
+  c = ircnet_fetchchannel(p, name);
+  if (!c)
+    return -1;
+
+  delay = p->conn_class->channel_rejoin;
+  for (i = 0; (i < c->rejoin_attempts) && (delay < REJOIN_BACKOFF_MAX); i++)
+    delay = (delay ? delay * 2 : 1);
+  if ((delay > REJOIN_BACKOFF_MAX)
+      && (p->conn_class->channel_rejoin < REJOIN_BACKOFF_MAX))
+    delay = REJOIN_BACKOFF_MAX;
+  c->rejoin_attempts++;
+
+  debug("Will rejoin '%s' in %ld seconds", c->name, delay);
+  c->rejoin_time = time(0) + delay;
+  _ircnet_rejointimer(p);
 
   return 0;
 }
@@ -26,11 +26,24 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include "irc_prot.h"
 #include "stringex.h"
 #include "net.h"
 
+/* strings a log file's records refer to by id rather than carrying a copy
+   of the text */
+typedef struct logstrings {
+  char **str;
+  unsigned long nstr, strsz;
+
+  unsigned long *hash;
+  unsigned long hashsz;
+
+  unsigned long compacted;
+} LogStrings;
+
 /* a log file - there are good reasons why this isn't defined in irc_log.h */
 typedef struct logfile {
   int open, made;
@@ -40,8 +53,40 @@ typedef struct logfile {
   unsigned long nlines, maxlines;
 
   int always;
+
+  time_t last;
+  struct logstrings strings;
+  unsigned char *strdef;
+  unsigned long strdefsz;
+
+  struct logindex *index;
+  unsigned long nindex, indexsz;
+
+  unsigned long first;
+  struct logsearch *search;
 } LogFile;
 
+/* a point in a log file we can seek straight to, without reading the
+   records before it */
+struct logindex {
+  long offset;
+  time_t base, when;
+};
+
+/* classes of line going to the server, most important first */
+#define SENDQ_CONTROL     0
+#define SENDQ_INTERACTIVE 1
+#define SENDQ_BULK        2
+#define SENDQ_CLASSES     3
+
+/* how one class of the server send queue is doing, waits in milliseconds */
+typedef struct sendqclass {
+  unsigned long queued, queued_bytes;
+  unsigned long sent;
+  unsigned long wait_total;
+  long wait_longest;
+} SendQClass;
+
 /* a description of an authorised connction */
 typedef struct ircconnclass {
   char *server_port;
@@ -49,7 +94,10 @@ typedef struct ircconnclass {
   long server_dnsretry;
   long server_maxattempts;
   long server_maxinitattempts;
+  long server_race;
+  long server_race_delay;
   int server_keepalive;
+  long server_timeout;
   long server_pingtimeout;
   long *server_throttle;
   int server_autoconnect;
@@ -62,6 +110,7 @@ typedef struct ircconnclass {
 
   int disconnect_existing;
   int disconnect_on_detach;
+  int multiple_clients;
 
   char *initial_modes;
   char *drop_modes;
@@ -85,6 +134,9 @@ typedef struct ircconnclass {
   int log_events;
   int log_timestamp;
   int log_relativetime;
+  int log_recall_since_detach;
+  int log_search;
+  long log_recall_queue;
   char *log_dir;
   char *log_program;
 
@@ -109,8 +161,12 @@ typedef struct ircconnclass {
   size_t dcc_proxy_ports_sz;
   long dcc_proxy_timeout;
   int dcc_proxy_sendreject;
+  long dcc_proxy_maxrate;
+  long dcc_proxy_classrate;
+  long dcc_proxy_weight;
 
   int dcc_send_fast;
+  long dcc_send_window;
 
   char *dcc_capture_directory;
   int dcc_capture_always;
@@ -153,9 +209,32 @@ typedef struct ircconnclass {
    
   char *orig_local_address;
 
+  char *motd_text;
+  time_t motd_mtime;
+
   struct ircconnclass *next;
 } IRCConnClass;
 
+/* the welcome numerics and start of the MOTD rendered ready to send, and
+   what they were rendered for */
+typedef struct ircburst {
+  char *nickname, *servername;
+  time_t motd_mtime;
+
+  char *welcome, *motd;
+  int welcomelen, motdlen;
+} IRCBurst;
+
+/* someone on a channel, and the prefixes (@, + etc.) showing their status,
+   highest first.  next is the next member in the same bucket of the
+   channel's member hash table. */
+typedef struct ircmember {
+  char *nick;
+  char *prefixes;
+
+  struct ircmember *next;
+} IRCMember;
+
 /* a channel someone is on */
 typedef struct ircchannel {
   char *name;
@@ -164,9 +243,35 @@ typedef struct ircchannel {
   int unjoined;
   struct logfile log;
 
+  char *topic, *topic_setter;
+  time_t topic_time;
+
+  char *modes;
+  long limit;
+  int modes_known;
+
+  char names_type;
+  struct ircmember **members;
+  unsigned long membersize, nmembers;
+  int names_pending, names_known;
+
+  int joining;
+  int rejoin_attempts;
+  time_t rejoin_time;
+
+  struct ircchannel *hash_next;
   struct ircchannel *next;
 } IRCChannel;
 
+/* another client attached to a proxy alongside the one it's talking to */
+typedef struct ircattach {
+  int sock;
+  SOCKADDR addr;
+  char *host;
+
+  struct ircattach *next;
+} IRCAttach;
+
 /* a proxied connection */
 typedef struct ircproxy {
   int dead;
@@ -178,11 +283,21 @@ typedef struct ircproxy {
   int client_status;
   SOCKADDR client_addr;
   char *client_host;
+  struct ircattach *attached;
+  int client_only;
 
   int server_sock;
   int server_status;
   SOCKADDR server_addr;
   long server_attempts;
+  struct serverrace *race;
+  struct sendqueue *sendq;
+  struct sendqclass sendq_stats[SENDQ_CLASSES];
+
+  struct timeval ping_sent;
+  int ping_outstanding, ping_heard;
+  long server_rtt, server_rttvar;
+  unsigned long rtt_samples;
 
   char *nickname;
   char *setnickname;
@@ -197,6 +312,9 @@ typedef struct ircproxy {
   char *servercmodes;
   char *serverpassword;
   struct strlist *serversupported;
+  char *prefix_modes, *prefix_chars;
+  char *chanmodes;
+  long join_targmax, maxchannels;
 
   char *password;
 
@@ -211,9 +329,15 @@ typedef struct ircproxy {
   char *awaymessage;
   char *modes;
   struct ircchannel *channels;
+  struct ircchannel **chanhash;
+  unsigned long chanhashsize, nchannels;
+  int casemapping;
 
   char *temp_logdir;
+  time_t detach_time;
   struct logfile private_log, server_log;
+  struct logrecall *recalls, *recalls_last;
+  struct ircburst burst;
 
   struct ircproxy *next;
 } IRCProxy;
@@ -231,6 +355,7 @@ struct dcc_resume {
 #else
    uint32_t size;
 #endif   
+  uint32_t total;
   struct in_addr r_addr;
   struct dcc_resume *next; 
 };
@@ -273,12 +398,26 @@ extern void ircnet_freeconnclass(struct ircconnclass *);
 extern int ircnet_hooksocket(int);
 extern struct ircproxy *ircnet_fetchclass(struct ircconnclass *);
 extern struct ircchannel *ircnet_fetchchannel(struct ircproxy *, const char *);
+extern void ircnet_casemapping(struct ircproxy *, const char *);
 extern int ircnet_addchannel(struct ircproxy *, const char *);
 extern int ircnet_delchannel(struct ircproxy *, const char *);
 extern int ircnet_channel_mode(struct ircproxy *, struct ircchannel *,
                                struct ircmessage *, int);
+extern void ircnet_channel_topic(struct ircchannel *, const char *,
+                                 const char *, time_t);
+extern void ircnet_channel_names(struct ircproxy *, struct ircchannel *,
+                                 char, const char *);
+extern void ircnet_channel_resetnames(struct ircchannel *);
+extern int ircnet_channel_addmember(struct ircproxy *, struct ircchannel *,
+                                    const char *, const char *);
+extern int ircnet_channel_delmember(struct ircproxy *, struct ircchannel *,
+                                    const char *);
+extern void ircnet_delmember(struct ircproxy *, const char *);
+extern void ircnet_renamemember(struct ircproxy *, const char *,
+                                const char *);
 extern struct ircchannel *ircnet_freechannel(struct ircchannel *);
 extern int ircnet_rejoin(struct ircproxy *, const char *);
+extern int ircnet_sendjoins(struct ircproxy *);
 extern int ircnet_dedicate(struct ircproxy *);
 extern int ircnet_announce_dedicated(struct ircproxy *);
 extern int ircnet_announce_nolisten(struct ircproxy *);
@@ -8,7 +8,7 @@
  * 
  * 
  * irc_prot.c
- *  - IRC protocol message parsing
+ *  - IRC protocol message parsing into the message arena
  *  - IRC x!y@z parsing
  *  - CTCP stripping and dequoting
  *  - CTCP message parsing
@@ -26,6 +26,7 @@
 
 #include <dircproxy.h>
 #include "sprintf.h"
+#include "arena.h"
 #include "stringex.h"
 #include "irc_prot.h"
 #include "irc_string.h"
@@ -37,20 +38,20 @@ static int _ircprot_get_params(char *, char ***, char ***);
 static char *_ircprot_skip_spaces(char *);
 static char *_ircprot_ctcpdequote(const char *);
 
-/* Parse an IRC message. num of params or -1 if no command */
+/* Parse an IRC message. num of params or -1 if no command.  Everything in
+   the message is allocated from the arena, so is gone once the caller
+   releases it. */
 int ircprot_parsemsg(const char *message, struct ircmessage *msg) {
   char *start, *ptr;
 
   /* Copy the original message as well */
-  ptr = start = msg->orig = x_strdup(message);
+  ptr = start = msg->orig = arena_strdup(message);
 
   /* Begins with a prefix? */
   if (*ptr == ':') {
     while (*ptr && (*ptr != ' ')) ptr++;
 
-    msg->src.orig = (char *)malloc(ptr - start);
-    strncpy(msg->src.orig, start + 1, ptr - start - 1);
-    msg->src.orig[ptr - start - 1] = 0;
+    msg->src.orig = arena_strndup(start + 1, ptr - start - 1);
 
     _ircprot_parse_prefix(msg->src.orig, &(msg->src));
 
@@ -63,31 +64,23 @@ int ircprot_parsemsg(const char *message, struct ircmessage *msg) {
   }
 
   /* No command? */
-  if (!*ptr) {
-    free(msg->src.name);
-    free(msg->src.username);
-    free(msg->src.hostname);
-    free(msg->src.fullname);
-    free(msg->src.orig);
-    free(msg->orig);
+  if (!*ptr)
     return -1;
-  }
 
   /* Take the command off the front */
   start = ptr;
   while (*ptr && (*ptr != ' ')) ptr++;
 
-  msg->cmd = (char *)malloc(ptr - start + 1);
-  strncpy(msg->cmd, start, ptr - start);
-  msg->cmd[ptr - start] = 0;
+  msg->cmd = arena_strndup(start, ptr - start);
 
   ptr = _ircprot_skip_spaces(ptr);
 
   /* Now do the parameters */
   msg->numparams = _ircprot_count_params(ptr);
   if (msg->numparams) {
-    msg->params = (char **)malloc(sizeof(char *) * msg->numparams);
-    msg->paramstarts = (char **)malloc(sizeof(char *) * msg->numparams);
+    msg->params = (char **)arena_alloc(sizeof(char *) * msg->numparams);
+    msg->paramstarts = (char **)arena_alloc(sizeof(char *)
+                                            * msg->numparams);
     _ircprot_get_params(ptr, &(msg->params), &(msg->paramstarts));
   } else {
     msg->params = 0;
@@ -97,24 +90,6 @@ int ircprot_parsemsg(const char *message, struct ircmessage *msg) {
   return msg->numparams;
 }
 
-/* Free an IRC message */
-void ircprot_freemsg(struct ircmessage *msg) {
-  int i;
-
-  for (i = 0; i < msg->numparams; i++)
-    free(msg->params[i]);
-
-  free(msg->src.name);
-  free(msg->src.username);
-  free(msg->src.hostname);
-  free(msg->src.fullname);
-  free(msg->src.orig);
-  free(msg->cmd);
-  free(msg->params);
-  free(msg->paramstarts);
-  free(msg->orig);
-}
-
 /* Parse a prefix from an irc message */
 static int _ircprot_parse_prefix(char *prefix, struct ircsource *source) {
   char *str, *ptr;
@@ -125,33 +100,29 @@ static int _ircprot_parse_prefix(char *prefix, struct ircsource *source) {
     source->type = IRC_USER;
     source->username = source->hostname = 0;
 
-    source->name = (char *)malloc(ptr - str + 1);
-    strncpy(source->name, str, ptr - str);
-    source->name[ptr - str] = 0;
+    source->name = arena_strndup(str, ptr - str);
     str = ptr + 1;
 
     ptr = strchr(str, '@');
     if (ptr) {
-      source->username = (char *)malloc(ptr - str + 1);
-      strncpy(source->username, str, ptr - str);
-      source->username[ptr - str] = 0;
+      source->username = arena_strndup(str, ptr - str);
       str = ptr + 1;
 
-      source->hostname = x_strdup(str);
+      source->hostname = arena_strdup(str);
     } else {
       source->type = IRC_EITHER;
     }
   } else {
     source->type = IRC_EITHER;
     source->username = source->hostname = 0;
-    source->name = x_strdup(str);
+    source->name = arena_strdup(str);
   }
 
   if (source->name && source->username && source->hostname) {
-    source->fullname = x_sprintf("%s (%s@%s)", source->name,
-                                 source->username, source->hostname);
+    source->fullname = arena_sprintf("%s (%s@%s)", source->name,
+                                     source->username, source->hostname);
   } else {
-    source->fullname = x_strdup(source->name);
+    source->fullname = source->name;
   }
 
   return source->type;
@@ -187,7 +158,7 @@ static int _ircprot_get_params(char *message, char ***params,
 
   while (*ptr) {
     if (*ptr == ':') {
-      (*params)[param] = x_strdup(ptr + 1);
+      (*params)[param] = arena_strdup(ptr + 1);
       (*paramstarts)[param] = ptr + 1;
       break;
     } else {
@@ -195,9 +166,7 @@ static int _ircprot_get_params(char *message, char ***params,
 
       while (*ptr && (*ptr != ' ')) ptr++;
 
-      (*params)[param] = (char *)malloc(ptr - start + 1);
-      strncpy((*params)[param], start, ptr - start);
-      (*params)[param][ptr - start] = 0;
+      (*params)[param] = arena_strndup(start, ptr - start);
 
       ptr = _ircprot_skip_spaces(ptr);
 
@@ -220,12 +189,13 @@ static char *_ircprot_skip_spaces(char *ptr) {
     return ptr;
 }
 
-/* Returns a new string that's the dequoted version of the old one */
+/* Returns a new string in the arena that's the dequoted version of the old
+   one */
 static char *_ircprot_ctcpdequote(const char *msg) {
-  char *new, *out, *in, *ret;
+  char *new, *out, *in;
   int quote = 0;
 
-  in = out = new = x_strdup(msg);
+  in = out = new = arena_strdup(msg);
   while (*in) {
     if (quote) {
       if (*in == 'a') {
@@ -247,14 +217,12 @@ static char *_ircprot_ctcpdequote(const char *msg) {
   }
   *out = 0;
 
-  ret = x_strdup(new);
-  free(new);
-  return ret;
+  return new;
 }
 
 /* Strip embedded CTCP messages from a string, placing the new string in the
  * newmsg pointer and a strlist of the ctcp's that were found in the list
- * pointer */
+ * pointer.  Both are allocated from the arena. */
 void ircprot_stripctcp(const char *msg, char **newmsg, struct strlist **list) {
   char *copy, *in, *out, *start = 0;
   int ctcp = 0;
@@ -262,7 +230,7 @@ void ircprot_stripctcp(const char *msg, char **newmsg, struct strlist **list) {
   if (list)
     *list = 0;
 
-  in = out = copy = x_strdup(msg);
+  in = out = copy = arena_strdup(msg);
   while (*in) {
     if (*in == 0x01) {
       if (ctcp) {
@@ -273,8 +241,8 @@ void ircprot_stripctcp(const char *msg, char **newmsg, struct strlist **list) {
         if (strlen(start + 1) && list) {
           struct strlist *s;
 
-          s = (struct strlist *)malloc(sizeof(struct strlist));
-          s->str = x_strdup(start + 1);
+          s = (struct strlist *)arena_alloc(sizeof(struct strlist));
+          s->str = arena_strdup(start + 1);
           s->next = 0;
                                           
           if (*list) {
@@ -302,11 +270,11 @@ void ircprot_stripctcp(const char *msg, char **newmsg, struct strlist **list) {
   *out = 0;
 
   if (newmsg)
-    *newmsg = x_strdup(copy);
-  free(copy);
+    *newmsg = copy;
 }
 
-/* Parse an CTCP message. num of params or -1 if no command */
+/* Parse an CTCP message into the arena. num of params or -1 if no
+   command */
 int ircprot_parsectcp(const char *message, struct ctcpmessage *cmsg) {
   char *start, *ptr;
 
@@ -314,16 +282,12 @@ int ircprot_parsectcp(const char *message, struct ctcpmessage *cmsg) {
   ptr = start = cmsg->orig = _ircprot_ctcpdequote(message);
 
   /* No command? */
-  if (!*ptr) {
-    free(cmsg->orig);
+  if (!*ptr)
     return -1;
-  }
 
   /* Take the command off the front */
   ptr += strcspn(ptr, " ");
-  cmsg->cmd = (char *)malloc(ptr - start + 1);
-  strncpy(cmsg->cmd, start, ptr - start);
-  cmsg->cmd[ptr - start] = 0;
+  cmsg->cmd = arena_strndup(start, ptr - start);
   irc_strupr(cmsg->cmd);
 
   /* Get the parameters */
@@ -339,8 +303,9 @@ int ircprot_parsectcp(const char *message, struct ctcpmessage *cmsg) {
       cmsg->numparams++;
     }
 
-    cmsg->params = (char **)malloc(sizeof(char *) * cmsg->numparams);
-    cmsg->paramstarts = (char **)malloc(sizeof(char *) * cmsg->numparams);
+    cmsg->params = (char **)arena_alloc(sizeof(char *) * cmsg->numparams);
+    cmsg->paramstarts = (char **)arena_alloc(sizeof(char *)
+                                             * cmsg->numparams);
 
     p = 0;
     ptr = start;
@@ -348,9 +313,7 @@ int ircprot_parsectcp(const char *message, struct ctcpmessage *cmsg) {
       ptr += strcspn(ptr, " ");
 
       cmsg->paramstarts[p] = start;
-      cmsg->params[p] = (char *)malloc(ptr - start + 1);
-      strncpy(cmsg->params[p], start, ptr - start);
-      cmsg->params[p][ptr - start] = 0;
+      cmsg->params[p] = arena_strndup(start, ptr - start);
 
       ptr += strspn(ptr, " ");
       start = ptr;
@@ -366,19 +329,6 @@ int ircprot_parsectcp(const char *message, struct ctcpmessage *cmsg) {
   return cmsg->numparams;
 }
 
-/* Free an CTCP message */
-void ircprot_freectcp(struct ctcpmessage *cmsg) {
-  int i;
-
-  for (i = 0; i < cmsg->numparams; i++)
-    free(cmsg->params[i]);
-
-  free(cmsg->cmd);
-  free(cmsg->params);
-  free(cmsg->paramstarts);
-  free(cmsg->orig);
-}
-
 /* Strip silly characters from a username */
 char *ircprot_sanitize_username(const char *str) {
   char *ret, *out, *in;
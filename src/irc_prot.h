@@ -62,10 +62,8 @@ struct ctcpmessage {
 
 /* functions */
 extern int ircprot_parsemsg(const char *, struct ircmessage *);
-extern void ircprot_freemsg(struct ircmessage *);
 extern void ircprot_stripctcp(const char *, char **, struct strlist **);
 extern int ircprot_parsectcp(const char *, struct ctcpmessage *);
-extern void ircprot_freectcp(struct ctcpmessage *);
 extern char *ircprot_sanitize_username(const char *);
 
 #endif /* __DIRCPROXY_IRC_PROT_H */
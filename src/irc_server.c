@@ -37,6 +37,7 @@
 
 #include <dircproxy.h>
 #include "sprintf.h"
+#include "arena.h"
 #include "net.h"
 #include "dns.h"
 #include "timers.h"
@@ -48,12 +49,107 @@
 #include "irc_client.h"
 #include "irc_server.h"
 
+/* a proxy waiting for, or holding, a place in the connection scheduler */
+struct connslot {
+  struct ircproxy *p;
+  char *server;
+  time_t queued;
+
+  struct connslot *next;
+};
+
+/* an address we might connect to a server on, racing the others */
+struct raceattempt {
+  struct strlist *server;
+  int order;
+  char *host;
+  SOCKADDR addr;
+  int sock;
+  int state;
+
+  struct raceattempt *next;
+};
+
+/* a server we're still waiting for the DNS answer for */
+struct racelookup {
+  long id;
+  struct strlist *server;
+  int order;
+  int port;
+
+  struct racelookup *next;
+};
+
+/* all the attempts being made to connect a proxy to a server */
+struct serverrace {
+  struct raceattempt *attempts;
+  struct racelookup *lookups;
+  struct strlist *last;
+
+  int local_pending;
+  char *local_ip;
+  char *local_host;
+};
+
+/* Longest channel or nickname that gets a turn of its own in the send
+   queue, lines for anything longer wait in order with the rest */
+#define SENDQ_TARGET_LEN 256
+
+/* a line waiting to go to the server */
+struct sendline {
+  struct netbuf *buf;
+  unsigned long seq;
+  struct timeval queued;
+
+  struct sendline *next;
+};
+
+/* lines waiting to go to one target, served in turn with the others */
+struct sendtarget {
+  char name[SENDQ_TARGET_LEN];
+  struct sendline *head, *tail;
+
+  struct sendtarget *next;
+};
+
+/* everything waiting to go to the server, in front of its throttle.  Lines
+   that aren't for one target keep their place in the order with the rest
+   of the interactive lines.  Spare lines and targets are kept to be used
+   again rather than freed. */
+struct sendqueue {
+  struct sendtarget *targets, *turn;
+  struct sendline *ordered, *ordered_tail;
+  struct sendline *bulk, *bulk_tail;
+  unsigned long seq;
+  int since_bulk;
+
+  struct sendline *spare_lines;
+  struct sendtarget *spare_targets;
+  int nspare_lines, nspare_targets;
+};
+
+/* states of an attempt */
+#define RACE_WAITING    0
+#define RACE_CONNECTING 1
+#define RACE_FAILED     2
+
 /* forward declarations */
 static void _ircserver_reconnect(struct ircproxy *, void *);
-static void _ircserver_connect2(struct ircproxy *, void *, const char *,
-                                const char *);
-static void _ircserver_connect3(struct ircproxy *, void *, const char *,
-                                const char *);
+static long _ircserver_retry(struct ircproxy *);
+static char *_ircserver_hostport(const char *);
+static int _ircserver_connslots(const char *);
+static void _ircserver_admit(void);
+static void _ircserver_admittimer(void *, void *);
+static void _ircserver_connect1(struct ircproxy *);
+static void _ircserver_racelocal(struct ircproxy *, void *, const char *,
+                                 const char *);
+static void _ircserver_raceresolved(struct ircproxy *, void *, const char *,
+                                    const char *);
+static void _ircserver_racenext(struct ircproxy *);
+static void _ircserver_racetimer(struct ircproxy *, void *);
+static int _ircserver_racedone(struct ircproxy *);
+static struct raceattempt *_ircserver_raceattempt(struct ircproxy *, int);
+static int _ircserver_socket(struct ircproxy *, int);
 static void _ircserver_connected(struct ircproxy *, int);
 static void _ircserver_connected2(struct ircproxy *, void *, const char *,
                                   const char *);
@@ -65,17 +161,60 @@ static int _ircserver_close(struct ircproxy *);
 static int _ircserver_lost(struct ircproxy *);
 static void _ircserver_ping(struct ircproxy *, void *);
 static void _ircserver_stoned(struct ircproxy *, void *);
+static void _ircserver_pong(struct ircproxy *);
+static int _ircserver_sendq(struct ircproxy *, struct netbuf *, int);
+static int _ircserver_sendclass(struct ircproxy *, const char *, char *);
+static void _ircserver_sendspare(struct sendqueue *, struct sendline *);
+static struct sendline *_ircserver_sendnext(struct sendqueue *, int *);
+static void _ircserver_sendrun(struct ircproxy *, int);
+static void _ircserver_sendjoinfirst(struct ircproxy *, const char *);
+static void _ircserver_drain(struct ircproxy *, int);
+static long _ircserver_stonedtime(struct ircproxy *);
 static void _ircserver_antiidle(struct ircproxy *, void *);
 static int _ircserver_forclient(struct ircproxy *, struct ircmessage *);
+static void _ircserver_isupport(struct ircproxy *, struct ircmessage *);
+static void _ircserver_join(struct ircproxy *, void *);
 static int _ircserver_send_dccreject(struct ircproxy *, const char *, const char *);
 static int _ircserver_dccresume_timeout(struct ircproxy *, struct dcc_resume *);
 
 struct dcc_resume *dcc_resume_list=NULL;
 
+/* proxies waiting to connect to a server, and those connecting right now */
+static struct connslot *connect_queue = 0;
+static struct connslot *connect_active = 0;
+
+/* connections we may start before waiting for the rate to catch up, and
+   when we last worked that out */
+static long connect_tokens = 0;
+static time_t connect_refill = 0;
+
+/* numbers for the status report */
+static unsigned long connect_admitted = 0;
+static unsigned long connect_delayed = 0;
+static long connect_longest = 0;
+
 
 /* Time/date format for strftime(3) */
 #define CTCP_TIMEDATE_FORMAT "%a, %d %b %Y %H:%M:%S %z"
 
+/* Longest we'll wait for the end of the MOTD before joining channels */
+#define SERVER_JOIN_WAIT 10
+
+/* Shortest time we'll wait for a reply to a PING, however quick the server
+   has been answering them.  Servers hold our PING behind anything they're
+   fake-lagging us for, so this is generous */
+#define SERVER_STONED_MIN 30
+
+/* Most we'll let sit in the socket's own buffer, anything more waits in the
+   send queue where it can be reordered */
+#define SENDQ_WATERMARK 1024
+
+/* Bulk gets one line in this many even when there's interactive waiting */
+#define SENDQ_BULK_EVERY 4
+
+/* Most spare lines and targets the send queue keeps for reuse */
+#define SENDQ_SPARE 64
+
 /* hook for timer code to reconnect to a server */
 static void _ircserver_reconnect(struct ircproxy *p, void *data) {
   debug("Reconnecting to server");
@@ -124,11 +263,148 @@ static void _ircserver_reconnect(struct ircproxy *p, void *data) {
   }
 }
 
-/* Called to initiate a connection to a server */
-int ircserver_connect(struct ircproxy *p) {
-  char *server;
+/* How long to wait before trying a server again, with a little random
+   jitter so proxies that lost their servers together don't all come back at
+   the same moment */
+static long _ircserver_retry(struct ircproxy *p) {
+  long retry;
 
-  debug("Connecting to server (stage 1)");
+  retry = p->conn_class->server_retry;
+  if (g.connect_jitter > 0)
+    retry += rand() % (g.connect_jitter + 1);
+
+  return retry;
+}
+
+/* Strip any password off a server so it only names the host and port */
+static char *_ircserver_hostport(const char *server) {
+  char *str;
+
+  str = x_strdup(server);
+  if (strchr(str, ':') != strrchr(str, ':'))
+    *(strrchr(str, ':')) = 0;
+
+  return str;
+}
+
+/* Count the connections in progress to a server */
+static int _ircserver_connslots(const char *server) {
+  struct connslot *s;
+  int count;
+
+  count = 0;
+  for (s = connect_active; s; s = s->next) {
+    if (!strcasecmp(s->server, server))
+      count++;
+  }
+
+  return count;
+}
+
+/* Let as many waiting proxies connect as the rate and the limit on
+   connections to each server allow.  Proxies waiting on a busy server don't
+   hold up those waiting for other servers. */
+static void _ircserver_admit(void) {
+  struct connslot **l;
+  time_t now;
+
+  now = time(0);
+  if (g.connect_rate > 0) {
+    if (!connect_refill) {
+      connect_tokens = g.connect_rate;
+    } else if (now > connect_refill) {
+      connect_tokens += (now - connect_refill) * g.connect_rate;
+    }
+    if (connect_tokens > g.connect_rate)
+      connect_tokens = g.connect_rate;
+    connect_refill = now;
+  }
+
+  l = &connect_queue;
+  while (*l && ((g.connect_rate <= 0) || (connect_tokens > 0))) {
+    struct connslot *s;
+
+    s = *l;
+    if ((g.connect_per_server > 0)
+        && (_ircserver_connslots(s->server) >= g.connect_per_server)) {
+      l = &(s->next);
+      continue;
+    }
+
+    *l = s->next;
+    s->next = connect_active;
+    connect_active = s;
+
+    if (g.connect_rate > 0)
+      connect_tokens--;
+    connect_admitted++;
+    if (now - s->queued > connect_longest)
+      connect_longest = now - s->queued;
+
+    _ircserver_connect1(s->p);
+  }
+
+  /* Come back when the rate allows some more */
+  if (connect_queue && !timer_exists((void *)&connect_queue, "connect_admit"))
+    timer_new((void *)&connect_queue, "connect_admit", 1,
+              TIMER_FUNCTION(_ircserver_admittimer), 0);
+}
+
+/* hook for timer code to let more proxies connect */
+static void _ircserver_admittimer(void *owner, void *data) {
+  _ircserver_admit();
+}
+
+/* The proxy has finished connecting, or given up, so make room for another.
+   Also used to forget a proxy that's still waiting. */
+void ircserver_unqueue(struct ircproxy *p) {
+  struct connslot **l;
+  int lists;
+
+  for (lists = 0; lists < 2; lists++) {
+    l = (lists ? &connect_queue : &connect_active);
+    while (*l) {
+      struct connslot *s;
+
+      s = *l;
+      if (s->p == p) {
+        *l = s->next;
+        free(s->server);
+        free(s);
+      } else {
+        l = &(s->next);
+      }
+    }
+  }
+
+  /* Let the next one in once we're out of the way */
+  if (connect_queue && !timer_exists((void *)&connect_queue, "connect_admit"))
+    timer_new((void *)&connect_queue, "connect_admit", 0,
+              TIMER_FUNCTION(_ircserver_admittimer), 0);
+}
+
+/* Fill in how the connection scheduler is doing */
+void ircserver_connectstats(struct connstats *stats) {
+  struct connslot *s;
+
+  memset(stats, 0, sizeof(struct connstats));
+  for (s = connect_queue; s; s = s->next) {
+    stats->waiting++;
+    if (time(0) - s->queued > stats->waiting_longest)
+      stats->waiting_longest = time(0) - s->queued;
+  }
+  for (s = connect_active; s; s = s->next)
+    stats->connecting++;
+
+  stats->admitted = connect_admitted;
+  stats->delayed = connect_delayed;
+  stats->longest = connect_longest;
+}
+
+/* Called to initiate a connection to a server, we wait our turn with
+   everyone else */
+int ircserver_connect(struct ircproxy *p) {
+  struct connslot *s, **l;
 
   if (timer_exists((void *)p, "server_recon")) {
     debug("Connection already in progress");
@@ -137,73 +413,332 @@ int ircserver_connect(struct ircproxy *p) {
     return 0;
   }
 
-  server = x_strdup(p->conn_class->next_server->str);
-  if (strchr(server, ':') != strrchr(server, ':')) {
-    /* More than one :, second denotes password */
-    char *pass;
+  for (l = &connect_queue; *l; l = &((*l)->next)) {
+    if ((*l)->p == p) {
+      debug("Already waiting to connect");
+      return 0;
+    }
+  }
 
-    pass = strrchr(server, ':');
-    *(pass++) = 0;
+  s = (struct connslot *)malloc(sizeof(struct connslot));
+  s->p = p;
+  s->server = _ircserver_hostport(p->conn_class->next_server->str);
+  s->queued = time(0);
+  s->next = 0;
+  *l = s;
 
-    if (strlen(pass))
-      p->serverpassword = x_strdup(pass);
+  _ircserver_admit();
+
+  /* Still there?  Then we'll have to wait */
+  for (s = connect_queue; s; s = s->next) {
+    if (s->p == p) {
+      debug("Waiting to connect to %s", s->server);
+      connect_delayed++;
+      if (IS_CLIENT_READY(p))
+        ircclient_send_notice(p, "Waiting for our turn to connect to %s...",
+                              s->server);
+      break;
+    }
   }
- 
-  if (IS_CLIENT_READY(p))
-    ircclient_send_notice(p, "Looking up %s...", server);
 
-  /* DNS lookup the server */
-  dns_filladdr((void *)p, server, p->conn_class->server_port,
-               &(p->server_addr), (dns_fun_t) _ircserver_connect2);
-  free(server);
   return 0;
 }
 
-/* Called to initiate a connection to a server once its been looked up */
-static void _ircserver_connect2(struct ircproxy *p, void *data,
-                                const char *ip, const char *host) {
-  if (!host || !ip) {
-    debug("DNS failure, retrying");
-    timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-              TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
-    free(p->serverpassword);
-    p->serverpassword = 0;
-    return;
-  }
+/* Called when it's our turn to connect to a server, we look up the next
+   few servers at once and connect to whichever answers first */
+static void _ircserver_connect1(struct ircproxy *p) {
+  struct strlist *server;
+  static long lookup_id = 0;
+  int order;
+
+  debug("Connecting to server (stage 1)");
 
-  debug("Resolved server");
+  ircserver_freerace(p);
+  p->race = (struct serverrace *)malloc(sizeof(struct serverrace));
+  memset(p->race, 0, sizeof(struct serverrace));
 
-  /* Copy the found information into p */
-  free(p->servername);
-  p->servername = x_strdup(host);
-  net_filladdr(&p->server_addr, ip, (unsigned short)data);
-  
   if (p->conn_class->local_address) {
+    p->race->local_pending = 1;
     dns_addrfromhost((void *)p, 0, p->conn_class->local_address,
-                     (dns_fun_t)_ircserver_connect3);
+                     (dns_fun_t)_ircserver_racelocal);
+    if (!p->race)
+      return;
+  }
+
+  server = p->conn_class->next_server;
+  for (order = 0; order < MAX(p->conn_class->server_race, 1); order++) {
+    struct racelookup *l;
+    char *host;
+
+    host = _ircserver_hostport(server->str);
+    if (IS_CLIENT_READY(p))
+      ircclient_send_notice(p, "Looking up %s...", host);
+
+    l = (struct racelookup *)malloc(sizeof(struct racelookup));
+    l->id = ++lookup_id;
+    l->server = server;
+    l->order = order;
+    l->next = p->race->lookups;
+    p->race->lookups = l;
+    p->race->last = server;
+
+    /* The lookup can finish (and even end the race) before this returns */
+    dns_filladdrs((void *)p, (void *)l->id, host, p->conn_class->server_port,
+                  &(l->port), (dns_fun_t)_ircserver_raceresolved);
+    free(host);
+    if (!p->race)
+      return;
+
+    server = (server->next ? server->next : p->conn_class->servers);
+    if (server == p->conn_class->next_server)
+      break;
+  }
+}
+
+/* Called once the local_address has been looked up */
+static void _ircserver_racelocal(struct ircproxy *p, void *data,
+                                 const char *ip, const char *host) {
+  if (!p->race)
+    return;
+
+  if (ip) {
+    p->race->local_ip = x_strdup(ip);
+    p->race->local_host = (host ? x_strdup(host) : 0);
+  } else if (IS_CLIENT_READY(p)) {
+    ircclient_send_notice(p, "(warning) Couldn't find address for %s",
+                          p->conn_class->local_address);
+  }
+
+  p->race->local_pending = 0;
+  _ircserver_racenext(p);
+}
+
+/* Called when one of the servers has been looked up, ip is every address
+   it has separated by spaces */
+static void _ircserver_raceresolved(struct ircproxy *p, void *data,
+                                    const char *ip, const char *host) {
+  struct racelookup *l, **ll;
+  struct raceattempt **a;
+  const char *start;
+
+  if (!p->race)
+    return;
+
+  for (ll = &(p->race->lookups); *ll; ll = &((*ll)->next)) {
+    if ((*ll)->id == (long)data)
+      break;
+  }
+  if (!*ll)
+    return;
+  l = *ll;
+  *ll = l->next;
+
+  if (!ip || !host) {
+    debug("DNS failure for %s", l->server->str);
   } else {
-    _ircserver_connect3(p, 0, 0, 0);
+    debug("Resolved server %s to %s", host, ip);
+
+    /* Keep the attempts sorted by where the server is in the list, the
+       order of the addresses within it we keep as the resolver gave us */
+    a = &(p->race->attempts);
+    while (*a && ((*a)->order <= l->order))
+      a = &((*a)->next);
+
+    start = ip;
+    while (*start) {
+      struct raceattempt *n;
+      char addr[41];
+      size_t len;
+
+      len = strcspn(start, " ");
+      if (len && (len < sizeof(addr))) {
+        memcpy(addr, start, len);
+        addr[len] = 0;
+
+        n = (struct raceattempt *)malloc(sizeof(struct raceattempt));
+        memset(n, 0, sizeof(struct raceattempt));
+        n->server = l->server;
+        n->order = l->order;
+        n->host = x_strdup(host);
+        n->sock = -1;
+        n->state = RACE_WAITING;
+        net_filladdr(&(n->addr), addr, l->port);
+
+        n->next = *a;
+        *a = n;
+        a = &(n->next);
+      }
+
+      start += len;
+      start += strspn(start, " ");
+    }
+  }
+  free(l);
+
+  /* Start straight away if nothing else is trying */
+  if (!_ircserver_raceattempt(p, RACE_CONNECTING)) {
+    _ircserver_racenext(p);
+  } else {
+    _ircserver_racedone(p);
   }
 }
 
-/* Called to initiate a connection to a server once its been looked up
-   and the local_host has been looked up */
-static void _ircserver_connect3(struct ircproxy *p, void *data,
-                                const char *ip, const char *host) {
-  int ret;
-#ifdef HAVE_SETEUID
-  int switched = 0;
-  pid_t old_euid;
-#endif /* HAVE_SETEUID */
+/* Start the next waiting attempt, and set a timer to start the one after
+   that if this one doesn't connect quickly */
+static void _ircserver_racenext(struct ircproxy *p) {
+  struct raceattempt *a;
 
-  debug("Connecting to %s port %d", p->servername,
-        ntohs(SOCKADDR_PORT(&p->server_addr)));
+  if (!p->race || p->race->local_pending)
+    return;
 
-  if (IS_CLIENT_READY(p))
-    ircclient_send_notice(p, "Connecting to %s port %d",
-                          p->servername, ntohs(SOCKADDR_PORT(&p->server_addr)));
+  timer_del((void *)p, "server_race");
+  while ((a = _ircserver_raceattempt(p, RACE_WAITING))) {
+    char ip[40];
+    int port;
+
+    net_ntop(&(a->addr), ip, sizeof(ip));
+    port = ntohs(SOCKADDR_PORT(&(a->addr)));
+    debug("Connecting to %s (%s) port %d", a->host, ip, port);
+
+    if (IS_CLIENT_READY(p))
+      ircclient_send_notice(p, "Connecting to %s port %d", a->host, port);
 
+    a->sock = _ircserver_socket(p, SOCKADDR_FAMILY(&(a->addr)));
+    if (a->sock != -1) {
+      if (p->race->local_ip) {
+        SOCKADDR local_addr;
+
+        /* Only bind if the address is the same family as the server */
+        net_filladdr(&local_addr, p->race->local_ip, 0);
+        if ((SOCKADDR_FAMILY(&local_addr) == SOCKADDR_FAMILY(&(a->addr)))
+            && bind(a->sock, (struct sockaddr *)&local_addr,
+                    SOCKADDR_LEN(&local_addr))) {
+          if (IS_CLIENT_READY(p))
+            ircclient_send_notice(p, "(warning) Couldn't use local address %s",
+                                  p->race->local_host ? p->race->local_host
+                                  : p->race->local_ip);
+        }
+      }
+
+      if (connect(a->sock, (struct sockaddr *)&(a->addr),
+                  SOCKADDR_LEN(&(a->addr)))
+          && (errno != EINPROGRESS)) {
+        syscall_fail("connect", a->host, 0);
+        net_close(&(a->sock));
+      }
+    }
+
+    if (a->sock == -1) {
+      if (IS_CLIENT_READY(p))
+        ircclient_send_notice(p, "Connection failed: %s", strerror(errno));
+      debug("Connection failed: %s", strerror(errno));
+      a->state = RACE_FAILED;
+      continue;
+    }
+
+    a->state = RACE_CONNECTING;
+    p->server_status |= IRC_SERVER_CREATED;
+    net_hook(a->sock, SOCK_CONNECTING, (void *)p,
+             ACTIVITY_FUNCTION(_ircserver_connected),
+             ERROR_FUNCTION(_ircserver_connectfailed));
+    debug("Connection in progress");
+
+    /* Give it a head start over the next one */
+    if (_ircserver_raceattempt(p, RACE_WAITING) || p->race->lookups)
+      timer_new((void *)p, "server_race",
+                MAX(p->conn_class->server_race_delay, 1),
+                TIMER_FUNCTION(_ircserver_racetimer), (void *)0);
+    return;
+  }
+
+  _ircserver_racedone(p);
+}
+
+/* hook for timer code to start another attempt */
+static void _ircserver_racetimer(struct ircproxy *p, void *data) {
+  _ircserver_racenext(p);
+}
+
+/* Check whether every attempt has failed, and if so give up and try again
+   later.  Returns 1 if it did */
+static int _ircserver_racedone(struct ircproxy *p) {
+  if (!p->race || p->race->lookups || p->race->local_pending
+      || _ircserver_raceattempt(p, RACE_WAITING)
+      || _ircserver_raceattempt(p, RACE_CONNECTING))
+    return 0;
+
+  debug("All connection attempts failed, retrying");
+
+  /* Carry on after the last server we tried next time */
+  if (p->race->last)
+    p->conn_class->next_server = p->race->last;
+
+  ircserver_freerace(p);
+  p->server_status &= ~(IRC_SERVER_CREATED);
+  ircserver_unqueue(p);
+  timer_new((void *)p, "server_recon", _ircserver_retry(p),
+            TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+
+  return 1;
+}
+
+/* Find the first attempt in the given state */
+static struct raceattempt *_ircserver_raceattempt(struct ircproxy *p,
+                                                  int state) {
+  struct raceattempt *a;
+
+  for (a = (p->race ? p->race->attempts : 0); a; a = a->next) {
+    if (a->state == state)
+      return a;
+  }
+
+  return 0;
+}
+
+/* Stop racing, closing any attempts still in progress */
+void ircserver_freerace(struct ircproxy *p) {
+  struct raceattempt *a;
+  struct racelookup *l;
+
+  if (!p->race)
+    return;
+
+  timer_del((void *)p, "server_race");
+
+  a = p->race->attempts;
+  while (a) {
+    struct raceattempt *n;
+
+    n = a->next;
+    if (a->sock != -1)
+      net_close(&(a->sock));
+    free(a->host);
+    free(a);
+    a = n;
+  }
+
+  l = p->race->lookups;
+  while (l) {
+    struct racelookup *n;
+
+    n = l->next;
+    free(l);
+    l = n;
+  }
+
+  free(p->race->local_ip);
+  free(p->race->local_host);
+  free(p->race);
+  p->race = 0;
+}
+
+/* Create a socket to connect to a server with, as the right user */
+static int _ircserver_socket(struct ircproxy *p, int family) {
+  int sock;
 #ifdef HAVE_SETEUID
+  int switched = 0;
+  pid_t old_euid;
+
   old_euid = geteuid();
 
   /* Switch to a user */
@@ -244,7 +779,7 @@ static void _ircserver_connect3(struct ircproxy *p, void *data,
   }
 #endif /* HAVE_SETEUID */
 
-  p->server_sock = net_socket(SOCKADDR_FAMILY(&p->server_addr));
+  sock = net_socket(family);
 
 #ifdef HAVE_SETEUID
   /* Switch back to our original euid */
@@ -257,79 +792,66 @@ static void _ircserver_connect3(struct ircproxy *p, void *data,
   }
 #endif /* HAVE_SETEUID */
 
-  if (p->server_sock == -1) {
-    ret = -1;
+  if ((sock != -1) && p->conn_class->server_keepalive)
+    net_keepalive(sock, p->conn_class->server_timeout);
+  if ((sock != -1) && p->conn_class->server_timeout)
+    net_usertimeout(sock, p->conn_class->server_timeout);
 
-  } else {
-    if (p->conn_class->server_keepalive)
-      net_keepalive(p->server_sock);
-
-    if (p->conn_class->local_address) {
-      if (ip) {
-        SOCKADDR local_addr;
+  return sock;
+}
 
-        net_filladdr(&local_addr, ip, 0);
-        if (bind(p->server_sock, (struct sockaddr *)&local_addr, SOCKADDR_LEN(&local_addr))) {
-          if (IS_CLIENT_READY(p))
-            ircclient_send_notice(p, "(warning) Couldn't use local address %s",
-                                  host);
-        } else {
-          free(p->hostname);
-          p->hostname = (host ? x_strdup(host) : p->conn_class->local_address);
-        }
-      } else {
-        if (IS_CLIENT_READY(p))
-          ircclient_send_notice(p, "(warning) Couldn't find address for %s",
-                                p->conn_class->local_address);
-      }
-    }
+/* Called when a new server has connected */
+static void _ircserver_connected(struct ircproxy *p, int sock) {
+  struct raceattempt *a;
 
-    if (connect(p->server_sock, (struct sockaddr *)&(p->server_addr),
-                SOCKADDR_LEN(&p->server_addr))
-        && (errno != EINPROGRESS)) {
-      syscall_fail("connect", p->servername, 0);
-      net_close(&(p->server_sock));
-      ret = -1;
-    } else {
-      ret = 0;
-    }
+  for (a = (p->race ? p->race->attempts : 0); a; a = a->next) {
+    if (a->sock == sock)
+      break;
+  }
+  if (!a) {
+    error("Unexpected socket %d in _ircserver_connected", sock);
+    net_close(&sock);
+    return;
   }
 
-  if (ret) {
-    if (IS_CLIENT_READY(p))
-      ircclient_send_notice(p, "Connection failed: %s", strerror(errno));
-    debug("Connection failed: %s", strerror(errno));
+  debug("Connection succeeded");
 
-    net_close(&(p->server_sock));
-    timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-              TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+  /* We have a winner, take its socket and forget the rest */
+  p->server_sock = a->sock;
+  a->sock = -1;
+  memcpy(&(p->server_addr), &(a->addr), sizeof(SOCKADDR));
+  free(p->servername);
+  p->servername = x_strdup(a->host);
+  p->conn_class->next_server = a->server;
 
-    free(p->serverpassword);
-    p->serverpassword = 0;
+  free(p->serverpassword);
+  p->serverpassword = 0;
+  if (strchr(a->server->str, ':') != strrchr(a->server->str, ':')) {
+    /* More than one :, second denotes password */
+    char *pass;
 
-  } else {
-    p->server_status |= IRC_SERVER_CREATED;
-    net_hook(p->server_sock, SOCK_CONNECTING, (void *)p,
-             ACTIVITY_FUNCTION(_ircserver_connected),
-             ERROR_FUNCTION(_ircserver_connectfailed));
-    debug("Connection in progress");
+    pass = strrchr(a->server->str, ':') + 1;
+    if (strlen(pass))
+      p->serverpassword = x_strdup(pass);
   }
-}
 
-/* Called when a new server has connected */
-static void _ircserver_connected(struct ircproxy *p, int sock) {
-  if (sock != p->server_sock) {
-    error("Unexpected socket %d in _ircserver_connected, expected %d", sock,
-          p->server_sock);
-    net_close(&sock);
-    return;
+  if (p->race->local_ip) {
+    SOCKADDR local_addr;
+
+    net_filladdr(&local_addr, p->race->local_ip, 0);
+    if (SOCKADDR_FAMILY(&local_addr) == SOCKADDR_FAMILY(&(p->server_addr))) {
+      free(p->hostname);
+      p->hostname = x_strdup(p->race->local_host ? p->race->local_host
+                             : p->conn_class->local_address);
+    }
   }
+  ircserver_freerace(p);
 
-  debug("Connection succeeded");
   p->server_status |= IRC_SERVER_CONNECTED;
   net_hook(p->server_sock, SOCK_NORMAL, (void *)p,
            ACTIVITY_FUNCTION(_ircserver_data),
            ERROR_FUNCTION(_ircserver_error));
+  net_drain(p->server_sock, ACTIVITY_FUNCTION(_ircserver_drain));
   if (p->conn_class->server_throttle)
     net_throttle(p->server_sock, p->conn_class->server_throttle[0], 
                  p->conn_class->server_throttle[1]);
@@ -404,29 +926,36 @@ static void _ircserver_connected2(struct ircproxy *p, void *data,
 
 /* Called when a connection fails */
 static void _ircserver_connectfailed(struct ircproxy *p, int sock, int bad) {
-  if (sock != p->server_sock) {
-    error("Unexpected socket %d in _ircserver_connectfailed, expected %d", sock,
-          p->server_sock);
+  struct raceattempt *a;
+
+  for (a = (p->race ? p->race->attempts : 0); a; a = a->next) {
+    if (a->sock == sock)
+      break;
+  }
+  if (!a) {
+    error("Unexpected socket %d in _ircserver_connectfailed", sock);
     net_close(&sock);
     return;
   }
 
-  debug("Connection failed");
+  debug("Connection to %s failed", a->host);
 
   if (IS_CLIENT_READY(p))
-    ircclient_send_notice(p, "Connection failed: %s", strerror(errno));
+    ircclient_send_notice(p, "Connection to %s failed: %s", a->host,
+                          strerror(errno));
 
-  net_close(&(p->server_sock));
-  p->server_status &= ~(IRC_SERVER_CREATED);
+  net_close(&(a->sock));
+  a->state = RACE_FAILED;
 
-  timer_new((void *)p, "server_recon", p->conn_class->server_retry,
-            TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
+  /* Don't wait for the timer, try the next one now */
+  _ircserver_racenext(p);
 }
 
 /* Called when a server sends us stuff. */
 static void _ircserver_data(struct ircproxy *p, int sock) {
+  struct arenamark mark;
   char *str;
-  
+
   if (sock != p->server_sock) {
     error("Unexpected socket %d in _ircserver_data, expected %d", sock,
           p->server_sock);
@@ -434,13 +963,18 @@ static void _ircserver_data(struct ircproxy *p, int sock) {
     return;
   }
 
+  /* Each line is read into the arena, and everything made while handling
+     it is thrown away before the next */
   str = 0;
+  arena_mark(&mark);
   while (!p->dead && (p->server_status & IRC_SERVER_CONNECTED)
          && net_gets(p->server_sock, &str, "\r\n") > 0) {
     debug("<< '%s'", str);
+    p->ping_heard = 1;
     _ircserver_gotmsg(p, str);
-    free(str);
+    arena_release(&mark);
   }
+  arena_release(&mark);
 }
 
 /* Called on server disconnection or error */
@@ -472,9 +1006,8 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
   /* Check source */
   if (!msg.src.orig) {
-    msg.src.orig = x_strdup(p->servername);
-    msg.src.fullname = x_strdup(p->servername);
-    msg.src.name = x_strdup(p->servername);
+    msg.src.orig = msg.src.fullname = msg.src.name
+      = arena_strdup(p->servername);
   }
   
   /* 437 is bizarre, it either means Nickname is juped or Channel is juped */
@@ -482,12 +1015,10 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
     if (msg.numparams >= 2) {
       if (!irc_strcasecmp(p->nickname, msg.params[1])) {
         /* Our nickname is Juped - make it a 433 */
-        free(msg.cmd);
-        msg.cmd = x_strdup("433");
+        msg.cmd = arena_strdup("433");
       } else {
         /* Channel is juped - make it a 471 */
-        free(msg.cmd);
-        msg.cmd = x_strdup("471");
+        msg.cmd = arena_strdup("471");
       }
     }
   }
@@ -515,9 +1046,11 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
       p->serverver = x_strdup(msg.params[2]);
       p->serverumodes = x_strdup(msg.params[3]);
       p->servercmodes = x_strdup(msg.params[4]);
+      ircclient_freeburst(p);
 
       p->server_status |= IRC_SERVER_GOTWELCOME | IRC_SERVER_SEEN;
       p->server_attempts = 0;
+      ircserver_unqueue(p);
 
       if (IS_CLIENT_READY(p) && !(p->client_status & IRC_CLIENT_SENTWELCOME))
         ircclient_welcome(p);
@@ -544,15 +1077,17 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
       c = p->channels;
       while (c) {
-        if (!c->unjoined) {
-          if (c->key) {
-            ircserver_send_command(p, "JOIN", "%s :%s", c->name, c->key);
-          } else {
-            ircserver_send_command(p, "JOIN", ":%s", c->name);
-          }
-        }
+        if (!c->unjoined)
+          c->joining = 1;
         c = c->next;
       }
+
+      /* Wait for the end of the MOTD, by then the server will have told us
+         how many channels we can put in each JOIN */
+      if (timer_exists((void *)p, "server_join"))
+        timer_del((void *)p, "server_join");
+      timer_new((void *)p, "server_join", SERVER_JOIN_WAIT,
+                TIMER_FUNCTION(_ircserver_join), 0);
     }
 
   } else if (!irc_strcasecmp(msg.cmd, "005")) {
@@ -582,6 +1117,9 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
     free(c0);
      
     if (i) {
+      /* Note the things we need to understand the server's replies */
+      _ircserver_isupport(p, &msg);
+
       // Store for future clients
       struct strlist *s = (struct strlist *)malloc(sizeof(struct strlist));
       s->str = x_strdup(msg.paramstarts[1]);
@@ -590,14 +1128,16 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
         struct strlist *ss;
         for (ss = p->serversupported; ss->next && strcmp(ss->str,s->str); ss = ss->next)
         ;
-        if (strcmp(ss->str,s->str))  // this line is not already present
+        if (strcmp(ss->str,s->str)) { // this line is not already present
           ss->next = s;
-        else {	      
+          ircclient_freeburst(p);
+        } else {	      
 	  free(s->str);
           free(s);
 	}	 
       } else {
         p->serversupported = s;
+        ircclient_freeburst(p);
       }
     } else {
       struct strlist *s;
@@ -661,12 +1201,22 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
       p->allow_motd = 0;
     }
 
+    if (timer_exists((void *)p, "server_join")) {
+      timer_del((void *)p, "server_join");
+      _ircserver_join(p, 0);
+    }
+
   } else if (!irc_strcasecmp(msg.cmd, "422")) {
     /* Ignore 422 unless allow_motd */
     if (p->allow_motd) {
       squelch = 0;
       p->allow_motd = 0;
     }
+
+    if (timer_exists((void *)p, "server_join")) {
+      timer_del((void *)p, "server_join");
+      _ircserver_join(p, 0);
+    }
     
   } else if (!irc_strcasecmp(msg.cmd, "431") || !irc_strcasecmp(msg.cmd, "432")
              || !irc_strcasecmp(msg.cmd, "433")
@@ -693,7 +1243,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
           ircclient_generate_nick(p, msg.params[1]);
         } else {
           /* Have to anti-squelch this manually */
-          net_send(p->client_sock, "%s\r\n", msg.orig);
+          ircclient_send_raw(p, "%s", msg.orig);
         }
       }
     } else {
@@ -772,6 +1322,12 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
       c = ircnet_fetchchannel(p, msg.params[1]);
       if (c) {
+        /* This is all of them, so forget what we had */
+        free(c->modes);
+        c->modes = 0;
+        c->limit = 0;
+        c->modes_known = 1;
+
         if (msg.numparams >= 3) {
           ircnet_channel_mode(p, c, &msg, 2);
         } else {
@@ -849,6 +1405,62 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
       }
     }
  
+  } else if (!irc_strcasecmp(msg.cmd, "331")) {
+    /* Channel has no topic */
+    if (msg.numparams >= 2) {
+      struct ircchannel *c;
+
+      if ((c = ircnet_fetchchannel(p, msg.params[1])))
+        ircnet_channel_topic(c, 0, 0, 0);
+    }
+    squelch = 0;
+
+  } else if (!irc_strcasecmp(msg.cmd, "332")) {
+    /* Channel topic */
+    if (msg.numparams >= 3) {
+      struct ircchannel *c;
+
+      if ((c = ircnet_fetchchannel(p, msg.params[1])))
+        ircnet_channel_topic(c, msg.params[2], 0, 0);
+    }
+    squelch = 0;
+
+  } else if (!irc_strcasecmp(msg.cmd, "333")) {
+    /* Who set the channel topic, and when */
+    if (msg.numparams >= 4) {
+      struct ircchannel *c;
+
+      if ((c = ircnet_fetchchannel(p, msg.params[1])))
+        ircnet_channel_topic(c, c->topic, msg.params[2],
+                             strtoul(msg.params[3], 0, 10));
+    }
+    squelch = 0;
+
+  } else if (!irc_strcasecmp(msg.cmd, "353")) {
+    /* Channel members, some servers leave out the channel type */
+    if (msg.numparams >= 3) {
+      struct ircchannel *c;
+      int chan;
+
+      chan = (msg.numparams >= 4 ? 2 : 1);
+      if ((c = ircnet_fetchchannel(p, msg.params[chan])))
+        ircnet_channel_names(p, c, (chan == 2 ? msg.params[1][0] : '='),
+                             msg.params[chan + 1]);
+    }
+    squelch = 0;
+
+  } else if (!irc_strcasecmp(msg.cmd, "366")) {
+    /* End of channel members */
+    if (msg.numparams >= 2) {
+      struct ircchannel *c;
+
+      if ((c = ircnet_fetchchannel(p, msg.params[1]))) {
+        c->names_pending = 0;
+        c->names_known = 1;
+      }
+    }
+    squelch = 0;
+
   } else if (!irc_strcasecmp(msg.cmd, "PING")) {
     /* Reply to pings for the client */
     if (msg.numparams == 1) {
@@ -868,6 +1480,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
     if (p->allow_pong)
       squelch = 0;
 
+    _ircserver_pong(p);
     if (p->conn_class->server_pingtimeout) {
       timer_del((void *)p, "server_stoned");
       timer_new((void *)p, "server_stoned", p->conn_class->server_pingtimeout,
@@ -876,6 +1489,9 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
     }
 
   } else if (!irc_strcasecmp(msg.cmd, "NICK")) {
+    if (msg.numparams >= 1)
+      ircnet_renamemember(p, msg.src.name, msg.params[0]);
+
     if (_ircserver_forclient(p, &msg)) {
       /* Server telling us our nickname */
       if (msg.numparams >= 1) {
@@ -954,8 +1570,12 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
       /* Channel topic change */
       c = ircnet_fetchchannel(p, msg.params[0]);
-      irclog_log(p, IRC_LOG_TOPIC, c->name, p->servername,
-                 "%s changed topic: %s", msg.src.fullname, msg.paramstarts[1]);
+      if (c) {
+        ircnet_channel_topic(c, msg.params[1], msg.src.orig, time(0));
+        irclog_log(p, IRC_LOG_TOPIC, c->name, p->servername,
+                   "%s changed topic: %s", msg.src.fullname,
+                   msg.paramstarts[1]);
+      }
 
       squelch = 0;
     }
@@ -966,7 +1586,16 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
       if (msg.numparams >= 1) {
         struct ircchannel *c;
 
+        /* The server will tell us the topic and members again */
         c = ircnet_fetchchannel(p, msg.params[0]);
+        if (c) {
+          ircnet_channel_resetnames(c);
+          ircnet_channel_topic(c, 0, 0, 0);
+        }
+
+        if (c)
+          c->rejoin_attempts = 0;
+
         if (c && c->inactive) {
           /* Must have got KICK'd or something ... */
           c->inactive = 0;
@@ -974,7 +1603,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
           /* If a client is connected, tell it we just joined and give it
              what they missed */
           if (p->client_status == IRC_CLIENT_ACTIVE) {
-            net_send(p->client_sock, "%s\r\n", msg.orig);
+            ircclient_send_raw(p, "%s", msg.orig);
             if (p->conn_class->chan_log_enabled)
               irclog_autorecall(p, msg.params[0]);
           }
@@ -1028,6 +1657,10 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
       }
     } else {
       if (msg.numparams >= 1) {
+        struct ircchannel *c;
+
+        if ((c = ircnet_fetchchannel(p, msg.params[0])))
+          ircnet_channel_addmember(p, c, msg.src.name, "");
         irclog_log(p, IRC_LOG_JOIN, msg.params[0], p->servername,
                    "%s joined the channel", msg.src.fullname);
       }
@@ -1045,12 +1678,19 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
         c = ircnet_fetchchannel(p, msg.params[0]);
         /* Ignore server PARTs for unjoined channels */
-        if (c && !c->unjoined)
+        if (c && !c->unjoined) {
           ircnet_delchannel(p, msg.params[0]);
+        } else if (c) {
+          ircnet_channel_resetnames(c);
+        }
         squelch = 0;
       }
     } else {
       if (msg.numparams >= 1) {
+        struct ircchannel *c;
+
+        if ((c = ircnet_fetchchannel(p, msg.params[0])))
+          ircnet_channel_delmember(p, c, msg.src.name);
         irclog_log(p, IRC_LOG_PART, msg.params[0], p->servername,
                    "%s left the channel", msg.src.fullname);
       }
@@ -1077,6 +1717,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
           chan = ircnet_fetchchannel(p, msg.params[0]);
           if (chan) {
             chan->inactive = 1;
+            ircnet_channel_resetnames(chan);
             ircnet_rejoin(p, chan->name);
           }
         } else {
@@ -1086,8 +1727,13 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
         squelch = 0;
       } else {
+        struct ircchannel *c;
+
         squelch = 0;
 
+        if ((c = ircnet_fetchchannel(p, msg.params[0])))
+          ircnet_channel_delmember(p, c, msg.params[1]);
+
         if (msg.numparams >= 3) {
           irclog_log(p, IRC_LOG_KICK, msg.params[0], p->servername,
                      "%s kicked off by %s: %s", msg.params[1],
@@ -1101,6 +1747,8 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
   } else if (!irc_strcasecmp(msg.cmd, "QUIT")) {
     /* Somebody left IRC */
+    ircnet_delmember(p, msg.src.name);
+
     if (msg.numparams >= 1) {
       irclog_log(p, IRC_LOG_QUIT, IRC_LOGFILE_SERVER, p->servername,
                  "%s quit from IRC: %s", msg.src.fullname, msg.params[0]);
@@ -1135,10 +1783,9 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
       /* Privmsgs get logged */
       if (str && strlen(str))
         irclog_log(p, IRC_LOG_MSG, logdest, msg.src.orig, "%s", str);
-      free(str);
 
       /* Handle CTCP */
-      str = x_strdup(msg.params[1]);
+      str = arena_strdup(msg.params[1]);
       s = list;
       while (s) {
         struct ctcpmessage cmsg;
@@ -1151,12 +1798,9 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
         n = s->next;
         r = ircprot_parsectcp(s->str, &cmsg);
         unquoted = s->str;
-        free(s);
         s = n;
-        if (r == -1) {
-          free(unquoted);
+        if (r == -1)
           continue;
-        }
       
         if (!strcmp(cmsg.cmd, "ACTION")) {
           irclog_log(p, IRC_LOG_ACTION, logdest, msg.src.orig,
@@ -1191,10 +1835,14 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 		   timer_del((void *)p, currptr->id);
 		   
 		   /* Make connection */
-		   if (!dccnet_new(DCC_SEND_CAPTURE, p->conn_class->dcc_proxy_timeout,
+		   if (!dccnet_new(DCC_SEND_CAPTURE, p->conn_class->dcc_proxy_timeout, 0,
+				   p->conn_class->dcc_proxy_maxrate,
+				   p->conn_class->dcc_proxy_classrate,
+				   p->conn_class->dcc_proxy_weight,
 				   p->conn_class->dcc_proxy_ports, p->conn_class->dcc_proxy_ports_sz,
 				   &currptr->l_port, currptr->r_addr, currptr->r_port,
 				   currptr->capfile, p->conn_class->dcc_capture_maxsize,
+				   currptr->total,
 				   DCCN_FUNCTION(_ircserver_send_dccreject),
 				   p, currptr->rejmsg, currptr->size)) {
 		      if (p->conn_class->log_events & IRC_LOG_CTCP)
@@ -1227,6 +1875,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
             char *tmp, *ptr, *dccmsg, *rejmsg;
             struct in_addr l_addr, r_addr;
             int l_port, r_port, t_port;
+            uint32_t r_size;
             char *capfile = 0;
             char *rest = 0;
 	    int type = 0;
@@ -1309,6 +1958,8 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
               r_addr.s_addr = INADDR_LOOPBACK;
               r_port = ntohs(t_port);
             }
+            r_size = ((cmsg.numparams >= 5)
+                      ? strtoul(cmsg.params[4], (char **)NULL, 10) : 0);
             l_addr.s_addr = ntohl(vis_addr.sin_addr.s_addr);
             if (cmsg.numparams >= 5)
               rest = cmsg.paramstarts[4];
@@ -1354,6 +2005,7 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 		  currptr->r_port = r_port;
 		  currptr->r_addr = r_addr;
 		  currptr->size = file_stat.st_size;
+		  currptr->total = r_size;
 		  currptr->next = NULL;
 		  
 		  /* Send RESUME request
@@ -1375,11 +2027,15 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 		 * back which is exactly what we want to do. */
 		if (ptr && type
 		    && !dccnet_new(type, p->conn_class->dcc_proxy_timeout,
+				   p->conn_class->dcc_send_window,
+				   p->conn_class->dcc_proxy_maxrate,
+				   p->conn_class->dcc_proxy_classrate,
+				   p->conn_class->dcc_proxy_weight,
 				   p->conn_class->dcc_proxy_ports,
 				   p->conn_class->dcc_proxy_ports_sz,
 				   &l_port, r_addr, r_port,
 				   capfile, p->conn_class->dcc_capture_maxsize,
-				   DCCN_FUNCTION(_ircserver_send_dccreject),
+				   r_size, DCCN_FUNCTION(_ircserver_send_dccreject),
 				   p, rejmsg, 0)) {		   
 		   if (capfile) {		      
 		      if (p->conn_class->log_events & IRC_LOG_CTCP)
@@ -1416,9 +2072,8 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
               ptr += strlen(tmp);
 
               oldstr = str;
-              str = x_sprintf("%s%s%s", oldstr, dccmsg, ptr);
+              str = arena_sprintf("%s%s%s", oldstr, dccmsg, ptr);
 
-              free(oldstr);
               free(dccmsg);
             }
 
@@ -1496,17 +2151,13 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
           irclog_log(p, IRC_LOG_CTCP, logdest, msg.src.orig,
                      "Received CTCP %s", cmsg.cmd);
         }
-
-        ircprot_freectcp(&cmsg);
-        free(unquoted);
       }
 
       /* Send str */
       if (strlen(str) && (p->client_status == IRC_CLIENT_ACTIVE))
-        net_send(p->client_sock, ":%s PRIVMSG %s :%s\r\n",
-                 msg.src.orig, msg.params[0], str);
+        ircclient_send_raw(p, ":%s PRIVMSG %s :%s",
+                           msg.src.orig, msg.params[0], str);
       squelch = 1;
-      free(str);
     }
 
   } else if (!irc_strcasecmp(msg.cmd, "NOTICE")) {
@@ -1524,7 +2175,6 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
       if (str && strlen(str))
         irclog_log(p, IRC_LOG_NOTICE, logdest, msg.src.orig, "%s", str);
-      free(str);
 
       if (list) {
         struct strlist *s;
@@ -1537,8 +2187,6 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
 
           n = s->next;
           r = ircprot_parsectcp(s->str, &cmsg);
-          free(s->str);
-          free(s);
           s = n;
           if (r == -1)
             continue;
@@ -1552,8 +2200,6 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
                        "Received CTCP %s Reply",
                        cmsg.cmd);
           }
-
-          ircprot_freectcp(&cmsg);
         }
       }
     }
@@ -1568,15 +2214,18 @@ static int _ircserver_gotmsg(struct ircproxy *p, const char *str) {
   if (!squelch 
       && ((p->client_status == IRC_CLIENT_ACTIVE)
           || (important && (p->client_status & IRC_CLIENT_CONNECTED)))) {
-    net_send(p->client_sock, "%s\r\n", msg.orig);
+    ircclient_send_raw(p, "%s", msg.orig);
   }
 
-  ircprot_freemsg(&msg);
   return 0;
 }
 
 /* Close the server socket itself */
 int ircserver_close_sock(struct ircproxy *p) {
+  struct ircchannel *c;
+
+  /* Anything still queued, a QUIT included, goes before the socket does */
+  _ircserver_sendrun(p, 1);
   net_close(&(p->server_sock));
   p->server_status &= ~(IRC_SERVER_CREATED | IRC_SERVER_CONNECTED
                         | IRC_SERVER_INTRODUCED | IRC_SERVER_GOTWELCOME);
@@ -1585,7 +2234,21 @@ int ircserver_close_sock(struct ircproxy *p) {
   timer_del((void *)p, "server_ping");
   timer_del((void *)p, "server_stoned");
   timer_del((void *)p, "server_antiidle");
+  p->ping_outstanding = p->ping_heard = 0;
+  p->server_rtt = p->server_rttvar = 0;
+  p->rtt_samples = 0;
   timer_del((void *)p, "server_recon");
+  timer_del((void *)p, "server_join");
+  ircserver_freerace(p);
+  ircserver_freesendq(p);
+  ircserver_unqueue(p);
+
+  /* What we knew about the channels will be out of date by the time we
+     get back */
+  for (c = p->channels; c; c = c->next) {
+    ircnet_channel_resetnames(c);
+    c->modes_known = 0;
+  }
 
   return 0;
 }
@@ -1602,7 +2265,7 @@ static int _ircserver_close(struct ircproxy *p) {
   irclog_log(p, IRC_LOG_SERVER, IRC_LOGFILE_SERVER, PACKAGE,
              "Lost connection to server: %s", p->servername);
 
-  timer_new((void *)p, "server_recon", p->conn_class->server_retry,
+  timer_new((void *)p, "server_recon", _ircserver_retry(p),
             TIMER_FUNCTION(_ircserver_reconnect), (void *)0);
 
   return 0;
@@ -1653,10 +2316,19 @@ int ircserver_connectagain(struct ircproxy *p) {
 /* hook for timer code to ping server */
 static void _ircserver_ping(struct ircproxy *p, void *data) {
   /* Server might not be ready yet 8*/
-  if (IS_SERVER_READY(p)) {
+  if (IS_SERVER_READY(p) && !p->ping_outstanding) {
     debug("Pinging the server");
     net_sendurgent(p->server_sock, "PING :%s\r\n", p->servername);
     debug("=> 'PING :%s'", p->servername);
+
+    /* Now we're expecting a reply, we needn't wait the whole timeout for
+       it when we know how quickly it usually comes */
+    gettimeofday(&(p->ping_sent), 0);
+    p->ping_outstanding = 1;
+    p->ping_heard = 0;
+    timer_del((void *)p, "server_stoned");
+    timer_new((void *)p, "server_stoned", _ircserver_stonedtime(p),
+              TIMER_FUNCTION(_ircserver_stoned), (void *)0);
   }
 
   timer_new((void *)p, "server_ping",
@@ -1664,10 +2336,70 @@ static void _ircserver_ping(struct ircproxy *p, void *data) {
             TIMER_FUNCTION(_ircserver_ping), (void *)0);
 }
 
+/* Got a reply to our PING, measure how long it took and keep a smoothed
+   round trip time and its deviation in milliseconds the way TCP does */
+static void _ircserver_pong(struct ircproxy *p) {
+  struct timeval now;
+  long sample, delta;
+
+  if (!p->ping_outstanding)
+    return;
+  p->ping_outstanding = 0;
+
+  gettimeofday(&now, 0);
+  sample = (now.tv_sec - p->ping_sent.tv_sec) * 1000
+           + (now.tv_usec - p->ping_sent.tv_usec) / 1000;
+  if (sample < 0)
+    sample = 0;
+
+  if (!p->rtt_samples++) {
+    p->server_rtt = sample;
+    p->server_rttvar = sample / 2;
+  } else {
+    delta = sample - p->server_rtt;
+    p->server_rtt += delta / 8;
+    p->server_rttvar += ((delta < 0 ? -delta : delta) - p->server_rttvar) / 4;
+  }
+
+  debug("Server lag %ldms, smoothed %ldms (deviation %ldms)", sample,
+        p->server_rtt, p->server_rttvar);
+}
+
+/* How long to wait for a PING reply before deciding the server is stoned,
+   generously more than it usually takes, at least half the
+   server_pingtimeout but never more than all of it */
+static long _ircserver_stonedtime(struct ircproxy *p) {
+  long wait;
+
+  if (!p->rtt_samples)
+    return p->conn_class->server_pingtimeout;
+
+  wait = (4 * (p->server_rtt + 4 * p->server_rttvar) + 999) / 1000;
+  if (wait < p->conn_class->server_pingtimeout / 2)
+    wait = p->conn_class->server_pingtimeout / 2;
+  if (wait < SERVER_STONED_MIN)
+    wait = SERVER_STONED_MIN;
+  if (wait > p->conn_class->server_pingtimeout)
+    wait = p->conn_class->server_pingtimeout;
+
+  return wait;
+}
+
 /* hook for timer code to close a stoned server */
 static void _ircserver_stoned(struct ircproxy *p, void *data) {
   /* Server is, like, stoned.  Yeah man! */
   if (IS_SERVER_READY(p)) {
+    /* Anything heard since the PING shows the link is alive and the reply
+       is just queued behind it, so give it another whole timeout */
+    if (p->ping_outstanding && p->ping_heard) {
+      debug("Server is slow to answer our PING, waiting longer");
+      p->ping_heard = 0;
+      timer_new((void *)p, "server_stoned",
+                p->conn_class->server_pingtimeout,
+                TIMER_FUNCTION(_ircserver_stoned), (void *)0);
+      return;
+    }
+
     debug("Server is stoned, reconnecting");
     ircserver_send_command(p, "QUIT", ":Getting off stoned server - %s %s",
                            PACKAGE, VERSION);
@@ -1718,22 +2450,561 @@ static int _ircserver_forclient(struct ircproxy *p, struct ircmessage *msg) {
   return 1;
 }
 
+/* Timer hook to join the channels we should be on once we've connected */
+static void _ircserver_join(struct ircproxy *p, void *data) {
+  if (!IS_SERVER_READY(p))
+    return;
+
+  ircnet_sendjoins(p);
+}
+
+/* Pick out the parameters of a 005 (ISUPPORT) that change how we read the
+   server's messages.  The last parameter is just text. */
+static void _ircserver_isupport(struct ircproxy *p, struct ircmessage *msg) {
+  int i;
+
+  for (i = 1; i < msg->numparams - 1; i++) {
+    const char *param;
+
+    param = msg->params[i];
+    if (!strncasecmp(param, "PREFIX=(", 8)) {
+      const char *end;
+
+      /* PREFIX=(modes)chars */
+      end = strchr(param + 8, ')');
+      if (end && (strlen(end + 1) == (size_t)(end - param - 8))) {
+        free(p->prefix_modes);
+        free(p->prefix_chars);
+        p->prefix_modes = x_strdup(param + 8);
+        p->prefix_modes[end - param - 8] = 0;
+        p->prefix_chars = x_strdup(end + 1);
+      }
+
+    } else if (!strncasecmp(param, "CHANMODES=", 10)) {
+      free(p->chanmodes);
+      p->chanmodes = x_strdup(param + 10);
+
+    } else if (!strncasecmp(param, "CASEMAPPING=", 12)) {
+      ircnet_casemapping(p, param + 12);
+
+    } else if (!strncasecmp(param, "TARGMAX=", 8)) {
+      const char *ptr;
+
+      /* TARGMAX=JOIN:4,PRIVMSG:3 with no number meaning no limit */
+      p->join_targmax = 0;
+      for (ptr = param + 8; ptr; ptr = strchr(ptr, ',')) {
+        if (*ptr == ',')
+          ptr++;
+        if (!strncasecmp(ptr, "JOIN:", 5))
+          p->join_targmax = atol(ptr + 5);
+      }
+
+    } else if (!strncasecmp(param, "MAXCHANNELS=", 12)) {
+      p->maxchannels = atol(param + 12);
+
+    } else if (!strncasecmp(param, "CHANLIMIT=", 10)) {
+      const char *ptr;
+
+      /* CHANLIMIT=#&:20,+:10, we only care about the largest */
+      p->maxchannels = 0;
+      for (ptr = strchr(param, ':'); ptr; ptr = strchr(ptr + 1, ':')) {
+        if (atol(ptr + 1) > p->maxchannels)
+          p->maxchannels = atol(ptr + 1);
+      }
+    }
+  }
+}
+
 /* send a command to the server with no prefix */
 int ircserver_send_command(struct ircproxy *p, const char *command, 
                                    const char *format, ...) {
+  struct netbuf *b;
   va_list ap;
-  char *msg;
-  int ret;
 
+  b = net_newbuf();
+  net_bufprintf(b, "%s ", command);
   va_start(ap, format);
-  msg = x_vsprintf(format, ap);
+  net_vbufprintf(b, format, ap);
   va_end(ap);
 
-  ret = net_send(p->server_sock, "%s %s\r\n", command, msg);
-  debug("-> '%s %s'", command, msg);
+  debug("-> '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
 
-  free(msg);
-  return ret;
+  return _ircserver_sendq(p, b, 0);
+}
+
+/* send a command to the server that can wait behind everything else, for
+   rejoining channels and asking what they're like */
+int ircserver_send_bulk(struct ircproxy *p, const char *command,
+                        const char *format, ...) {
+  struct netbuf *b;
+  va_list ap;
+
+  b = net_newbuf();
+  net_bufprintf(b, "%s ", command);
+  va_start(ap, format);
+  net_vbufprintf(b, format, ap);
+  va_end(ap);
+
+  debug("-> '%.*s' (bulk)", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
+
+  return _ircserver_sendq(p, b, 1);
+}
+
+/* send a whole line to the server, as the client gave it */
+int ircserver_send_raw(struct ircproxy *p, const char *format, ...) {
+  struct netbuf *b;
+  va_list ap;
+
+  b = net_newbuf();
+  va_start(ap, format);
+  net_vbufprintf(b, format, ap);
+  va_end(ap);
+
+  debug("-> '%.*s'", (int)b->len, b->data);
+  net_bufprintf(b, "\r\n");
+
+  return _ircserver_sendq(p, b, 0);
+}
+
+/* Queue a line (giving up our reference to it) to go to the server.
+   Control lines skip the queue, everything else is queued behind the rest
+   of its class and fed to the socket as it drains */
+static int _ircserver_sendq(struct ircproxy *p, struct netbuf *b, int bulk) {
+  char target[SENDQ_TARGET_LEN];
+  struct sendqueue *q;
+  struct sendline *l;
+  int class;
+
+  if (bulk) {
+    class = SENDQ_BULK;
+    target[0] = 0;
+  } else {
+    class = _ircserver_sendclass(p, b->data, target);
+  }
+  if ((class == SENDQ_CONTROL) || !(p->server_status & IRC_SERVER_CONNECTED)) {
+    int ret;
+
+    ret = net_queuebuf(p->server_sock, b);
+    p->sendq_stats[SENDQ_CONTROL].sent++;
+    net_freebuf(b);
+    return ret;
+  }
+
+  if (!p->sendq) {
+    p->sendq = (struct sendqueue *)malloc(sizeof(struct sendqueue));
+    memset(p->sendq, 0, sizeof(struct sendqueue));
+  }
+  q = p->sendq;
+  if (target[0])
+    _ircserver_sendjoinfirst(p, target);
+
+  if (q->spare_lines) {
+    l = q->spare_lines;
+    q->spare_lines = l->next;
+    q->nspare_lines--;
+  } else {
+    l = (struct sendline *)malloc(sizeof(struct sendline));
+  }
+  l->buf = b;
+  l->seq = q->seq++;
+  gettimeofday(&(l->queued), 0);
+  l->next = 0;
+
+  if (class == SENDQ_BULK) {
+    if (q->bulk_tail) {
+      q->bulk_tail->next = l;
+    } else {
+      q->bulk = l;
+    }
+    q->bulk_tail = l;
+
+  } else if (!target[0]) {
+    if (q->ordered_tail) {
+      q->ordered_tail->next = l;
+    } else {
+      q->ordered = l;
+    }
+    q->ordered_tail = l;
+
+  } else {
+    struct sendtarget *t;
+
+    for (t = q->targets; t; t = t->next) {
+      if (!irc_strcasecmp_map(t->name, target, p->casemapping))
+        break;
+    }
+
+    /* New targets go at the back of the round */
+    if (!t) {
+      struct sendtarget **tt;
+
+      if (q->spare_targets) {
+        t = q->spare_targets;
+        q->spare_targets = t->next;
+        q->nspare_targets--;
+      } else {
+        t = (struct sendtarget *)malloc(sizeof(struct sendtarget));
+      }
+      strcpy(t->name, target);
+      t->head = t->tail = 0;
+      t->next = 0;
+
+      for (tt = &(q->targets); *tt; tt = &((*tt)->next)) ;
+      *tt = t;
+      if (!q->turn)
+        q->turn = t;
+    }
+
+    if (t->tail) {
+      t->tail->next = l;
+    } else {
+      t->head = l;
+    }
+    t->tail = l;
+  }
+
+  p->sendq_stats[class].queued++;
+  p->sendq_stats[class].queued_bytes += b->len;
+
+  _ircserver_sendrun(p, 0);
+  return 0;
+}
+
+/* Work out which class a line goes in, and for interactive lines who it's
+   going to (target is SENDQ_TARGET_LEN long, and left empty if there isn't
+   one).  Lines that aren't for just one target, or that change things for
+   all of them, get no target and wait for everything before them. */
+static int _ircserver_sendclass(struct ircproxy *p, const char *line,
+                                char *target) {
+  char cmd[16], param[SENDQ_TARGET_LEN];
+  const char *s;
+  size_t len;
+  int nparams;
+
+  target[0] = 0;
+  s = line;
+
+  /* Skip any prefix */
+  if (*s == ':') {
+    s += strcspn(s, " ");
+    s += strspn(s, " ");
+  }
+
+  len = strcspn(s, " \r\n");
+  if (len >= sizeof(cmd))
+    len = sizeof(cmd) - 1;
+  memcpy(cmd, s, len);
+  cmd[len] = 0;
+  s += strcspn(s, " \r\n");
+  s += strspn(s, " ");
+
+  param[0] = 0;
+  nparams = 0;
+  if (*s && (*s != ':') && (*s != '\r') && (*s != '\n')) {
+    len = strcspn(s, " \r\n");
+    if (len < sizeof(param)) {
+      memcpy(param, s, len);
+      param[len] = 0;
+    }
+    nparams++;
+
+    s += strcspn(s, " \r\n");
+    s += strspn(s, " ");
+    if (*s && (*s != '\r') && (*s != '\n'))
+      nparams++;
+  }
+
+  /* Registration and keeping the link alive can't wait.  QUIT can, it has
+     to go after everything the user said before it */
+  if (!irc_strcasecmp(cmd, "PONG") || !irc_strcasecmp(cmd, "PING")
+      || !irc_strcasecmp(cmd, "PASS") || !irc_strcasecmp(cmd, "USER")
+      || (!irc_strcasecmp(cmd, "NICK") && !IS_SERVER_READY(p)))
+    return SENDQ_CONTROL;
+
+  /* Commands for one channel or nickname take turns with the others */
+  if (nparams && param[0] && !strchr(param, ',')
+      && (!irc_strcasecmp(cmd, "PRIVMSG") || !irc_strcasecmp(cmd, "NOTICE")
+          || !irc_strcasecmp(cmd, "JOIN") || !irc_strcasecmp(cmd, "PART")
+          || !irc_strcasecmp(cmd, "MODE") || !irc_strcasecmp(cmd, "TOPIC")
+          || !irc_strcasecmp(cmd, "KICK") || !irc_strcasecmp(cmd, "NAMES")
+          || !irc_strcasecmp(cmd, "WHO") || !irc_strcasecmp(cmd, "WHOIS")))
+    strcpy(target, param);
+
+  return SENDQ_INTERACTIVE;
+}
+
+/* Pick the next line to send, taking one from each target in turn with
+   bulk getting an occasional look in.  A line without a target goes once
+   everything queued before it has. */
+static struct sendline *_ircserver_sendnext(struct sendqueue *q, int *class) {
+  struct sendtarget *t;
+  struct sendline *l;
+
+  if (q->bulk && ((!q->turn && !q->ordered)
+                  || (q->since_bulk >= SENDQ_BULK_EVERY - 1))) {
+    l = q->bulk;
+    q->bulk = l->next;
+    if (!q->bulk)
+      q->bulk_tail = 0;
+    q->since_bulk = 0;
+    *class = SENDQ_BULK;
+    return l;
+  }
+
+  /* Skip targets whose next line has to wait for one without a target */
+  t = q->turn;
+  if (t && q->ordered) {
+    while (t->head->seq > q->ordered->seq) {
+      t = (t->next ? t->next : q->targets);
+      if (t == q->turn) {
+        t = 0;
+        break;
+      }
+    }
+  }
+
+  if (!t && q->ordered) {
+    l = q->ordered;
+    q->ordered = l->next;
+    if (!q->ordered)
+      q->ordered_tail = 0;
+
+    q->since_bulk++;
+    *class = SENDQ_INTERACTIVE;
+    return l;
+  }
+
+  if (t) {
+    struct sendtarget **tt;
+
+    l = t->head;
+    t->head = l->next;
+    if (!t->head)
+      t->tail = 0;
+    q->turn = (t->next ? t->next : q->targets);
+
+    /* Nothing more for them, out of the round they go */
+    if (!t->head) {
+      for (tt = &(q->targets); *tt != t; tt = &((*tt)->next)) ;
+      *tt = t->next;
+      if (q->turn == t)
+        q->turn = q->targets;
+
+      if (q->nspare_targets < SENDQ_SPARE) {
+        t->next = q->spare_targets;
+        q->spare_targets = t;
+        q->nspare_targets++;
+      } else {
+        free(t);
+      }
+    }
+
+    q->since_bulk++;
+    *class = SENDQ_INTERACTIVE;
+    return l;
+  }
+
+  return 0;
+}
+
+/* A channel whose bulk JOIN is still queued gets it moved in front of a
+   line for it, or the line would get there before we're on the channel */
+static void _ircserver_sendjoinfirst(struct ircproxy *p, const char *target) {
+  struct sendqueue *q;
+  struct sendline *l, *prev;
+
+  q = p->sendq;
+  prev = 0;
+  for (l = q->bulk; l; prev = l, l = l->next) {
+    const char *s;
+
+    if (irc_strncasecmp(l->buf->data, "JOIN ", 5))
+      continue;
+
+    s = l->buf->data + 5;
+    if (*s == ':')
+      s++;
+    while (*s && (*s != ' ') && (*s != '\r')) {
+      char chan[256];
+      size_t len;
+
+      len = strcspn(s, ", \r");
+      if (len < sizeof(chan)) {
+        memcpy(chan, s, len);
+        chan[len] = 0;
+        if (!irc_strcasecmp_map(chan, target, p->casemapping))
+          break;
+      }
+
+      s += len;
+      if (*s == ',')
+        s++;
+    }
+    if (*s && (*s != ' ') && (*s != '\r'))
+      break;
+  }
+  if (!l)
+    return;
+
+  if (prev) {
+    prev->next = l->next;
+  } else {
+    q->bulk = l->next;
+  }
+  if (q->bulk_tail == l)
+    q->bulk_tail = prev;
+
+  /* It waits for what's ahead of it like any other line without a target */
+  l->seq = q->seq++;
+  l->next = 0;
+  if (q->ordered_tail) {
+    q->ordered_tail->next = l;
+  } else {
+    q->ordered = l;
+  }
+  q->ordered_tail = l;
+
+  p->sendq_stats[SENDQ_BULK].queued--;
+  p->sendq_stats[SENDQ_BULK].queued_bytes -= l->buf->len;
+  p->sendq_stats[SENDQ_INTERACTIVE].queued++;
+  p->sendq_stats[SENDQ_INTERACTIVE].queued_bytes += l->buf->len;
+}
+
+/* Feed the socket from the queue while it has room, or everything in it
+   when we're about to close */
+static void _ircserver_sendrun(struct ircproxy *p, int all) {
+  struct sendline *l;
+  struct timeval now;
+  long room;
+  int class;
+
+  if (!p->sendq)
+    return;
+
+  /* Throttled sockets only get what they'd send in one period */
+  room = SENDQ_WATERMARK;
+  if (p->conn_class && p->conn_class->server_throttle && p->conn_class->server_throttle[0]
+      && (p->conn_class->server_throttle[0] < room))
+    room = p->conn_class->server_throttle[0];
+
+  gettimeofday(&now, 0);
+  while ((all || (net_queued(p->server_sock) < room))
+         && (l = _ircserver_sendnext(p->sendq, &class))) {
+    struct sendqclass *stats;
+    long wait;
+
+    wait = (now.tv_sec - l->queued.tv_sec) * 1000
+           + (now.tv_usec - l->queued.tv_usec) / 1000;
+    if (wait < 0)
+      wait = 0;
+
+    stats = &(p->sendq_stats[class]);
+    stats->queued--;
+    stats->queued_bytes -= l->buf->len;
+    stats->sent++;
+    stats->wait_total += wait;
+    if (wait > stats->wait_longest)
+      stats->wait_longest = wait;
+
+    net_queuebuf(p->server_sock, l->buf);
+    _ircserver_sendspare(p->sendq, l);
+  }
+}
+
+/* Finished with a line, keep it for the next one if we haven't plenty */
+static void _ircserver_sendspare(struct sendqueue *q, struct sendline *l) {
+  net_freebuf(l->buf);
+  l->buf = 0;
+
+  if (q->nspare_lines < SENDQ_SPARE) {
+    l->next = q->spare_lines;
+    q->spare_lines = l;
+    q->nspare_lines++;
+  } else {
+    free(l);
+  }
+}
+
+/* Called when some of what we sent the server has gone */
+static void _ircserver_drain(struct ircproxy *p, int sock) {
+  if (sock == p->server_sock)
+    _ircserver_sendrun(p, 0);
+}
+
+/* Throw away anything still waiting to go to the server */
+void ircserver_freesendq(struct ircproxy *p) {
+  struct sendtarget *t;
+  struct sendline *l;
+  int class;
+
+  if (!p->sendq)
+    return;
+
+  t = p->sendq->targets;
+  while (t) {
+    struct sendtarget *n;
+
+    n = t->next;
+    l = t->head;
+    while (l) {
+      struct sendline *nl;
+
+      nl = l->next;
+      net_freebuf(l->buf);
+      free(l);
+      l = nl;
+    }
+    free(t);
+    t = n;
+  }
+
+  l = p->sendq->ordered;
+  while (l) {
+    struct sendline *nl;
+
+    nl = l->next;
+    net_freebuf(l->buf);
+    free(l);
+    l = nl;
+  }
+
+  l = p->sendq->bulk;
+  while (l) {
+    struct sendline *nl;
+
+    nl = l->next;
+    net_freebuf(l->buf);
+    free(l);
+    l = nl;
+  }
+
+  l = p->sendq->spare_lines;
+  while (l) {
+    struct sendline *nl;
+
+    nl = l->next;
+    free(l);
+    l = nl;
+  }
+
+  t = p->sendq->spare_targets;
+  while (t) {
+    struct sendtarget *n;
+
+    n = t->next;
+    free(t);
+    t = n;
+  }
+
+  for (class = 0; class < SENDQ_CLASSES; class++) {
+    p->sendq_stats[class].queued = 0;
+    p->sendq_stats[class].queued_bytes = 0;
+  }
+
+  free(p->sendq);
+  p->sendq = 0;
 }
 
 /* Send a DCC reject message */
@@ -1744,12 +3015,9 @@ static int _ircserver_send_dccreject(struct ircproxy *p, const char *msg,
   if (p && p->conn_class && p->conn_class->dcc_proxy_sendreject &&
       (p->server_status == IRC_SERVER_ACTIVE)) {
     if (reason) {
-      ret = net_send(p->server_sock, "%s (%s: %s)\001\r\n", msg,
-                     PACKAGE, reason);
-      debug("-> '%s (%s: %s)\001'", msg, PACKAGE, reason);
+      ret = ircserver_send_raw(p, "%s (%s: %s)\001", msg, PACKAGE, reason);
     } else {
-      ret = net_send(p->server_sock, "%s\001\r\n", msg);
-      debug("-> '%s\001'", msg);
+      ret = ircserver_send_raw(p, "%s\001", msg);
     }
   }
 
@@ -1785,10 +3053,13 @@ static int _ircserver_dccresume_timeout(struct ircproxy *p, struct dcc_resume *n
    free(newfile);
    
    /* Make connection anyway (Just means we can't resume) */
-   if (!dccnet_new(DCC_SEND_CAPTURE, p->conn_class->dcc_proxy_timeout,
+   if (!dccnet_new(DCC_SEND_CAPTURE, p->conn_class->dcc_proxy_timeout, 0,
+		   p->conn_class->dcc_proxy_maxrate,
+		   p->conn_class->dcc_proxy_classrate,
+		   p->conn_class->dcc_proxy_weight,
 		   p->conn_class->dcc_proxy_ports, p->conn_class->dcc_proxy_ports_sz,
 		   &node->l_port, node->r_addr, node->r_port,
-		   node->capfile, p->conn_class->dcc_capture_maxsize,
+		   node->capfile, p->conn_class->dcc_capture_maxsize, node->total,
 		   DCCN_FUNCTION(_ircserver_send_dccreject), p, node->rejmsg, 0)) {  
       if (p->conn_class->log_events & IRC_LOG_CTCP)
 	irclog_log(p, IRC_LOG_NOTICE, p->servername, node->fullname, 
@@ -22,12 +22,26 @@
 /* required includes */
 #include "irc_net.h"
 
+/* how the connection scheduler is doing */
+typedef struct connstats {
+  unsigned long waiting, connecting;
+  unsigned long admitted, delayed;
+  long waiting_longest, longest;
+} ConnStats;
+
 /* functions */
 extern int ircserver_connect(struct ircproxy *);
+extern void ircserver_freesendq(struct ircproxy *);
+extern void ircserver_unqueue(struct ircproxy *);
+extern void ircserver_freerace(struct ircproxy *);
+extern void ircserver_connectstats(struct connstats *);
 extern int ircserver_close_sock(struct ircproxy *);
 extern int ircserver_connectagain(struct ircproxy *);
 extern void ircserver_resetidle(struct ircproxy *);
 extern int ircserver_send_command(struct ircproxy *, const char *, const char *,
                                   ...);
+extern int ircserver_send_raw(struct ircproxy *, const char *, ...);
+extern int ircserver_send_bulk(struct ircproxy *, const char *, const char *,
+                               ...);
 
 #endif /* __DIRCPROXY_IRC_SERVER_H */
@@ -30,6 +30,7 @@
 /* forward declarations */
 static int _irc_tolower(int);
 static int _irc_toupper(int);
+static int _irc_maplower(int, int);
 
 /* IRC version of tolower */
 static int _irc_tolower(int c) {
@@ -51,6 +52,26 @@ static int _irc_toupper(int c) {
   }
 }
 
+/* Lowercase according to a server's case mapping, rfc1459 folds []\\^ onto
+   {}|~ and strict-rfc1459 leaves ^ alone */
+static int _irc_maplower(int c, int casemap) {
+  c = (unsigned char)c;
+  switch (casemap) {
+    case IRC_CASEMAP_ASCII:
+      break;
+    case IRC_CASEMAP_STRICT:
+      if ((c >= '[') && (c <= ']'))
+        return c + ('{' - '[');
+      break;
+    default:
+      if ((c >= '[') && (c <= '^'))
+        return c + ('{' - '[');
+      break;
+  }
+
+  return ((c >= 'A') && (c <= 'Z') ? c + ('a' - 'A') : c);
+}
+
 /* Changes the case of a string to lowercase */
 char *irc_strlwr(char *str) {
   char *c;
@@ -92,18 +113,61 @@ int irc_strcasecmp(const char *s1, const char *s2) {
   return _irc_tolower(*s1) - _irc_tolower(*s2);
 }
 
-/* Match an irc string against wildcards, ignoring case */
-int irc_strcasematch(const char *str, const char *mask) {
-  char *newstr, *newmask;
-  int ret;
+/* Compare at most n characters of two irc strings, ignoring case */
+int irc_strncasecmp(const char *s1, const char *s2, size_t n) {
+  if (!n)
+    return 0;
 
-  newstr = irc_strlwr(x_strdup(str));
-  newmask = irc_strlwr(x_strdup(mask));
+  while (_irc_tolower(*s1) == _irc_tolower(*s2)) {
+    if (!*s1 || !--n)
+      return 0;
 
-  ret = strmatch(newstr, newmask);
+    s1++;
+    s2++;
+  }
+
+  return _irc_tolower(*s1) - _irc_tolower(*s2);
+}
 
-  free(newstr);
-  free(newmask);
+/* Convert the name of a case mapping given in ISUPPORT to its number,
+   anything we don't know is treated as rfc1459 */
+int irc_casemapping(const char *name) {
+  if (!strcasecmp(name, "ascii")) {
+    return IRC_CASEMAP_ASCII;
+  } else if (!strcasecmp(name, "strict-rfc1459")) {
+    return IRC_CASEMAP_STRICT;
+  } else {
+    return IRC_CASEMAP_RFC1459;
+  }
+}
 
-  return ret;
+/* Compare two irc strings, ignoring case according to the case mapping */
+int irc_strcasecmp_map(const char *s1, const char *s2, int casemap) {
+  while (_irc_maplower(*s1, casemap) == _irc_maplower(*s2, casemap)) {
+    if (!*s1)
+      return 0;
+
+    s1++;
+    s2++;
+  }
+
+  return _irc_maplower(*s1, casemap) - _irc_maplower(*s2, casemap);
+}
+
+/* Hash an irc string so that strings which compare equal under the case
+   mapping hash the same (FNV-1a) */
+unsigned long irc_strhash(const char *str, int casemap) {
+  unsigned long hash = 2166136261UL;
+
+  while (*str) {
+    hash ^= (unsigned long)_irc_maplower(*(str++), casemap);
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/* Match an irc string against wildcards, ignoring case */
+int irc_strcasematch(const char *str, const char *mask) {
+  return strmatch_map(str, mask, _irc_tolower);
 }
@@ -20,12 +20,24 @@
 #define __DIRCPROXY_IRC_STRING_H
 
 /* required includes */
+#include <sys/types.h>
+
 #include "match.h"
 
+/* case mappings a server can tell us it uses (ISUPPORT CASEMAPPING), the
+   default is rfc1459 */
+#define IRC_CASEMAP_RFC1459 0
+#define IRC_CASEMAP_STRICT  1
+#define IRC_CASEMAP_ASCII   2
+
 /* functions */
 extern char *irc_strlwr(char *);
 extern char *irc_strupr(char *);
 extern int irc_strcasecmp(const char *, const char *);
+extern int irc_strncasecmp(const char *, const char *, size_t);
 extern int irc_strcasematch(const char *, const char *);
+extern int irc_casemapping(const char *);
+extern int irc_strcasecmp_map(const char *, const char *, int);
+extern unsigned long irc_strhash(const char *, int);
 
 #endif /* __DIRCPROXY_STRINGEX_H */
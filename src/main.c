@@ -43,10 +43,12 @@
 #include <signal.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
 
 #include <dircproxy.h>
 #include "getopt/getopt.h"
 #include "sprintf.h"
+#include "arena.h"
 #include "cfgfile.h"
 #include "irc_net.h"
 #include "irc_client.h"
@@ -314,6 +316,9 @@ int main(int argc, char *argv[]) {
     }
   }
   
+  /* Used to spread out reconnections */
+  srand(time(0) ^ getpid());
+
   /* Main loop! */
   while (!stop_poll) {
     int ns, nt, status;
@@ -321,6 +326,7 @@ int main(int argc, char *argv[]) {
 
     ircnet_expunge_proxies();
     dccnet_expunge_proxies();
+    dccnet_schedule();
     ns = net_poll();
     nt = timer_poll();
 
@@ -362,6 +368,7 @@ int main(int argc, char *argv[]) {
   free(listen_port);
   free(pid_file);
   free(config_file);
+  arena_flush();
 
 #ifdef DEBUG_MEMORY
   mem_report("termination");
@@ -460,8 +467,16 @@ static int _reload_config(void) {
         struct ircproxy *p;
 
         p = ircnet_fetchclass(o);
-        if (p)
+        if (p) {
           p->conn_class = c;
+          ircclient_freeburst(p);
+
+          /* Still connecting to one of the old servers, start again */
+          if (p->race) {
+            ircserver_close_sock(p);
+            ircserver_connect(p);
+          }
+        }
 
         break;
       }
@@ -23,6 +23,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <dircproxy.h>
 #include "sprintf.h"
@@ -31,6 +32,18 @@
 
 /* Checks whether a string matches a wildcard string.  1 = yes, 0 = no */
 int strmatch(const char *str, const char *mask) {
+  return strmatch_map(str, mask, 0);
+}
+
+/* Case insentively matches against wildcards */
+int strcasematch(const char *str, const char *mask) {
+  return strmatch_map(str, mask, tolower);
+}
+
+/* Checks whether a string matches a wildcard string, comparing characters
+   after passing them through map (if given) rather than making copies of
+   both to change.  1 = yes, 0 = no */
+int strmatch_map(const char *str, const char *mask, int (*map)(int)) {
   int instar;
 
   instar = 0;
@@ -39,8 +52,10 @@ int strmatch(const char *str, const char *mask) {
       instar = 1;
       mask++;
     }
-    if ((*mask == *str) || (*mask == '?')) {
-      if (instar && strmatch(str, mask))
+    if ((*mask == '?') || (map ? (map((unsigned char)*mask)
+                                  == map((unsigned char)*str))
+                               : (*mask == *str))) {
+      if (instar && strmatch_map(str, mask, map))
         return 1;
     } else {
       if (!instar)
@@ -56,20 +71,3 @@ int strmatch(const char *str, const char *mask) {
 
   return !(*mask && (*mask != '*'));
 }
-
-/* Case insentively matches against wildcards */
-int strcasematch(const char *str, const char *mask) {
-  char *newstr, *newmask;
-  int ret;
-
-  newstr = strlwr(x_strdup(str));
-  newmask = strlwr(x_strdup(mask));
-
-  ret = strmatch(newstr, newmask);
-
-  free(newstr);
-  free(newmask);
-
-  return ret;
-}
-
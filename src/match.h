@@ -22,5 +22,6 @@
 /* functions */
 extern int strmatch(const char *, const char *);
 extern int strcasematch(const char *, const char *);
+extern int strmatch_map(const char *, const char *, int (*)(int));
 
 #endif /* __DIRCPROXY_MATCH_H */
@@ -64,6 +64,7 @@ struct memcount {
 void *mem_malloc(size_t, char *, int);
 void *mem_realloc(void *, size_t, char *, int);
 void mem_report(char *);
+void mem_counts(unsigned long *, unsigned long *);
 
 /* variables */
 static unsigned long memalloccount = 0L;
@@ -260,6 +261,13 @@ void *mem_realloc(void *ptr, size_t size, char *file, int line) {
   return block;
 }
 
+/* Get how many allocations and frees there have been, not counting those
+   made by the debugging code itself */
+void mem_counts(unsigned long *allocs, unsigned long *frees) {
+  *allocs = memalloccount;
+  *frees = memfreecount;
+}
+
 /* Reports current memory usage and shows what was malloc()d where */
 void mem_report(char *message) {
   struct memstamp *msptr;
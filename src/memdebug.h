@@ -38,5 +38,6 @@
 extern void *mem_malloc(size_t, char *, int);
 extern void *mem_realloc(void *, size_t, char *, int);
 extern void mem_report(const char *);
+extern void mem_counts(unsigned long *, unsigned long *);
 
 #endif /* __DIRCPROXY_MEMDEBUG_H */
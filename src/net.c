@@ -37,6 +37,10 @@
 
 #include <dircproxy.h>
 
+#ifdef HAVE_NETINET_TCP_H
+# include <netinet/tcp.h>
+#endif /* HAVE_NETINET_TCP_H */
+
 #ifdef HAVE_POLL_H
 # include <poll.h>
 #else /* HAVE_POLL_H */
@@ -46,6 +50,7 @@
 #endif /* HAVE_POLL_H */
 
 #include "sprintf.h"
+#include "arena.h"
 #include "net.h"
 
 /* Sanity check */
@@ -55,12 +60,17 @@
 # endif /* HAVE_SELECT */
 #endif /* HAVE_POLL */
 
-/* Structure to hold a socket buffer */
+/* Structure to hold a socket buffer.  Our memory starts at base and has
+   room for size bytes, data is where what's left to read or write begins
+   (or points into shared data that isn't ours) */
 struct sockbuff {
   void *data;
+  void *base;
+  size_t size;
   size_t linelen;
   size_t len;
   int mode;
+  struct netbuf *shared;
 
   struct sockbuff *next;
 };
@@ -72,11 +82,14 @@ struct sockinfo {
  
   struct sockbuff *in_buff, *in_buff_last;
   struct sockbuff *out_buff, *out_buff_last;
+  long out_len;
 
   int type;
   void *info;
   void (*activity_func)(void *, int);
   void (*error_func)(void *, int, int);
+  void (*drain_func)(void *, int);
+  int want_read, want_write;
 
   long throtbytes;
   long throtperiod;
@@ -89,6 +102,8 @@ struct sockinfo {
 /* forward declarations */
 static struct sockinfo *_net_fetch(int);
 static void _net_free(struct sockinfo *);
+static struct sockbuff *_net_newbuff(size_t);
+static void _net_freebuff(struct sockbuff *);
 static void _net_freebuffers(struct sockbuff *);
 static void _net_expunge(void);
 static int _net_buffer(struct sockinfo *, int, int, void *, int);
@@ -103,9 +118,23 @@ static int _net_unbuffer(struct sockinfo *, int, void *, int);
 #define SM_RAW  0x01
 #define SM_PACK 0x02
 
+/* Most buffers of each kind kept for reuse, and the most memory one can
+   have and still be kept */
+#define NET_POOL_MAX 256
+#define NET_POOL_KEEP NET_BLOCK_SIZE
+
 /* Sockets */
 static struct sockinfo *sockets = 0;
 
+/* Buffers kept for reuse, so sending or reading a line needn't malloc() */
+static struct sockbuff *sockbuff_pool = 0;
+static struct netbuf *netbuf_pool = 0;
+static int sockbuff_pooled = 0, netbuf_pooled = 0;
+
+/* Longest the next net_poll() may wait for something to happen, in
+   milliseconds */
+static long poll_wait = 1000;
+
 /* Make a non-blocking socket */
 int net_socket(int family) {
   int sock, param;
@@ -130,7 +159,7 @@ int net_socket(int family) {
 }
 
 /* Make a socket keep_alive */
-void net_keepalive(int sock) {
+void net_keepalive(int sock, long timeout) {
   struct sockinfo *sockinfo;
 
   sockinfo = _net_fetch(sock);
@@ -140,11 +169,55 @@ void net_keepalive(int sock) {
     param = 1;
     if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&param, sizeof(int)))
       syscall_fail("setsockopt", "SO_KEEPALIVE", 0);
+
+    /* Rather than the system default of hours, start probing when the
+       connection has been idle for half the timeout and give up after
+       three unanswered probes over the other half */
+    if (timeout > 0) {
+#ifdef TCP_KEEPIDLE
+      param = (timeout / 2 > 0 ? timeout / 2 : 1);
+      if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, (void *)&param,
+                     sizeof(int)))
+        syscall_fail("setsockopt", "TCP_KEEPIDLE", 0);
+#endif /* TCP_KEEPIDLE */
+#ifdef TCP_KEEPINTVL
+      param = (timeout / 6 > 0 ? timeout / 6 : 1);
+      if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, (void *)&param,
+                     sizeof(int)))
+        syscall_fail("setsockopt", "TCP_KEEPINTVL", 0);
+#endif /* TCP_KEEPINTVL */
+#ifdef TCP_KEEPCNT
+      param = 3;
+      if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, (void *)&param,
+                     sizeof(int)))
+        syscall_fail("setsockopt", "TCP_KEEPCNT", 0);
+#endif /* TCP_KEEPCNT */
+    }
   } else {
     syscall_fail("net_keepalive", 0, "bad socket provided");
   }
 }
 
+/* Give up on a socket if data we've sent to it isn't acknowledged within
+   the timeout (in seconds), where the system supports it */
+void net_usertimeout(int sock, long timeout) {
+  struct sockinfo *sockinfo;
+
+  sockinfo = _net_fetch(sock);
+  if (sockinfo) {
+#ifdef TCP_USER_TIMEOUT
+    unsigned int param;
+
+    param = (unsigned int)timeout * 1000;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, (void *)&param,
+                   sizeof(param)))
+      syscall_fail("setsockopt", "TCP_USER_TIMEOUT", 0);
+#endif /* TCP_USER_TIMEOUT */
+  } else {
+    syscall_fail("net_usertimeout", 0, "bad socket provided");
+  }
+}
+
 /* Create a sockinfo structure */
 void net_create(int *sock) {
   struct sockinfo *sockinfo;
@@ -226,14 +299,68 @@ static void _net_free(struct sockinfo *s) {
   free(s);
 }
 
+/* Get a socket buffer with room for need bytes, from the pool if there's
+   one there */
+static struct sockbuff *_net_newbuff(size_t need) {
+  struct sockbuff *b;
+
+  if (sockbuff_pool) {
+    b = sockbuff_pool;
+    sockbuff_pool = b->next;
+    sockbuff_pooled--;
+  } else {
+    b = (struct sockbuff *)malloc(sizeof(struct sockbuff));
+    if (!b)
+      return 0;
+    b->base = 0;
+    b->size = 0;
+  }
+
+  if (need > b->size) {
+    free(b->base);
+    b->base = malloc(need);
+    if (!b->base) {
+      free(b);
+      return 0;
+    }
+    b->size = need;
+  }
+
+  b->data = b->base;
+  b->linelen = b->len = 0;
+  b->mode = 0;
+  b->shared = 0;
+  b->next = 0;
+
+  return b;
+}
+
+/* Finished with a socket buffer, it goes back in the pool unless that's
+   full or the buffer has grown too big to be worth keeping */
+static void _net_freebuff(struct sockbuff *b) {
+  if (b->shared) {
+    net_freebuf(b->shared);
+    b->shared = 0;
+  }
+
+  if ((sockbuff_pooled >= NET_POOL_MAX) || (b->size > NET_POOL_KEEP)) {
+    free(b->base);
+    free(b);
+    return;
+  }
+
+  b->next = sockbuff_pool;
+  sockbuff_pool = b;
+  sockbuff_pooled++;
+}
+
 /* Free a socket buffer chain */
 static void _net_freebuffers(struct sockbuff *b) {
   while (b) {
     struct sockbuff *n;
 
     n = b->next;
-    free(b->data);
-    free(b);
+    _net_freebuff(b);
     b = n;
   }
 }
@@ -295,6 +422,25 @@ int net_flush(void) {
   }
   sockets = 0;
 
+  /* And the buffers kept for reuse */
+  while (sockbuff_pool) {
+    struct sockbuff *b;
+
+    b = sockbuff_pool;
+    sockbuff_pool = b->next;
+    free(b->base);
+    free(b);
+  }
+  while (netbuf_pool) {
+    struct netbuf *nb;
+
+    nb = netbuf_pool;
+    netbuf_pool = nb->next;
+    free(nb->data);
+    free(nb);
+  }
+  sockbuff_pooled = netbuf_pooled = 0;
+
   /* Free up the ufds buffer */
   net_poll();
 
@@ -337,6 +483,8 @@ int net_hook(int sock, int type, void *info, void (*activity_func)(void *, int),
     sockinfo->info = info;
     sockinfo->activity_func = activity_func;
     sockinfo->error_func = error_func;
+    sockinfo->want_read = 1;
+    sockinfo->want_write = 0;
     return 0;
   } else {
     syscall_fail("net_hook", 0, "bad socket provided");
@@ -344,6 +492,45 @@ int net_hook(int sock, int type, void *info, void (*activity_func)(void *, int),
   }
 }
 
+/* Set the function called each time some of a socket's output has been
+   written, so the owner can queue more when there's room for it */
+int net_drain(int sock, void (*drain_func)(void *, int)) {
+  struct sockinfo *sockinfo;
+
+  sockinfo = _net_fetch(sock);
+  if (sockinfo) {
+    sockinfo->drain_func = drain_func;
+    return 0;
+  } else {
+    syscall_fail("net_drain", 0, "bad socket provided");
+    return -1;
+  }
+}
+
+/* Say whether the owner of a direct socket wants to be told when it can be
+   read from (the activity function) or written to (the drain function) */
+int net_direct(int sock, int want_read, int want_write) {
+  struct sockinfo *sockinfo;
+
+  sockinfo = _net_fetch(sock);
+  if (sockinfo) {
+    sockinfo->want_read = want_read;
+    sockinfo->want_write = want_write;
+    return 0;
+  } else {
+    syscall_fail("net_direct", 0, "bad socket provided");
+    return -1;
+  }
+}
+
+/* Number of bytes waiting to be written to a socket */
+long net_queued(int sock) {
+  struct sockinfo *sockinfo;
+
+  sockinfo = _net_fetch(sock);
+  return (sockinfo ? sockinfo->out_len : 0);
+}
+
 /* Amend a socket's throttle attributes */
 int net_throttle(int sock, long bytes, long period) {
   struct sockinfo *sockinfo;
@@ -367,17 +554,19 @@ int net_send(int sock, const char *message, ...) {
 
   sockinfo = _net_fetch(sock);
   if (sockinfo) {
+    struct arenamark mark;
     int ret = 0;
     va_list ap;
     char *msg;
 
+    arena_mark(&mark);
     va_start(ap, message);
-    msg = x_vsprintf(message, ap);
+    msg = arena_vsprintf(message, ap);
     va_end(ap);
 
     ret = _net_buffer(sockinfo, SB_OUT, SM_PACK, msg, strlen(msg));
 
-    free(msg);
+    arena_release(&mark);
     return ret;
   } else {
     syscall_fail("net_send", 0, "bad socket provided");
@@ -391,17 +580,19 @@ int net_sendurgent(int sock, const char *message, ...) {
 
   sockinfo = _net_fetch(sock);
   if (sockinfo) {
+    struct arenamark mark;
     int ret = 0;
     va_list ap;
     char *msg;
 
+    arena_mark(&mark);
     va_start(ap, message);
-    msg = x_vsprintf(message, ap);
+    msg = arena_vsprintf(message, ap);
     va_end(ap);
 
     ret = _net_buffer(sockinfo, SB_PRI, SM_PACK, msg, strlen(msg));
 
-    free(msg);
+    arena_release(&mark);
     return ret;
   } else {
     syscall_fail("net_sendurgent", 0, "bad socket provided");
@@ -422,25 +613,122 @@ int net_queue(int sock, void *data, int len) {
   }
 }
 
+/* Get an empty buffer to format a line into, which can then be queued on
+   several sockets.  The caller holds the first reference. */
+struct netbuf *net_newbuf(void) {
+  struct netbuf *b;
+
+  if (netbuf_pool) {
+    b = netbuf_pool;
+    netbuf_pool = b->next;
+    netbuf_pooled--;
+  } else {
+    b = (struct netbuf *)malloc(sizeof(struct netbuf));
+    b->data = 0;
+    b->size = 0;
+  }
+
+  b->len = 0;
+  b->refs = 1;
+  b->next = 0;
+
+  return b;
+}
+
+/* Format onto the end of a buffer (using formatting) */
+int net_bufprintf(struct netbuf *nb, const char *format, ...) {
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  ret = net_vbufprintf(nb, format, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+/* va_list version of the above, it only needs to malloc() when the line is
+   longer than any the buffer has held before */
+int net_vbufprintf(struct netbuf *nb, const char *format, va_list ap) {
+  StrBuf sb;
+  int ret;
+
+  sb.str = nb->data;
+  sb.len = nb->len;
+  sb.size = nb->size;
+  ret = x_vbprintf(&sb, format, ap);
+
+  nb->data = sb.str;
+  nb->len = sb.len;
+  nb->size = sb.size;
+
+  return ret;
+}
+
+/* Queue shared data on the output socket, it's not copied */
+int net_queuebuf(int sock, struct netbuf *nb) {
+  struct sockinfo *sockinfo;
+  struct sockbuff *b;
+
+  sockinfo = _net_fetch(sock);
+  if (!sockinfo) {
+    syscall_fail("net_queuebuf", 0, "bad socket provided");
+    return -1;
+  }
+
+  b = _net_newbuff(0);
+  if (!b)
+    return -1;
+  b->mode = SM_PACK;
+  b->shared = nb;
+  b->data = nb->data;
+  b->len = b->linelen = nb->len;
+  nb->refs++;
+
+  if (sockinfo->out_buff) {
+    sockinfo->out_buff_last->next = b;
+  } else {
+    sockinfo->out_buff = b;
+  }
+  sockinfo->out_buff_last = b;
+  sockinfo->out_len += nb->len;
+
+  return 0;
+}
+
+/* Drop a reference to shared data, if it was the last the buffer goes back
+   in the pool to be used again */
+void net_freebuf(struct netbuf *nb) {
+  if (--nb->refs > 0)
+    return;
+
+  if ((netbuf_pooled >= NET_POOL_MAX) || (nb->size > NET_POOL_KEEP)) {
+    free(nb->data);
+    free(nb);
+    return;
+  }
+
+  nb->next = netbuf_pool;
+  netbuf_pool = nb;
+  netbuf_pooled++;
+}
+
 /* Add data to a socket's buffer */
 static int _net_buffer(struct sockinfo *s, int buff, int mode,
                        void *data, int len) {
   struct sockbuff **l;
 
+  if (buff != SB_IN)
+    s->out_len += len;
+
   /* Priority stuff just gets stuck on the front */
   if (buff == SB_PRI) {
     struct sockbuff *b;
 
-    b = (struct sockbuff *)malloc(sizeof(struct sockbuff));
+    b = _net_newbuff(len);
     if (!b)
       return -1;
-    memset(b, 0, sizeof(struct sockbuff));
     b->mode = SB_OUT;
-    b->data = malloc(len);
-    if (!b->data) {
-      free(b);
-      return -1;
-    }
     memcpy(b->data, data, len);
     b->len = len;
 
@@ -466,27 +754,42 @@ static int _net_buffer(struct sockinfo *s, int buff, int mode,
   l = (buff == SB_IN) ? &s->in_buff_last : &s->out_buff_last;
   /* Check whether we can just add to the existing buffer */
   if ((mode == SM_RAW) && *l && ((*l)->mode == mode)) {
-    (*l)->data = realloc((*l)->data, (*l)->len + len);
-    if (!(*l)->data)
-      return -1;
-    memcpy((*l)->data + (*l)->len, data, len);
-    (*l)->len += len;
-    (*l)->linelen += len;
+    struct sockbuff *b;
+
+    /* Not enough room on the end, move what's left back to the start and
+       grow it if that's still not enough */
+    b = *l;
+    if ((char *)b->data - (char *)b->base + b->len + len > b->size) {
+      if (b->data != b->base) {
+        memmove(b->base, b->data, b->len);
+        b->data = b->base;
+      }
+
+      if (b->len + len > b->size) {
+        size_t size;
+        void *base;
+
+        size = (b->size * 2 > b->len + len ? b->size * 2 : b->len + len);
+        base = realloc(b->base, size);
+        if (!base)
+          return -1;
+        b->data = b->base = base;
+        b->size = size;
+      }
+    }
+
+    memcpy((char *)b->data + b->len, data, len);
+    b->len += len;
+    b->linelen += len;
 
   } else {
     struct sockbuff *b;
 
-    /* Allocate new buffer */
-    b = (struct sockbuff *)malloc(sizeof(struct sockbuff));
+    /* Get a new buffer */
+    b = _net_newbuff(len);
     if (!b)
-      return 1;
-    memset(b, 0, sizeof(struct sockbuff));
-    b->mode = mode;
-    b->data = malloc(len);
-    if (!b->data) {
-      free(b);
       return -1;
-    }
+    b->mode = mode;
     memcpy(b->data, data, len);
     b->len = len;
     b->linelen = len;
@@ -511,7 +814,8 @@ static int _net_buffer(struct sockinfo *s, int buff, int mode,
   return 0;
 }
 
-/* Get data from a socket up unto a delimiter */
+/* Get data from a socket up unto a delimiter, the string is put in the
+   arena */
 int net_gets(int sock, char **dest, const char *delim) {
   struct sockinfo *sockinfo;
 
@@ -519,36 +823,26 @@ int net_gets(int sock, char **dest, const char *delim) {
   if (sockinfo) {
     if (sockinfo->in_buff) {
       int bufflen, retlen, getlen;
-      char *buff;
+      const char *buff;
 
-      /* Convert it into a string to make things easier */
+      /* Find out how many characters to get and how many to return, the
+         buffer isn't terminated so we can't just strcspn() it */
+      buff = sockinfo->in_buff->data;
       bufflen = sockinfo->in_buff->len;
-      buff = (char *)malloc(bufflen + 1);
-      memcpy(buff, sockinfo->in_buff->data, bufflen);
-      buff[bufflen] = 0;
-
-      /* Find out how many characters to get and how many to return */
-      retlen = strcspn(buff, delim);
-      getlen = retlen + strspn(buff + retlen, delim);
-      free(buff);
+      for (retlen = 0; retlen < bufflen; retlen++)
+        if (!buff[retlen] || strchr(delim, buff[retlen]))
+          break;
+      for (getlen = retlen; getlen < bufflen; getlen++)
+        if (!buff[getlen] || !strchr(delim, buff[getlen]))
+          break;
 
       /* Make sure there was a delimiter, then get the data */
       if (retlen < bufflen) {
-        void *get;
-
-        get = malloc(getlen);
-        if (!_net_unbuffer(sockinfo, SB_IN, get, getlen)) {
-          if (retlen) {
-            *dest = (char *)malloc(retlen + 1);
-            memcpy(*dest, get, retlen);
-            (*dest)[retlen] = 0;
-          }
-          free(get);
-
-          return retlen;
-        }
+        if (retlen)
+          *dest = arena_strndup(buff, retlen);
+        _net_unbuffer(sockinfo, SB_IN, 0, getlen);
 
-        free(get);
+        return retlen;
       }
     }
 
@@ -566,20 +860,12 @@ int net_read(int sock, void *dest, int len) {
   sockinfo = _net_fetch(sock);
   if (sockinfo) {
     if (sockinfo->in_buff) {
-      void *get;
-
       /* Omitting len means we want to know how much data is in the buffer */
       if (!len)
         return sockinfo->in_buff->len;
 
-      get = malloc(len);
-      if (!_net_unbuffer(sockinfo, SB_IN, get, len)) {
-        memcpy(dest, get, len);
-        free(get);
+      if (!_net_unbuffer(sockinfo, SB_IN, dest, len))
         return len;
-      }
-
-      free(get);
     }
 
     return 0;
@@ -589,6 +875,72 @@ int net_read(int sock, void *dest, int len) {
   }
 }
 
+/* Move the complete lines waiting on one socket onto the end of another's
+   output, handing over the buffer itself rather than copying it; only an
+   incomplete line left on the end gets copied, into a buffer of its own.
+   If tap is given, it's shown the data before it goes */
+int net_relay(int from, int to, void (*tap)(void *, const char *, int),
+              void *info) {
+  struct sockinfo *fs, *ts;
+  struct sockbuff *b, *rest;
+  char *end;
+
+  fs = _net_fetch(from);
+  ts = _net_fetch(to);
+  if (!fs || !ts) {
+    syscall_fail("net_relay", 0, "bad socket provided");
+    return -1;
+  }
+
+  /* Incoming data is always gathered into the one buffer */
+  b = fs->in_buff;
+  if (!b || !b->len)
+    return 0;
+
+  end = (char *)b->data + b->len;
+  while ((end > (char *)b->data) && (end[-1] != '\n'))
+    end--;
+  if (end == (char *)b->data)
+    return 0;
+
+  /* Split off anything after the last newline */
+  rest = 0;
+  if (end < (char *)b->data + b->len) {
+    rest = _net_newbuff((char *)b->data + b->len - end);
+    if (!rest)
+      return -1;
+    rest->mode = SM_RAW;
+    rest->len = rest->linelen = (char *)b->data + b->len - end;
+    memcpy(rest->data, end, rest->len);
+    b->len = b->linelen = end - (char *)b->data;
+  }
+
+  if (rest) {
+    rest->next = b->next;
+    fs->in_buff = rest;
+  } else {
+    fs->in_buff = b->next;
+  }
+  if (!b->next)
+    fs->in_buff_last = rest;
+
+  if (tap)
+    tap(info, b->data, b->len);
+
+  /* Whole lines, so nothing urgent gets put in the middle of one */
+  b->mode = SM_PACK;
+  b->next = 0;
+  if (ts->out_buff) {
+    ts->out_buff_last->next = b;
+  } else {
+    ts->out_buff = b;
+  }
+  ts->out_buff_last = b;
+  ts->out_len += b->len;
+
+  return b->len;
+}
+
 /* Remove data from the front of a buffer */
 static int _net_unbuffer(struct sockinfo *s, int buff, void *data, int len) {
   struct sockbuff *b;
@@ -602,27 +954,21 @@ static int _net_unbuffer(struct sockinfo *s, int buff, void *data, int len) {
   /* Store data if we are given a pointer to somewhere to put it */
   if (data)
     memcpy(data, b->data, len);
+  if (buff != SB_IN)
+    s->out_len -= len;
 
   /* Check whether there's any data left */
   b->len -= len;
   if (b->len) {
-    void *tmp;
-
-    /* Yes, shift it all up */
-    tmp = malloc(b->len);
-    if (!tmp)
-      return -1;
-    memcpy(tmp, b->data + len, b->len);
-    free(b->data);
-    b->data = tmp;
+    /* Yes, just move along it */
+    b->data = (char *)b->data + len;
 
   } else {
     struct sockbuff *n;
 
-    /* No, free up this buffer and position the next one */
+    /* No, give up this buffer and position the next one */
     n = b->next;
-    free(b->data);
-    free(b);
+    _net_freebuff(b);
 
     if (buff == SB_IN) {
       s->in_buff = n;
@@ -638,6 +984,13 @@ static int _net_unbuffer(struct sockinfo *s, int buff, void *data, int len) {
   return 0;
 }
 
+/* Don't let the next net_poll() wait longer than this many milliseconds,
+   for those who have something to do soon even if nothing happens */
+void net_pollwait(long ms) {
+  if (ms < poll_wait)
+    poll_wait = (ms > 0 ? ms : 0);
+}
+
 /* Poll sockets for activity, return number of sockets or -1 if error */
 int net_poll(void) {
 #ifdef HAVE_POLL
@@ -652,6 +1005,7 @@ int net_poll(void) {
 #endif /* HAVE_POLL */
   struct sockinfo *s;
   int ns, nr, sn;
+  long wait;
   time_t now;
   char *func;
 
@@ -664,6 +1018,8 @@ int net_poll(void) {
 #endif /* HAVE_POLL */
   nr = ns = 0;
   now = time(0);
+  wait = poll_wait;
+  poll_wait = 1000;
 
   /* Really close closed sockets */
   _net_expunge();
@@ -705,12 +1061,18 @@ int net_poll(void) {
 
 #ifdef HAVE_POLL
     ufds[sn].fd = s->sock;
-    ufds[sn].events = POLLIN;
+    ufds[sn].events = (s->want_read || (s->type != SOCK_DIRECT) ? POLLIN : 0);
     ufds[sn].revents = 0;
+
+    /* poll() reports hangups and errors whatever we ask for, so a direct
+       socket whose owner wants nothing from it isn't polled at all */
+    if ((s->type == SOCK_DIRECT) && !s->want_read && !s->want_write)
+      ufds[sn].fd = -1;
 #else /* HAVE_POLL */
 # ifdef HAVE_SELECT
     hs = (hs < s->sock ? s->sock : hs);
-    FD_SET(s->sock, &readset);
+    if (s->want_read || (s->type != SOCK_DIRECT))
+      FD_SET(s->sock, &readset);
 # endif /* HAVE_SELECT */
 #endif /* HAVE_POLL */
 
@@ -718,7 +1080,8 @@ int net_poll(void) {
        there's data to write and we're either not throttling this socket or
        we've sent less then the throttle (period stuff is done above) */
 #ifdef HAVE_POLL
-    if (s->type == SOCK_CONNECTING) {
+    if ((s->type == SOCK_CONNECTING)
+        || ((s->type == SOCK_DIRECT) && s->want_write)) {
       ufds[sn].events |= POLLOUT;
     } else if ((s->type != SOCK_LISTENING) && s->out_buff
                && (!s->throtbytes || (s->throtamt < s->throtbytes))) {
@@ -726,7 +1089,8 @@ int net_poll(void) {
     }
 #else /* HAVE_POLL */
 # ifdef HAVE_SELECT
-    if (s->type == SOCK_CONNECTING) {
+    if ((s->type == SOCK_CONNECTING)
+        || ((s->type == SOCK_DIRECT) && s->want_write)) {
       FD_SET(s->sock, &writeset);
     } else if ((s->type != SOCK_LISTENING) && s->out_buff
                && (!s->throtbytes || (s->throtamt < s->throtbytes))) {
@@ -741,13 +1105,13 @@ int net_poll(void) {
 
 #ifdef HAVE_POLL
   /* Do the poll itself */
-  nr = poll(ufds, ns, 1000);
+  nr = poll(ufds, ns, wait);
   func = "poll";
 #else /* HAVE_POLL */
 # ifdef HAVE_SELECT
   /* Do the select itself */
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
+  timeout.tv_sec = wait / 1000;
+  timeout.tv_usec = (wait % 1000) * 1000;
   nr = select(hs + 1, &readset, &writeset, 0, &timeout);
   func = "select";
 # endif /* HAVE_SELECT */
@@ -803,6 +1167,7 @@ int net_poll(void) {
               s->closed = 1;
             }
           } else if (error) {
+            errno = error;
             if (s->error_func) {
               s->error_func(s->info, s->sock, 1);
             } else {
@@ -828,8 +1193,32 @@ int net_poll(void) {
       } else {
         /* If we can read from the socket, suck in all the data there is to
            keep the buffer size on the IRC server down.
-           This can result in the call of the error function. */
-        if (can_read) {
+           This can result in the call of the error function.  Direct
+           sockets are left for the owner to read. */
+        if (can_read && (s->type == SOCK_DIRECT)) {
+          if (s->closed) {
+            /* Nothing */
+          } else if (s->want_read) {
+            if (s->activity_func)
+              s->activity_func(s->info, s->sock);
+          } else {
+            int error = 0, len;
+
+            /* The owner isn't reading, so it would never see this hangup or
+               error; tell it through the error function instead */
+            len = sizeof(int);
+            if (!getsockopt(s->sock, SOL_SOCKET, SO_ERROR,
+                            (void *)&error, &len) && error)
+              errno = error;
+
+            if (s->error_func) {
+              s->error_func(s->info, s->sock, (error != ECONNRESET));
+            } else {
+              s->closed = 1;
+            }
+          }
+
+        } else if (can_read) {
           char buff[NET_BLOCK_SIZE];
           int br, rr;
 
@@ -854,6 +1243,7 @@ int net_poll(void) {
               /* Make sure that it really closes */
               _net_freebuffers(s->out_buff);
               s->out_buff = 0;
+              s->out_len = 0;
 
               if (!s->closed && s->error_func) {
                 s->error_func(s->info, s->sock, baderror);
@@ -868,6 +1258,7 @@ int net_poll(void) {
             /* Make sure that it really closes */
             _net_freebuffers(s->out_buff);
             s->out_buff = 0;
+            s->out_len = 0;
 
             if (!s->closed && s->error_func) {
               s->error_func(s->info, s->sock, 0);
@@ -880,6 +1271,9 @@ int net_poll(void) {
         /* If we can write data to the socket write any that we have lying
            around, keeping in mind throttling of course */
         if ((!s->closed || s->out_buff) && can_write) {
+          int written;
+
+          written = 0;
           while (s->out_buff) {
             int bl, wl;
 
@@ -911,10 +1305,20 @@ int net_poll(void) {
               _net_unbuffer(s, SB_OUT, 0, wl);
               if (s->throtbytes)
                 s->throtamt += wl;
+              written += wl;
             }
           }
+
+          /* Let the owner top it up again */
+          if (!s->closed && written && s->drain_func)
+            s->drain_func(s->info, s->sock);
         }
 
+        /* Let the owner of a direct socket write to it */
+        if (!s->closed && can_write && (s->type == SOCK_DIRECT)
+            && s->want_write && s->drain_func)
+          s->drain_func(s->info, s->sock);
+
         /* If there's incoming data, call the activity function */
         if (!s->closed && s->in_buff && s->activity_func)
           s->activity_func(s->info, s->sock);
@@ -23,6 +23,10 @@
 #include "config.h"
 #endif
 
+/* required includes */
+#include <stddef.h>
+#include <stdarg.h>
+
 #if HAVE_STRUCT_SOCKADDR_STORAGE_SS_FAMILY
 #  define HAVE_IPV6 1
 #  define SOCKADDR struct sockaddr_storage
@@ -41,6 +45,18 @@
 #define SOCK_NORMAL     0x00
 #define SOCK_CONNECTING 0x01
 #define SOCK_LISTENING  0x02
+#define SOCK_DIRECT     0x03  /* Owner does its own reading and writing */
+
+/* Data that can be queued on several sockets at once without copying it,
+   given back when the last of them has sent it.  size is how much room
+   data has, which is kept when the buffer is reused for another line. */
+typedef struct netbuf {
+  char *data;
+  size_t len, size;
+  int refs;
+
+  struct netbuf *next;
+} NetBuf;
 
 /* handy defines */
 #define ACTIVITY_FUNCTION(_FUNC) ((void (*)(void *, int)) (_FUNC))
@@ -49,18 +65,29 @@
 /* functions */
 extern int net_socket(int);
 extern void net_create(int *);
-extern void net_keepalive(int);
+extern void net_keepalive(int, long);
+extern void net_usertimeout(int, long);
 extern int net_close(int *);
 extern int net_closeall(void);
 extern int net_flush(void);
 extern int net_hook(int, int, void *,
                     void(*)(void *, int), void(*)(void *, int, int));
+extern int net_drain(int, void(*)(void *, int));
+extern int net_direct(int, int, int);
+extern long net_queued(int);
 extern int net_throttle(int, long, long);
 extern int net_send(int, const char *, ...);
 extern int net_sendurgent(int, const char *, ...);
 extern int net_queue(int, void *, int);
+extern struct netbuf *net_newbuf(void);
+extern int net_bufprintf(struct netbuf *, const char *, ...);
+extern int net_vbufprintf(struct netbuf *, const char *, va_list);
+extern int net_queuebuf(int, struct netbuf *);
+extern void net_freebuf(struct netbuf *);
 extern int net_gets(int, char **, const char *);
 extern int net_read(int, void *, int);
+extern int net_relay(int, int, void(*)(void *, const char *, int), void *);
+extern void net_pollwait(long);
 extern int net_poll(void);
 
 extern const char *net_ntop(SOCKADDR *, char *, int);
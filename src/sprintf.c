@@ -9,6 +9,7 @@
  * 
  * sprintf.c
  *  - various ways of doing allocating sprintf() functions to void b/o
+ *  - formatting onto the end of a string being built up
  *  - wrapper around strdup()
  * --
  * @(#) $Id: sprintf.c,v 1.12 2002/12/29 21:30:12 scott Exp $
@@ -28,6 +29,28 @@
 #include "stringex.h"
 #include "sprintf.h"
 
+/* Most strings we format are short, so they're done on the stack and only
+   copied to the heap once we know how long they are */
+#define X_STACK_SIZE 256
+
+/* Where formatted output is going */
+struct _x_out {
+  struct strbuf *sb;
+  int fixed;                    /* sb->str isn't ours to realloc() */
+#ifdef DEBUG_MEMORY
+  char *file;
+  int line;
+#endif /* DEBUG_MEMORY */
+};
+
+/* forward declarations */
+static int _x_grow(struct _x_out *, size_t);
+static int _x_vformat(struct _x_out *, const char *, va_list);
+static void _x_put(struct _x_out *, const char *, size_t);
+static void _x_pad(struct _x_out *, char, int);
+static void _x_num(struct _x_out *, unsigned long, int, int, int, int, int,
+                   int, int, char);
+
 /* The sprintf() version is just a wrapper around whatever vsprintf() we
    decide to implement. */
 #ifdef DEBUG_MEMORY
@@ -64,486 +87,379 @@ char *x_vsprintf(const char *format, va_list ap) {
 
 #else /* HAVE_VASPRINTF */
 
-# ifdef HAVE_VSNPRINTF
-
-/* Does vsnprintf()s until its not truncated and returns the string.  We
-   can't memdebug this, so its disabled by configure.in if DEBUG_MEMORY is
-   enabled. */
-char *x_vsprintf(const char *format, va_list ap) {
-  int buffsz, ret;
-  char *buff;
-
-  buff = 0;
-  buffsz = 0;
-
-  do {
-    buffsz += 64;
-    buff = (char *)realloc(buff, buffsz + 1);
-
-    ret = vsnprintf(buff, buffsz, format, ap);
-  } while ((ret == -1) || (ret >= buffsz));
-
-  return buff;
-}
-
-# else /* HAVE_VSNPRINTF */
-
-/* These routines are based on those found in the Linux Kernel.  I've
- * rewritten them quite a bit (read completely) since then.
- *
- * Copyright (C) 1991, 1992  Linus Torvalds
- */
-
-/* Makes a string representation of a number which can have different
-   lengths, bases and precisions etc. */
+/* Formats on the stack, and only goes to the heap when it knows how much
+   it needs or it's outgrown the stack */
 #ifdef DEBUG_MEMORY
-static char *_x_makenum(char *file, int line,
-                        long num, int base, int minsize, int mindigits,
-                        char padchar, char signchar) {
+char *xx_vsprintf(char *file, int line, const char *format, va_list ap) {
 #else /* DEBUG_MEMORY */
-static char *_x_makenum(long num, int base, int minsize, int mindigits,
-                        char padchar, char signchar) {
+char *x_vsprintf(const char *format, va_list ap) {
 #endif /* DEBUG_MEMORY */
-  static char *digits = "0123456789abcdefghijklmnopqrstuvwxyz";
-  unsigned long newstrlen;
-  char *newstr;
-  int i, j;
+  char stack[X_STACK_SIZE];
+  struct strbuf sb;
+  struct _x_out o;
 
-  if ((base < 2) || (base > 36) || (minsize < 0) || (mindigits < 0)) {
-    return NULL;
-  }
+  sb.str = stack;
+  sb.len = 0;
+  sb.size = sizeof(stack);
+  o.sb = &sb;
+  o.fixed = 1;
+#ifdef DEBUG_MEMORY
+  o.file = file;
+  o.line = line;
+#endif /* DEBUG_MEMORY */
 
+  _x_vformat(&o, format, ap);
+  if (o.fixed) {
 #ifdef DEBUG_MEMORY
-  newstr = xx_strdup(file, line, "");
+    sb.str = (char *)mem_malloc(sb.len + 1, file, line);
 #else /* DEBUG_MEMORY */
-  newstr = x_strdup("");
+    sb.str = (char *)malloc(sb.len + 1);
 #endif /* DEBUG_MEMORY */
-  newstrlen = 1;
-
-  if (signchar) {
-    if (num < 0) {
-      signchar = '-';
-      num = -num;
-    }
-  }
-  if (signchar == ' ') {
-    signchar = 0;
+    if (sb.str)
+      memcpy(sb.str, stack, sb.len + 1);
   }
 
-  if (!num) {
+  return sb.str;
+}
+
+#endif /* HAVE_VASPRINTF */
+
+/* Formats onto the end of a string being built up, returns how much was
+   added or -1 if it couldn't be */
 #ifdef DEBUG_MEMORY
-    newstr = (char *)mem_realloc(newstr, newstrlen + 1, file, line);
+int xx_bprintf(char *file, int line, struct strbuf *sb,
+               const char *format, ...) {
 #else /* DEBUG_MEMORY */
-    newstr = (char *)realloc(newstr, newstrlen + 1);
+int x_bprintf(struct strbuf *sb, const char *format, ...) {
 #endif /* DEBUG_MEMORY */
-    strcpy(newstr + newstrlen - 1, "0");
-    newstrlen++;
-  } else {
-    while (num) {
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
 #ifdef DEBUG_MEMORY
-      newstr = (char *)mem_realloc(newstr, newstrlen + 1, file, line);
+  ret = xx_vbprintf(file, line, sb, format, ap);
 #else /* DEBUG_MEMORY */
-      newstr = (char *)realloc(newstr, newstrlen + 1);
+  ret = x_vbprintf(sb, format, ap);
 #endif /* DEBUG_MEMORY */
-      newstr[newstrlen - 1] = digits[((unsigned long) num) % base];
-      newstr[newstrlen] = 0;
-      newstrlen++;
-      num = ((unsigned long) num) / base;
-    }
-  }
+  va_end(ap);
+
+  return ret;
+}
 
-  if (strlen(newstr) < mindigits) {
-    mindigits -= strlen(newstr);
-    while (mindigits--) {
+/* va_list version of the above */
 #ifdef DEBUG_MEMORY
-      newstr = (char *)mem_realloc(newstr, newstrlen + 1, file, line);
+int xx_vbprintf(char *file, int line, struct strbuf *sb,
+                const char *format, va_list ap) {
 #else /* DEBUG_MEMORY */
-      newstr = (char *)realloc(newstr, newstrlen + 1);
+int x_vbprintf(struct strbuf *sb, const char *format, va_list ap) {
 #endif /* DEBUG_MEMORY */
-      strcpy(newstr + newstrlen - 1, "0");
-      newstrlen++;
-    }
-  }
+  struct _x_out o;
 
-  if (signchar && (padchar != '0')) {
+  o.sb = sb;
+  o.fixed = 0;
 #ifdef DEBUG_MEMORY
-    newstr = (char *)mem_realloc(newstr, newstrlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-    newstr = (char *)realloc(newstr, newstrlen + 1);
+  o.file = file;
+  o.line = line;
 #endif /* DEBUG_MEMORY */
-    newstr[newstrlen - 1] = signchar;
-    newstr[newstrlen] = 0;
-    newstrlen++;
-    signchar = 0;
-  }
 
-  if ((strlen(newstr) < minsize) && padchar) {
-    minsize -= strlen(newstr);
-    while (minsize--) {
+  return _x_vformat(&o, format, ap);
+}
+
+/* Formats into space in sb that isn't ours, such as the stack or an arena.
+   If it doesn't fit, the string is moved to the heap and sb->str is then
+   the caller's to free() */
 #ifdef DEBUG_MEMORY
-      newstr = (char *)mem_realloc(newstr, newstrlen + 1, file, line);
+int xx_vbprintf_fixed(char *file, int line, struct strbuf *sb,
+                      const char *format, va_list ap) {
 #else /* DEBUG_MEMORY */
-      newstr = (char *)realloc(newstr, newstrlen + 1);
+int x_vbprintf_fixed(struct strbuf *sb, const char *format, va_list ap) {
 #endif /* DEBUG_MEMORY */
-      newstr[newstrlen - 1] = padchar;
-      newstr[newstrlen] = 0;
-      newstrlen++;
-    }
-    if (signchar) {
-      newstr[strlen(newstr)-1] = signchar;
-      signchar = 0;
-    }
-  }
+  struct _x_out o;
 
-  if (signchar) {
+  o.sb = sb;
+  o.fixed = 1;
 #ifdef DEBUG_MEMORY
-    newstr = (char *)mem_realloc(newstr, newstrlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-    newstr = (char *)realloc(newstr, newstrlen + 1);
+  o.file = file;
+  o.line = line;
 #endif /* DEBUG_MEMORY */
-    newstr[newstrlen - 1] = signchar;
-    newstr[newstrlen] = 0;
-    newstrlen++;
-  }
 
-  i = strlen(newstr)-1;
-  j = 0;
-  while (i > j) {
-    char tmpchar;
+  return _x_vformat(&o, format, ap);
+}
 
-    tmpchar = newstr[i];
-    newstr[i] = newstr[j];
-    newstr[j] = tmpchar;
-    i--;
-    j++;
-  }
+/* Make sure there's room for need more characters and the terminator,
+   at least doubling so building up a string a piece at a time is cheap */
+static int _x_grow(struct _x_out *o, size_t need) {
+  struct strbuf *sb;
+  size_t size;
+  char *str;
 
-  if ((strlen(newstr) < minsize) && !padchar) {
-    char *tmpstr;
+  sb = o->sb;
+  if (sb->len + need < sb->size)
+    return 0;
 
-    i = minsize - strlen(newstr);
-#ifdef DEBUG_MEMORY
-    tmpstr = (char *)mem_malloc(i + 1, file, line);
-#else /* DEBUG_MEMORY */
-    tmpstr = (char *)malloc(i + 1);
-#endif /* DEBUG_MEMORY */
-    tmpstr[i--] = 0;
-    while (i >= 0) {
-      tmpstr[i--] = ' ';
-    }
+  size = (sb->size ? sb->size * 2 : 64);
+  while (size <= sb->len + need)
+    size *= 2;
 
+  if (o->fixed) {
 #ifdef DEBUG_MEMORY
-    tmpstr = (char *)mem_realloc(tmpstr, strlen(tmpstr) + strlen(newstr) + 1,
-                                 file, line);
+    str = (char *)mem_malloc(size, o->file, o->line);
 #else /* DEBUG_MEMORY */
-    tmpstr = (char *)realloc(tmpstr, strlen(tmpstr) + strlen(newstr) + 1);
+    str = (char *)malloc(size);
 #endif /* DEBUG_MEMORY */
-    strcpy(tmpstr + strlen(tmpstr), newstr);
+    if (str)
+      memcpy(str, sb->str, sb->len);
+  } else {
 #ifdef DEBUG_MEMORY
-    mem_realloc(newstr, 0, file, line);
+    str = (char *)mem_realloc(sb->str, size, o->file, o->line);
 #else /* DEBUG_MEMORY */
-    free(newstr);
+    str = (char *)realloc(sb->str, size);
 #endif /* DEBUG_MEMORY */
-    newstr = tmpstr;
   }
+  if (!str)
+    return -1;
 
-  return newstr;
+  sb->str = str;
+  sb->size = size;
+  o->fixed = 0;
+  return 0;
 }
 
-/* Basically vasprintf, except it doesn't do floating point or pointers */
-#ifdef DEBUG_MEMORY
-char *xx_vsprintf(char *file, int line, const char *format, va_list ap) {
-#else /* DEBUG_MEMORY */
-char *x_vsprintf(const char *format, va_list ap) {
-#endif /* DEBUG_MEMORY */
-  char *newdest, *formatcpy, *formatpos, padding, signchar, qualifier;
-  int width, prec, base, special, len, caps;
-  unsigned long newdestlen;
-  long num;
+/* These routines were once based on those found in the Linux Kernel,
+ * though they've been rewritten completely since.
+ *
+ * Copyright (C) 1991, 1992  Linus Torvalds
+ */
 
-#ifdef DEBUG_MEMORY
-  newdest = xx_strdup(file, line, "");
-#else /* DEBUG_MEMORY */
-  newdest = x_strdup("");
-#endif /* DEBUG_MEMORY */
-  newdestlen = 1;
-#ifdef DEBUG_MEMORY
-  formatpos = formatcpy = xx_strdup(file, line, format);
-#else /* DEBUG_MEMORY */
-  formatpos = formatcpy = x_strdup(format);
-#endif /* DEBUG_MEMORY */
+/* Basically vsnprintf, except it doesn't do floating point or pointers.
+   It goes through the format once, putting everything straight into the
+   buffer. */
+static int _x_vformat(struct _x_out *o, const char *format, va_list ap) {
+  const char *pos, *str;
+  int left, zero, plus, space, special, width, prec, qualifier;
+  size_t start, len;
+
+  start = o->sb->len;
+  pos = format;
+  while (*pos) {
+    /* Copy everything up to the next conversion in one go */
+    len = strcspn(pos, "%");
+    if (len) {
+      _x_put(o, pos, len);
+      pos += len;
+      continue;
+    }
+    pos++;
+
+    left = zero = plus = space = special = 0;
+    while (1) {
+      if (*pos == '-') {
+        left = 1;
+      } else if (*pos == '+') {
+        plus = 1;
+      } else if (*pos == ' ') {
+        space = 1;
+      } else if (*pos == '#') {
+        special = 1;
+      } else if (*pos == '0') {
+        zero = 1;
+      } else {
+        break;
+      }
+      pos++;
+    }
 
-  while (*formatpos) {
-    if (*formatpos == '%') {
-      padding = signchar = ' ';
-      qualifier = 0;
-      width = prec = special = caps = 0;
-      base = 10;
-      formatpos++;
-
-      while (1) {
-        if (*formatpos == '-') {
-          padding = 0;
-        } else if (*formatpos == '+') {
-          signchar = '+';
-        } else if (*formatpos == ' ') {
-          signchar = (signchar == '+') ? '+' : ' ';
-        } else if (*formatpos == '#') {
-          special = 1;
-        } else {
-          break;
-        }
-        formatpos++;
+    width = 0;
+    if (*pos == '*') {
+      width = va_arg(ap, int);
+      if (width < 0) {
+        width = -width;
+        left = 1;
       }
+      pos++;
+    } else {
+      while (isdigit(*pos))
+        width = width * 10 + (*(pos++) - '0');
+    }
 
-      if (*formatpos == '*') {
-        width = va_arg(ap, int);
-        if (width < 0) {
-          width =- width;
-          padding = 0;
-        }
-        formatpos++;
+    prec = -1;
+    if (*pos == '.') {
+      pos++;
+      if (*pos == '*') {
+        prec = va_arg(ap, int);
+        pos++;
       } else {
-        if (*formatpos == '0') {
-          padding = '0';
-          formatpos++;
-        }
-
-        while (isdigit(*formatpos)) {
-          width *= 10;
-          width += (*formatpos - '0');
-          formatpos++;
-        }
+        prec = 0;
+        while (isdigit(*pos))
+          prec = prec * 10 + (*(pos++) - '0');
       }
+    }
 
-      if (*formatpos == '.') {
-        formatpos++;
-        if (*formatpos == '*') {
-          prec = abs(va_arg(ap, int));
-          formatpos++;
+    qualifier = 0;
+    if ((*pos == 'h') || (*pos == 'l'))
+      qualifier = *(pos++);
+
+    switch (*pos) {
+      case 'c':
+        {
+          char c;
+
+          c = (char)va_arg(ap, int);
+          if (!left)
+            _x_pad(o, ' ', width - 1);
+          _x_put(o, &c, 1);
+          if (left)
+            _x_pad(o, ' ', width - 1);
+        }
+        break;
+
+      case 's':
+        str = va_arg(ap, const char *);
+        if (!str)
+          str = "(null)";
+        if (prec >= 0) {
+          for (len = 0; (len < (size_t)prec) && str[len]; len++) ;
         } else {
-          while (isdigit(*formatpos)) {
-            prec *= 10;
-            prec += (*formatpos - '0');
-            formatpos++;
-          }
+          len = strlen(str);
         }
-      }
 
-      if ((*formatpos == 'h') || (*formatpos == 'l')) {
-        qualifier = *formatpos;
-        formatpos++;
-      }
+        if (!left)
+          _x_pad(o, ' ', width - (int)len);
+        _x_put(o, str, len);
+        if (left)
+          _x_pad(o, ' ', width - (int)len);
+        break;
+
+      case 'd':
+      case 'i':
+        {
+          long num;
+
+          if (qualifier == 'l') {
+            num = va_arg(ap, long);
+          } else if (qualifier == 'h') {
+            num = (short)va_arg(ap, int);
+          } else {
+            num = va_arg(ap, int);
+          }
 
-      if (*formatpos == 'c') {
-        if (padding) {
-          while (--width > 0) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-            newdest[newdestlen - 1] = padding;
-            newdest[newdestlen] = 0;
-            newdestlen++;
+          _x_num(o, (num < 0 ? -(unsigned long)num : (unsigned long)num),
+                 10, 0, width, prec, left, zero,
+                 0, (num < 0 ? '-' : (plus ? '+' : (space ? ' ' : 0))));
+        }
+        break;
+
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        {
+          unsigned long num;
+
+          if (qualifier == 'l') {
+            num = va_arg(ap, unsigned long);
+          } else if (qualifier == 'h') {
+            num = (unsigned short)va_arg(ap, unsigned int);
+          } else {
+            num = va_arg(ap, unsigned int);
           }
+
+          _x_num(o, num, (*pos == 'u' ? 10 : (*pos == 'o' ? 8 : 16)),
+                 (*pos == 'X'), width, prec, left, zero,
+                 (special && num && (*pos != 'u')), 0);
         }
+        break;
 
-#ifdef DEBUG_MEMORY
-        newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-        newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-        newdest[newdestlen - 1] = va_arg(ap, unsigned char);
-        newdest[newdestlen] = 0;
-        newdestlen++;
+      case '%':
+        _x_put(o, "%", 1);
+        break;
 
-        if (!padding) {
-          while (--width > 0) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-            newdest[newdestlen - 1] = padding;
-            newdest[newdestlen] = 0;
-            newdestlen++;
-          }
-        }
-      } else if (*formatpos == 's') {
-        char *tmpstr;
+      case 0:
+        /* Format ended half way through, stay on the terminator */
+        pos--;
+        break;
+    }
+    pos++;
+  }
 
-#ifdef DEBUG_MEMORY
-        tmpstr = xx_strdup(file, line, va_arg(ap, char *));
-#else /* DEBUG_MEMORY */
-        tmpstr = x_strdup(va_arg(ap, char *));
-#endif /* DEBUG_MEMORY */
-        len = (prec && (prec < strlen(tmpstr))) ? prec : strlen(tmpstr);
-        if (padding) {
-          while (--width > len) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-            newdest[newdestlen - 1] = padding;
-            newdest[newdestlen] = 0;
-            newdestlen++;
-          }
-        }
+  /* Always leave it terminated */
+  if (_x_grow(o, 0))
+    return -1;
+  o->sb->str[o->sb->len] = 0;
 
-#ifdef DEBUG_MEMORY
-        newdest = (char *)mem_realloc(newdest, newdestlen + len, file, line);
-#else /* DEBUG_MEMORY */
-        newdest = (char *)realloc(newdest, newdestlen + len);
-#endif /* DEBUG_MEMORY */
-        strncpy(newdest + newdestlen - 1, tmpstr, len);
-        newdestlen += len;
-        newdest[newdestlen - 1] = 0;
-#ifdef DEBUG_MEMORY
-        mem_realloc(tmpstr, 0, file, line);
-#else /* DEBUG_MEMORY */
-        free(tmpstr);
-#endif /* DEBUG_MEMORY */
+  return o->sb->len - start;
+}
 
-        if (!padding) {
-          while (--width > len) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-            newdest[newdestlen - 1] = padding;
-            newdest[newdestlen] = 0;
-            newdestlen++;
-          }
-        }
-      } else if (strchr("oXxdiu", *formatpos) != NULL) {
-        char *tmpstr;
+/* Put some characters onto the end of the output */
+static void _x_put(struct _x_out *o, const char *s, size_t len) {
+  if (_x_grow(o, len))
+    return;
 
-        if (*formatpos == 'o') {
-          base = 8;
-          if (signchar) {
-            signchar = 0;
-          }
-          if (special) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-            strcpy(newdest + newdestlen - 1, "0");
-            newdestlen++;
-          }
-        } else if (*formatpos == 'X') {
-          base = 16;
-          caps = 1;
-          if (signchar) {
-            signchar = 0;
-          }
-          if (special) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-            strcpy(newdest + newdestlen - 1, "0");
-            newdestlen++;
-          }
-        } else if (*formatpos == 'x') {
-          base = 16;
-          if (signchar) {
-            signchar = 0;
-          }
-          if (special) {
-#ifdef DEBUG_MEMORY
-            newdest = (char *)mem_realloc(newdest, newdestlen + 2, file, line);
-#else /* DEBUG_MEMORY */
-            newdest = (char *)realloc(newdest, newdestlen + 2);
-#endif /* DEBUG_MEMORY */
-            strcpy(newdest + newdestlen - 1, "0x");
-            newdestlen += 2;
-          }
-        } else if (*formatpos == 'i') {
-          if (!signchar) {
-            signchar = ' ';
-          }
-        } else if (*formatpos == 'u') {
-          if (signchar) {
-            signchar = 0;
-          }
-        }
-        
-        if (qualifier == 'l') {
-          num = va_arg(ap, unsigned long);
-        } else if (qualifier == 'h') {
-          if (signchar) {
-            num = va_arg(ap, signed short int);
-          } else {
-            num = va_arg(ap, unsigned short int);
-          }
-        } else if (signchar) {
-          num = va_arg(ap, signed int);
-        } else {
-          num = va_arg(ap, unsigned int);
-        }
+  memcpy(o->sb->str + o->sb->len, s, len);
+  o->sb->len += len;
+}
 
-#ifdef DEBUG_MEMORY
-        tmpstr = _x_makenum(file, line,
-                            num, base, width, prec, padding, signchar);
-#else /* DEBUG_MEMORY */
-        tmpstr = _x_makenum(num, base, width, prec, padding, signchar);
-#endif /* DEBUG_MEMORY */
-        if (caps)
-          strupr(tmpstr);
+/* Put some of the same character onto the end of the output */
+static void _x_pad(struct _x_out *o, char c, int len) {
+  if ((len <= 0) || _x_grow(o, len))
+    return;
 
-#ifdef DEBUG_MEMORY
-        newdest = (char *)mem_realloc(newdest, newdestlen + strlen(tmpstr),
-                                      file, line);
-#else /* DEBUG_MEMORY */
-        newdest = (char *)realloc(newdest, newdestlen + strlen(tmpstr));
-#endif /* DEBUG_MEMORY */
-        strcpy(newdest + newdestlen - 1, tmpstr);
-        newdestlen += strlen(tmpstr);
-#ifdef DEBUG_MEMORY
-        mem_realloc(tmpstr, 0, file, line);
-#else /* DEBUG_MEMORY */
-        free(tmpstr);
-#endif /* DEBUG_MEMORY */
-      } else if (*formatpos == '%') {
-#ifdef DEBUG_MEMORY
-        newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-        newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-        newdest[newdestlen - 1] = *formatpos;
-        newdest[newdestlen] = 0;
-        newdestlen++;
-      }
-    } else {
-#ifdef DEBUG_MEMORY
-      newdest = (char *)mem_realloc(newdest, newdestlen + 1, file, line);
-#else /* DEBUG_MEMORY */
-      newdest = (char *)realloc(newdest, newdestlen + 1);
-#endif /* DEBUG_MEMORY */
-      newdest[newdestlen - 1] = *formatpos;
-      newdest[newdestlen] = 0;
-      newdestlen++;
-    }
+  memset(o->sb->str + o->sb->len, c, len);
+  o->sb->len += len;
+}
 
-    formatpos++;
+/* Put a number onto the end of the output.  The digits are worked out
+   backwards on the stack, then it all goes out in the right order. */
+static void _x_num(struct _x_out *o, unsigned long num, int base, int caps,
+                   int width, int prec, int left, int zero, int special,
+                   char signchar) {
+  static const char *lower = "0123456789abcdef";
+  static const char *upper = "0123456789ABCDEF";
+  const char *digits, *prefix;
+  char buf[sizeof(unsigned long) * 3 + 1];
+  int ndigits, nzeros, plen, total;
+
+  digits = (caps ? upper : lower);
+  ndigits = 0;
+  if ((num || (prec != 0)) && (base == 10)) {
+    /* Dividing by a constant is much quicker, and it's nearly always 10 */
+    do {
+      buf[sizeof(buf) - ++ndigits] = '0' + num % 10;
+      num /= 10;
+    } while (num);
+  } else if (num || (prec != 0)) {
+    do {
+      buf[sizeof(buf) - ++ndigits] = digits[num % base];
+      num /= base;
+    } while (num);
   }
 
-#ifdef DEBUG_MEMORY
-  mem_realloc(formatcpy, 0, file, line);
-#else /* DEBUG_MEMORY */
-  free(formatcpy);
-#endif /* DEBUG_MEMORY */
-  return newdest;
-}
+  /* Octal's 0 prefix only if there isn't one already */
+  prefix = "";
+  if (special && (base == 16)) {
+    prefix = (caps ? "0X" : "0x");
+  } else if (special && (base == 8) && (prec <= ndigits)) {
+    prefix = "0";
+  }
+  plen = strlen(prefix) + (signchar ? 1 : 0);
 
-# endif /* HAVE_VSNPRINTF */
-#endif /* HAVE_VASPRINTF */
+  nzeros = (prec > ndigits ? prec - ndigits : 0);
+  total = plen + nzeros + ndigits;
+  if (zero && !left && (prec < 0) && (width > total)) {
+    nzeros += width - total;
+    total = width;
+  }
+
+  if (!left)
+    _x_pad(o, ' ', width - total);
+  if (signchar)
+    _x_put(o, &signchar, 1);
+  _x_put(o, prefix, strlen(prefix));
+  _x_pad(o, '0', nzeros);
+  _x_put(o, buf + sizeof(buf) - ndigits, ndigits);
+  if (left)
+    _x_pad(o, ' ', width - total);
+}
 
 #ifdef HAVE_STRDUP
 
@@ -20,20 +20,41 @@
 #define __DIRCPROXY_SPRINTF_H
 
 /* required includes */
+#include <stddef.h>
 #include <stdarg.h>
 
+/* a string being built up a piece at a time with x_bprintf(), start with
+   it all zero and free() str when done with it */
+typedef struct strbuf {
+  char *str;
+  size_t len, size;
+} StrBuf;
+
 /* functions */
 #ifdef DEBUG_MEMORY
 #define x_sprintf(...) xx_sprintf(__FILE__, __LINE__, __VA_ARGS__)
 #define x_vsprintf(FMT, LIST) xx_vsprintf(__FILE__, __LINE__, FMT, LIST)
+#define x_bprintf(SB, ...) xx_bprintf(__FILE__, __LINE__, SB, __VA_ARGS__)
+#define x_vbprintf(SB, FMT, LIST) xx_vbprintf(__FILE__, __LINE__, SB, FMT, \
+                                              LIST)
+#define x_vbprintf_fixed(SB, FMT, LIST) xx_vbprintf_fixed(__FILE__, \
+                                                          __LINE__, SB, \
+                                                          FMT, LIST)
 #define x_strdup(STR) xx_strdup(__FILE__, __LINE__, STR)
 extern char *xx_sprintf(char *, int, const char *, ...);
 extern char *xx_vsprintf(char *, int, const char *, va_list);
+extern int xx_bprintf(char *, int, struct strbuf *, const char *, ...);
+extern int xx_vbprintf(char *, int, struct strbuf *, const char *, va_list);
+extern int xx_vbprintf_fixed(char *, int, struct strbuf *, const char *,
+                             va_list);
 extern char *xx_strdup(char *, int, const char *);
 #else /* DEBUG_MEMORY */
 /* Not debugging memory, run normally */
 extern char *x_sprintf(const char *, ...);
 extern char *x_vsprintf(const char *, va_list);
+extern int x_bprintf(struct strbuf *, const char *, ...);
+extern int x_vbprintf(struct strbuf *, const char *, va_list);
+extern int x_vbprintf_fixed(struct strbuf *, const char *, va_list);
 extern char *x_strdup(const char *);
 #endif /* DEBUG_MEMORY */
 